@@ -0,0 +1,368 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** bench times each phase of the filter on synthetic collections of several
+** sizes, with several thread counts, and reports the throughput of each
+** phase and the peak resident memory of each run.  The collections go
+** through bcal_filter_prepare, bcal_filter_run and bcal_filter_finish, and
+** the times are those of their run statistics, see bcal_stats_write.  The
+** phases of the working tiles are seconds summed over the threads.  Each
+** run is a child process of its own, so its peak is not that of an earlier
+** larger one.  Windows has no fork, there the peak is of the whole bench
+** so far.
+*/
+
+#include <math.h>
+
+#include "bcal_bench.h"
+#include "bcal_time.h"
+
+#include "cpl_conv.h"
+
+#ifndef _WIN32
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+/* Most sizes or thread counts in a list */
+#define BCAL_BENCH_MAX_RUNS 16
+
+enum
+{
+    PHASE_READ,
+    PHASE_PARTITION,
+    PHASE_FILTER,
+    PHASE_WRITE,
+    PHASE_TOTAL,
+    PHASE_TILE_BIN,
+    PHASE_TILE_SEED,
+    PHASE_TILE_ITERATE,
+    PHASE_TILE_MERGE,
+    PHASE_COUNT
+};
+
+/* Phases of the tiles are marked, their times are summed over threads */
+static const char *phase_names[PHASE_COUNT] =
+{
+    "read", "partition", "filter", "write", "total", "bin*", "seed*",
+    "iterate*", "merge*"
+};
+
+static void Usage()
+{
+    printf(
+"bench [-points n,...] [-threads n,...] [-format n] [-density f]\n"
+"      [-canopy_spacing f] [-cover f] [-grid_space f] [-dir path] [-keep]\n"
+"      [-outliers global|tile] [-simd scalar|sse2|avx2]\n"
+"\n"
+"   -points         collection sizes, default 1000000,10000000,100000000\n"
+"   -threads        thread counts, default 1 up to the cpu count, doubling\n"
+"   -format         LAS point data format, 0-3 or 6-8, default 1\n"
+"   -density        points per square meter, default 8\n"
+"   -canopy_spacing distance between tree crowns, default 6\n"
+"   -cover          fraction of crown sites with a tree, default 0.5\n"
+"   -grid_space     filter grid spacing, default 1.0\n"
+"   -dir            where to write the collections, default CPL_TMPDIR\n"
+"   -keep           keep the collections and filter outputs\n"
+"   -outliers       low outlier statistics over the whole collection\n"
+"                   (default) or over each working tile, see bcal filter\n"
+"   -simd           most capable point kernels to use, default the best\n"
+"                   this cpu has\n" );
+    exit( 1 );
+}
+
+/* Parse a comma separated list of positive integers into v. */
+static int parse_list( const char *s, uint64 *v )
+{
+    char *end;
+    int n = 0;
+    while( n < BCAL_BENCH_MAX_RUNS )
+    {
+        v[n] = strtoull( s, &end, 10 );
+        if( end == s || v[n] == 0 || (*end != ',' && *end != '\0') )
+        {
+            return 0;
+        }
+        n++;
+        if( *end == '\0' )
+        {
+            return n;
+        }
+        s = end + 1;
+    }
+    return 0;
+}
+
+/*
+** Filter the collection at path into output as bcal filter does, with the
+** threads of b, and set t to the seconds of each phase.
+*/
+static CPLErr run( const char *path, const char *output, bcal_filter_data *b,
+                   double *t )
+{
+    bcal_filter_file f;
+    const bcal_run_stats *r = &f.run;
+    CPLErr eErr;
+
+    b->input = (char *)path;
+    b->output = (char *)output;
+    eErr = bcal_filter_prepare( &f, b );
+    if( eErr == CE_None )
+    {
+        eErr = bcal_filter_run( &f );
+    }
+    eErr = bcal_filter_finish( &f, eErr );
+    t[PHASE_READ] = r->t_read;
+    t[PHASE_PARTITION] = r->t_partition;
+    t[PHASE_FILTER] = r->t_filter;
+    t[PHASE_WRITE] = r->t_write;
+    t[PHASE_TOTAL] = r->t_total;
+    t[PHASE_TILE_BIN] = r->tiles.t_bin;
+    t[PHASE_TILE_SEED] = r->tiles.t_seed;
+    t[PHASE_TILE_ITERATE] = r->tiles.t_iterate;
+    t[PHASE_TILE_MERGE] = r->tiles.t_write;
+    return eErr;
+}
+
+/* What a run sends back from its process */
+typedef struct bcal_bench_result
+{
+    double t[PHASE_COUNT];
+    uint64 rss;
+    CPLErr eErr;
+} bcal_bench_result;
+
+/*
+** run in a child process, and set t to the seconds of each phase and rss
+** to the peak resident memory of the child.
+*/
+static CPLErr run_child( const char *path, const char *output,
+                         bcal_filter_data *b, double *t, uint64 *rss )
+{
+    bcal_bench_result res;
+#ifdef _WIN32
+    res.eErr = run( path, output, b, t );
+    *rss = bcal_peak_rss();
+    return res.eErr;
+#else
+    size_t got = 0;
+    ssize_t n;
+    pid_t pid;
+    int fd[2], status;
+    fflush( stdout );
+    if( pipe( fd ) != 0 || (pid = fork()) < 0 )
+    {
+        CPLError( CE_Failure, CPLE_AppDefined,
+                  "Failed to start a process for the run" );
+        return CE_Failure;
+    }
+    if( pid == 0 )
+    {
+        close( fd[0] );
+        memset( &res, 0, sizeof( res ) );
+        res.eErr = run( path, output, b, res.t );
+        res.rss = bcal_peak_rss();
+        n = write( fd[1], &res, sizeof( res ) );
+        _exit( n == (ssize_t)sizeof( res ) ? 0 : 1 );
+    }
+    close( fd[1] );
+    while( got < sizeof( res ) &&
+           (n = read( fd[0], (char *)&res + got, sizeof( res ) - got )) > 0 )
+    {
+        got += (size_t)n;
+    }
+    close( fd[0] );
+    if( waitpid( pid, &status, 0 ) != pid || !WIFEXITED( status ) ||
+        WEXITSTATUS( status ) != 0 || got != sizeof( res ) )
+    {
+        CPLError( CE_Failure, CPLE_AppDefined,
+                  "The run of %s did not finish", path );
+        return CE_Failure;
+    }
+    memcpy( t, res.t, sizeof( res.t ) );
+    *rss = res.rss;
+    return res.eErr;
+#endif
+}
+
+int main( int argc, char *argv[] )
+{
+    uint64 sizes[BCAL_BENCH_MAX_RUNS] = { 1000000, 10000000, 100000000 };
+    uint64 threads[BCAL_BENCH_MAX_RUNS];
+    int n_sizes = 3, n_threads = 0;
+    bcal_synth s;
+    bcal_filter_data b;
+    const char *dir = NULL;
+    int keep = FALSE;
+    int i, j, k, rc = 0;
+    double t[PHASE_COUNT], t0, gen;
+    uint64 rss;
+    char name[64], path[4096], output[4096 + 16];
+
+    s.n_points = 0;
+    s.point_format = 1;
+    s.density = 8.;
+    s.canopy_spacing = 6.;
+    s.cover = 0.5;
+    s.seed = 1;
+
+    memset( &b, 0, sizeof( b ) );
+    b.tile_points = BCAL_TILE_POINTS;
+    b.spacing = 1.;
+    b.threshold = 0.;
+    b.max_height = 50.;
+    b.max_iter = 15;
+    b.interp = BCAL_INTERP_LINEAR;
+    b.outliers = BCAL_OUTLIERS_GLOBAL;
+
+    for( i = 1; i < argc; i++ )
+    {
+        if( strncmp( argv[i], "-help", strlen( "-help" ) ) == 0 )
+        {
+            Usage();
+        }
+        else if( strncmp( argv[i], "-points", strlen( "-points" ) ) == 0 && i + 1 < argc )
+        {
+            n_sizes = parse_list( argv[++i], sizes );
+        }
+        else if( strncmp( argv[i], "-threads", strlen( "-threads" ) ) == 0 && i + 1 < argc )
+        {
+            n_threads = parse_list( argv[++i], threads );
+            if( n_threads == 0 )
+            {
+                Usage();
+            }
+        }
+        else if( strncmp( argv[i], "-format", strlen( "-format" ) ) == 0 && i + 1 < argc )
+        {
+            s.point_format = atoi( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-density", strlen( "-density" ) ) == 0 && i + 1 < argc )
+        {
+            s.density = atof( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-canopy_spacing", strlen( "-canopy_spacing" ) ) == 0 && i + 1 < argc )
+        {
+            s.canopy_spacing = atof( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-cover", strlen( "-cover" ) ) == 0 && i + 1 < argc )
+        {
+            s.cover = atof( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-grid_space", strlen( "-grid_space" ) ) == 0 && i + 1 < argc )
+        {
+            b.spacing = atof( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-dir", strlen( "-dir" ) ) == 0 && i + 1 < argc )
+        {
+            dir = argv[++i];
+        }
+        else if( strncmp( argv[i], "-keep", strlen( "-keep" ) ) == 0 )
+        {
+            keep = TRUE;
+        }
+        else if( strncmp( argv[i], "-outliers", strlen( "-outliers" ) ) == 0 && i + 1 < argc )
+        {
+            i++;
+            if( EQUAL( argv[i], "global" ) )
+            {
+                b.outliers = BCAL_OUTLIERS_GLOBAL;
+            }
+            else if( EQUAL( argv[i], "tile" ) )
+            {
+                b.outliers = BCAL_OUTLIERS_TILE;
+            }
+            else
+            {
+                Usage();
+            }
+        }
+        else if( strncmp( argv[i], "-simd", strlen( "-simd" ) ) == 0 && i + 1 < argc )
+        {
+            i++;
+            bcal_simd_set_level( EQUAL( argv[i], "scalar" ) ? BCAL_SIMD_SCALAR :
+                                 EQUAL( argv[i], "sse2" ) ? BCAL_SIMD_SSE2 :
+                                 BCAL_SIMD_AVX2 );
+        }
+        else
+        {
+            Usage();
+        }
+    }
+    if( n_sizes == 0 || b.spacing <= 0 )
+    {
+        Usage();
+    }
+    if( n_threads == 0 )
+    {
+        for( k = 1; k < CPLGetNumCPUs() && n_threads < BCAL_BENCH_MAX_RUNS - 1;
+             k *= 2 )
+        {
+            threads[n_threads++] = k;
+        }
+        threads[n_threads++] = CPLGetNumCPUs() > 1 ? CPLGetNumCPUs() : 1;
+    }
+    b.merge_buf = BCAL_HALO_CELLS * b.spacing;
+
+    k = bcal_simd_level();
+    printf( "point kernels: %s\n", k == BCAL_SIMD_AVX2 ? "avx2" :
+                                   k == BCAL_SIMD_SSE2 ? "sse2" : "scalar" );
+    printf( "%12s %7s %10s", "points", "threads", "phase" );
+    printf( " %10s %10s %10s\n", "seconds", "Mpts/s", "peak MB" );
+    for( i = 0; i < n_sizes && rc == 0; i++ )
+    {
+        s.n_points = sizes[i];
+        snprintf( name, sizeof( name ), "bench_%llu",
+                  (unsigned long long)sizes[i] );
+        if( dir != NULL )
+        {
+            snprintf( path, sizeof( path ), "%s",
+                      CPLFormFilename( dir, name, "las" ) );
+        }
+        else
+        {
+            snprintf( path, sizeof( path ), "%s",
+                      CPLGenerateTempFilename( name ) );
+        }
+        snprintf( output, sizeof( output ), "%s.out.las", path );
+        t0 = bcal_time_now();
+        if( bcal_synth_write( &s, path ) != CE_None )
+        {
+            rc = 1;
+        }
+        gen = bcal_time_now() - t0;
+        if( rc == 0 )
+        {
+            printf( "%12llu %7s %10s %10.3f %10.2f %10s\n",
+                    (unsigned long long)sizes[i], "-", "generate", gen,
+                    sizes[i] / gen / 1e6, "-" );
+        }
+        for( j = 0; j < n_threads && rc == 0; j++ )
+        {
+            b.jobs = (int)threads[j];
+            memset( t, 0, sizeof( t ) );
+            if( run_child( path, output, &b, t, &rss ) != CE_None )
+            {
+                rc = 1;
+                break;
+            }
+            for( k = 0; k < PHASE_COUNT; k++ )
+            {
+                printf( "%12llu %7d %10s %10.3f %10.2f %10.1f\n",
+                        (unsigned long long)sizes[i], b.jobs, phase_names[k],
+                        t[k], t[k] > 0 ? sizes[i] / t[k] / 1e6 : 0.,
+                        rss / (1024. * 1024.) );
+            }
+            fflush( stdout );
+        }
+        if( !keep )
+        {
+            VSIUnlink( path );
+            VSIUnlink( output );
+        }
+    }
+    return rc;
+}
+
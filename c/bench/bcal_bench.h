@@ -0,0 +1,31 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef BCAL_BENCH_H_
+#define BCAL_BENCH_H_
+
+#include "bcal_filter.h"
+
+/*
+** Parameters of a synthetic lidar collection.  The same parameters always
+** produce the same file.
+*/
+typedef struct bcal_synth
+{
+    uint64 n_points;
+    /* LAS point data format, 0-3 or 6-8 */
+    int point_format;
+    /* Points per square meter */
+    double density;
+    /* Distance (m) between tree crowns */
+    double canopy_spacing;
+    /* Fraction of crown sites that hold a tree */
+    double cover;
+    uint64 seed;
+} bcal_synth;
+
+CPLErr bcal_synth_write( const bcal_synth *s, const char *path );
+
+#endif /* BCAL_BENCH_H_ */
+
@@ -0,0 +1,253 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** synth writes a deterministic synthetic lidar collection.  Points are laid
+** out in scan lines like a real flight, over rolling, sloped terrain.  Tree
+** crowns sit on a jittered grid, and a crown hit gives a first return on
+** the canopy, otherwise the pulse returns from the ground.  A few low
+** outliers are mixed in for the outlier test.
+*/
+
+#include <math.h>
+
+#include "bcal_bench.h"
+
+#include "cpl_port.h"
+#include "cpl_vsi.h"
+
+/* Records written per call */
+#define BCAL_SYNTH_BLOCK 65536
+/* Quantization of the coordinates */
+#define BCAL_SYNTH_SCALE 0.01
+
+static uint64 splitmix( uint64 *state )
+{
+    uint64 z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* A uniform value in [0, 1) */
+static double uniform( uint64 *state )
+{
+    return (splitmix( state ) >> 11) * (1. / 9007199254740992.);
+}
+
+/* A uniform value in [0, 1) that depends only on the cell and a salt */
+static double hash01( uint64 seed, int64 i, int64 j, uint64 salt )
+{
+    uint64 s = seed ^ ((uint64)i * 0x8cb92ba72f3d8dd7ULL) ^
+               ((uint64)j * 0xc2b2ae3d27d4eb4fULL) ^ salt;
+    return uniform( &s );
+}
+
+static double terrain( double x, double y )
+{
+    return 0.08 * x + 0.03 * y + 4. * sin( x / 60. ) * cos( y / 45. ) +
+           1.5 * sin( (x + y) / 13. );
+}
+
+static int record_length( int format )
+{
+    static const int lengths[9] = { 20, 28, 26, 34, 0, 0, 30, 36, 38 };
+    return format >= 0 && format <= 8 ? lengths[format] : 0;
+}
+
+static void put_u16( uint8 *b, uint16 v )
+{
+    CPL_LSBPTR16( &v );
+    memcpy( b, &v, sizeof( v ) );
+}
+
+static void put_u32( uint8 *b, uint32 v )
+{
+    CPL_LSBPTR32( &v );
+    memcpy( b, &v, sizeof( v ) );
+}
+
+static void put_u64( uint8 *b, uint64 v )
+{
+    CPL_LSBPTR64( &v );
+    memcpy( b, &v, sizeof( v ) );
+}
+
+static void put_f64( uint8 *b, double d )
+{
+    uint64 v;
+    memcpy( &v, &d, sizeof( v ) );
+    put_u64( b, v );
+}
+
+static void write_header( uint8 *h, const bcal_synth *s, int size,
+                          const double *min, const double *max )
+{
+    int d;
+    memset( h, 0, size );
+    memcpy( h, "LASF", 4 );
+    h[24] = 1;
+    h[25] = s->point_format < 6 ? 2 : 4;
+    memcpy( h + 26, "bcal", 4 );
+    memcpy( h + 58, "bcal bench", 10 );
+    put_u16( h + 94, (uint16)size );
+    put_u32( h + 96, (uint32)size );
+    h[104] = (uint8)s->point_format;
+    put_u16( h + 105, (uint16)record_length( s->point_format ) );
+    if( s->point_format < 6 || s->n_points <= UINT32_MAX )
+    {
+        put_u32( h + 107, (uint32)s->n_points );
+    }
+    for( d = 0; d < 3; d++ )
+    {
+        put_f64( h + 131 + d * 8, BCAL_SYNTH_SCALE );
+        put_f64( h + 179 + d * 16, max[d] );
+        put_f64( h + 187 + d * 16, min[d] );
+    }
+    if( size >= BCAL_LAS_HEADER_SIZE_14 )
+    {
+        put_u64( h + 247, s->n_points );
+    }
+}
+
+/*
+** bcal_synth_write writes the collection described by s to path.  The
+** domain is square, sized so the points have the requested density.
+*/
+CPLErr bcal_synth_write( const bcal_synth *s, const char *path )
+{
+    int len = record_length( s->point_format );
+    int hsize = s->point_format < 6 ? BCAL_LAS_HEADER_SIZE_10 :
+                                      BCAL_LAS_HEADER_SIZE_14;
+    uint8 header[BCAL_LAS_HEADER_SIZE_14];
+    uint8 *block, *rec;
+    uint64 state = s->seed, k, per_line, line;
+    uint32 m;
+    int64 ci, cj;
+    double side, dx, x, y, z, g, cx, cy, r, d2, top, u;
+    double min[3] = { HUGE_VAL, HUGE_VAL, HUGE_VAL };
+    double max[3] = { -HUGE_VAL, -HUGE_VAL, -HUGE_VAL };
+    int ret, nret, ok = 1;
+    VSILFILE *fp;
+    if( len == 0 || s->n_points == 0 || s->density <= 0 ||
+        s->canopy_spacing <= 0 )
+    {
+        CPLError( CE_Failure, CPLE_IllegalArg,
+                  "Invalid synthetic collection parameters" );
+        return CE_Failure;
+    }
+    block = calloc( BCAL_SYNTH_BLOCK, len );
+    fp = VSIFOpenL( path, "wb" );
+    if( block == NULL || fp == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OpenFailed, "Failed to create %s", path );
+        free( block );
+        if( fp != NULL )
+        {
+            VSIFCloseL( fp );
+        }
+        return CE_Failure;
+    }
+    /* Reserve the header, it is written once the bounds are known */
+    memset( header, 0, sizeof( header ) );
+    ok = VSIFWriteL( header, 1, hsize, fp ) == (size_t)hsize;
+
+    side = sqrt( s->n_points / s->density );
+    dx = 1. / sqrt( s->density );
+    per_line = (uint64)ceil( side / dx );
+    for( k = 0; k < s->n_points && ok; k++ )
+    {
+        m = (uint32)(k % BCAL_SYNTH_BLOCK);
+        rec = block + (size_t)m * len;
+        line = k / per_line;
+        x = ((k % per_line) + uniform( &state )) * dx;
+        y = (line + uniform( &state )) * dx;
+        /* Lines run back and forth like a scanner */
+        if( line % 2 == 1 )
+        {
+            x = side - x;
+        }
+        g = terrain( x, y );
+        z = g + (uniform( &state ) + uniform( &state ) - 1.) * 0.05;
+        ret = 1;
+        nret = 1;
+        ci = (int64)floor( x / s->canopy_spacing );
+        cj = (int64)floor( y / s->canopy_spacing );
+        if( hash01( s->seed, ci, cj, 1 ) < s->cover )
+        {
+            cx = (ci + 0.25 + 0.5 * hash01( s->seed, ci, cj, 2 )) *
+                 s->canopy_spacing;
+            cy = (cj + 0.25 + 0.5 * hash01( s->seed, ci, cj, 3 )) *
+                 s->canopy_spacing;
+            r = 0.35 * s->canopy_spacing;
+            top = 2. + 18. * hash01( s->seed, ci, cj, 4 );
+            d2 = ((x - cx) * (x - cx) + (y - cy) * (y - cy)) / (r * r);
+            u = uniform( &state );
+            if( d2 < 1. )
+            {
+                nret = 2;
+                if( u < 0.8 )
+                {
+                    z = g + top * (1. - 0.6 * d2) * (0.6 + 0.4 * u);
+                }
+                else
+                {
+                    ret = 2;
+                }
+            }
+        }
+        if( uniform( &state ) < 1e-5 )
+        {
+            z = g - 50.;
+        }
+        memset( rec, 0, len );
+        put_u32( rec, (uint32)(int32)floor( x / BCAL_SYNTH_SCALE + 0.5 ) );
+        put_u32( rec + 4, (uint32)(int32)floor( y / BCAL_SYNTH_SCALE + 0.5 ) );
+        put_u32( rec + 8, (uint32)(int32)floor( z / BCAL_SYNTH_SCALE + 0.5 ) );
+        put_u16( rec + 12, (uint16)(200 + 100 * ret) );
+        if( s->point_format < 6 )
+        {
+            rec[14] = (uint8)(ret | (nret << 3));
+            put_u16( rec + 18, 1 );
+            if( s->point_format == 1 || s->point_format == 3 )
+            {
+                put_f64( rec + 20, k * 1e-5 );
+            }
+        }
+        else
+        {
+            rec[14] = (uint8)(ret | (nret << 4));
+            put_u16( rec + 20, 1 );
+            put_f64( rec + 22, k * 1e-5 );
+        }
+        min[0] = x < min[0] ? x : min[0];
+        max[0] = x > max[0] ? x : max[0];
+        min[1] = y < min[1] ? y : min[1];
+        max[1] = y > max[1] ? y : max[1];
+        min[2] = z < min[2] ? z : min[2];
+        max[2] = z > max[2] ? z : max[2];
+        if( m == BCAL_SYNTH_BLOCK - 1 || k == s->n_points - 1 )
+        {
+            ok = VSIFWriteL( block, len, m + 1, fp ) == m + 1;
+        }
+    }
+    /* Round the bounds out to the quantization */
+    for( m = 0; m < 3; m++ )
+    {
+        min[m] = floor( min[m] / BCAL_SYNTH_SCALE ) * BCAL_SYNTH_SCALE;
+        max[m] = ceil( max[m] / BCAL_SYNTH_SCALE ) * BCAL_SYNTH_SCALE;
+    }
+    write_header( header, s, hsize, min, max );
+    ok = ok && VSIFSeekL( fp, 0, SEEK_SET ) == 0 &&
+         VSIFWriteL( header, 1, hsize, fp ) == (size_t)hsize;
+    if( VSIFCloseL( fp ) != 0 || !ok )
+    {
+        CPLError( CE_Failure, CPLE_FileIO, "Failed to write %s", path );
+        free( block );
+        return CE_Failure;
+    }
+    free( block );
+    return CE_None;
+}
+
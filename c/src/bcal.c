@@ -12,13 +12,15 @@
 #include <string.h>
 
 #include "bcal_filter.h"
+#include "bcal_index.h"
+#include "bcal_metrics.h"
 
 void Usage()
 {
     printf(
 "bcal <tool> [options] arguments\n"
 "\n"
-"   tools: filter\n" );
+"   tools: filter, index, dem, topo, metrics, vegmetrics\n" );
     exit(1);
 }
 
@@ -34,6 +36,17 @@ int main( int argc, char *argv[] )
     {
         return bcal_filter_app( argc, argv );
     }
+    else if( strncmp( argv[i], "index", strlen( "index" ) ) == 0 )
+    {
+        return bcal_index_app( argc, argv );
+    }
+    else if( strncmp( argv[i], "metrics", strlen( "metrics" ) ) == 0 ||
+             strncmp( argv[i], "vegmetrics", strlen( "vegmetrics" ) ) == 0 ||
+             strncmp( argv[i], "dem", strlen( "dem" ) ) == 0 ||
+             strncmp( argv[i], "topo", strlen( "topo" ) ) == 0 )
+    {
+        return bcal_metrics_app( argc, argv );
+    }
     else
     {
         Usage();
@@ -0,0 +1,149 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** point manages the columnar point store.  A point is 24 bytes spread over
+** the columns, and the filter's inner loops only touch the columns they use.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bcal_point.h"
+
+void bcal_points_init( bcal_points *p, const double *scale,
+                       const double *offset )
+{
+    memset( p, 0, sizeof( bcal_points ) );
+    memcpy( p->scale, scale, sizeof( p->scale ) );
+    memcpy( p->offset, offset, sizeof( p->offset ) );
+}
+
+static CPLErr grow( void **col, size_t size, uint32 n )
+{
+    void *a = realloc( *col, size * (n > 0 ? n : 1) );
+    if( a == NULL )
+    {
+        return CE_Failure;
+    }
+    *col = a;
+    return CE_None;
+}
+
+/*
+** bcal_points_reserve makes room for at least n points.  p->n is not
+** changed.
+*/
+CPLErr bcal_points_reserve( bcal_points *p, uint32 n )
+{
+    if( n <= p->alloced && p->fid != NULL )
+    {
+        return CE_None;
+    }
+    if( grow( (void**)&p->fid, sizeof( int64 ), n ) != CE_None ||
+        grow( (void**)&p->x, sizeof( int32 ), n ) != CE_None ||
+        grow( (void**)&p->y, sizeof( int32 ), n ) != CE_None ||
+        grow( (void**)&p->z, sizeof( int32 ), n ) != CE_None ||
+        grow( (void**)&p->c, sizeof( uint8 ), n ) != CE_None ||
+        grow( (void**)&p->r, sizeof( uint8 ), n ) != CE_None ||
+        grow( (void**)&p->h, sizeof( uint16 ), n ) != CE_None ||
+        (p->attrs &&
+         (grow( (void**)&p->intensity, sizeof( uint16 ), n ) != CE_None ||
+          grow( (void**)&p->n_returns, sizeof( uint8 ), n ) != CE_None ||
+          grow( (void**)&p->user, sizeof( uint8 ), n ) != CE_None)) )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate %u points", n );
+        return CE_Failure;
+    }
+    p->alloced = n;
+    return CE_None;
+}
+
+void bcal_points_copy( bcal_points *dst, uint32 di,
+                       const bcal_points *src, uint32 si )
+{
+    dst->fid[di] = src->fid[si];
+    dst->x[di] = src->x[si];
+    dst->y[di] = src->y[si];
+    dst->z[di] = src->z[si];
+    dst->c[di] = src->c[si];
+    dst->r[di] = src->r[si];
+    dst->h[di] = src->h[si];
+    if( dst->intensity != NULL && src->intensity != NULL )
+    {
+        dst->intensity[di] = src->intensity[si];
+        dst->n_returns[di] = src->n_returns[si];
+        dst->user[di] = src->user[si];
+    }
+}
+
+#define SCATTER( type, col )                                \
+    do {                                                    \
+        type *from = (type*)p->col;                         \
+        type *to = (type*)tmp;                              \
+        for( i = 0; i < p->n; i++ )                         \
+        {                                                   \
+            to[dest[i]] = from[i];                          \
+        }                                                   \
+        p->col = to;                                        \
+        tmp = from;                                         \
+    } while( 0 )
+
+/*
+** bcal_points_scatter moves point i to dest[i], one column at a time, so the
+** extra memory is a single column.  Each scattered column swaps buffers with
+** the spare, so columns go from the widest type to the narrowest.
+*/
+CPLErr bcal_points_scatter( bcal_points *p, const uint32 *dest )
+{
+    uint32 i;
+    void *tmp = malloc( sizeof( int64 ) * (p->alloced > 0 ? p->alloced : 1) );
+    if( tmp == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate reorder buffer" );
+        return CE_Failure;
+    }
+    SCATTER( int64, fid );
+    SCATTER( int32, x );
+    SCATTER( int32, y );
+    SCATTER( int32, z );
+    SCATTER( uint16, h );
+    if( p->intensity != NULL )
+    {
+        SCATTER( uint16, intensity );
+    }
+    SCATTER( uint8, c );
+    SCATTER( uint8, r );
+    if( p->intensity != NULL )
+    {
+        SCATTER( uint8, n_returns );
+        SCATTER( uint8, user );
+    }
+    free( tmp );
+    return CE_None;
+}
+
+void bcal_points_free( bcal_points *p )
+{
+    free( p->fid );
+    free( p->x );
+    free( p->y );
+    free( p->z );
+    free( p->c );
+    free( p->r );
+    free( p->h );
+    free( p->intensity );
+    free( p->n_returns );
+    free( p->user );
+    p->fid = NULL;
+    p->x = p->y = p->z = NULL;
+    p->c = p->r = NULL;
+    p->h = NULL;
+    p->intensity = NULL;
+    p->n_returns = p->user = NULL;
+    p->n = p->alloced = 0;
+}
+
@@ -7,18 +7,75 @@
 
 #include "bcal_types.h"
 
-typedef struct bcal_point bcal_point;
-struct bcal_point
+#include <gdal.h>
+
+/* Classifications assigned by the filter, see the LAS specification. */
+#define BCAL_CLASS_CREATED       0
+#define BCAL_CLASS_UNCLASSIFIED  1
+#define BCAL_CLASS_GROUND        2
+#define BCAL_CLASS_VEGETATION    3
+
+/*
+** A column per attribute.  Coordinates are kept as the scaled integers of
+** the LAS file, use the accessors for real world values.
+*/
+typedef struct bcal_points bcal_points;
+struct bcal_points
 {
-    int64 fid;
-    double x;
-    double y;
-    double z;
-    uint8  c;
-    uint8  h;
-
-    uint32 bin;
+    uint32 n;
+    uint32 alloced;
+    double scale[3];
+    double offset[3];
+
+    int64  *fid;
+    int32  *x;
+    int32  *y;
+    int32  *z;
+    /* classification */
+    uint8  *c;
+    /* return number */
+    uint8  *r;
+    /* height above ground in z scale units, stored as the point source id */
+    uint16 *h;
+
+    /*
+    ** The attributes only raster products use, kept when attrs is set
+    ** before the first bcal_points_reserve, and NULL otherwise.
+    */
+    int attrs;
+    uint16 *intensity;
+    /* number of returns of the pulse */
+    uint8  *n_returns;
+    /* user data, the AGC of some sensors */
+    uint8  *user;
 };
 
+static inline double bcal_points_x( const bcal_points *p, uint32 i )
+{
+    return p->x[i] * p->scale[0] + p->offset[0];
+}
+
+static inline double bcal_points_y( const bcal_points *p, uint32 i )
+{
+    return p->y[i] * p->scale[1] + p->offset[1];
+}
+
+static inline double bcal_points_z( const bcal_points *p, uint32 i )
+{
+    return p->z[i] * p->scale[2] + p->offset[2];
+}
+
+void bcal_points_init( bcal_points *p, const double *scale,
+                       const double *offset );
+
+CPLErr bcal_points_reserve( bcal_points *p, uint32 n );
+
+void bcal_points_copy( bcal_points *dst, uint32 di,
+                       const bcal_points *src, uint32 si );
+
+CPLErr bcal_points_scatter( bcal_points *p, const uint32 *dest );
+
+void bcal_points_free( bcal_points *p );
+
 #endif /* BCAL_POINT_H_ */
 
@@ -0,0 +1,258 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** batch filters many inputs into an output directory.  HeightLAS_BCAL.pro
+** reads, filters and writes each file in turn, so the cpus idle during
+** every read and write.  Here the files move through a three stage
+** pipeline in lock step: while file n is filtered on the worker pool, file
+** n + 1 is read, counted and binned on a smaller pool and file n - 1 is
+** flushed and released on a thread of its own.  At most three files are in
+** flight, and only two of them hold working sets, so each gets half of
+** -max_mem.  The threads of -jobs are split between the two pools.
+*/
+
+#include "bcal_filter.h"
+
+#include "cpl_conv.h"
+#include "cpl_multiproc.h"
+#include "cpl_string.h"
+#include "cpl_vsi.h"
+
+/* Files in flight, one per stage */
+#define BCAL_BATCH_STAGES 3
+
+typedef struct bcal_batch_slot
+{
+    bcal_filter_file f;
+    bcal_filter_data b;
+    CPLErr eErr;
+} bcal_batch_slot;
+
+static void prepare_thread( void *arg )
+{
+    bcal_batch_slot *slot = arg;
+    slot->eErr = bcal_filter_prepare( &slot->f, &slot->b );
+}
+
+static void finish_thread( void *arg )
+{
+    bcal_batch_slot *slot = arg;
+    slot->eErr = bcal_filter_finish( &slot->f, slot->eErr );
+}
+
+/* Run f on a thread of its own, or right away if no thread can be made. */
+static CPLJoinableThread * start( CPLThreadFunc f, bcal_batch_slot *slot )
+{
+    CPLJoinableThread *t = CPLCreateJoinableThread( f, slot );
+    if( t == NULL )
+    {
+        f( slot );
+    }
+    return t;
+}
+
+static int is_las( const char *path )
+{
+    const char *ext = CPLGetExtension( path );
+    return EQUAL( ext, "las" ) || EQUAL( ext, "laz" );
+}
+
+static int compare_names( const void *a, const void *b )
+{
+    return strcmp( *(char * const *)a, *(char * const *)b );
+}
+
+/*
+** bcal_batch_add adds path to the list of inputs, or if path is a
+** directory, every las and laz file in it in name order.
+*/
+char ** bcal_batch_add( char **inputs, const char *path )
+{
+    VSIStatBufL st;
+    char **names;
+    int i, n;
+    if( VSIStatL( path, &st ) != 0 || !VSI_ISDIR( st.st_mode ) )
+    {
+        return CSLAddString( inputs, path );
+    }
+    names = VSIReadDir( path );
+    n = CSLCount( names );
+    if( n > 0 )
+    {
+        qsort( names, n, sizeof( char* ), compare_names );
+    }
+    for( i = 0; i < n; i++ )
+    {
+        if( is_las( names[i] ) )
+        {
+            inputs = CSLAddString( inputs,
+                                   CPLFormFilename( path, names[i], NULL ) );
+        }
+    }
+    CSLDestroy( names );
+    return inputs;
+}
+
+/*
+** bcal_batch_add_list adds the inputs named in the text file list, one per
+** line.  Blank lines are skipped.  Returns NULL, after freeing inputs, if
+** the list can't be read.
+*/
+char ** bcal_batch_add_list( char **inputs, const char *list )
+{
+    const char *line;
+    VSILFILE *fp = VSIFOpenL( list, "rb" );
+    if( fp == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OpenFailed, "Failed to open %s", list );
+        CSLDestroy( inputs );
+        return NULL;
+    }
+    while( (line = CPLReadLineL( fp )) != NULL )
+    {
+        while( *line == ' ' || *line == '\t' )
+        {
+            line++;
+        }
+        if( *line != '\0' )
+        {
+            inputs = bcal_batch_add( inputs, line );
+        }
+    }
+    VSIFCloseL( fp );
+    return inputs;
+}
+
+/*
+** Fail if two of the n inputs have the same base name, as a.las and a.laz
+** or d1/x.las and d2/x.las.  Both would be written to one output, by two
+** stages of the pipeline at once.
+*/
+static CPLErr check_names( char **inputs, uint32 n, const char *output_dir )
+{
+    char **names = NULL;
+    uint32 i;
+    CPLErr eErr = CE_None;
+    for( i = 0; i < n; i++ )
+    {
+        names = CSLAddString( names, CPLGetBasename( inputs[i] ) );
+    }
+    if( n > 1 )
+    {
+        qsort( names, n, sizeof( char* ), compare_names );
+    }
+    for( i = 1; i < n && eErr == CE_None; i++ )
+    {
+        if( strcmp( names[i - 1], names[i] ) == 0 )
+        {
+            CPLError( CE_Failure, CPLE_IllegalArg,
+                      "Two inputs named %s would both be written to %s",
+                      names[i], CPLFormFilename( output_dir, names[i],
+                                                 "las" ) );
+            eErr = CE_Failure;
+        }
+    }
+    CSLDestroy( names );
+    return eErr;
+}
+
+/*
+** bcal_filter_batch filters each of the n inputs into output_dir, as las
+** files of the same base name, which must differ.  If b->stats is set it
+** names a directory for a json file of statistics per input.  Files that
+** fail are reported and skipped, and the result is CE_Failure if any did.
+** A file is filtered on three quarters of b->jobs while the next is read
+** on the rest, at least one.
+*/
+CPLErr bcal_filter_batch( const bcal_filter_data *b, char **inputs,
+                          uint32 n, const char *output_dir )
+{
+    bcal_batch_slot slots[BCAL_BATCH_STAGES];
+    bcal_batch_slot *slot;
+    CPLJoinableThread *reader, *writer;
+    uint32 step, failed = 0;
+    int read_jobs = b->jobs / 4 > 0 ? b->jobs / 4 : 1;
+    char *base;
+
+    if( check_names( inputs, n, output_dir ) != CE_None )
+    {
+        return CE_Failure;
+    }
+    memset( slots, 0, sizeof( slots ) );
+    for( step = 0; step < n + 2; step++ )
+    {
+        reader = NULL;
+        writer = NULL;
+        /* Read file step */
+        if( step < n )
+        {
+            slot = slots + step % BCAL_BATCH_STAGES;
+            base = strdup( CPLGetBasename( inputs[step] ) );
+            slot->b = *b;
+            slot->b.input = inputs[step];
+            slot->b.output = strdup( CPLFormFilename( output_dir, base,
+                                                      "las" ) );
+            slot->b.stats = b->stats != NULL ?
+                            strdup( CPLFormFilename( b->stats, base,
+                                                     "json" ) ) : NULL;
+            slot->b.max_mem = b->max_mem / 2;
+            slot->b.jobs = b->jobs > read_jobs ? b->jobs - read_jobs : 1;
+            slot->b.read_jobs = read_jobs;
+            free( base );
+            slot->eErr = CE_None;
+            reader = start( prepare_thread, slot );
+        }
+        /* Write file step - 2 */
+        if( step >= 2 )
+        {
+            writer = start( finish_thread,
+                            slots + (step - 2) % BCAL_BATCH_STAGES );
+        }
+        /* Filter file step - 1 */
+        if( step >= 1 && step - 1 < n )
+        {
+            slot = slots + (step - 1) % BCAL_BATCH_STAGES;
+            if( slot->eErr == CE_None )
+            {
+                slot->eErr = bcal_filter_run( &slot->f );
+            }
+        }
+        if( reader != NULL )
+        {
+            CPLJoinThread( reader );
+        }
+        if( writer != NULL )
+        {
+            CPLJoinThread( writer );
+        }
+        if( step >= 2 )
+        {
+            slot = slots + (step - 2) % BCAL_BATCH_STAGES;
+            if( slot->eErr != CE_None )
+            {
+                CPLError( CE_Warning, CPLE_AppDefined,
+                          "Failed to filter %s", slot->b.input );
+                failed++;
+            }
+            else
+            {
+                CPLDebug( "BCAL", "filtered %s to %s in %.2lf s",
+                          slot->b.input, slot->b.output,
+                          slot->f.run.t_total );
+            }
+            free( slot->b.output );
+            free( slot->b.stats );
+            slot->b.output = NULL;
+            slot->b.stats = NULL;
+        }
+    }
+    if( failed > 0 )
+    {
+        CPLError( CE_Failure, CPLE_AppDefined,
+                  "Failed to filter %u of %u files", failed, n );
+        return CE_Failure;
+    }
+    return CE_None;
+}
@@ -4,33 +4,81 @@
 
 /*
 ** bin cycles through and assigns a bin based on a canopy spacing.  The bin
-** value is stored in each point, then the points are sorted by bin.
+** value is stored in each point, then the points are reordered by bin with a
+** counting sort.  Points that are not filtered (unclassified points, and
+** other returns when a return is selected) get bin nx * ny and go to the end.
+**
+** The cell offsets are kept in compressed sparse row form, so the points of
+** cell k are s->p[s->cells[k]] through s->p[s->cells[k + 1] - 1].  This is
+** the reverse_indices of IDL's histogram in HeightLAS_BCAL.pro.
 */
 
 #include "bcal_filter.h"
 
-static int compare( const void *a, const void *b )
-{
-    return ((bcal_point*)a)->bin - ((bcal_point*)b)->bin;
-}
-
 CPLErr bcal_bin( bcal_working_set *s )
 {
     CPLDebug( "BCAL", "Sorting points into bins for initial ground classification." );
+    bcal_points *p = &s->p;
     double dx, dy;
     dx = s->env.MaxX - s->env.MinX;
     dy = s->env.MaxY - s->env.MinY;
-    uint32 nx = (dx / s->spacing) + 1;
-    uint32 ny = (dy / s->spacing) + 1;
-    uint32 i;
-    uint32 x, y;
-    for( i = 0; i < s->n; i++ )
+    uint64 nx = (dx / s->spacing) + 1;
+    uint64 ny = (dy / s->spacing) + 1;
+    uint32 i, k, ncell;
+    uint32 *bin;
+    /* One more bin holds the points that are not filtered. */
+    if( nx * ny >= UINT32_MAX - 1 )
+    {
+        CPLError( CE_Failure, CPLE_AppDefined,
+                  "Grid of %llu by %llu cells is too large, increase the "
+                  "grid spacing or the number of jobs",
+                  (unsigned long long)nx, (unsigned long long)ny );
+        return CE_Failure;
+    }
+    s->nx = (uint32)nx;
+    s->ny = (uint32)ny;
+    ncell = s->nx * s->ny;
+    free( s->cells );
+    s->cells = calloc( ncell + 2, sizeof( uint32 ) );
+    bin = malloc( sizeof( uint32 ) * (p->n + 1) );
+    if( s->cells == NULL || bin == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate a %u cell grid", ncell );
+        free( bin );
+        return CE_Failure;
+    }
+    /* Assign bins and count the points in each */
+    bcal_bin_cells( s, bin );
+    for( i = 0; i < p->n; i++ )
+    {
+        if( p->c[i] == BCAL_CLASS_UNCLASSIFIED ||
+            (s->ret != 0 && p->r[i] != s->ret) )
+        {
+            bin[i] = ncell;
+        }
+        s->cells[bin[i] + 1]++;
+    }
+    /* Offsets from counts */
+    for( k = 0; k <= ncell; k++ )
+    {
+        s->cells[k + 1] += s->cells[k];
+    }
+    /*
+    ** Destinations in input order, so points within a cell keep their order.
+    ** cells[k] is walked forward and restored after.
+    */
+    for( i = 0; i < p->n; i++ )
+    {
+        bin[i] = s->cells[bin[i]]++;
+    }
+    for( k = ncell + 1; k > 0; k-- )
     {
-        x = (s->p[i].x - s->env.MinX) / s->spacing;
-        y = (s->env.MaxY - s->p[i].y) / s->spacing;
-        s->p[i].bin = y * nx + x;
+        s->cells[k] = s->cells[k - 1];
     }
-    qsort( s->p, s->n, sizeof( bcal_point ), *compare );
-    return CE_None;
+    s->cells[0] = 0;
+    CPLErr eErr = bcal_points_scatter( p, bin );
+    free( bin );
+    return eErr;
 }
 
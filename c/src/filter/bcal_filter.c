@@ -2,20 +2,83 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+#include <math.h>
+
 #include "bcal_filter.h"
 #include "bcal_point.h"
+#include "bcal_pool.h"
+#include "bcal_time.h"
+
+#include "cpl_string.h"
 
 static void Usage()
 {
     printf(
-"bcal filter [-jobs n] [-buffer f] [grid_space f] input output\n"
+"bcal filter [-jobs n] [-tile_points n] [-max_mem n] [-buffer f]\n"
+"            [-grid_space f] [-threshold f] [-max_height f] [-max_iter n]\n"
+"            [-return n] [-interp linear|idw] [-outliers global|tile]\n"
+"            [-stats path] [-list file] [-mosaic]\n"
+"            [-order input|morton|hilbert] [-index]\n"
+"            input [input ...] output\n"
 "\n"
-"   -jobs           how many parallel threads to run.\n"
-"   -buffer         when merging working tiles, use a buffer of f\n"
-"                   overlap.\n"
+"   -jobs           how many parallel threads to run.  A batch filters\n"
+"                   each file on three quarters of them while the next\n"
+"                   is read on the rest, at least one, and the last is\n"
+"                   written on one more.\n"
+"   -tile_points    target number of points per working tile, default\n"
+"                   1000000.  The domain is cut into at least 4 tiles\n"
+"                   per job.\n"
+"   -max_mem        approximate memory budget in megabytes.  Tiles are\n"
+"                   shrunk to fit, and spilled to a temporary file\n"
+"                   (see CPL_TMPDIR) if they do not all fit at once.\n"
+"                   Inputs indexed with bcal index are not spilled,\n"
+"                   each tile reads the records near it instead.\n"
+"                   Split between two files in a batch.\n"
+"   -buffer         width of the halo each working tile reads from its\n"
+"                   neighbours, default 8 times -grid_space.  Only the\n"
+"                   points a tile owns are merged into the output.\n"
 "   -grid_space     estimated canopy spacing, default 1.0\n"
-"   input           the input *.las or *.laz file\n"
-"   output          the output las file (laz writing not supported)\n" );
+"   -threshold      height under which points are reclassified as\n"
+"                   ground, default 0.0\n"
+"   -max_height     maximum allowed vegetation height, default 50.0\n"
+"   -max_iter       maximum filter iterations per cell, default 15\n"
+"   -return         only filter this return number, default all\n"
+"   -interp         ground surface interpolation, linear on a tin of the\n"
+"                   ground points (default) or inverse distance\n"
+"   -outliers       points 8 standard deviations under the median\n"
+"                   elevation are unclassified low outliers.  global\n"
+"                   (default) takes the statistics over the whole input,\n"
+"                   tile over each working tile and its halo, for areas\n"
+"                   of high relief.\n"
+"   -stats          write point counts, iteration histograms and phase\n"
+"                   timings for the run and every working tile to this\n"
+"                   json file.  In a batch, a directory that gets one\n"
+"                   json file per input.\n"
+"   -list           a text file of inputs, one per line\n"
+"   -mosaic         filter the inputs as one domain, so working tiles at\n"
+"                   the edge of a file read their halo from its\n"
+"                   neighbours.  Outputs go to the output directory, and\n"
+"                   -stats is a single json file.\n"
+"   -order          order of the output records.  input (default) keeps\n"
+"                   the order of the input, morton and hilbert sort the\n"
+"                   points along that curve through cells of -grid_space,\n"
+"                   so nearby points are close in the file.  Sorting\n"
+"                   takes 8 bytes per point.\n"
+"   -index          write a .bcx index next to each output, see bcal\n"
+"                   index.\n"
+"   input           the input *.las or *.laz file.  laz is decompressed\n"
+"                   with -jobs threads to a temporary file (see\n"
+"                   CPL_TMPDIR), and needs a build with LASzip.  The\n"
+"                   file takes the disk of the uncompressed las, for\n"
+"                   every input of a mosaic and up to three inputs of a\n"
+"                   batch at once.  A directory stands for all the las\n"
+"                   and laz files in it.\n"
+"   output          the output las file, a copy of the input with the\n"
+"                   classification and point source id (height)\n"
+"                   rewritten (laz writing not supported).  With more\n"
+"                   than one input, a directory for outputs of the same\n"
+"                   base names.  The next file is read and the last one\n"
+"                   written while each file is filtered.\n" );
     exit( 1 );
 }
 
@@ -23,10 +86,27 @@ int bcal_filter_app( int argc, char *argv[] )
 {
     int i = 0;
     int jobs = 1;
+    uint64 tile_points = BCAL_TILE_POINTS;
+    double max_mem = 0;
     double merge_buf = 0;
+    int have_buf = 0;
     double spacing = 1.0;
-    const char *input = NULL;
+    double threshold = 0.0;
+    double max_height = 50.0;
+    int max_iter = 15;
+    int return_num = 0;
+    int interp = BCAL_INTERP_LINEAR;
+    int outliers = BCAL_OUTLIERS_GLOBAL;
+    char **inputs = NULL;
+    char **names = NULL;
     const char *output = NULL;
+    const char *stats = NULL;
+    int batch = FALSE;
+    int mosaic = FALSE;
+    int order = BCAL_ORDER_INPUT;
+    int write_index = FALSE;
+    int n;
+    VSIStatBufL st;
     /* Absolute minimum is 4 arguments. bcal filter in out */
     if( argc < 4 )
     {
@@ -44,157 +124,681 @@ int bcal_filter_app( int argc, char *argv[] )
         {
             jobs = atoi( argv[++i] );
         }
+        else if( strncmp( argv[i], "-tile_points", strlen( "-tile_points" ) ) == 0 && i + 1 < argc )
+        {
+            tile_points = strtoull( argv[++i], NULL, 10 );
+        }
+        else if( strncmp( argv[i], "-max_mem", strlen( "-max_mem" ) ) == 0 && i + 1 < argc )
+        {
+            max_mem = atof( argv[++i] );
+        }
         else if( strncmp( argv[i], "-buffer", strlen( "-buffer" ) ) == 0 && i + 1 < argc )
         {
             merge_buf = atof( argv[++i] );
+            have_buf = 1;
         }
         else if( strncmp( argv[i], "-grid_space", strlen( "-grid_space" ) ) == 0 && i + 1 < argc )
         {
             spacing = atof( argv[++i] );
         }
-        else if( input == NULL )
+        else if( strncmp( argv[i], "-threshold", strlen( "-threshold" ) ) == 0 && i + 1 < argc )
+        {
+            threshold = atof( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-max_height", strlen( "-max_height" ) ) == 0 && i + 1 < argc )
+        {
+            max_height = atof( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-max_iter", strlen( "-max_iter" ) ) == 0 && i + 1 < argc )
+        {
+            max_iter = atoi( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-return", strlen( "-return" ) ) == 0 && i + 1 < argc )
+        {
+            return_num = atoi( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-interp", strlen( "-interp" ) ) == 0 && i + 1 < argc )
+        {
+            i++;
+            if( EQUAL( argv[i], "linear" ) )
+            {
+                interp = BCAL_INTERP_LINEAR;
+            }
+            else if( EQUAL( argv[i], "idw" ) )
+            {
+                interp = BCAL_INTERP_IDW;
+            }
+            else
+            {
+                fprintf( stderr, "Invalid -interp %s\n", argv[i] );
+                exit( 1 );
+            }
+        }
+        else if( strncmp( argv[i], "-outliers", strlen( "-outliers" ) ) == 0 && i + 1 < argc )
+        {
+            i++;
+            if( EQUAL( argv[i], "global" ) )
+            {
+                outliers = BCAL_OUTLIERS_GLOBAL;
+            }
+            else if( EQUAL( argv[i], "tile" ) )
+            {
+                outliers = BCAL_OUTLIERS_TILE;
+            }
+            else
+            {
+                fprintf( stderr, "Invalid -outliers %s\n", argv[i] );
+                exit( 1 );
+            }
+        }
+        else if( strncmp( argv[i], "-order", strlen( "-order" ) ) == 0 && i + 1 < argc )
+        {
+            i++;
+            if( EQUAL( argv[i], "input" ) )
+            {
+                order = BCAL_ORDER_INPUT;
+            }
+            else if( EQUAL( argv[i], "morton" ) )
+            {
+                order = BCAL_ORDER_MORTON;
+            }
+            else if( EQUAL( argv[i], "hilbert" ) )
+            {
+                order = BCAL_ORDER_HILBERT;
+            }
+            else
+            {
+                fprintf( stderr, "Invalid -order %s\n", argv[i] );
+                exit( 1 );
+            }
+        }
+        else if( strncmp( argv[i], "-index", strlen( "-index" ) ) == 0 )
         {
-            input = argv[i];
+            write_index = TRUE;
         }
-        else if( output == NULL )
+        else if( strncmp( argv[i], "-stats", strlen( "-stats" ) ) == 0 && i + 1 < argc )
         {
-            output = argv[i];
+            stats = argv[++i];
+        }
+        else if( strncmp( argv[i], "-mosaic", strlen( "-mosaic" ) ) == 0 )
+        {
+            mosaic = TRUE;
+        }
+        else if( strncmp( argv[i], "-list", strlen( "-list" ) ) == 0 && i + 1 < argc )
+        {
+            inputs = bcal_batch_add_list( inputs, argv[++i] );
+            if( inputs == NULL )
+            {
+                exit( 1 );
+            }
+            batch = TRUE;
+        }
+        else
+        {
+            names = CSLAddString( names, argv[i] );
         }
         i++;
     }
-    if( input == NULL )
+    /* The last name is the output, the others are inputs */
+    n = CSLCount( names );
+    if( n > 0 )
+    {
+        output = names[n - 1];
+    }
+    if( n > 2 )
+    {
+        batch = TRUE;
+    }
+    for( i = 0; i < n - 1; i++ )
+    {
+        if( VSIStatL( names[i], &st ) == 0 && VSI_ISDIR( st.st_mode ) )
+        {
+            batch = TRUE;
+        }
+        inputs = bcal_batch_add( inputs, names[i] );
+    }
+    if( CSLCount( inputs ) == 0 )
     {
         fprintf( stderr, "No input specified\n" );
         exit( 1 );
     }
-    if( output == NULL )
+    if( output == NULL || (n < 2 && !batch) )
     {
         fprintf( stderr, "No output specified\n" );
         exit( 1 );
     }
+    /* A mosaic is one run, into a directory even for a single input */
+    if( mosaic )
+    {
+        batch = TRUE;
+    }
+    if( batch && VSIStatL( output, &st ) != 0 &&
+        VSIMkdir( output, 0755 ) != 0 )
+    {
+        fprintf( stderr, "Failed to create output directory %s\n", output );
+        exit( 1 );
+    }
+    if( batch && (VSIStatL( output, &st ) != 0 || !VSI_ISDIR( st.st_mode )) )
+    {
+        fprintf( stderr, "The output of several inputs must be a directory\n" );
+        exit( 1 );
+    }
+    if( batch && !mosaic && stats != NULL && VSIStatL( stats, &st ) != 0 &&
+        VSIMkdir( stats, 0755 ) != 0 )
+    {
+        fprintf( stderr, "Failed to create stats directory %s\n", stats );
+        exit( 1 );
+    }
+
+    if( jobs < 1 || tile_points < 1 || max_mem < 0 || spacing <= 0 ||
+        max_iter < 2 || merge_buf < 0 )
+    {
+        fprintf( stderr, "Invalid -jobs, -tile_points, -max_mem, -buffer, "
+                         "-grid_space or -max_iter\n" );
+        exit( 1 );
+    }
+    if( !have_buf )
+    {
+        merge_buf = BCAL_HALO_CELLS * spacing;
+    }
 
     bcal_filter_data b;
-    b.input = strdup( input );
+    memset( &b, 0, sizeof( b ) );
+    b.input = strdup( inputs[0] );
     b.output = strdup( output );
     b.jobs = jobs;
+    b.tile_points = tile_points;
+    b.max_mem = (uint64)(max_mem * 1024 * 1024);
     b.merge_buf = merge_buf;
     b.spacing = spacing;
+    b.threshold = threshold;
+    b.max_height = max_height;
+    b.max_iter = max_iter;
+    b.return_num = return_num;
+    b.interp = interp;
+    b.outliers = outliers;
+    b.low_z = -HUGE_VAL;
+    b.stats = stats != NULL ? strdup( stats ) : NULL;
+    b.mosaic = NULL;
+    b.order = order;
+    b.index = write_index;
 
-    return (int)bcal_filter( &b );
+    int rc;
+    if( mosaic )
+    {
+        b.mosaic = inputs;
+        rc = (int)bcal_filter( &b );
+    }
+    else if( batch )
+    {
+        rc = (int)bcal_filter_batch( &b, inputs, CSLCount( inputs ), output );
+    }
+    else
+    {
+        rc = (int)bcal_filter( &b );
+    }
+    CSLDestroy( inputs );
+    CSLDestroy( names );
+    free( b.input );
+    free( b.output );
+    free( b.stats );
+    return rc;
+}
+/*
+** With a memory budget, shrink the tiles until jobs of them, halos
+** included, fit in the part of the budget left for working sets.  Point
+** density is assumed even, so the budget is approximate.
+*/
+static CPLErr fit_tiles( const bcal_filter_data *b, bcal_domain *d,
+                         uint64 n_points, uint64 budget )
+{
+    uint64 tile_points = b->tile_points;
+    double w, h, grow, per;
+    int tries;
+    for( tries = 0; tries < 8; tries++ )
+    {
+        if( bcal_partition_tiles( d, b->jobs, n_points, tile_points,
+                                  b->spacing ) != CE_None )
+        {
+            return CE_Failure;
+        }
+        if( budget == 0 )
+        {
+            return CE_None;
+        }
+        w = d->sub_envs[0].MaxX - d->sub_envs[0].MinX;
+        h = d->sub_envs[0].MaxY - d->sub_envs[0].MinY;
+        grow = w > 0 && h > 0 ?
+               (w + 2 * b->merge_buf) * (h + 2 * b->merge_buf) / (w * h) : 1;
+        per = (double)n_points / d->n * grow * BCAL_POINT_BYTES * b->jobs;
+        if( per <= budget || tile_points <= 1 )
+        {
+            return CE_None;
+        }
+        tile_points = (uint64)(tile_points * 0.9 * budget / per);
+        if( tile_points < 1 )
+        {
+            tile_points = 1;
+        }
+        bcal_free_decomp( d );
+    }
+    return bcal_partition_tiles( d, b->jobs, n_points, tile_points,
+                                 b->spacing );
 }
 
-CPLErr bcal_filter( bcal_filter_data *b )
+/*
+** Reset the classification and height of every point of set i, flagging
+** low outliers, and bin the set.  A local threshold is taken over the
+** set's points, halo included, so neighbouring tiles agree near their
+** edges.
+*/
+static CPLErr bin_set( bcal_filter_file *f, uint32 i )
 {
-    if( b == NULL )
+    bcal_working_set *s = f->sets + i;
+    uint32 j;
+    CPLErr eErr;
+    double t0 = bcal_time_now();
+    s->ret = (uint8)f->b.return_num;
+    s->stats.low_z = f->b.outliers == BCAL_OUTLIERS_TILE ?
+                     bcal_zstats_local_low( &s->p, BCAL_LOW_SIGMAS ) :
+                     f->b.low_z;
+    for( j = 0; j < s->p.n; j++ )
     {
-        return CE_Failure;
+        s->p.c[j] = BCAL_CLASS_CREATED;
+        if( bcal_points_z( &s->p, j ) < s->stats.low_z )
+        {
+            s->p.c[j] = BCAL_CLASS_UNCLASSIFIED;
+            s->stats.n_low++;
+        }
+        s->p.h[j] = BCAL_LAS_NO_HEIGHT;
     }
+    eErr = bcal_bin( s );
+    s->stats.t_bin = bcal_time_now() - t0;
+    return eErr;
+}
 
-    //const char * aszValidDrivers = {"LAS", NULL};
+static CPLErr bin_task( void *arg, uint32 i )
+{
+    return bin_set( (bcal_filter_file*)arg, i );
+}
 
+/*
+** Read a set back from the spill file or through the input indexes and bin
+** it if needed, run the ground filter and merge the points it owns.  The
+** set is freed once it is merged.
+*/
+static CPLErr filter_set( void *arg, uint32 i )
+{
+    bcal_filter_file *f = arg;
+    bcal_working_set *s = f->sets + i;
     CPLErr eErr = CE_None;
-    GDALDatasetH hDS = NULL;
-    hDS = GDALOpenEx( b->input, GDAL_OF_VECTOR | GDAL_OF_READONLY,
-                        NULL, NULL, NULL );
-    if( hDS == NULL )
+    double t0 = bcal_time_now();
+    if( f->sp != NULL || f->indexed )
     {
-        /* GDAL will report a proper failed to open error. */
+        eErr = f->sp != NULL ?
+               bcal_spill_read( f->sp, i, &s->p ) :
+               bcal_load_set( &f->m, &f->domain, f->b.merge_buf, i, s );
+        s->stats.t_read = bcal_time_now() - t0;
+        if( eErr == CE_None )
+        {
+            eErr = bin_set( f, i );
+        }
+    }
+    if( eErr == CE_None )
+    {
+        eErr = bcal_ground( s, &f->b );
+    }
+    t0 = bcal_time_now();
+    if( eErr == CE_None )
+    {
+        bcal_merge( &f->domain, i, s, f->out );
+    }
+    s->stats.t_write = bcal_time_now() - t0;
+    bcal_free_sets( s, 1 );
+    return eErr;
+}
+
+/* The threads that read and bin the input */
+static uint32 read_jobs( const bcal_filter_data *b )
+{
+    return (uint32)(b->read_jobs > 0 ? b->read_jobs : b->jobs);
+}
+
+/*
+** Open the input, or the inputs of a mosaic, and count the compressed bytes
+** of laz inputs as read.
+*/
+static CPLErr open_inputs( bcal_filter_file *f )
+{
+    char *single[1];
+    char **paths = f->b.mosaic;
+    VSIStatBufL st;
+    uint32 i;
+    if( paths == NULL )
+    {
+        single[0] = f->b.input;
+        paths = single;
+    }
+    /* The outputs are copies of the records, so laz is decompressed */
+    if( bcal_mosaic_open( &f->m, paths, paths == single ? 1 :
+                          (uint32)CSLCount( paths ), read_jobs( &f->b ),
+                          FALSE ) != CE_None )
+    {
+        /* bcal_las_open reports a proper failed to open error. */
         return CE_Failure;
     }
+    for( i = 0; i < f->m.n; i++ )
+    {
+        if( f->m.las[i].decoded != NULL &&
+            VSIStatL( f->m.las[i].path, &st ) == 0 )
+        {
+            f->run.bytes_read += (uint64)st.st_size;
+        }
+    }
+    return CE_None;
+}
 
-    OGRLayerH hLayer = GDALDatasetGetLayer( hDS, 0 );
-    if( hLayer == NULL )
+/*
+** Copy each input to its output: b.output, or for a mosaic the file of the
+** same base name in the b.output directory.
+*/
+static CPLErr create_outputs( bcal_filter_file *f )
+{
+    char **names = NULL;
+    char *path;
+    uint32 i, j;
+    CPLErr eErr = CE_None;
+    f->out = calloc( f->m.n, sizeof( bcal_las_writer ) );
+    if( f->out == NULL )
     {
-        CPLError( CE_Failure, CPLE_AppDefined,
-                  "Failed to fetch a valid las layer." );
-        GDALClose( hDS );
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate outputs" );
         return CE_Failure;
     }
+    if( f->b.mosaic == NULL )
+    {
+        return bcal_las_create_copy( f->m.las, f->b.output, f->out );
+    }
+    for( i = 0; i < f->m.n && eErr == CE_None; i++ )
+    {
+        names = CSLAddString( names, CPLGetBasename( f->m.las[i].path ) );
+        path = strdup( CPLFormFilename( f->b.output, names[i], "las" ) );
+        for( j = 0; j < i; j++ )
+        {
+            if( strcmp( names[j], names[i] ) == 0 )
+            {
+                CPLError( CE_Failure, CPLE_IllegalArg,
+                          "%s and %s would both be written to %s",
+                          f->m.las[j].path, f->m.las[i].path, path );
+                eErr = CE_Failure;
+            }
+        }
+        if( eErr == CE_None )
+        {
+            eErr = bcal_las_create_copy( f->m.las + i, path, f->out + i );
+        }
+        free( path );
+    }
+    CSLDestroy( names );
+    return eErr;
+}
 
-    bcal_domain domain;
-    if( OGR_L_GetExtent( hLayer, &(domain.env), FALSE ) != OGRERR_NONE )
+/*
+** bcal_filter_prepare opens b->input, or the b->mosaic inputs, creates the
+** output copies, and loads the working sets, binned unless they were
+** spilled.  When every input has an index, sets that would be spilled, and
+** with per tile thresholds all sets, are read as they are filtered instead.
+** f takes a copy of b.  Whatever the result, release f with
+** bcal_filter_finish.
+*/
+CPLErr bcal_filter_prepare( bcal_filter_file *f, const bcal_filter_data *b )
+{
+    bcal_filter_data *fb = &f->b;
+    bcal_run_stats *run = &f->run;
+    bcal_zstats *zs = NULL;
+    uint64 budget, total = 0;
+    uint32 i, passes = 0;
+    CPLErr eErr = CE_None;
+    double t0;
+
+    memset( f, 0, sizeof( bcal_filter_file ) );
+    f->b = *b;
+    f->t_start = bcal_time_now();
+    /* Pick the point kernels before any worker needs them */
+    bcal_simd_level();
+    t0 = f->t_start;
+    if( open_inputs( f ) != CE_None )
+    {
+        return CE_Failure;
+    }
+    run->t_read = bcal_time_now() - t0;
+    bcal_mosaic_env( &f->m, &f->domain.env );
+
+    /*
+    ** The outputs are copies of the inputs, and results are patched into
+    ** them as each set is filtered.
+    */
+    t0 = bcal_time_now();
+    if( create_outputs( f ) != CE_None )
     {
-        CPLError( CE_Failure, CPLE_AppDefined,
-                  "Failed to obtain a valid domain boundary." );
-        GDALClose( hDS );
         return CE_Failure;
     }
+    run->t_write = bcal_time_now() - t0;
 
-    eErr = bcal_partition( &domain, b->jobs );
+    /*
+    ** A quarter of the budget buffers spill writes, the rest holds the
+    ** working sets being filtered.
+    */
+    budget = fb->max_mem / 4 * 3;
+    t0 = bcal_time_now();
+    eErr = fit_tiles( fb, &f->domain, f->m.h.n_points, budget );
+    run->t_partition = bcal_time_now() - t0;
     if( eErr != CE_None )
     {
         CPLError( CE_Failure, CPLE_AppDefined,
                   "Failed to partition domain" );
-        GDALClose( hDS );
+        return CE_Failure;
+    }
+    f->sets = calloc( f->domain.n, sizeof( bcal_working_set ) );
+    f->counts = calloc( f->domain.n, sizeof( uint32 ) );
+    if( f->sets == NULL || f->counts == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate working sets" );
         return CE_Failure;
     }
     /*
-    ** We could use fast feature count here, when spatial filter enabled.
-    ** Instead, we'll guess and keep track.
+    ** The global threshold is gathered while the input is counted, local
+    ** ones as each set is binned.  Those need no count of the input when
+    ** the indexes have one.
     */
-    uint64 guess = OGR_L_GetFeatureCount( hLayer, FALSE ) / domain.n;
-    int alloced = guess;
-    bcal_working_set *set = malloc( sizeof( bcal_working_set ) * domain.n );
-    OGRGeometryH hPoly;
-    OGRGeometryH hRing;
-    OGRGeometryH hGeom;
-    OGRFeatureH hFeat;
-    uint32 i, j;
-    for( i = 0; i < domain.n; i++ )
-    {
-        alloced = guess;
-        set[i].p = malloc( sizeof( bcal_point ) * alloced );
-        set[i].env = domain.sub_envs[i];
-        hRing = OGR_G_CreateGeometry( wkbLinearRing );
-        hPoly = OGR_G_CreateGeometry( wkbPolygon );
-        OGR_G_SetPoint( hRing, 0, domain.sub_envs[i].MinX, domain.sub_envs[i].MaxY, 0 );
-        OGR_G_SetPoint( hRing, 1, domain.sub_envs[i].MaxX, domain.sub_envs[i].MaxY, 0 );
-        OGR_G_SetPoint( hRing, 2, domain.sub_envs[i].MinX, domain.sub_envs[i].MinY, 0 );
-        OGR_G_SetPoint( hRing, 3, domain.sub_envs[i].MaxX, domain.sub_envs[i].MinY, 0 );
-        OGR_G_CloseRings( hRing );
-        OGR_G_AddGeometry( hPoly, hRing );
-        OGR_L_ResetReading( hLayer );
-        OGR_L_SetSpatialFilter( hLayer, hPoly );
-        j = 0;
-        while( (hFeat = OGR_L_GetNextFeature( hLayer )) != NULL )
-        {
-            if( j >= alloced )
+    t0 = bcal_time_now();
+    if( fb->outliers == BCAL_OUTLIERS_GLOBAL )
+    {
+        eErr = bcal_zstats_init( &f->zs, &f->m.h );
+        zs = &f->zs;
+    }
+    if( eErr == CE_None && zs == NULL && f->m.indexed )
+    {
+        eErr = bcal_load_count_index( &f->m, &f->domain, fb->merge_buf,
+                                      f->counts );
+        f->indexed = TRUE;
+    }
+    else if( eErr == CE_None )
+    {
+        eErr = bcal_load_count( &f->m, &f->domain, fb->merge_buf,
+                                read_jobs( fb ), f->counts, zs );
+        passes++;
+    }
+    if( eErr == CE_None && zs != NULL )
+    {
+        fb->low_z = bcal_zstats_low( &f->zs, BCAL_LOW_SIGMAS );
+        CPLDebug( "BCAL", "flagging points under %lf as low outliers",
+                  fb->low_z );
+    }
+    if( eErr == CE_None )
+    {
+        for( i = 0; i < f->domain.n; i++ )
+        {
+            total += f->counts[i];
+        }
+        /* Sets that don't fit are read through the indexes, or spilled */
+        if( budget > 0 && total * BCAL_POINT_BYTES > budget )
+        {
+            f->indexed = f->m.indexed;
+        }
+        if( budget > 0 && total * BCAL_POINT_BYTES > budget && !f->indexed )
+        {
+            eErr = bcal_spill_create( &f->spill, f->domain.n, f->counts,
+                                      fb->max_mem / 4 );
+            f->sp = eErr == CE_None ? &f->spill : NULL;
+        }
+    }
+    if( eErr == CE_None && f->indexed )
+    {
+        bcal_load_init( &f->m, &f->domain, fb->spacing, fb->merge_buf,
+                        f->counts, f->sets );
+    }
+    else if( eErr == CE_None )
+    {
+        eErr = bcal_load( &f->m, &f->domain, fb->spacing, fb->merge_buf,
+                          f->counts, f->sp, f->sets );
+        passes++;
+    }
+    /*
+    ** The input is scanned to count and to load, a spill is read back once.
+    ** Sets read through the indexes count their own reads.
+    */
+    run->t_read += bcal_time_now() - t0;
+    run->n_points = f->m.h.n_points;
+    run->jobs = fb->jobs;
+    run->spilled = f->sp != NULL;
+    for( i = 0; i < f->m.n; i++ )
+    {
+        run->bytes_read += passes * f->m.las[i].h.n_points *
+                           f->m.las[i].h.point_length;
+    }
+    if( f->sp != NULL )
+    {
+        run->bytes_read += total * BCAL_SPILL_POINT_BYTES;
+    }
+    /* Spilled and indexed sets are binned as they are read */
+    if( eErr == CE_None && f->sp == NULL && !f->indexed )
+    {
+        eErr = bcal_pool_run( read_jobs( fb ), f->domain.n, bin_task, f );
+    }
+    return eErr;
+}
+
+/*
+** bcal_filter_run filters the working sets of a prepared file and patches
+** the results into the output copy.
+*/
+CPLErr bcal_filter_run( bcal_filter_file *f )
+{
+    uint64 *cost = malloc( sizeof( uint64 ) * f->domain.n );
+    uint32 i;
+    CPLErr eErr;
+    double t0;
+    /* Tiles are dealt out by point count, heaviest first */
+    for( i = 0; i < f->domain.n && cost != NULL; i++ )
+    {
+        cost[i] = f->counts[i];
+    }
+    t0 = bcal_time_now();
+    eErr = bcal_pool_run_weighted( f->b.jobs, f->domain.n, cost, filter_set,
+                                   f );
+    f->run.t_filter = bcal_time_now() - t0;
+    for( i = 0; i < f->domain.n; i++ )
+    {
+        f->run.bytes_read += f->sets[i].stats.bytes_read;
+    }
+    free( cost );
+    return eErr;
+}
+
+/*
+** bcal_filter_finish sorts and flushes the output, which is removed if eErr
+** is not CE_None, indexes it and writes the run statistics if asked, and
+** releases f.
+*/
+CPLErr bcal_filter_finish( bcal_filter_file *f, CPLErr eErr )
+{
+    uint32 i;
+    double t0;
+    char *path;
+    bcal_bcx x;
+    if( f->sp != NULL )
+    {
+        bcal_spill_close( f->sp );
+        f->sp = NULL;
+    }
+    if( f->sets != NULL )
+    {
+        bcal_free_sets( f->sets, f->domain.n );
+        /* The counters stay, the points are gone */
+        bcal_stats_sum( f->sets, f->domain.n, &f->run.tiles );
+    }
+    t0 = bcal_time_now();
+    for( i = 0; f->out != NULL && i < f->m.n; i++ )
+    {
+        if( eErr == CE_None )
+        {
+            eErr = bcal_las_sort( f->out + i, &f->domain.env, f->b.spacing,
+                                  f->b.order );
+        }
+        path = eErr == CE_None && f->b.index ? strdup( f->out[i].path ) :
+                                                NULL;
+        bcal_las_writer_close( f->out + i, eErr != CE_None );
+        /*
+        ** Outputs are closed, so the index sees their final size.  The
+        ** index is optional, its readers do without, so the output stays.
+        */
+        if( path != NULL )
+        {
+            if( bcal_bcx_create( path, BCAL_BCX_CELL_POINTS, 1, &x ) !=
+                CE_None )
             {
-                alloced = alloced * 1.5;
-                set[i].p = realloc( set[i].p, sizeof( bcal_point ) * alloced );
+                CPLError( CE_Warning, CPLE_AppDefined,
+                          "Failed to index %s, it is written unindexed",
+                          path );
             }
-            set[i].p[j].fid = OGR_F_GetFID( hFeat );
-            set[i].p[j].c =
-                OGR_F_GetFieldAsInteger( hFeat, OGR_F_GetFieldIndex( hFeat, "classification" ) );
-            hGeom = OGR_F_GetGeometryRef( hFeat );
-            set[i].p[j].x = OGR_G_GetX( hGeom, 0 );
-            set[i].p[j].y = OGR_G_GetY( hGeom, 0 );
-            set[i].p[j].z = OGR_G_GetZ( hGeom, 0 );
-            OGR_F_Destroy( hFeat );
-            j++;
-        }
-        /* Free unused array stuff */
-        set[i].p = realloc( set[i].p, sizeof( bcal_point ) * (j - 1) );
-        set[i].n = j - 1;
-        OGR_L_SetSpatialFilter( hLayer, NULL );
-        OGR_G_DestroyGeometry( hRing );
-        OGR_G_DestroyGeometry( hPoly );
-    }
-    /* Thread over this loop */
-    for( i = 0; i < domain.n; i++ )
-    {
-        //bin( points[i], p_counts[i], b->spacing );
-        //set_init_ground(
-    }
-    for( i = 0; i < domain.n; i++ )
-    {
-        free( set[i].p );
-        set[i].p = NULL;
-    }
-    free( set );
-    set = NULL;
-
-    GDALClose( hDS );
-    return CE_None;
+            bcal_bcx_free( &x );
+            free( path );
+        }
+    }
+    f->run.t_write += bcal_time_now() - t0;
+    f->run.t_total = bcal_time_now() - f->t_start;
+    if( eErr == CE_None && f->b.stats != NULL )
+    {
+        eErr = bcal_stats_write( f->b.stats, &f->b, &f->run, &f->domain,
+                                 f->sets );
+    }
+    free( f->sets );
+    f->sets = NULL;
+    free( f->counts );
+    f->counts = NULL;
+    bcal_zstats_free( &f->zs );
+    bcal_free_decomp( &f->domain );
+    free( f->out );
+    f->out = NULL;
+    bcal_mosaic_close( &f->m );
+    return eErr;
 }
 
+CPLErr bcal_filter( bcal_filter_data *b )
+{
+    bcal_filter_file f;
+    CPLErr eErr;
+    if( b == NULL )
+    {
+        return CE_Failure;
+    }
+    eErr = bcal_filter_prepare( &f, b );
+    if( eErr == CE_None )
+    {
+        eErr = bcal_filter_run( &f );
+    }
+    b->low_z = f.b.low_z;
+    return bcal_filter_finish( &f, eErr );
+}
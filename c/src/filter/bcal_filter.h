@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "bcal_las.h"
 #include "bcal_point.h"
 #include "bcal_types.h"
 
@@ -16,20 +17,126 @@
 
 typedef OGREnvelope bcal_env;
 
+/* Default number of points per tile */
+#define BCAL_TILE_POINTS 1000000
+/* Minimum number of tiles per job, for load balancing */
+#define BCAL_TILES_PER_JOB 4
+/* Minimum tile width and height, in grid cells */
+#define BCAL_TILE_MIN_CELLS 32
+/* Default halo width, in grid cells */
+#define BCAL_HALO_CELLS 8
+/*
+** Approximate bytes a working set needs per point while it is filtered: the
+** point columns, the binning scratch and the cell offsets.
+*/
+#define BCAL_POINT_BYTES 48
+/* Bytes per point in a spill file: fid, x, y, z and return */
+#define BCAL_SPILL_POINT_BYTES 21
+/* Marks the end of a chain of points */
+#define BCAL_NO_POINT UINT32_MAX
+/* Ground surface interpolation methods */
+#define BCAL_INTERP_LINEAR 0
+#define BCAL_INTERP_IDW 1
+/* Low outlier thresholds, for the whole input or each working tile */
+#define BCAL_OUTLIERS_GLOBAL 0
+#define BCAL_OUTLIERS_TILE 1
+/* Points this many standard deviations under the median are low outliers */
+#define BCAL_LOW_SIGMAS 8
+/* Instruction sets of the point kernels, see bcal_simd_level */
+#define BCAL_SIMD_SCALAR 0
+#define BCAL_SIMD_SSE2 1
+#define BCAL_SIMD_AVX2 2
+/* Most bins in the elevation histogram used to find the median */
+#define BCAL_ZSTATS_BINS (1 << 20)
+/* Bins of the iteration histogram, the last holds all later iterations */
+#define BCAL_STATS_ITER_BINS 32
+/*
+** Low bits of a point fid that hold its record number, the bits above hold
+** the index of its file in the mosaic.
+*/
+#define BCAL_FID_RECORD_BITS 40
+#define BCAL_FID_MAX_RECORDS (UINT64_C(1) << BCAL_FID_RECORD_BITS)
+#define BCAL_FID_MAX_FILES (UINT64_C(1) << (63 - BCAL_FID_RECORD_BITS))
+#define BCAL_FID( file, record ) \
+    ((int64)(((uint64)(file) << BCAL_FID_RECORD_BITS) | (uint64)(record)))
+#define BCAL_FID_FILE( fid ) \
+    ((uint32)((uint64)(fid) >> BCAL_FID_RECORD_BITS))
+#define BCAL_FID_RECORD( fid ) \
+    ((uint64)(fid) & (BCAL_FID_MAX_RECORDS - 1))
+
 typedef struct bcal_filter_data
 {
     char *input;
     char *output;
     int jobs;
+    /*
+    ** Threads that read, decompress and bin the input, 0 for jobs.  A batch
+    ** reads the next file on these while this one is filtered on jobs.
+    */
+    int read_jobs;
+    /* Target number of points per tile */
+    uint64 tile_points;
+    /* Approximate memory budget in bytes, 0 for no limit */
+    uint64 max_mem;
     double merge_buf;
     double spacing;
+    /* Height (m) under which points are reclassified as ground */
+    double threshold;
+    /* Maximum allowed vegetation height (m) */
+    double max_height;
+    /* Maximum number of filter iterations per cell */
+    int max_iter;
+    /* Return number to filter, 0 for all returns */
+    int return_num;
+    /* BCAL_INTERP_LINEAR or BCAL_INTERP_IDW */
+    int interp;
+    /* BCAL_OUTLIERS_GLOBAL or BCAL_OUTLIERS_TILE */
+    int outliers;
+    /*
+    ** Points below this elevation are low outliers, set by bcal_filter for
+    ** BCAL_OUTLIERS_GLOBAL
+    */
+    double low_z;
+    /* Path of the json run statistics, NULL for none */
+    char *stats;
+    /*
+    ** Inputs filtered as one domain in place of input, NULL for none.  Each
+    ** is copied to the output directory under its own base name.
+    */
+    char **mosaic;
+    /*
+    ** BCAL_ORDER_INPUT, or the curve the output records are sorted along,
+    ** through cells of spacing over the domain
+    */
+    int order;
+    /* Set to write a .bcx index next to each output */
+    int index;
 } bcal_filter_data;
 
+/*
+** Las files read as one domain.  Points are read at the scale and offset of
+** the first file, and h holds those, the bounds of all the files and their
+** total point count.
+*/
+typedef struct bcal_mosaic
+{
+    uint32 n;
+    bcal_las *las;
+    /* Header bounds of each file */
+    bcal_env *envs;
+    bcal_las_header h;
+    /* Set when every file has a .bcx index, see bcal_load_set */
+    int indexed;
+} bcal_mosaic;
+
 typedef struct bcal_domain
 {
     bcal_env env;
     bcal_env *sub_envs;
     uint32 n;
+    /* Columns and rows of the sub envelope grid */
+    uint32 nx;
+    uint32 ny;
 } bcal_domain;
 
 typedef struct bcal_decomposition
@@ -38,21 +145,299 @@ typedef struct bcal_decomposition
     bcal_env *envs;
 } bcal_decomposition;
 
+/*
+** Counters and timings of one working set, the ProcessingNotes.txt of
+** HeightLAS_BCAL.pro per tile.
+*/
+typedef struct bcal_set_stats
+{
+    /* Points loaded, halo included */
+    uint32 n_loaded;
+    /* Points owned, by final class.  Unfinished points are still created. */
+    uint32 n_owned;
+    uint32 n_ground;
+    uint32 n_vegetation;
+    uint32 n_unclassified;
+    uint32 n_unfinished;
+    /*
+    ** Loaded points that are low outliers, or whose height came out
+    ** infinite or over the maximum
+    */
+    uint32 n_low;
+    uint32 n_infinite;
+    uint32 n_too_high;
+    /* The low outlier threshold the set was filtered with */
+    double low_z;
+    /* Occupied cells, and those still marked when the iterations ran out */
+    uint32 n_cells;
+    uint32 n_cells_unfinished;
+    /* Occupied cells by the iteration that finished them, 1 if seeded */
+    uint32 iter[BCAL_STATS_ITER_BINS];
+    /* Bytes of input records read for this set alone, see bcal_load_set */
+    uint64 bytes_read;
+    /* Seconds spent in each phase */
+    double t_read;
+    double t_bin;
+    double t_seed;
+    double t_iterate;
+    double t_write;
+} bcal_set_stats;
+
+/*
+** The counters and times of bcal_set_stats summed over the working sets of
+** a run, see bcal_stats_sum.  A mosaic or batch passes 2^32 points, so the
+** counters are 64 bit.
+*/
+typedef struct bcal_stats_total
+{
+    uint64 n_loaded;
+    uint64 n_owned;
+    uint64 n_ground;
+    uint64 n_vegetation;
+    uint64 n_unclassified;
+    uint64 n_unfinished;
+    uint64 n_low;
+    uint64 n_infinite;
+    uint64 n_too_high;
+    uint64 n_cells;
+    uint64 n_cells_unfinished;
+    uint64 iter[BCAL_STATS_ITER_BINS];
+    double t_read;
+    double t_bin;
+    double t_seed;
+    double t_iterate;
+    double t_write;
+} bcal_stats_total;
+
+/* Whole run counters and wall times, see bcal_stats_write */
+typedef struct bcal_run_stats
+{
+    uint64 n_points;
+    uint32 jobs;
+    int spilled;
+    uint64 bytes_read;
+    double t_read;
+    double t_partition;
+    double t_filter;
+    double t_write;
+    double t_total;
+    /* The working sets summed, by bcal_filter_finish */
+    bcal_stats_total tiles;
+} bcal_run_stats;
+
 typedef struct bcal_working_set
 {
-    uint32 n;
+    /* Envelope of the loaded points, the owned envelope plus the halo */
     bcal_env env;
-    bcal_point *p;
+    /* Envelope of the points this set decides */
+    bcal_env own;
+    bcal_points p;
     double spacing;
+    /* Return number to bin, 0 for all returns */
+    uint8 ret;
+    /* Bin grid dimensions, set by bcal_bin */
+    uint32 nx;
+    uint32 ny;
+    /*
+    ** nx * ny + 2 cell offsets into p, set by bcal_bin.  The last bin holds
+    ** the points that are not filtered.  Heights are in p's z scale units.
+    */
+    uint32 *cells;
+    bcal_set_stats stats;
 } bcal_working_set;
 
+/*
+** The ground points of a binned working set, chained per cell as they are
+** classified so neighbour queries visit nothing else.
+*/
+typedef struct bcal_ground_index
+{
+    uint32 nx;
+    uint32 ny;
+    /* First ground point of each cell, BCAL_NO_POINT if none */
+    uint32 *head;
+    /* Next ground point in the same cell, by point */
+    uint32 *next;
+} bcal_ground_index;
+
+/* A list of point indices, reused from query to query */
+typedef struct bcal_neighbors
+{
+    uint32 *idx;
+    uint32 n;
+    uint32 alloced;
+} bcal_neighbors;
+
+/*
+** Elevation statistics gathered while the input is counted.  Sums are taken
+** about zmin in quantized units, and the histogram bins are width units
+** wide, so the median is exact when the elevation range fits in
+** BCAL_ZSTATS_BINS units.
+*/
+typedef struct bcal_zstats
+{
+    uint64 n;
+    double sum;
+    double sum2;
+    int32 zmin;
+    uint32 width;
+    uint32 nbins;
+    uint64 *bins;
+    double scale;
+    double offset;
+} bcal_zstats;
+
+/*
+** Working sets spilled to a temporary file.  Each set has a region of
+** counts[i] points, stored column by column, and a small buffer of points
+** waiting to be written.
+*/
+typedef struct bcal_spill
+{
+    char *path;
+    VSILFILE *fp;
+    uint32 n;
+    uint32 *counts;
+    uint32 *written;
+    vsi_l_offset *base;
+    bcal_points *buf;
+} bcal_spill;
+
+/*
+** One input on its way through the filter: bcal_filter_prepare reads it,
+** bcal_filter_run filters it and bcal_filter_finish writes it out.
+*/
+typedef struct bcal_filter_file
+{
+    /* Options for this file, low_z is set by bcal_filter_prepare */
+    bcal_filter_data b;
+    bcal_mosaic m;
+    /* A copy of each file of the mosaic */
+    bcal_las_writer *out;
+    bcal_domain domain;
+    bcal_working_set *sets;
+    uint32 *counts;
+    bcal_zstats zs;
+    bcal_spill spill;
+    /* &spill if the sets were spilled, otherwise NULL */
+    bcal_spill *sp;
+    /* Set when each set is read through the input indexes as it is filtered */
+    int indexed;
+    bcal_run_stats run;
+    double t_start;
+} bcal_filter_file;
+
 int bcal_filter_app( int argc, char *argv[] );
 
 CPLErr bcal_filter( bcal_filter_data *b);
 
+CPLErr bcal_filter_prepare( bcal_filter_file *f, const bcal_filter_data *b );
+
+CPLErr bcal_filter_run( bcal_filter_file *f );
+
+CPLErr bcal_filter_finish( bcal_filter_file *f, CPLErr eErr );
+
+CPLErr bcal_filter_batch( const bcal_filter_data *b, char **inputs,
+                          uint32 n, const char *output_dir );
+
+char ** bcal_batch_add( char **inputs, const char *path );
+
+char ** bcal_batch_add_list( char **inputs, const char *list );
+
 CPLErr bcal_partition( bcal_domain *d, uint32 jobs );
 
+CPLErr bcal_partition_tiles( bcal_domain *d, uint32 jobs, uint64 n_points,
+                             uint64 tile_points, double spacing );
+
+uint32 bcal_partition_find( const bcal_domain *d, double x, double y );
+
+void bcal_free_decomp( bcal_domain *d );
+
+CPLErr bcal_mosaic_open( bcal_mosaic *m, char **paths, uint32 n,
+                         uint32 jobs, int stream );
+
+void bcal_mosaic_env( const bcal_mosaic *m, bcal_env *env );
+
+void bcal_mosaic_close( bcal_mosaic *m );
+
+CPLErr bcal_load_count( const bcal_mosaic *m, const bcal_domain *d,
+                        double halo, uint32 jobs, uint32 *counts,
+                        bcal_zstats *zs );
+
+CPLErr bcal_load_count_index( const bcal_mosaic *m, const bcal_domain *d,
+                              double halo, uint32 *counts );
+
+void bcal_load_init( const bcal_mosaic *m, const bcal_domain *d,
+                     double spacing, double halo, const uint32 *counts,
+                     bcal_working_set *sets );
+
+CPLErr bcal_load( const bcal_mosaic *m, const bcal_domain *d, double spacing,
+                  double halo, const uint32 *counts, bcal_spill *spill,
+                  bcal_working_set *sets );
+
+CPLErr bcal_load_set( const bcal_mosaic *m, const bcal_domain *d,
+                      double halo, uint32 i, bcal_working_set *s );
+
+void bcal_merge( const bcal_domain *d, uint32 i, bcal_working_set *s,
+                 bcal_las_writer *w );
+
+void bcal_free_sets( bcal_working_set *sets, uint32 n );
+
+CPLErr bcal_spill_create( bcal_spill *s, uint32 n, const uint32 *counts,
+                          uint64 buf_bytes );
+
+CPLErr bcal_spill_append( bcal_spill *s, uint32 i, const bcal_points *src,
+                          uint32 k );
+
+CPLErr bcal_spill_flush( bcal_spill *s );
+
+CPLErr bcal_spill_read( const bcal_spill *s, uint32 i, bcal_points *p );
+
+void bcal_spill_close( bcal_spill *s );
+
+CPLErr bcal_zstats_init( bcal_zstats *zs, const bcal_las_header *h );
+
+void bcal_zstats_add( bcal_zstats *zs, const bcal_points *p );
+
+void bcal_zstats_merge( bcal_zstats *dst, const bcal_zstats *src );
+
+double bcal_zstats_low( const bcal_zstats *zs, double sigmas );
+
+double bcal_zstats_local_low( const bcal_points *p, double sigmas );
+
+void bcal_zstats_free( bcal_zstats *zs );
+
 CPLErr bcal_bin( bcal_working_set *s );
 
+int bcal_simd_level( void );
+
+int bcal_simd_set_level( int level );
+
+void bcal_bin_cells( const bcal_working_set *s, uint32 *bin );
+
+uint32 bcal_heights( const bcal_points *p, const uint32 *index, uint32 n,
+                     double *h, double cut );
+
+CPLErr bcal_ground( bcal_working_set *s, const bcal_filter_data *b );
+
+CPLErr bcal_ground_index_init( bcal_ground_index *gi,
+                               const bcal_working_set *s );
+
+void bcal_ground_index_add( bcal_ground_index *gi, uint32 k, uint32 q );
+
+CPLErr bcal_ground_index_query( const bcal_ground_index *gi, uint32 i,
+                                uint32 j, uint32 min, bcal_neighbors *nb );
+
+void bcal_ground_index_free( bcal_ground_index *gi );
+
+void bcal_neighbors_free( bcal_neighbors *nb );
+
+void bcal_stats_sum( const bcal_working_set *sets, uint32 n,
+                     bcal_stats_total *sum );
+
+CPLErr bcal_stats_write( const char *path, const bcal_filter_data *b,
+                         const bcal_run_stats *r, const bcal_domain *d,
+                         const bcal_working_set *sets );
+
 #endif /* BCAL_FILTER_H_ */
 
@@ -0,0 +1,432 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** ground separates ground and vegetation points in a binned working set and
+** assigns vegetation heights.  It follows Streutker, D. and Glenn, N., 2006,
+** LiDAR measurement of sagebrush steppe vegetation heights, as implemented in
+** HeightLAS_BCAL.pro:
+**
+**   1. The lowest point(s) of every cell holding enough points seed the
+**      ground.
+**   2. For each cell still marked for filtering, the ground surface under
+**      its non-ground points is interpolated from the ground points of the
+**      surrounding cells.  A "hole" in the surface sends the cell back for
+**      another iteration.  Otherwise points within threshold / iteration of
+**      the surface become ground; if only some do, the cell is filtered
+**      again.  If none do, the points are vegetation and any height over
+**      the maximum sends the cell back.
+**   3. After the last iteration, heights over the maximum are flagged as
+**      unclassified.
+**
+** The surface is interpolated linearly on a Delaunay triangulation of the
+** ground, like triangulate and griddata in the IDL code.  Rather than
+** triangulating the surrounding ground for every cell in every iteration,
+** one tin per working set is built from the seeds and grows as points are
+** classified as ground.  Outside the hull of the ground, and with -interp
+** idw, the surface is the inverse distance weighting of the surrounding
+** ground.
+*/
+
+#include <math.h>
+
+#include "bcal_filter.h"
+#include "bcal_time.h"
+#include "bcal_tin.h"
+
+/* Minimum points in a cell to seed ground */
+#define BCAL_SEED_MIN 5
+/* Allowed dip (m) of the surface under the surrounding ground */
+#define BCAL_MIN_DIFF 0.5
+/* Minimum ground points to interpolate from */
+#define BCAL_INTERP_MIN 10
+
+typedef struct bcal_ground_grid
+{
+    bcal_working_set *s;
+    const bcal_filter_data *b;
+    uint32 ncell;
+    /* Cell offsets from bcal_bin */
+    const uint32 *start;
+    /* Iteration count of each cell, the cell is filtered while it matches */
+    uint16 *iter;
+    /* Ground points by cell, and the ground around the current cell */
+    bcal_ground_index gi;
+    bcal_neighbors surround;
+    /* Scratch lists of point indices and interpolated values */
+    uint32 *index;
+    uint32 nindex;
+    uint32 aindex;
+    double *interp;
+    uint32 ainterp;
+    /* Triangulation of the ground, used if use_tin is set */
+    bcal_tin tin;
+    int use_tin;
+} bcal_ground_grid;
+
+static uint32 * grow( uint32 *a, uint32 n, uint32 *alloced )
+{
+    if( n < *alloced )
+    {
+        return a;
+    }
+    *alloced = *alloced * 2 + 64;
+    return realloc( a, sizeof( uint32 ) * *alloced );
+}
+
+/* Interpolate the ground surface at point i. */
+static double interpolate( const bcal_ground_grid *g, uint32 i )
+{
+    const bcal_points *p = &g->s->p;
+    double num = 0, den = 0, dx, dy, d2, w;
+    uint32 k, q;
+    for( k = 0; k < g->surround.n; k++ )
+    {
+        q = g->surround.idx[k];
+        dx = (double)(p->x[q] - p->x[i]) * p->scale[0];
+        dy = (double)(p->y[q] - p->y[i]) * p->scale[1];
+        d2 = dx * dx + dy * dy;
+        if( d2 == 0 )
+        {
+            return bcal_points_z( p, q );
+        }
+        w = 1. / d2;
+        num += w * bcal_points_z( p, q );
+        den += w;
+    }
+    return num / den;
+}
+
+/* Mark point q of cell k as ground and add it to the surface. */
+static CPLErr add_ground( bcal_ground_grid *g, uint32 k, uint32 q )
+{
+    bcal_points *p = &g->s->p;
+    p->c[q] = BCAL_CLASS_GROUND;
+    p->h[q] = 0;
+    bcal_ground_index_add( &g->gi, k, q );
+    if( g->use_tin &&
+        bcal_tin_insert( &g->tin, p->x[q], p->y[q],
+                         bcal_points_z( p, q ) ) == CE_Failure )
+    {
+        return CE_Failure;
+    }
+    return CE_None;
+}
+
+/*
+** Start a tin over the grid.  Sets too large for the tin's integer
+** coordinates fall back to inverse distance weighting.
+*/
+static void init_tin( bcal_ground_grid *g )
+{
+    const bcal_working_set *s = g->s;
+    const bcal_points *p = &s->p;
+    double x0 = floor( (s->env.MinX - p->offset[0]) / p->scale[0] );
+    double y0 = floor( (s->env.MinY - p->offset[1]) / p->scale[1] );
+    double x1 = ceil( (s->env.MaxX - p->offset[0]) / p->scale[0] );
+    double y1 = ceil( (s->env.MaxY - p->offset[1]) / p->scale[1] );
+    if( g->b->interp != BCAL_INTERP_LINEAR )
+    {
+        return;
+    }
+    if( x1 - x0 >= BCAL_TIN_MAX_EXTENT || y1 - y0 >= BCAL_TIN_MAX_EXTENT )
+    {
+        CPLDebug( "BCAL", "working set too large for a tin, using idw" );
+        return;
+    }
+    g->use_tin = bcal_tin_init( &g->tin, (int64)x0, (int64)y0, (int64)x1,
+                                (int64)y1 ) == CE_None;
+}
+
+static uint16 to_height( double h, double zscale )
+{
+    double raw = floor( h / zscale + 0.5 );
+    if( raw < 0 )
+    {
+        return 0;
+    }
+    return raw < BCAL_LAS_NO_HEIGHT ? (uint16)raw : BCAL_LAS_NO_HEIGHT - 1;
+}
+
+/*
+** Seed the ground with the lowest point(s) in each cell, iteration 1.  All
+** occupied cells require the first filtering pass (2) unless every point
+** was seeded.
+*/
+static CPLErr seed( bcal_ground_grid *g )
+{
+    bcal_points *p = &g->s->p;
+    uint32 k, i, n, low;
+    int32 zmin;
+    for( k = 0; k < g->ncell; k++ )
+    {
+        n = g->start[k + 1] - g->start[k];
+        g->iter[k] = n > 0 ? 2 : 0;
+        if( n < BCAL_SEED_MIN )
+        {
+            continue;
+        }
+        zmin = p->z[g->start[k]];
+        for( i = g->start[k] + 1; i < g->start[k + 1]; i++ )
+        {
+            zmin = p->z[i] < zmin ? p->z[i] : zmin;
+        }
+        low = 0;
+        for( i = g->start[k]; i < g->start[k + 1]; i++ )
+        {
+            if( p->z[i] == zmin )
+            {
+                if( add_ground( g, k, i ) != CE_None )
+                {
+                    return CE_Failure;
+                }
+                low++;
+            }
+        }
+        if( low == n )
+        {
+            g->iter[k] = 1;
+        }
+    }
+    return CE_None;
+}
+
+/* Filter cell k = j * nx + i during iteration n_iter. */
+static CPLErr filter_cell( bcal_ground_grid *g, uint32 i, uint32 j,
+                           uint16 n_iter )
+{
+    bcal_working_set *s = g->s;
+    const bcal_filter_data *b = g->b;
+    bcal_points *p = &s->p;
+    uint32 k = j * s->nx + i;
+    uint32 m, q, n_low, n_high;
+    int32 zmin_ground;
+    double zmin_interp, h, h_max, cut;
+
+    g->nindex = 0;
+    for( m = g->start[k]; m < g->start[k + 1]; m++ )
+    {
+        if( p->c[m] == BCAL_CLASS_GROUND )
+        {
+            continue;
+        }
+        g->index = grow( g->index, g->nindex, &g->aindex );
+        if( g->index == NULL )
+        {
+            CPLError( CE_Failure, CPLE_OutOfMemory,
+                      "Failed to grow point list" );
+            return CE_Failure;
+        }
+        g->index[g->nindex++] = m;
+    }
+    if( g->nindex == 0 )
+    {
+        return CE_None;
+    }
+    if( bcal_ground_index_query( &g->gi, i, j, BCAL_INTERP_MIN,
+                                 &g->surround ) != CE_None )
+    {
+        return CE_Failure;
+    }
+    if( g->surround.n == 0 )
+    {
+        /* No ground anywhere in the set, the cell can't be finished. */
+        return CE_None;
+    }
+    if( g->ainterp < g->aindex )
+    {
+        g->ainterp = g->aindex;
+        g->interp = realloc( g->interp, sizeof( double ) * g->ainterp );
+        if( g->interp == NULL )
+        {
+            CPLError( CE_Failure, CPLE_OutOfMemory,
+                      "Failed to allocate interpolation buffer" );
+            return CE_Failure;
+        }
+    }
+    zmin_ground = p->z[g->surround.idx[0]];
+    for( m = 1; m < g->surround.n; m++ )
+    {
+        q = g->surround.idx[m];
+        zmin_ground = p->z[q] < zmin_ground ? p->z[q] : zmin_ground;
+    }
+    if( g->use_tin )
+    {
+        bcal_tin_interpolate_n( &g->tin, p->x, p->y, g->index, g->nindex,
+                                g->interp );
+    }
+    zmin_interp = HUGE_VAL;
+    for( m = 0; m < g->nindex; m++ )
+    {
+        if( !g->use_tin || isnan( g->interp[m] ) )
+        {
+            g->interp[m] = interpolate( g, g->index[m] );
+        }
+        zmin_interp = g->interp[m] < zmin_interp ? g->interp[m] : zmin_interp;
+    }
+    /* A hole in the surface, filter again */
+    if( zmin_interp < zmin_ground * p->scale[2] + p->offset[2] - BCAL_MIN_DIFF )
+    {
+        g->iter[k]++;
+        return CE_None;
+    }
+    /* From here on interp holds the height above the surface. */
+    cut = b->threshold / n_iter;
+    n_low = bcal_heights( p, g->index, g->nindex, g->interp, cut );
+    n_high = g->nindex - n_low;
+    if( n_low > 0 )
+    {
+        /*
+        ** Points at or under the surface are ground.  If some points are
+        ** still above it, filter again with the new ground.
+        */
+        for( m = 0; m < g->nindex; m++ )
+        {
+            if( (n_high == 0 || g->interp[m] <= cut) &&
+                add_ground( g, k, g->index[m] ) != CE_None )
+            {
+                return CE_Failure;
+            }
+        }
+        if( n_high > 0 )
+        {
+            g->iter[k]++;
+        }
+        return CE_None;
+    }
+    /* Everything is above the surface, record the heights. */
+    h_max = 0;
+    for( m = 0; m < g->nindex; m++ )
+    {
+        q = g->index[m];
+        h = g->interp[m];
+        if( !isfinite( h ) )
+        {
+            s->stats.n_infinite++;
+            p->c[q] = BCAL_CLASS_UNCLASSIFIED;
+            p->h[q] = BCAL_LAS_NO_HEIGHT;
+            continue;
+        }
+        p->c[q] = BCAL_CLASS_VEGETATION;
+        p->h[q] = to_height( h, p->scale[2] );
+        h_max = h > h_max ? h : h_max;
+    }
+    if( h_max > b->max_height )
+    {
+        g->iter[k]++;
+    }
+    return CE_None;
+}
+
+/*
+** bcal_ground classifies the points in s, which must be binned.  Points
+** outside the grid (bin nx * ny) are left alone.  The cell, height and
+** timing counters of s->stats are set.
+*/
+CPLErr bcal_ground( bcal_working_set *s, const bcal_filter_data *b )
+{
+    bcal_ground_grid g;
+    bcal_set_stats *st = &s->stats;
+    CPLErr eErr = CE_None;
+    uint32 i, j, k, m;
+    uint16 n_iter, iter_max;
+    int more;
+    double t0;
+
+    memset( &g, 0, sizeof( g ) );
+    g.s = s;
+    g.b = b;
+    g.ncell = s->nx * s->ny;
+    g.start = s->cells;
+    g.iter = malloc( sizeof( uint16 ) * g.ncell );
+    if( g.iter == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate a %u cell grid", g.ncell );
+        return CE_Failure;
+    }
+    if( bcal_ground_index_init( &g.gi, s ) != CE_None )
+    {
+        free( g.iter );
+        return CE_Failure;
+    }
+
+    st->n_infinite = 0;
+    st->n_too_high = 0;
+    st->n_cells = 0;
+    st->n_cells_unfinished = 0;
+    memset( st->iter, 0, sizeof( st->iter ) );
+
+    t0 = bcal_time_now();
+    init_tin( &g );
+    eErr = seed( &g );
+    st->t_seed = bcal_time_now() - t0;
+
+    t0 = bcal_time_now();
+    iter_max = b->max_iter > 2 ? (uint16)b->max_iter : 2;
+    n_iter = 1;
+    do
+    {
+        n_iter++;
+        more = FALSE;
+        for( j = 0; j < s->ny && eErr == CE_None; j++ )
+        {
+            for( i = 0; i < s->nx && eErr == CE_None; i++ )
+            {
+                k = j * s->nx + i;
+                if( g.iter[k] != n_iter )
+                {
+                    continue;
+                }
+                eErr = filter_cell( &g, i, j, n_iter );
+                if( g.iter[k] > n_iter )
+                {
+                    more = TRUE;
+                }
+            }
+        }
+    } while( eErr == CE_None && more && n_iter < iter_max );
+    CPLDebug( "BCAL", "filtered %u points in %d iterations", s->p.n, n_iter );
+
+    /* Cells marked past the last iteration did not finish */
+    for( k = 0; k < g.ncell; k++ )
+    {
+        if( g.iter[k] == 0 )
+        {
+            continue;
+        }
+        st->n_cells++;
+        if( g.iter[k] > n_iter )
+        {
+            st->n_cells_unfinished++;
+        }
+        else
+        {
+            st->iter[g.iter[k] < BCAL_STATS_ITER_BINS ?
+                     g.iter[k] - 1 : BCAL_STATS_ITER_BINS - 1]++;
+        }
+    }
+
+    /* Flag heights that are too large as unclassified */
+    for( m = 0; m < s->p.n; m++ )
+    {
+        if( s->p.c[m] == BCAL_CLASS_VEGETATION &&
+            s->p.h[m] * s->p.scale[2] > b->max_height )
+        {
+            s->p.c[m] = BCAL_CLASS_UNCLASSIFIED;
+            s->p.h[m] = BCAL_LAS_NO_HEIGHT;
+            st->n_too_high++;
+        }
+    }
+    st->t_iterate = bcal_time_now() - t0;
+
+    free( g.iter );
+    bcal_ground_index_free( &g.gi );
+    bcal_neighbors_free( &g.surround );
+    free( g.index );
+    free( g.interp );
+    bcal_tin_free( &g.tin );
+    return eErr;
+}
+
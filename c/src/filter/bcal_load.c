@@ -0,0 +1,522 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** load reads the inputs and scatters each point to the working set of the
+** sub envelope that owns it, and to the working sets whose halo reaches it.
+** A counting pass over the mapped files sizes every set exactly, so the cost
+** of reading does not grow with the number of sub envelopes.  Sets are
+** filled in memory, or written to a spill file when they do not fit.  Each
+** set is filtered on its own, and merge keeps only the results of the
+** points it owns, so tiles do not show seams.  When the inputs have .bcx
+** indexes, each set can instead read the records near it as it is
+** filtered, with counts taken from the indexes, so nothing is read twice.
+*/
+
+#include <math.h>
+
+#include "bcal_filter.h"
+#include "bcal_pool.h"
+
+/* Points are decoded in blocks of this many records. */
+#define BCAL_READ_BLOCK 65536
+
+/*
+** Find the rows and columns of the sets whose envelope grown by halo holds
+** x, y.
+*/
+static void halo_range( const bcal_domain *d, double x, double y,
+                        double halo, uint32 *c0, uint32 *c1, uint32 *r0,
+                        uint32 *r1 )
+{
+    uint32 nw = bcal_partition_find( d, x - halo, y + halo );
+    uint32 se = bcal_partition_find( d, x + halo, y - halo );
+    *c0 = nw % d->nx;
+    *r0 = nw / d->nx;
+    *c1 = se % d->nx;
+    *r1 = se / d->nx;
+}
+
+/*
+** The set that owns every point of a file, and the halos of no other set
+** reach, going by its header bounds e.  BCAL_NO_POINT if there is none.
+*/
+static uint32 file_set( const bcal_domain *d, const bcal_env *e,
+                        double halo )
+{
+    uint32 nw = bcal_partition_find( d, e->MinX - halo, e->MaxY + halo );
+    uint32 se = bcal_partition_find( d, e->MaxX + halo, e->MinY - halo );
+    return nw == se ? nw : BCAL_NO_POINT;
+}
+
+/* Blocks of the mosaic, counted over all its files */
+static uint64 count_blocks( const bcal_mosaic *m )
+{
+    uint64 n = 0;
+    uint32 f;
+    for( f = 0; f < m->n; f++ )
+    {
+        n += (m->las[f].h.n_points + BCAL_READ_BLOCK - 1) / BCAL_READ_BLOCK;
+    }
+    return n;
+}
+
+/*
+** Read blocks first to last - 1 of the mosaic and hand each point to visit,
+** once for every set whose envelope holds it.  Points of a file that falls
+** in a single set skip the lookup, unless they lie outside the file's
+** header bounds.
+*/
+typedef CPLErr (*bcal_visit)( void *arg, uint32 i, const bcal_points *block,
+                              uint32 k );
+
+static CPLErr scan( const bcal_mosaic *m, const bcal_domain *d, double halo,
+                    uint64 first, uint64 last, bcal_visit visit, void *arg,
+                    bcal_zstats *zs )
+{
+    CPLErr eErr = CE_None;
+    const bcal_las *las;
+    const bcal_env *e;
+    bcal_points block;
+    uint64 start, count, b = 0;
+    uint32 f, k, row, col, c0, c1, r0, r1, only;
+    double x, y;
+    bcal_points_init( &block, m->h.scale, m->h.offset );
+    if( bcal_points_reserve( &block, BCAL_READ_BLOCK ) != CE_None )
+    {
+        return CE_Failure;
+    }
+    for( f = 0; f < m->n && b < last && eErr == CE_None; f++ )
+    {
+        las = m->las + f;
+        e = m->envs + f;
+        only = file_set( d, e, halo );
+        for( start = 0; start < las->h.n_points && b < last &&
+                        eErr == CE_None; start += BCAL_READ_BLOCK )
+        {
+            if( b++ < first )
+            {
+                continue;
+            }
+            count = las->h.n_points - start;
+            if( count > BCAL_READ_BLOCK )
+            {
+                count = BCAL_READ_BLOCK;
+            }
+            block.n = 0;
+            eErr = bcal_las_read( las, start, count, &block );
+            if( eErr != CE_None )
+            {
+                break;
+            }
+            if( f > 0 )
+            {
+                for( k = 0; k < block.n; k++ )
+                {
+                    block.fid[k] = BCAL_FID( f, block.fid[k] );
+                }
+            }
+            if( zs != NULL )
+            {
+                bcal_zstats_add( zs, &block );
+            }
+            for( k = 0; k < block.n && eErr == CE_None; k++ )
+            {
+                x = bcal_points_x( &block, k );
+                y = bcal_points_y( &block, k );
+                if( only != BCAL_NO_POINT && x >= e->MinX && x <= e->MaxX &&
+                    y >= e->MinY && y <= e->MaxY )
+                {
+                    eErr = visit( arg, only, &block, k );
+                    continue;
+                }
+                halo_range( d, x, y, halo, &c0, &c1, &r0, &r1 );
+                for( row = r0; row <= r1 && eErr == CE_None; row++ )
+                {
+                    for( col = c0; col <= c1 && eErr == CE_None; col++ )
+                    {
+                        eErr = visit( arg, row * d->nx + col, &block, k );
+                    }
+                }
+            }
+        }
+    }
+    bcal_points_free( &block );
+    return eErr;
+}
+
+static CPLErr count_point( void *arg, uint32 i, const bcal_points *block,
+                           uint32 k )
+{
+    (void)block;
+    (void)k;
+    ((uint32*)arg)[i]++;
+    return CE_None;
+}
+
+static CPLErr copy_point( void *arg, uint32 i, const bcal_points *block,
+                          uint32 k )
+{
+    bcal_points *p = &((bcal_working_set*)arg)[i].p;
+    bcal_points_copy( p, p->n++, block, k );
+    return CE_None;
+}
+
+static CPLErr spill_point( void *arg, uint32 i, const bcal_points *block,
+                           uint32 k )
+{
+    return bcal_spill_append( (bcal_spill*)arg, i, block, k );
+}
+
+/* Counting is split into ranges of blocks, each with its own tallies */
+typedef struct bcal_count_job
+{
+    const bcal_mosaic *m;
+    const bcal_domain *d;
+    double halo;
+    uint64 n_blocks;
+    uint32 n_ranges;
+    uint32 **counts;
+    bcal_zstats **zs;
+} bcal_count_job;
+
+static CPLErr count_range( void *arg, uint32 i )
+{
+    bcal_count_job *job = arg;
+    return scan( job->m, job->d, job->halo,
+                 job->n_blocks * i / job->n_ranges,
+                 job->n_blocks * (i + 1) / job->n_ranges, count_point,
+                 job->counts[i], job->zs[i] );
+}
+
+/*
+** bcal_load_count counts the points of each set into counts, which must be
+** zeroed, and adds every input point to zs if it is not NULL, in which case
+** zs must have been set up with bcal_zstats_init from m->h.  The blocks of
+** the mosaic are split into a range per job.  Each range is counted into
+** its own counts and elevation histogram, and those are summed at the end.
+*/
+CPLErr bcal_load_count( const bcal_mosaic *m, const bcal_domain *d,
+                        double halo, uint32 jobs, uint32 *counts,
+                        bcal_zstats *zs )
+{
+    bcal_count_job job;
+    uint32 i, j;
+    CPLErr eErr = CE_None;
+    job.n_blocks = count_blocks( m );
+    job.n_ranges = job.n_blocks < jobs ? (uint32)job.n_blocks : jobs;
+    if( job.n_ranges < 2 )
+    {
+        return scan( m, d, halo, 0, job.n_blocks, count_point, counts, zs );
+    }
+    job.m = m;
+    job.d = d;
+    job.halo = halo;
+    job.counts = calloc( job.n_ranges, sizeof( uint32* ) );
+    job.zs = calloc( job.n_ranges, sizeof( bcal_zstats* ) );
+    if( job.counts == NULL || job.zs == NULL )
+    {
+        eErr = CE_Failure;
+    }
+    for( i = 0; i < job.n_ranges && eErr == CE_None; i++ )
+    {
+        job.counts[i] = i == 0 ? counts : calloc( d->n, sizeof( uint32 ) );
+        if( job.counts[i] == NULL )
+        {
+            eErr = CE_Failure;
+        }
+        else if( zs != NULL && i == 0 )
+        {
+            job.zs[i] = zs;
+        }
+        else if( zs != NULL )
+        {
+            job.zs[i] = malloc( sizeof( bcal_zstats ) );
+            if( job.zs[i] == NULL ||
+                bcal_zstats_init( job.zs[i], &m->h ) != CE_None )
+            {
+                free( job.zs[i] );
+                job.zs[i] = NULL;
+                eErr = CE_Failure;
+            }
+        }
+    }
+    if( eErr != CE_None )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate point counts" );
+    }
+    else
+    {
+        eErr = bcal_pool_run( jobs, job.n_ranges, count_range, &job );
+    }
+    for( i = 1; job.counts != NULL && i < job.n_ranges; i++ )
+    {
+        for( j = 0; j < d->n && job.counts[i] != NULL; j++ )
+        {
+            counts[j] += job.counts[i][j];
+        }
+        free( job.counts[i] );
+        if( job.zs != NULL && job.zs[i] != NULL )
+        {
+            bcal_zstats_merge( zs, job.zs[i] );
+            bcal_zstats_free( job.zs[i] );
+            free( job.zs[i] );
+        }
+    }
+    free( job.counts );
+    free( job.zs );
+    return eErr;
+}
+
+/*
+** The envelope set i reads from an index: its own grown by the halo, and by
+** a quantum either way so rounding in bcal_partition_find can't drop a
+** point.  Edge sets also hold the points off the domain.
+*/
+static void index_env( const bcal_mosaic *m, const bcal_domain *d,
+                       double halo, uint32 i, bcal_env *env )
+{
+    uint32 row = i / d->nx;
+    uint32 col = i % d->nx;
+    *env = d->sub_envs[i];
+    env->MinX -= halo + m->h.scale[0];
+    env->MaxX += halo + m->h.scale[0];
+    env->MinY -= halo + m->h.scale[1];
+    env->MaxY += halo + m->h.scale[1];
+    env->MinX = col == 0 ? -HUGE_VAL : env->MinX;
+    env->MaxX = col == d->nx - 1 ? HUGE_VAL : env->MaxX;
+    env->MaxY = row == 0 ? HUGE_VAL : env->MaxY;
+    env->MinY = row == d->ny - 1 ? -HUGE_VAL : env->MinY;
+}
+
+/*
+** bcal_load_count_index sets counts to the points of the index cells each
+** set's envelope touches, without reading a point.  Only the cells across
+** a set's edge are overcounted.  Every file of m must have an index.
+*/
+CPLErr bcal_load_count_index( const bcal_mosaic *m, const bcal_domain *d,
+                              double halo, uint32 *counts )
+{
+    bcal_env env;
+    bcal_bcx_run *runs;
+    uint64 n, count, total;
+    uint32 i, f;
+    for( i = 0; i < d->n; i++ )
+    {
+        index_env( m, d, halo, i, &env );
+        for( f = 0, total = 0; f < m->n; f++ )
+        {
+            if( bcal_bcx_query( m->las[f].index, &env, &runs, &n,
+                                &count ) != CE_None )
+            {
+                return CE_Failure;
+            }
+            free( runs );
+            total += count;
+        }
+        counts[i] = total < UINT32_MAX ? (uint32)total : UINT32_MAX;
+    }
+    return CE_None;
+}
+
+/*
+** bcal_load_init sets up the working sets for the points counted, without
+** reading any.
+*/
+void bcal_load_init( const bcal_mosaic *m, const bcal_domain *d,
+                     double spacing, double halo, const uint32 *counts,
+                     bcal_working_set *sets )
+{
+    uint32 i;
+    for( i = 0; i < d->n; i++ )
+    {
+        bcal_points_init( &sets[i].p, m->h.scale, m->h.offset );
+        sets[i].cells = NULL;
+        sets[i].own = d->sub_envs[i];
+        sets[i].env = d->sub_envs[i];
+        sets[i].env.MinX -= halo;
+        sets[i].env.MaxX += halo;
+        sets[i].env.MinY -= halo;
+        sets[i].env.MaxY += halo;
+        sets[i].spacing = spacing;
+        memset( &sets[i].stats, 0, sizeof( bcal_set_stats ) );
+        sets[i].stats.n_loaded = counts[i];
+        CPLDebug( "BCAL", "working set %u holds %u points", i, counts[i] );
+    }
+}
+
+/*
+** bcal_load sets up the working sets and fills them with the points
+** counted by bcal_load_count.  If spill is not NULL, the points are written
+** to it instead and each set is read back when it is filtered.
+*/
+CPLErr bcal_load( const bcal_mosaic *m, const bcal_domain *d, double spacing,
+                  double halo, const uint32 *counts, bcal_spill *spill,
+                  bcal_working_set *sets )
+{
+    uint32 i;
+    bcal_load_init( m, d, spacing, halo, counts, sets );
+    for( i = 0; i < d->n; i++ )
+    {
+        if( spill == NULL &&
+            bcal_points_reserve( &sets[i].p, counts[i] ) != CE_None )
+        {
+            return CE_Failure;
+        }
+    }
+    if( spill != NULL )
+    {
+        if( scan( m, d, halo, 0, UINT64_MAX, spill_point, spill,
+                  NULL ) != CE_None )
+        {
+            return CE_Failure;
+        }
+        return bcal_spill_flush( spill );
+    }
+    return scan( m, d, halo, 0, UINT64_MAX, copy_point, sets, NULL );
+}
+
+/*
+** bcal_load_set reads the points of set i, set up by bcal_load_init,
+** straight from the inputs: the runs of the index cells near the set, or
+** every record of a file without an index.  The set gets the points
+** bcal_load would give it, in the same order.  Records read are counted in
+** the set's stats.
+*/
+CPLErr bcal_load_set( const bcal_mosaic *m, const bcal_domain *d,
+                      double halo, uint32 i, bcal_working_set *s )
+{
+    const bcal_las *las;
+    bcal_points *p = &s->p;
+    bcal_bcx_run whole, *runs;
+    bcal_env env;
+    uint64 n_runs, count, start, end, n, r;
+    uint32 f, j, k, c0, c1, r0, r1;
+    uint32 row = i / d->nx;
+    uint32 col = i % d->nx;
+    CPLErr eErr = CE_None;
+    index_env( m, d, halo, i, &env );
+    /* The estimate, and room for the block being sifted */
+    if( s->stats.n_loaded < UINT32_MAX - BCAL_READ_BLOCK &&
+        bcal_points_reserve( p, s->stats.n_loaded + BCAL_READ_BLOCK ) !=
+        CE_None )
+    {
+        return CE_Failure;
+    }
+    for( f = 0; f < m->n && eErr == CE_None; f++ )
+    {
+        las = m->las + f;
+        whole.start = 0;
+        whole.count = las->h.n_points;
+        runs = &whole;
+        n_runs = 1;
+        if( las->index != NULL &&
+            bcal_bcx_query( las->index, &env, &runs, &n_runs, &count ) !=
+            CE_None )
+        {
+            return CE_Failure;
+        }
+        for( r = 0; r < n_runs && eErr == CE_None; r++ )
+        {
+            end = runs[r].start + runs[r].count;
+            for( start = runs[r].start; start < end && eErr == CE_None;
+                 start += n )
+            {
+                n = end - start;
+                n = n < BCAL_READ_BLOCK ? n : BCAL_READ_BLOCK;
+                j = p->n;
+                eErr = bcal_las_read( las, start, n, p );
+                for( k = j; k < p->n; k++ )
+                {
+                    p->fid[k] = BCAL_FID( f, p->fid[k] );
+                    halo_range( d, bcal_points_x( p, k ),
+                                bcal_points_y( p, k ), halo, &c0, &c1, &r0,
+                                &r1 );
+                    if( col >= c0 && col <= c1 && row >= r0 && row <= r1 )
+                    {
+                        bcal_points_copy( p, j++, p, k );
+                    }
+                }
+                p->n = j;
+                s->stats.bytes_read += n * las->h.point_length;
+            }
+        }
+        if( runs != &whole )
+        {
+            free( runs );
+        }
+    }
+    s->stats.n_loaded = p->n;
+    return eErr;
+}
+
+/*
+** The height h in units of from, those of the mosaic, in units of to, those
+** of the file it is written to.
+*/
+static uint16 file_height( uint16 h, double from, double to )
+{
+    if( h == BCAL_LAS_NO_HEIGHT || from == to )
+    {
+        return h;
+    }
+    return (uint16)fmin( floor( h * from / to + 0.5 ),
+                         BCAL_LAS_NO_HEIGHT - 1 );
+}
+
+/*
+** bcal_merge patches the results of the points set i owns into w, which has
+** a copy for each file of the mosaic, and counts them by class in the set's
+** stats.  Halo points are decided by their own set.  Heights are written in
+** the z scale of their file.
+*/
+void bcal_merge( const bcal_domain *d, uint32 i, bcal_working_set *s,
+                 bcal_las_writer *w )
+{
+    const bcal_points *p = &s->p;
+    bcal_set_stats *st = &s->stats;
+    bcal_las_writer *out;
+    uint32 k;
+    for( k = 0; k < p->n; k++ )
+    {
+        if( d->n > 1 &&
+            bcal_partition_find( d, bcal_points_x( p, k ),
+                                 bcal_points_y( p, k ) ) != i )
+        {
+            continue;
+        }
+        out = w + BCAL_FID_FILE( p->fid[k] );
+        bcal_las_patch( out, BCAL_FID_RECORD( p->fid[k] ), p->c[k],
+                        file_height( p->h[k], p->scale[2], out->scale[2] ) );
+        st->n_owned++;
+        switch( p->c[k] )
+        {
+            case BCAL_CLASS_GROUND:
+                st->n_ground++;
+                break;
+            case BCAL_CLASS_VEGETATION:
+                st->n_vegetation++;
+                break;
+            case BCAL_CLASS_UNCLASSIFIED:
+                st->n_unclassified++;
+                break;
+            default:
+                st->n_unfinished++;
+                break;
+        }
+    }
+}
+
+void bcal_free_sets( bcal_working_set *sets, uint32 n )
+{
+    uint32 i;
+    for( i = 0; i < n; i++ )
+    {
+        bcal_points_free( &sets[i].p );
+        free( sets[i].cells );
+        sets[i].cells = NULL;
+    }
+}
+
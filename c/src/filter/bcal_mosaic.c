@@ -0,0 +1,122 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** mosaic opens a set of las files as one virtual domain, in place of the
+** buffered copies BufferLAS_BCAL.pro writes of every tile.  The header
+** bounds of the files index the mosaic: their union is the domain that is
+** partitioned, and load reads each file once and hands its points to the
+** working sets whose envelope plus halo they fall in, whichever file they
+** came from.  The fid of a point carries the index of its file, so merge
+** patches it into the copy of that file.  When every file has a .bcx
+** index, a working set can read just the records near it instead.
+*/
+
+#include "bcal_filter.h"
+
+/*
+** bcal_mosaic_open opens the n files at paths, decompressing laz inputs
+** with jobs threads, or with stream set decoding them as they are read
+** where they allow it (see bcal_las_decompress).  Points of every file are
+** read at the scale and offset of the first.  Release with
+** bcal_mosaic_close, whatever the result.
+*/
+CPLErr bcal_mosaic_open( bcal_mosaic *m, char **paths, uint32 n,
+                         uint32 jobs, int stream )
+{
+    bcal_las *las;
+    bcal_env *e;
+    uint32 i;
+    int d;
+    memset( m, 0, sizeof( bcal_mosaic ) );
+    if( n == 0 || (uint64)n > BCAL_FID_MAX_FILES )
+    {
+        CPLError( CE_Failure, CPLE_IllegalArg,
+                  "A mosaic holds 1 to %llu files",
+                  (unsigned long long)BCAL_FID_MAX_FILES );
+        return CE_Failure;
+    }
+    m->las = calloc( n, sizeof( bcal_las ) );
+    m->envs = calloc( n, sizeof( bcal_env ) );
+    if( m->las == NULL || m->envs == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate a mosaic of %u files", n );
+        return CE_Failure;
+    }
+    for( i = 0; i < n; i++ )
+    {
+        las = m->las + i;
+        e = m->envs + i;
+        if( bcal_las_open( paths[i], las ) != CE_None )
+        {
+            return CE_Failure;
+        }
+        m->n = i + 1;
+        if( bcal_las_decompress( las, jobs, stream ) != CE_None )
+        {
+            return CE_Failure;
+        }
+        if( las->h.n_points > BCAL_FID_MAX_RECORDS )
+        {
+            CPLError( CE_Failure, CPLE_NotSupported,
+                      "%s has too many points for a mosaic", las->path );
+            return CE_Failure;
+        }
+        e->MinX = las->h.min[0];
+        e->MaxX = las->h.max[0];
+        e->MinY = las->h.min[1];
+        e->MaxY = las->h.max[1];
+        if( !(e->MinX <= e->MaxX) || !(e->MinY <= e->MaxY) )
+        {
+            CPLError( CE_Failure, CPLE_AppDefined,
+                      "Failed to obtain a valid domain boundary from %s.",
+                      las->path );
+            return CE_Failure;
+        }
+        if( i == 0 )
+        {
+            m->h = las->h;
+            continue;
+        }
+        for( d = 0; d < 3; d++ )
+        {
+            m->h.min[d] = las->h.min[d] < m->h.min[d] ?
+                          las->h.min[d] : m->h.min[d];
+            m->h.max[d] = las->h.max[d] > m->h.max[d] ?
+                          las->h.max[d] : m->h.max[d];
+        }
+        m->h.n_points += las->h.n_points;
+    }
+    m->indexed = TRUE;
+    for( i = 0; i < n; i++ )
+    {
+        m->indexed = m->indexed && m->las[i].index != NULL;
+    }
+    return CE_None;
+}
+
+/* bcal_mosaic_env sets env to the union of the file bounds. */
+void bcal_mosaic_env( const bcal_mosaic *m, bcal_env *env )
+{
+    env->MinX = m->h.min[0];
+    env->MaxX = m->h.max[0];
+    env->MinY = m->h.min[1];
+    env->MaxY = m->h.max[1];
+}
+
+void bcal_mosaic_close( bcal_mosaic *m )
+{
+    uint32 i;
+    for( i = 0; i < m->n; i++ )
+    {
+        bcal_las_close( m->las + i );
+    }
+    free( m->las );
+    m->las = NULL;
+    free( m->envs );
+    m->envs = NULL;
+    m->n = 0;
+    m->indexed = FALSE;
+}
@@ -0,0 +1,137 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** neighbor finds the ground points around a cell of a binned working set.
+** GetIndex_BCAL grows a square around the cell one ring at a time and
+** rescans the whole square, and every point in it, at each step.  Here the
+** ground points of each cell are chained as they are classified, and the
+** search adds only the new ring at each step, so every cell and every
+** ground point is visited once per query.
+*/
+
+#include "bcal_filter.h"
+
+CPLErr bcal_ground_index_init( bcal_ground_index *gi,
+                               const bcal_working_set *s )
+{
+    uint32 k, ncell = s->nx * s->ny;
+    memset( gi, 0, sizeof( bcal_ground_index ) );
+    gi->nx = s->nx;
+    gi->ny = s->ny;
+    gi->head = malloc( sizeof( uint32 ) * (ncell > 0 ? ncell : 1) );
+    gi->next = malloc( sizeof( uint32 ) * (s->p.n > 0 ? s->p.n : 1) );
+    if( gi->head == NULL || gi->next == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate ground index" );
+        bcal_ground_index_free( gi );
+        return CE_Failure;
+    }
+    for( k = 0; k < ncell; k++ )
+    {
+        gi->head[k] = BCAL_NO_POINT;
+    }
+    return CE_None;
+}
+
+/* Chain point q, which lies in cell k and was just classified as ground. */
+void bcal_ground_index_add( bcal_ground_index *gi, uint32 k, uint32 q )
+{
+    gi->next[q] = gi->head[k];
+    gi->head[k] = q;
+}
+
+static CPLErr append_cell( const bcal_ground_index *gi, uint32 k,
+                           bcal_neighbors *nb )
+{
+    uint32 q;
+    uint32 *a;
+    for( q = gi->head[k]; q != BCAL_NO_POINT; q = gi->next[q] )
+    {
+        if( nb->n == nb->alloced )
+        {
+            a = realloc( nb->idx, sizeof( uint32 ) * (nb->alloced * 2 + 64) );
+            if( a == NULL )
+            {
+                CPLError( CE_Failure, CPLE_OutOfMemory,
+                          "Failed to grow neighbor list" );
+                return CE_Failure;
+            }
+            nb->idx = a;
+            nb->alloced = nb->alloced * 2 + 64;
+        }
+        nb->idx[nb->n++] = q;
+    }
+    return CE_None;
+}
+
+/*
+** bcal_ground_index_query sets nb to the ground points in the smallest
+** square of (2f + 1)^2 cells, f >= 1, around cell (i, j) that holds at
+** least min of them, or in the whole grid if none does.
+*/
+CPLErr bcal_ground_index_query( const bcal_ground_index *gi, uint32 i,
+                                uint32 j, uint32 min, bcal_neighbors *nb )
+{
+    uint32 f, ii, jj, i0, i1, j0, j1;
+    CPLErr eErr = CE_None;
+    nb->n = 0;
+    eErr = append_cell( gi, j * gi->nx + i, nb );
+    for( f = 1; eErr == CE_None; f++ )
+    {
+        i0 = i >= f ? i - f : 0;
+        j0 = j >= f ? j - f : 0;
+        i1 = i + f < gi->nx ? i + f : gi->nx - 1;
+        j1 = j + f < gi->ny ? j + f : gi->ny - 1;
+        /* The rows of the ring, then what is left of its columns */
+        for( ii = i0; ii <= i1 && eErr == CE_None; ii++ )
+        {
+            if( j >= f )
+            {
+                eErr = append_cell( gi, (j - f) * gi->nx + ii, nb );
+            }
+            if( j + f < gi->ny && eErr == CE_None )
+            {
+                eErr = append_cell( gi, (j + f) * gi->nx + ii, nb );
+            }
+        }
+        for( jj = j0; jj <= j1 && eErr == CE_None; jj++ )
+        {
+            if( jj + f == j || jj == j + f )
+            {
+                continue;
+            }
+            if( i >= f )
+            {
+                eErr = append_cell( gi, jj * gi->nx + i - f, nb );
+            }
+            if( i + f < gi->nx && eErr == CE_None )
+            {
+                eErr = append_cell( gi, jj * gi->nx + i + f, nb );
+            }
+        }
+        if( nb->n >= min ||
+            (i0 == 0 && j0 == 0 && i1 == gi->nx - 1 && j1 == gi->ny - 1) )
+        {
+            break;
+        }
+    }
+    return eErr;
+}
+
+void bcal_ground_index_free( bcal_ground_index *gi )
+{
+    free( gi->head );
+    free( gi->next );
+    gi->head = NULL;
+    gi->next = NULL;
+}
+
+void bcal_neighbors_free( bcal_neighbors *nb )
+{
+    free( nb->idx );
+    memset( nb, 0, sizeof( bcal_neighbors ) );
+}
+
@@ -2,12 +2,53 @@
 // Use of this source code is governed by a BSD-style
 // license that can be found in the LICENSE file.
 
+#include <math.h>
+
 #include "bcal_filter.h"
 #include "bcal_point.h"
 
 #include "gdal.h"
 #include "cpl_conv.h"
 
+/* Split the domain into an nx by ny grid of sub envelopes. */
+static CPLErr grid( bcal_domain *d, uint32 nx, uint32 ny )
+{
+    double x, y;
+    double dx, dy;
+    x = d->env.MinX;
+    y = d->env.MaxY;
+    dx = (d->env.MaxX - d->env.MinX) / (double)nx;
+    dy = (d->env.MaxY - d->env.MinY) / (double)ny;
+    CPLDebug( "BCAL", "using dx:%lf and dy:%lf to build grid", dx, dy );
+    d->sub_envs = malloc( sizeof( bcal_env ) * nx * ny );
+    if( d->sub_envs == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate %u envelopes", nx * ny );
+        return CE_Failure;
+    }
+    d->n = nx * ny;
+    d->nx = nx;
+    d->ny = ny;
+    uint32 i, j, k;
+    /* Envelopes are stored row major, starting at the north west corner. */
+    for( i = 0; i < ny; i++ )
+    {
+        for( j = 0; j < nx; j++ )
+        {
+            k = i * nx + j;
+            d->sub_envs[k].MinX = x + dx * j;
+            d->sub_envs[k].MaxX = x + (dx * (j + 1));
+            d->sub_envs[k].MaxY = y - dy * i;
+            d->sub_envs[k].MinY = y - (dy * (i + 1));
+            CPLDebug( "BCAL", "using envelope:{%lf,%lf,%lf,%lf} for grid",
+                      d->sub_envs[k].MinX, d->sub_envs[k].MaxX,
+                      d->sub_envs[k].MinY, d->sub_envs[k].MaxY );
+        }
+    }
+    return CE_None;
+}
+
 /*
 ** bcal_partiiton partitions a domain into tiles.  These tiles will be spread
 ** over threads to do work.
@@ -20,42 +61,79 @@ CPLErr bcal_partition( bcal_domain *d, uint32 jobs )
     }
     if( jobs == 1 )
     {
-        d->sub_envs = malloc( sizeof( OGREnvelope ) );
-        d->sub_envs[0] = d->env;
-        d->n = 1;
-        return CE_None;
+        return grid( d, 1, 1 );
     }
     uint32 env_count = 0;
     while( env_count * env_count < jobs )
     {
         env_count++;
     }
-    uint32 ec2 = env_count * env_count;
     CPLDebug( "BCAL", "partitioning domain into %d fields", env_count );
-    double x, y;
-    double dx, dy;
-    x = d->env.MinX;
-    y = d->env.MaxY;
-    dx = (d->env.MaxX - d->env.MinX) / (double)env_count;
-    dy = (d->env.MaxY - d->env.MinY) / (double)env_count;
-    CPLDebug( "BCAL", "using dx:%lf and dy:%lf to build grid", dx, dy );
-    d->sub_envs = malloc( sizeof( bcal_env ) * ec2 );
-    d->n = ec2;
-    int i, j, k;
-    for( i = 0; i < env_count; i++ )
+    return grid( d, env_count, env_count );
+}
+
+/*
+** bcal_partition_tiles over decomposes a domain holding n_points into tiles
+** of about tile_points points each, and at least BCAL_TILES_PER_JOB tiles
+** per job, so idle threads can pick up the remaining tiles of dense areas.
+** Tiles are kept square-ish and no narrower than BCAL_TILE_MIN_CELLS cells
+** of spacing.
+*/
+CPLErr bcal_partition_tiles( bcal_domain *d, uint32 jobs, uint64 n_points,
+                             uint64 tile_points, double spacing )
+{
+    if( d == NULL || jobs == 0 || tile_points == 0 || spacing <= 0 )
     {
-        for( j = 0; j < env_count; j++ )
-        {
-            d->sub_envs[i+j].MinX = x + dx * j;
-            d->sub_envs[i+j].MaxX = x + (dx * (j + 1));
-            d->sub_envs[i+j].MaxY = y + dy * i;
-            d->sub_envs[i+j].MinY = y - (dy * (j + 1));
-            CPLDebug( "BCAL", "using envelope:{%lf,%lf,%lf,%lf} for grid",
-                      d->sub_envs[i].MinX, d->sub_envs[i].MaxX,
-                      d->sub_envs[i].MinY, d->sub_envs[i].MinY );
-        }
+        return CE_Failure;
     }
-    return CE_None;
+    double w = d->env.MaxX - d->env.MinX;
+    double h = d->env.MaxY - d->env.MinY;
+    double tiles = (double)((n_points + tile_points - 1) / tile_points);
+    double min_size = BCAL_TILE_MIN_CELLS * spacing;
+    double nx, ny;
+    if( jobs > 1 && tiles < (double)jobs * BCAL_TILES_PER_JOB )
+    {
+        tiles = (double)jobs * BCAL_TILES_PER_JOB;
+    }
+    if( w <= 0 || h <= 0 )
+    {
+        nx = w > 0 ? tiles : 1;
+        ny = h > 0 ? tiles : 1;
+    }
+    else
+    {
+        nx = ceil( sqrt( tiles * w / h ) );
+        ny = ceil( tiles / nx );
+    }
+    nx = nx * min_size > w ? floor( w / min_size ) : nx;
+    ny = ny * min_size > h ? floor( h / min_size ) : ny;
+    nx = nx < 1 ? 1 : (nx > 65535 ? 65535 : nx);
+    ny = ny < 1 ? 1 : (ny > 65535 ? 65535 : ny);
+    CPLDebug( "BCAL", "partitioning %llu points into %.0lf x %.0lf tiles",
+              (unsigned long long)n_points, nx, ny );
+    return grid( d, (uint32)nx, (uint32)ny );
+}
+
+/*
+** bcal_partition_find returns the index of the sub envelope that owns x, y.
+** Points on a shared edge belong to the east/south envelope, points outside
+** the domain are clamped to the nearest envelope.
+*/
+uint32 bcal_partition_find( const bcal_domain *d, double x, double y )
+{
+    double fx = 0, fy = 0;
+    uint32 col, row;
+    if( d->env.MaxX > d->env.MinX )
+    {
+        fx = (x - d->env.MinX) / (d->env.MaxX - d->env.MinX) * d->nx;
+    }
+    if( d->env.MaxY > d->env.MinY )
+    {
+        fy = (d->env.MaxY - y) / (d->env.MaxY - d->env.MinY) * d->ny;
+    }
+    col = fx > 0 ? (fx < d->nx ? (uint32)fx : d->nx - 1) : 0;
+    row = fy > 0 ? (fy < d->ny ? (uint32)fy : d->ny - 1) : 0;
+    return row * d->nx + col;
 }
 
 void bcal_free_decomp( bcal_domain *d )
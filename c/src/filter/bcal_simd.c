@@ -0,0 +1,342 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** simd holds the per point kernels of the filter, the bin of every point
+** and the heights of a cell's points over the ground surface, in scalar,
+** SSE2 and AVX2 versions.  The instruction set is picked at run time, and
+** capped by the BCAL_SIMD configuration option (scalar, sse2 or avx2).
+** Every version does the same double operations in the same order, so the
+** results are identical; this file is built without floating point
+** contraction so the compiler can't fuse the scalar ones either.
+*/
+
+#include "bcal_filter.h"
+
+#include "cpl_conv.h"
+#include "cpl_multiproc.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BCAL_SIMD_X86
+#define BCAL_TARGET( isa ) __attribute__((target( isa )))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_AMD64))
+/* SSE2 is part of x64, AVX2 is not dispatched with MSVC */
+#define BCAL_SIMD_X86
+#define BCAL_SIMD_NO_AVX2
+#define BCAL_TARGET( isa )
+#include <emmintrin.h>
+#endif
+
+/*
+** Written once under simd_lock, by the first bcal_simd_level or by
+** bcal_simd_set_level, and only read after.
+*/
+static int simd_level = -1;
+static CPLMutex *simd_lock = NULL;
+
+/* Set bits in the low 4 bits of a compare mask */
+static const uint8 mask_bits[16] =
+{
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+};
+
+/* Bin of point i, as bcal_bin has always computed it. */
+static uint32 bin_cell( const bcal_working_set *s, uint32 i )
+{
+    const bcal_points *p = &s->p;
+    double x = (bcal_points_x( p, i ) - s->env.MinX) / s->spacing;
+    double y = (s->env.MaxY - bcal_points_y( p, i )) / s->spacing;
+    /* Points on or past the envelope edge go to the edge cell */
+    x = x < 0 ? 0 : (x < s->nx ? x : s->nx - 1);
+    y = y < 0 ? 0 : (y < s->ny ? y : s->ny - 1);
+    return (uint32)y * s->nx + (uint32)x;
+}
+
+static void bin_cells_scalar( const bcal_working_set *s, uint32 start,
+                              uint32 *bin )
+{
+    uint32 i;
+    for( i = start; i < s->p.n; i++ )
+    {
+        bin[i] = bin_cell( s, i );
+    }
+}
+
+static uint32 heights_scalar( const bcal_points *p, const uint32 *index,
+                              uint32 start, uint32 n, double *h, double cut )
+{
+    uint32 m, n_low = 0;
+    for( m = start; m < n; m++ )
+    {
+        h[m] = bcal_points_z( p, index[m] ) - h[m];
+        n_low += h[m] <= cut;
+    }
+    return n_low;
+}
+
+#ifdef BCAL_SIMD_X86
+
+BCAL_TARGET( "sse2" )
+static void bin_cells_sse2( const bcal_working_set *s, uint32 *bin )
+{
+    const bcal_points *p = &s->p;
+    const __m128d sx = _mm_set1_pd( p->scale[0] );
+    const __m128d sy = _mm_set1_pd( p->scale[1] );
+    const __m128d ox = _mm_set1_pd( p->offset[0] );
+    const __m128d oy = _mm_set1_pd( p->offset[1] );
+    const __m128d min_x = _mm_set1_pd( s->env.MinX );
+    const __m128d max_y = _mm_set1_pd( s->env.MaxY );
+    const __m128d spacing = _mm_set1_pd( s->spacing );
+    const __m128d zero = _mm_setzero_pd();
+    const __m128d last_x = _mm_set1_pd( s->nx - 1 );
+    const __m128d last_y = _mm_set1_pd( s->ny - 1 );
+    const __m128d nx = _mm_set1_pd( s->nx );
+    __m128d x, y;
+    uint32 i;
+    for( i = 0; i + 2 <= p->n; i += 2 )
+    {
+        x = _mm_cvtepi32_pd( _mm_loadl_epi64( (const __m128i*)(p->x + i) ) );
+        y = _mm_cvtepi32_pd( _mm_loadl_epi64( (const __m128i*)(p->y + i) ) );
+        x = _mm_add_pd( _mm_mul_pd( x, sx ), ox );
+        y = _mm_add_pd( _mm_mul_pd( y, sy ), oy );
+        x = _mm_div_pd( _mm_sub_pd( x, min_x ), spacing );
+        y = _mm_div_pd( _mm_sub_pd( max_y, y ), spacing );
+        x = _mm_min_pd( _mm_max_pd( x, zero ), last_x );
+        y = _mm_min_pd( _mm_max_pd( y, zero ), last_y );
+        x = _mm_cvtepi32_pd( _mm_cvttpd_epi32( x ) );
+        y = _mm_cvtepi32_pd( _mm_cvttpd_epi32( y ) );
+        _mm_storel_epi64( (__m128i*)(bin + i),
+                          _mm_cvttpd_epi32( _mm_add_pd( _mm_mul_pd( y, nx ),
+                                                        x ) ) );
+    }
+    bin_cells_scalar( s, i, bin );
+}
+
+BCAL_TARGET( "sse2" )
+static uint32 heights_sse2( const bcal_points *p, const uint32 *index,
+                            uint32 n, double *h, double cut )
+{
+    const __m128d sz = _mm_set1_pd( p->scale[2] );
+    const __m128d oz = _mm_set1_pd( p->offset[2] );
+    const __m128d c = _mm_set1_pd( cut );
+    __m128d z;
+    uint32 m, n_low = 0;
+    for( m = 0; m + 2 <= n; m += 2 )
+    {
+        z = _mm_set_pd( p->z[index[m + 1]], p->z[index[m]] );
+        z = _mm_add_pd( _mm_mul_pd( z, sz ), oz );
+        z = _mm_sub_pd( z, _mm_loadu_pd( h + m ) );
+        _mm_storeu_pd( h + m, z );
+        n_low += mask_bits[_mm_movemask_pd( _mm_cmple_pd( z, c ) )];
+    }
+    return n_low + heights_scalar( p, index, m, n, h, cut );
+}
+
+#ifndef BCAL_SIMD_NO_AVX2
+
+BCAL_TARGET( "avx2" )
+static void bin_cells_avx2( const bcal_working_set *s, uint32 *bin )
+{
+    const bcal_points *p = &s->p;
+    const __m256d sx = _mm256_set1_pd( p->scale[0] );
+    const __m256d sy = _mm256_set1_pd( p->scale[1] );
+    const __m256d ox = _mm256_set1_pd( p->offset[0] );
+    const __m256d oy = _mm256_set1_pd( p->offset[1] );
+    const __m256d min_x = _mm256_set1_pd( s->env.MinX );
+    const __m256d max_y = _mm256_set1_pd( s->env.MaxY );
+    const __m256d spacing = _mm256_set1_pd( s->spacing );
+    const __m256d zero = _mm256_setzero_pd();
+    const __m256d last_x = _mm256_set1_pd( s->nx - 1 );
+    const __m256d last_y = _mm256_set1_pd( s->ny - 1 );
+    const __m256d nx = _mm256_set1_pd( s->nx );
+    __m256d x, y;
+    uint32 i;
+    for( i = 0; i + 4 <= p->n; i += 4 )
+    {
+        x = _mm256_cvtepi32_pd(
+                _mm_loadu_si128( (const __m128i*)(p->x + i) ) );
+        y = _mm256_cvtepi32_pd(
+                _mm_loadu_si128( (const __m128i*)(p->y + i) ) );
+        x = _mm256_add_pd( _mm256_mul_pd( x, sx ), ox );
+        y = _mm256_add_pd( _mm256_mul_pd( y, sy ), oy );
+        x = _mm256_div_pd( _mm256_sub_pd( x, min_x ), spacing );
+        y = _mm256_div_pd( _mm256_sub_pd( max_y, y ), spacing );
+        x = _mm256_min_pd( _mm256_max_pd( x, zero ), last_x );
+        y = _mm256_min_pd( _mm256_max_pd( y, zero ), last_y );
+        x = _mm256_round_pd( x, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC );
+        y = _mm256_round_pd( y, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC );
+        _mm_storeu_si128( (__m128i*)(bin + i),
+                          _mm256_cvttpd_epi32(
+                              _mm256_add_pd( _mm256_mul_pd( y, nx ), x ) ) );
+    }
+    bin_cells_scalar( s, i, bin );
+}
+
+BCAL_TARGET( "avx2" )
+static uint32 heights_avx2( const bcal_points *p, const uint32 *index,
+                            uint32 n, double *h, double cut )
+{
+    const __m256d sz = _mm256_set1_pd( p->scale[2] );
+    const __m256d oz = _mm256_set1_pd( p->offset[2] );
+    const __m256d c = _mm256_set1_pd( cut );
+    __m128i zi;
+    __m256d z;
+    uint32 m, n_low = 0;
+    for( m = 0; m + 4 <= n; m += 4 )
+    {
+        zi = _mm_i32gather_epi32( (const int*)p->z,
+                                  _mm_loadu_si128( (const __m128i*)
+                                                   (index + m) ), 4 );
+        z = _mm256_cvtepi32_pd( zi );
+        z = _mm256_add_pd( _mm256_mul_pd( z, sz ), oz );
+        z = _mm256_sub_pd( z, _mm256_loadu_pd( h + m ) );
+        _mm256_storeu_pd( h + m, z );
+        n_low += mask_bits[_mm256_movemask_pd(
+                               _mm256_cmp_pd( z, c, _CMP_LE_OQ ) )];
+    }
+    return n_low + heights_scalar( p, index, m, n, h, cut );
+}
+
+#endif /* BCAL_SIMD_NO_AVX2 */
+
+#endif /* BCAL_SIMD_X86 */
+
+/* The best instruction set of this machine. */
+static int detect( void )
+{
+#if defined(BCAL_SIMD_X86) && defined(__GNUC__)
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports( "avx2" ) )
+    {
+        return BCAL_SIMD_AVX2;
+    }
+    if( __builtin_cpu_supports( "sse2" ) )
+    {
+        return BCAL_SIMD_SSE2;
+    }
+    return BCAL_SIMD_SCALAR;
+#elif defined(BCAL_SIMD_X86)
+    return BCAL_SIMD_SSE2;
+#else
+    return BCAL_SIMD_SCALAR;
+#endif
+}
+
+/* Cap the level at level and what this machine has, with simd_lock held. */
+static int set_level( int level )
+{
+    int best = detect();
+    level = level < best ? level : best;
+    simd_level = level > BCAL_SIMD_SCALAR ? level : BCAL_SIMD_SCALAR;
+    return simd_level;
+}
+
+/*
+** bcal_simd_set_level uses at most the given instruction set, one of the
+** BCAL_SIMD_* values, and returns the one in use.  Call it before any
+** filtering starts, the kernels read the level without a lock.
+*/
+int bcal_simd_set_level( int level )
+{
+    if( !CPLCreateOrAcquireMutex( &simd_lock, 1000.0 ) )
+    {
+        return bcal_simd_level();
+    }
+    level = set_level( level );
+    CPLReleaseMutex( simd_lock );
+    return level;
+}
+
+/*
+** bcal_simd_level returns the instruction set of the kernels, the best this
+** machine has unless capped by BCAL_SIMD or bcal_simd_set_level.  The first
+** call picks it under a lock, so threads may race to it, but the kernels
+** only read it after bcal_filter_prepare has, before its pools start.
+*/
+int bcal_simd_level( void )
+{
+    const char *cap;
+    if( simd_level >= 0 )
+    {
+        return simd_level;
+    }
+    if( !CPLCreateOrAcquireMutex( &simd_lock, 1000.0 ) )
+    {
+        /* The scalar kernels are always there */
+        return BCAL_SIMD_SCALAR;
+    }
+    if( simd_level < 0 )
+    {
+        cap = CPLGetConfigOption( "BCAL_SIMD", "avx2" );
+        set_level( EQUAL( cap, "scalar" ) ? BCAL_SIMD_SCALAR :
+                   EQUAL( cap, "sse2" ) ? BCAL_SIMD_SSE2 : BCAL_SIMD_AVX2 );
+        CPLDebug( "BCAL", "point kernels use %s",
+                  simd_level == BCAL_SIMD_AVX2 ? "avx2" :
+                  simd_level == BCAL_SIMD_SSE2 ? "sse2" : "scalar" );
+    }
+    CPLReleaseMutex( simd_lock );
+    return simd_level;
+}
+
+/*
+** bcal_bin_cells sets bin[i] to the cell of point i of s, a binned set's
+** nx by ny grid.  Points on or past the edge of the envelope go to the
+** edge cell.
+*/
+void bcal_bin_cells( const bcal_working_set *s, uint32 *bin )
+{
+    int level = bcal_simd_level();
+    /* The vector versions work in int32 */
+    if( (uint64)s->nx * s->ny > INT32_MAX )
+    {
+        level = BCAL_SIMD_SCALAR;
+    }
+#ifdef BCAL_SIMD_X86
+#ifndef BCAL_SIMD_NO_AVX2
+    if( level == BCAL_SIMD_AVX2 )
+    {
+        bin_cells_avx2( s, bin );
+        return;
+    }
+#endif
+    if( level >= BCAL_SIMD_SSE2 )
+    {
+        bin_cells_sse2( s, bin );
+        return;
+    }
+#endif
+    (void)level;
+    bin_cells_scalar( s, 0, bin );
+}
+
+/*
+** bcal_heights turns h[m], the surface under point index[m] of p, into the
+** height of the point above it for each of the n points, and returns how
+** many are at most cut.
+*/
+uint32 bcal_heights( const bcal_points *p, const uint32 *index, uint32 n,
+                     double *h, double cut )
+{
+    int level = bcal_simd_level();
+    /* The gather takes int32 indices */
+    if( p->n > INT32_MAX )
+    {
+        level = BCAL_SIMD_SSE2 < level ? BCAL_SIMD_SSE2 : level;
+    }
+#ifdef BCAL_SIMD_X86
+#ifndef BCAL_SIMD_NO_AVX2
+    if( level == BCAL_SIMD_AVX2 )
+    {
+        return heights_avx2( p, index, n, h, cut );
+    }
+#endif
+    if( level >= BCAL_SIMD_SSE2 )
+    {
+        return heights_sse2( p, index, n, h, cut );
+    }
+#endif
+    (void)level;
+    return heights_scalar( p, index, 0, n, h, cut );
+}
@@ -0,0 +1,205 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** spill keeps working sets in a temporary file when they do not all fit in
+** memory.  The counting pass sizes every set, so each set gets a fixed
+** region of the file and points are written in place as they are read,
+** column by column, so a set is read back with one read per column.  The
+** file is written in native byte order and removed when it is closed.
+*/
+
+#include "bcal_filter.h"
+
+#include "cpl_conv.h"
+
+/* Smallest and largest per-set write buffers, in points */
+#define BCAL_SPILL_MIN_BUF 256
+#define BCAL_SPILL_MAX_BUF 65536
+
+CPLErr bcal_spill_create( bcal_spill *s, uint32 n, const uint32 *counts,
+                          uint64 buf_bytes )
+{
+    uint64 per;
+    uint32 i;
+    vsi_l_offset base = 0;
+    memset( s, 0, sizeof( bcal_spill ) );
+    s->n = n;
+    s->path = strdup( CPLGenerateTempFilename( "bcal_spill" ) );
+    s->counts = malloc( sizeof( uint32 ) * n );
+    s->written = calloc( n, sizeof( uint32 ) );
+    s->base = malloc( sizeof( vsi_l_offset ) * n );
+    s->buf = calloc( n, sizeof( bcal_points ) );
+    if( s->path == NULL || s->counts == NULL || s->written == NULL ||
+        s->base == NULL || s->buf == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate spill buffers" );
+        bcal_spill_close( s );
+        return CE_Failure;
+    }
+    per = buf_bytes / ((uint64)n * BCAL_POINT_BYTES + 1);
+    if( per < BCAL_SPILL_MIN_BUF )
+    {
+        per = BCAL_SPILL_MIN_BUF;
+    }
+    if( per > BCAL_SPILL_MAX_BUF )
+    {
+        per = BCAL_SPILL_MAX_BUF;
+    }
+    for( i = 0; i < n; i++ )
+    {
+        s->counts[i] = counts[i];
+        s->base[i] = base;
+        base += (vsi_l_offset)counts[i] * BCAL_SPILL_POINT_BYTES;
+        /* Buffers hold raw copies, their quantization is never used */
+        if( bcal_points_reserve( &s->buf[i],
+                                 counts[i] < per ? counts[i] : (uint32)per ) !=
+            CE_None )
+        {
+            bcal_spill_close( s );
+            return CE_Failure;
+        }
+    }
+    s->fp = VSIFOpenL( s->path, "wb+" );
+    if( s->fp == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OpenFailed,
+                  "Failed to create spill file %s", s->path );
+        bcal_spill_close( s );
+        return CE_Failure;
+    }
+    CPLDebug( "BCAL", "spilling %u working sets to %s, %llu bytes", n,
+              s->path, (unsigned long long)base );
+    return CE_None;
+}
+
+/*
+** Write the buffered points of set i at the end of each of its columns.
+*/
+static CPLErr flush_set( bcal_spill *s, uint32 i )
+{
+    bcal_points *b = &s->buf[i];
+    vsi_l_offset n = s->counts[i];
+    vsi_l_offset w = s->written[i];
+    vsi_l_offset base = s->base[i];
+    int ok = 1;
+    if( b->n == 0 )
+    {
+        return CE_None;
+    }
+    ok &= VSIFSeekL( s->fp, base + w * 8, SEEK_SET ) == 0;
+    ok &= VSIFWriteL( b->fid, 8, b->n, s->fp ) == b->n;
+    ok &= VSIFSeekL( s->fp, base + n * 8 + w * 4, SEEK_SET ) == 0;
+    ok &= VSIFWriteL( b->x, 4, b->n, s->fp ) == b->n;
+    ok &= VSIFSeekL( s->fp, base + n * 12 + w * 4, SEEK_SET ) == 0;
+    ok &= VSIFWriteL( b->y, 4, b->n, s->fp ) == b->n;
+    ok &= VSIFSeekL( s->fp, base + n * 16 + w * 4, SEEK_SET ) == 0;
+    ok &= VSIFWriteL( b->z, 4, b->n, s->fp ) == b->n;
+    ok &= VSIFSeekL( s->fp, base + n * 20 + w, SEEK_SET ) == 0;
+    ok &= VSIFWriteL( b->r, 1, b->n, s->fp ) == b->n;
+    if( !ok )
+    {
+        CPLError( CE_Failure, CPLE_FileIO,
+                  "Failed to write spill file %s", s->path );
+        return CE_Failure;
+    }
+    s->written[i] += b->n;
+    b->n = 0;
+    return CE_None;
+}
+
+CPLErr bcal_spill_append( bcal_spill *s, uint32 i, const bcal_points *src,
+                          uint32 k )
+{
+    bcal_points *b = &s->buf[i];
+    bcal_points_copy( b, b->n++, src, k );
+    if( b->n == b->alloced )
+    {
+        return flush_set( s, i );
+    }
+    return CE_None;
+}
+
+CPLErr bcal_spill_flush( bcal_spill *s )
+{
+    uint32 i;
+    for( i = 0; i < s->n; i++ )
+    {
+        if( flush_set( s, i ) != CE_None )
+        {
+            return CE_Failure;
+        }
+        bcal_points_free( &s->buf[i] );
+    }
+    if( VSIFFlushL( s->fp ) != 0 )
+    {
+        CPLError( CE_Failure, CPLE_FileIO,
+                  "Failed to write spill file %s", s->path );
+        return CE_Failure;
+    }
+    return CE_None;
+}
+
+/*
+** Read set i back into p, which must be initialized with the quantization
+** of the input.  Every caller opens its own handle, so sets can be read
+** from several threads.
+*/
+CPLErr bcal_spill_read( const bcal_spill *s, uint32 i, bcal_points *p )
+{
+    vsi_l_offset n = s->counts[i];
+    vsi_l_offset base = s->base[i];
+    VSILFILE *fp;
+    int ok = 1;
+    if( bcal_points_reserve( p, s->counts[i] ) != CE_None )
+    {
+        return CE_Failure;
+    }
+    fp = VSIFOpenL( s->path, "rb" );
+    if( fp == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OpenFailed,
+                  "Failed to open spill file %s", s->path );
+        return CE_Failure;
+    }
+    ok &= VSIFSeekL( fp, base, SEEK_SET ) == 0;
+    ok &= VSIFReadL( p->fid, 8, n, fp ) == n;
+    ok &= VSIFReadL( p->x, 4, n, fp ) == n;
+    ok &= VSIFReadL( p->y, 4, n, fp ) == n;
+    ok &= VSIFReadL( p->z, 4, n, fp ) == n;
+    ok &= VSIFReadL( p->r, 1, n, fp ) == n;
+    VSIFCloseL( fp );
+    if( !ok )
+    {
+        CPLError( CE_Failure, CPLE_FileIO,
+                  "Failed to read working set %u from spill file %s", i,
+                  s->path );
+        return CE_Failure;
+    }
+    p->n = s->counts[i];
+    return CE_None;
+}
+
+void bcal_spill_close( bcal_spill *s )
+{
+    uint32 i;
+    if( s->fp != NULL )
+    {
+        VSIFCloseL( s->fp );
+        VSIUnlink( s->path );
+        s->fp = NULL;
+    }
+    for( i = 0; s->buf != NULL && i < s->n; i++ )
+    {
+        bcal_points_free( &s->buf[i] );
+    }
+    free( s->path );
+    free( s->counts );
+    free( s->written );
+    free( s->base );
+    free( s->buf );
+    memset( s, 0, sizeof( bcal_spill ) );
+}
+
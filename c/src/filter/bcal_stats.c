@@ -0,0 +1,201 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** stats writes the counters of a filter run as json, in place of the
+** ProcessingNotes.txt of HeightLAS_BCAL.pro: point counts by class, the
+** histogram of the iteration each cell finished at, and wall times, for
+** the whole run and for every working tile.  Run times are wall seconds of
+** each step.  Tile times are seconds on the thread that filtered the tile,
+** so their sums over tiles exceed the filter wall time with several jobs.
+*/
+
+#include <math.h>
+
+#include "bcal_filter.h"
+#include "bcal_time.h"
+
+/* Write s as a json string, quoted and escaped. */
+static void write_string( VSILFILE *fp, const char *s )
+{
+    VSIFPrintfL( fp, "\"" );
+    for( ; *s != '\0'; s++ )
+    {
+        if( *s == '"' || *s == '\\' )
+        {
+            VSIFPrintfL( fp, "\\%c", *s );
+        }
+        else if( (unsigned char)*s < 0x20 )
+        {
+            VSIFPrintfL( fp, "\\u%04x", (unsigned char)*s );
+        }
+        else
+        {
+            VSIFPrintfL( fp, "%c", *s );
+        }
+    }
+    VSIFPrintfL( fp, "\"" );
+}
+
+static void write_counts( VSILFILE *fp, const bcal_stats_total *st,
+                          uint32 n_iter, const char *indent )
+{
+    uint32 k;
+    VSIFPrintfL( fp, "%s\"owned\": %llu,\n", indent,
+                 (unsigned long long)st->n_owned );
+    VSIFPrintfL( fp, "%s\"ground\": %llu,\n", indent,
+                 (unsigned long long)st->n_ground );
+    VSIFPrintfL( fp, "%s\"vegetation\": %llu,\n", indent,
+                 (unsigned long long)st->n_vegetation );
+    VSIFPrintfL( fp, "%s\"unclassified\": %llu,\n", indent,
+                 (unsigned long long)st->n_unclassified );
+    VSIFPrintfL( fp, "%s\"unfinished\": %llu,\n", indent,
+                 (unsigned long long)st->n_unfinished );
+    VSIFPrintfL( fp, "%s\"cells\": %llu,\n", indent,
+                 (unsigned long long)st->n_cells );
+    VSIFPrintfL( fp, "%s\"unfinished_cells\": %llu,\n", indent,
+                 (unsigned long long)st->n_cells_unfinished );
+    VSIFPrintfL( fp, "%s\"iterations\": [", indent );
+    for( k = 0; k < n_iter; k++ )
+    {
+        VSIFPrintfL( fp, k == 0 ? "%llu" : ", %llu",
+                     (unsigned long long)st->iter[k] );
+    }
+    VSIFPrintfL( fp, "],\n" );
+}
+
+/*
+** bcal_stats_sum sets sum to the counters and times of the n sets added
+** up.
+*/
+void bcal_stats_sum( const bcal_working_set *sets, uint32 n,
+                     bcal_stats_total *sum )
+{
+    const bcal_set_stats *a;
+    uint32 i, k;
+    memset( sum, 0, sizeof( bcal_stats_total ) );
+    for( i = 0; i < n; i++ )
+    {
+        a = &sets[i].stats;
+        sum->n_loaded += a->n_loaded;
+        sum->n_owned += a->n_owned;
+        sum->n_ground += a->n_ground;
+        sum->n_vegetation += a->n_vegetation;
+        sum->n_unclassified += a->n_unclassified;
+        sum->n_unfinished += a->n_unfinished;
+        sum->n_low += a->n_low;
+        sum->n_infinite += a->n_infinite;
+        sum->n_too_high += a->n_too_high;
+        sum->n_cells += a->n_cells;
+        sum->n_cells_unfinished += a->n_cells_unfinished;
+        for( k = 0; k < BCAL_STATS_ITER_BINS; k++ )
+        {
+            sum->iter[k] += a->iter[k];
+        }
+        sum->t_read += a->t_read;
+        sum->t_bin += a->t_bin;
+        sum->t_seed += a->t_seed;
+        sum->t_iterate += a->t_iterate;
+        sum->t_write += a->t_write;
+    }
+}
+
+/*
+** bcal_stats_write writes the run statistics to path.  iterations[k] is the
+** number of cells finished at iteration k + 1, iteration 1 being cells
+** made up of seed points only.  The low, infinite and too_high counts of a
+** tile include its halo.  The run totals are r->tiles.  A mosaic lists its
+** inputs, and its output is the directory they were copied to.
+*/
+CPLErr bcal_stats_write( const char *path, const bcal_filter_data *b,
+                         const bcal_run_stats *r, const bcal_domain *d,
+                         const bcal_working_set *sets )
+{
+    const bcal_stats_total *sum = &r->tiles;
+    bcal_stats_total tile;
+    const bcal_set_stats *st;
+    const bcal_env *e;
+    uint32 i, n_iter;
+    VSILFILE *fp = VSIFOpenL( path, "wb" );
+    if( fp == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OpenFailed, "Failed to create %s", path );
+        return CE_Failure;
+    }
+    n_iter = b->max_iter > 2 ? (uint32)b->max_iter : 2;
+    n_iter = n_iter < BCAL_STATS_ITER_BINS ? n_iter : BCAL_STATS_ITER_BINS;
+
+    if( b->mosaic != NULL )
+    {
+        VSIFPrintfL( fp, "{\n  \"inputs\": [" );
+        for( i = 0; b->mosaic[i] != NULL; i++ )
+        {
+            VSIFPrintfL( fp, i == 0 ? "\n    " : ",\n    " );
+            write_string( fp, b->mosaic[i] );
+        }
+        VSIFPrintfL( fp, "\n  ]" );
+    }
+    else
+    {
+        VSIFPrintfL( fp, "{\n  \"input\": " );
+        write_string( fp, b->input );
+    }
+    VSIFPrintfL( fp, ",\n  \"output\": " );
+    write_string( fp, b->output );
+    VSIFPrintfL( fp, ",\n  \"points\": %llu,\n",
+                 (unsigned long long)r->n_points );
+    VSIFPrintfL( fp, "  \"jobs\": %u,\n", r->jobs );
+    VSIFPrintfL( fp, "  \"tiles\": %u,\n", d->n );
+    VSIFPrintfL( fp, "  \"spilled\": %s,\n", r->spilled ? "true" : "false" );
+    VSIFPrintfL( fp, "  \"bytes_read\": %llu,\n",
+                 (unsigned long long)r->bytes_read );
+    VSIFPrintfL( fp, "  \"peak_rss\": %llu,\n",
+                 (unsigned long long)bcal_peak_rss() );
+    write_counts( fp, sum, n_iter, "  " );
+    VSIFPrintfL( fp, "  \"seconds\": {\"read\": %.6f, \"partition\": %.6f, "
+                     "\"filter\": %.6f, \"write\": %.6f, \"total\": %.6f},\n",
+                 r->t_read, r->t_partition, r->t_filter, r->t_write,
+                 r->t_total );
+    VSIFPrintfL( fp, "  \"tile_seconds\": {\"read\": %.6f, \"bin\": %.6f, "
+                     "\"seed\": %.6f, \"iterate\": %.6f, \"write\": %.6f},\n",
+                 sum->t_read, sum->t_bin, sum->t_seed, sum->t_iterate,
+                 sum->t_write );
+    VSIFPrintfL( fp, "  \"working_tiles\": [" );
+    for( i = 0; i < d->n; i++ )
+    {
+        st = &sets[i].stats;
+        e = &d->sub_envs[i];
+        VSIFPrintfL( fp, "%s\n    {\n", i == 0 ? "" : "," );
+        VSIFPrintfL( fp, "      \"tile\": %u,\n", i );
+        VSIFPrintfL( fp, "      \"envelope\": [%.15g, %.15g, %.15g, %.15g],\n",
+                     e->MinX, e->MinY, e->MaxX, e->MaxY );
+        VSIFPrintfL( fp, "      \"loaded\": %u,\n", st->n_loaded );
+        bcal_stats_sum( sets + i, 1, &tile );
+        write_counts( fp, &tile, n_iter, "      " );
+        VSIFPrintfL( fp, "      \"low\": %u,\n", st->n_low );
+        VSIFPrintfL( fp, "      \"infinite\": %u,\n", st->n_infinite );
+        VSIFPrintfL( fp, "      \"too_high\": %u,\n", st->n_too_high );
+        /* No threshold is -inf, which json can't hold */
+        if( st->low_z > -HUGE_VAL )
+        {
+            VSIFPrintfL( fp, "      \"low_z\": %.6f,\n", st->low_z );
+        }
+        else
+        {
+            VSIFPrintfL( fp, "      \"low_z\": null,\n" );
+        }
+        VSIFPrintfL( fp, "      \"seconds\": {\"read\": %.6f, \"bin\": %.6f, "
+                         "\"seed\": %.6f, \"iterate\": %.6f, "
+                         "\"write\": %.6f}\n    }",
+                     st->t_read, st->t_bin, st->t_seed, st->t_iterate,
+                     st->t_write );
+    }
+    VSIFPrintfL( fp, "\n  ]\n}\n" );
+    if( VSIFCloseL( fp ) != 0 )
+    {
+        CPLError( CE_Failure, CPLE_FileIO, "Failed to write %s", path );
+        return CE_Failure;
+    }
+    return CE_None;
+}
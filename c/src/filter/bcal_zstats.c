@@ -0,0 +1,218 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** zstats finds the low outlier threshold of the original filter, the
+** median elevation less a number of standard deviations, without holding
+** every elevation in memory.  Points are accumulated block by block while
+** the input is counted, into a histogram per range of blocks that are
+** merged at the end.  A local threshold per working tile is found by
+** selection over the elevations of the tile, halo included, when its
+** points are binned.
+*/
+
+#include <math.h>
+
+#include "bcal_filter.h"
+
+CPLErr bcal_zstats_init( bcal_zstats *zs, const bcal_las_header *h )
+{
+    double lo = floor( (h->min[2] - h->offset[2]) / h->scale[2] );
+    double hi = ceil( (h->max[2] - h->offset[2]) / h->scale[2] );
+    double range;
+    memset( zs, 0, sizeof( bcal_zstats ) );
+    zs->scale = h->scale[2];
+    zs->offset = h->offset[2];
+    /* A bad header only costs histogram resolution, points are clamped */
+    if( !(lo <= hi) || lo < INT32_MIN || hi > INT32_MAX )
+    {
+        lo = INT32_MIN;
+        hi = INT32_MAX;
+    }
+    range = hi - lo + 1;
+    zs->zmin = (int32)lo;
+    zs->width = (uint32)ceil( range / BCAL_ZSTATS_BINS );
+    zs->nbins = (uint32)ceil( range / zs->width );
+    zs->bins = calloc( zs->nbins, sizeof( uint64 ) );
+    if( zs->bins == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate elevation histogram" );
+        return CE_Failure;
+    }
+    return CE_None;
+}
+
+void bcal_zstats_add( bcal_zstats *zs, const bcal_points *p )
+{
+    uint32 k;
+    int64 dz;
+    double d;
+    for( k = 0; k < p->n; k++ )
+    {
+        dz = (int64)p->z[k] - zs->zmin;
+        d = (double)dz;
+        zs->sum += d;
+        zs->sum2 += d * d;
+        if( dz < 0 )
+        {
+            dz = 0;
+        }
+        dz /= zs->width;
+        if( dz >= zs->nbins )
+        {
+            dz = zs->nbins - 1;
+        }
+        zs->bins[dz]++;
+    }
+    zs->n += p->n;
+}
+
+/*
+** Points more than sigmas standard deviations under the median elevation
+** are low outliers.  Like IDL's median, the upper middle value is taken for
+** even counts.
+*/
+double bcal_zstats_low( const bcal_zstats *zs, double sigmas )
+{
+    uint64 seen = 0;
+    uint32 i;
+    double var, median;
+    if( zs->n < 2 )
+    {
+        return -HUGE_VAL;
+    }
+    for( i = 0; i < zs->nbins - 1; i++ )
+    {
+        seen += zs->bins[i];
+        if( seen > zs->n / 2 )
+        {
+            break;
+        }
+    }
+    median = (double)zs->zmin + (double)i * zs->width +
+             (double)(zs->width - 1) / 2;
+    var = (zs->sum2 - zs->sum * zs->sum / zs->n) / (zs->n - 1);
+    if( var < 0 )
+    {
+        var = 0;
+    }
+    return zs->offset + zs->scale * (median - sigmas * sqrt( var ));
+}
+
+/*
+** bcal_zstats_merge adds the points of src to dst.  Both must have been set
+** up from the same header.
+*/
+void bcal_zstats_merge( bcal_zstats *dst, const bcal_zstats *src )
+{
+    uint32 i;
+    dst->n += src->n;
+    dst->sum += src->sum;
+    dst->sum2 += src->sum2;
+    for( i = 0; i < dst->nbins && i < src->nbins; i++ )
+    {
+        dst->bins[i] += src->bins[i];
+    }
+}
+
+/*
+** Rearrange v so v[k] holds the value it would have if v were sorted, with
+** no larger value before it and no smaller one after.  Hoare partitioning
+** around the median of three.
+*/
+static void select_nth( int32 *v, int64 n, int64 k )
+{
+    int64 lo = 0, hi = n - 1, i, j;
+    int32 a, b, c, pivot, t;
+    while( lo < hi )
+    {
+        a = v[lo];
+        b = v[lo + (hi - lo) / 2];
+        c = v[hi];
+        pivot = a < b ? (b < c ? b : (a < c ? c : a)) :
+                        (a < c ? a : (b < c ? c : b));
+        i = lo;
+        j = hi;
+        while( i <= j )
+        {
+            while( v[i] < pivot )
+            {
+                i++;
+            }
+            while( v[j] > pivot )
+            {
+                j--;
+            }
+            if( i <= j )
+            {
+                t = v[i];
+                v[i] = v[j];
+                v[j] = t;
+                i++;
+                j--;
+            }
+        }
+        /* v[lo..j] <= pivot, v[i..hi] >= pivot and pivot in between */
+        if( k <= j )
+        {
+            hi = j;
+        }
+        else if( k >= i )
+        {
+            lo = i;
+        }
+        else
+        {
+            return;
+        }
+    }
+}
+
+/*
+** bcal_zstats_local_low is bcal_zstats_low over the points of p alone, with
+** the exact median found by selection on a copy of the elevations.
+** Returns -HUGE_VAL for fewer than 2 points, or if the copy can't be made.
+*/
+double bcal_zstats_local_low( const bcal_points *p, double sigmas )
+{
+    int32 *v;
+    uint32 k;
+    double median, d, sum = 0, sum2 = 0, var;
+    if( p->n < 2 )
+    {
+        return -HUGE_VAL;
+    }
+    v = malloc( sizeof( int32 ) * p->n );
+    if( v == NULL )
+    {
+        CPLError( CE_Warning, CPLE_OutOfMemory,
+                  "Failed to find a local outlier threshold" );
+        return -HUGE_VAL;
+    }
+    memcpy( v, p->z, sizeof( int32 ) * p->n );
+    select_nth( v, p->n, p->n / 2 );
+    median = v[p->n / 2];
+    free( v );
+    /* Sums about the median keep the terms small */
+    for( k = 0; k < p->n; k++ )
+    {
+        d = (double)p->z[k] - median;
+        sum += d;
+        sum2 += d * d;
+    }
+    var = (sum2 - sum * sum / p->n) / (p->n - 1);
+    if( var < 0 )
+    {
+        var = 0;
+    }
+    return p->offset[2] + p->scale[2] * (median - sigmas * sqrt( var ));
+}
+
+void bcal_zstats_free( bcal_zstats *zs )
+{
+    free( zs->bins );
+    zs->bins = NULL;
+}
+
@@ -0,0 +1,131 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** index writes the .bcx spatial index of las files, see las/bcal_bcx.c.
+** Readers pick up the index of a file when it is newer than the file, and
+** read only the records near the envelope they need.  filter reads each
+** working tile through the indexes of its inputs, so it does not count the
+** input first (with -outliers tile) or spill tiles to a temporary file.
+*/
+
+#include "bcal_filter.h"
+#include "bcal_index.h"
+
+#include "cpl_conv.h"
+#include "cpl_string.h"
+
+static void Usage()
+{
+    printf(
+"bcal index [-jobs n] [-cell_points n] [-list file] input [input ...]\n"
+"\n"
+"   -jobs           how many threads decompress laz inputs.\n"
+"   -cell_points    target number of points per index cell, default\n"
+"                   4096.\n"
+"   -list           a text file of inputs, one per line\n"
+"   input           the *.las or *.laz file to index.  The index is\n"
+"                   written next to it with the extension .bcx, and is\n"
+"                   ignored once the file changes.  laz is decompressed\n"
+"                   to a temporary file (see CPL_TMPDIR) that takes the\n"
+"                   disk of the uncompressed las, one input at a time.\n"
+"                   A directory stands for all the las and laz files in\n"
+"                   it.\n" );
+    exit( 1 );
+}
+
+/*
+** bcal_index writes the index of the las or laz file at path next to it,
+** with about cell_points points per cell.
+*/
+CPLErr bcal_index( const char *path, uint32 cell_points, uint32 jobs )
+{
+    bcal_bcx x;
+    uint64 c, n = 0;
+    if( bcal_bcx_create( path, cell_points, jobs, &x ) != CE_None )
+    {
+        return CE_Failure;
+    }
+    for( c = 0; c < (uint64)x.nx * x.ny; c++ )
+    {
+        n += x.cells[c].count;
+    }
+    printf( "%s: %llu points in %ux%u cells, %llu runs\n",
+            CPLResetExtension( path, BCAL_BCX_EXTENSION ),
+            (unsigned long long)n, x.nx, x.ny,
+            (unsigned long long)x.n_runs );
+    bcal_bcx_free( &x );
+    return CE_None;
+}
+
+int bcal_index_app( int argc, char *argv[] )
+{
+    int i;
+    int jobs = 1;
+    int cell_points = BCAL_BCX_CELL_POINTS;
+    char **inputs = NULL;
+    int n, failed = 0;
+    /* Absolute minimum is 3 arguments. bcal index in */
+    if( argc < 3 )
+    {
+        Usage();
+    }
+
+    i = 2;
+    while( i < argc )
+    {
+        if( strncmp( argv[i], "-help", strlen( "-help" ) ) == 0 )
+        {
+            Usage();
+        }
+        else if( strncmp( argv[i], "-jobs", strlen( "-jobs" ) ) == 0 && i + 1 < argc )
+        {
+            jobs = atoi( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-cell_points", strlen( "-cell_points" ) ) == 0 && i + 1 < argc )
+        {
+            cell_points = atoi( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-list", strlen( "-list" ) ) == 0 && i + 1 < argc )
+        {
+            inputs = bcal_batch_add_list( inputs, argv[++i] );
+            if( inputs == NULL )
+            {
+                exit( 1 );
+            }
+        }
+        else
+        {
+            inputs = bcal_batch_add( inputs, argv[i] );
+        }
+        i++;
+    }
+    n = CSLCount( inputs );
+    if( n == 0 )
+    {
+        fprintf( stderr, "No input specified\n" );
+        exit( 1 );
+    }
+    if( jobs < 1 || cell_points < 1 )
+    {
+        fprintf( stderr, "Invalid -jobs or -cell_points\n" );
+        exit( 1 );
+    }
+
+    /* A file that fails is reported and skipped */
+    for( i = 0; i < n; i++ )
+    {
+        if( bcal_index( inputs[i], (uint32)cell_points, (uint32)jobs ) !=
+            CE_None )
+        {
+            failed++;
+        }
+    }
+    if( failed > 0 && n > 1 )
+    {
+        fprintf( stderr, "Failed to index %d of %d files\n", failed, n );
+    }
+    CSLDestroy( inputs );
+    return failed > 0 ? (int)CE_Failure : (int)CE_None;
+}
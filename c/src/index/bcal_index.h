@@ -0,0 +1,15 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef BCAL_INDEX_H_
+#define BCAL_INDEX_H_
+
+#include "bcal_las.h"
+#include "bcal_types.h"
+
+int bcal_index_app( int argc, char *argv[] );
+
+CPLErr bcal_index( const char *path, uint32 cell_points, uint32 jobs );
+
+#endif /* BCAL_INDEX_H_ */
@@ -0,0 +1,564 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** bcx is a spatial index of a las file, kept next to it in a .bcx sidecar.
+** A grid over the header bounds holds, for every cell, the number of points
+** in it, their elevation range and the runs of consecutive records that
+** hold them.  Records a few apart are read as one run, so a cell of a
+** spatially sorted file is one or two runs, and a flight line crossing it
+** is one more.  Records are not moved, so any reader of the file can skip
+** the runs outside an envelope.
+**
+** The sidecar is little endian:
+**
+**     "BCX1", u32 0 (reserved)
+**     u64 size of the las file, u64 points
+**     f64 min x, f64 min y, f64 cell size, u32 columns, u32 rows
+**     f64 min x, max x, min y, max y of the points
+**     u64 runs
+**     per cell, rows from the south: u64 first run, u64 runs, u64 points,
+**                                    i32 min z, i32 max z
+**     per run: u64 first record, u64 records
+*/
+
+#include <math.h>
+
+#include "bcal_las.h"
+
+#include "cpl_conv.h"
+#include "cpl_port.h"
+#include "cpl_vsi.h"
+
+#define BCX_MAGIC "BCX1"
+#define BCX_HEADER_SIZE 88
+#define BCX_CELL_SIZE 32
+#define BCX_RUN_SIZE 16
+/* Records decoded at a time while the index is built */
+#define BCX_BLOCK 65536
+
+/* Cell of x, y, points off the grid go to the edge cell. */
+static uint64 cell_of( const bcal_bcx *x, double px, double py )
+{
+    double c = (px - x->min_x) / x->size;
+    double r = (py - x->min_y) / x->size;
+    c = c < 0 ? 0 : (c < x->nx ? c : x->nx - 1);
+    r = r < 0 ? 0 : (r < x->ny ? r : x->ny - 1);
+    return (uint64)r * x->nx + (uint64)c;
+}
+
+/*
+** Size the grid to hold about cell_points points per cell, with square
+** cells over the header bounds.
+*/
+static CPLErr init_grid( const bcal_las *las, uint32 cell_points,
+                         bcal_bcx *x )
+{
+    const bcal_las_header *h = &las->h;
+    double w = h->max[0] - h->min[0];
+    double ht = h->max[1] - h->min[1];
+    double cells;
+    memset( x, 0, sizeof( bcal_bcx ) );
+    if( !(w >= 0) || !(ht >= 0) )
+    {
+        CPLError( CE_Failure, CPLE_AppDefined,
+                  "Failed to obtain a valid domain boundary from %s.",
+                  las->path );
+        return CE_Failure;
+    }
+    cells = (double)h->n_points / (cell_points > 0 ? cell_points : 1);
+    x->min_x = h->min[0];
+    x->min_y = h->min[1];
+    x->size = cells > 1 && w * ht > 0 ? sqrt( w * ht / cells ) :
+              (w > ht ? w : ht);
+    if( x->size <= 0 )
+    {
+        x->size = 1;
+    }
+    if( w / x->size > BCAL_BCX_MAX_CELLS ||
+        ht / x->size > BCAL_BCX_MAX_CELLS )
+    {
+        x->size = (w > ht ? w : ht) / BCAL_BCX_MAX_CELLS;
+    }
+    /* Points on the north and east bounds go to the edge cells */
+    x->nx = w > 0 ? (uint32)ceil( w / x->size ) : 1;
+    x->ny = ht > 0 ? (uint32)ceil( ht / x->size ) : 1;
+    x->nx = x->nx < BCAL_BCX_MAX_CELLS ? x->nx : BCAL_BCX_MAX_CELLS;
+    x->ny = x->ny < BCAL_BCX_MAX_CELLS ? x->ny : BCAL_BCX_MAX_CELLS;
+    x->cells = calloc( (size_t)x->nx * x->ny, sizeof( bcal_bcx_cell ) );
+    if( x->cells == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate a %ux%u index", x->nx, x->ny );
+        return CE_Failure;
+    }
+    return CE_None;
+}
+
+/*
+** Visit every record of las in order.  On the first pass count the points,
+** elevation range and runs of each cell, on the second fill the runs, which
+** the first pass laid out.  last holds the last record seen in each cell,
+** plus one.
+*/
+static CPLErr index_pass( const bcal_las *las, bcal_bcx *x, uint64 *last,
+                          int fill )
+{
+    bcal_points block;
+    bcal_bcx_cell *cell;
+    bcal_bcx_run *run;
+    OGREnvelope *b = &x->bounds;
+    uint64 start, count, rec, c;
+    uint32 k;
+    double px, py;
+    CPLErr eErr = CE_None;
+    bcal_points_init( &block, las->h.scale, las->h.offset );
+    memset( last, 0, sizeof( uint64 ) * x->nx * x->ny );
+    for( start = 0; start < las->h.n_points && eErr == CE_None;
+         start += BCX_BLOCK )
+    {
+        count = las->h.n_points - start;
+        count = count < BCX_BLOCK ? count : BCX_BLOCK;
+        block.n = 0;
+        eErr = bcal_las_read( las, start, count, &block );
+        for( k = 0; k < block.n && eErr == CE_None; k++ )
+        {
+            rec = start + k;
+            px = bcal_points_x( &block, k );
+            py = bcal_points_y( &block, k );
+            c = cell_of( x, px, py );
+            cell = x->cells + c;
+            if( !fill )
+            {
+                b->MinX = rec == 0 || px < b->MinX ? px : b->MinX;
+                b->MaxX = rec == 0 || px > b->MaxX ? px : b->MaxX;
+                b->MinY = rec == 0 || py < b->MinY ? py : b->MinY;
+                b->MaxY = rec == 0 || py > b->MaxY ? py : b->MaxY;
+                cell->zmin = cell->count == 0 || block.z[k] < cell->zmin ?
+                             block.z[k] : cell->zmin;
+                cell->zmax = cell->count == 0 || block.z[k] > cell->zmax ?
+                             block.z[k] : cell->zmax;
+                cell->count++;
+            }
+            if( last[c] == 0 || rec + 1 - last[c] > BCAL_BCX_GAP )
+            {
+                if( fill )
+                {
+                    run = x->runs + cell->first + cell->n_runs;
+                    run->start = rec;
+                    run->count = 0;
+                }
+                cell->n_runs++;
+            }
+            if( fill )
+            {
+                run = x->runs + cell->first + cell->n_runs - 1;
+                run->count = rec + 1 - run->start;
+            }
+            last[c] = rec + 1;
+        }
+    }
+    bcal_points_free( &block );
+    return eErr;
+}
+
+/*
+** bcal_bcx_build indexes the points of las, which must not be compressed,
+** with about cell_points points per cell.  Release with bcal_bcx_free.
+*/
+CPLErr bcal_bcx_build( const bcal_las *las, uint32 cell_points, bcal_bcx *x )
+{
+    uint64 n_cells, c, *last;
+    CPLErr eErr;
+    if( init_grid( las, cell_points, x ) != CE_None )
+    {
+        return CE_Failure;
+    }
+    n_cells = (uint64)x->nx * x->ny;
+    last = malloc( sizeof( uint64 ) * n_cells );
+    if( last == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate a %ux%u index", x->nx, x->ny );
+        bcal_bcx_free( x );
+        return CE_Failure;
+    }
+    eErr = index_pass( las, x, last, FALSE );
+    for( c = 0; c < n_cells && eErr == CE_None; c++ )
+    {
+        x->cells[c].first = x->n_runs;
+        x->n_runs += x->cells[c].n_runs;
+        x->cells[c].n_runs = 0;
+    }
+    if( eErr == CE_None )
+    {
+        x->runs = malloc( sizeof( bcal_bcx_run ) * (x->n_runs + 1) );
+        if( x->runs == NULL )
+        {
+            CPLError( CE_Failure, CPLE_OutOfMemory,
+                      "Failed to allocate %llu index runs",
+                      (unsigned long long)x->n_runs );
+            eErr = CE_Failure;
+        }
+    }
+    if( eErr == CE_None )
+    {
+        eErr = index_pass( las, x, last, TRUE );
+    }
+    free( last );
+    if( eErr != CE_None )
+    {
+        bcal_bcx_free( x );
+        return CE_Failure;
+    }
+    CPLDebug( "BCAL", "indexed %s: %ux%u cells of %lf, %llu runs",
+              las->path, x->nx, x->ny, x->size,
+              (unsigned long long)x->n_runs );
+    return CE_None;
+}
+
+static void put_u32( uint8 *b, uint32 v )
+{
+    CPL_LSBPTR32( &v );
+    memcpy( b, &v, sizeof( v ) );
+}
+
+static void put_u64( uint8 *b, uint64 v )
+{
+    CPL_LSBPTR64( &v );
+    memcpy( b, &v, sizeof( v ) );
+}
+
+static void put_f64( uint8 *b, double d )
+{
+    uint64 v;
+    memcpy( &v, &d, sizeof( v ) );
+    put_u64( b, v );
+}
+
+static uint32 get_u32( const uint8 *b )
+{
+    uint32 v;
+    memcpy( &v, b, sizeof( v ) );
+    CPL_LSBPTR32( &v );
+    return v;
+}
+
+static uint64 get_u64( const uint8 *b )
+{
+    uint64 v;
+    memcpy( &v, b, sizeof( v ) );
+    CPL_LSBPTR64( &v );
+    return v;
+}
+
+static double get_f64( const uint8 *b )
+{
+    uint64 v = get_u64( b );
+    double d;
+    memcpy( &d, &v, sizeof( d ) );
+    return d;
+}
+
+/*
+** bcal_bcx_write writes x, the index of las, to path.  A partial file is
+** removed.
+*/
+CPLErr bcal_bcx_write( const bcal_bcx *x, const bcal_las *las,
+                       const char *path )
+{
+    uint8 b[BCX_HEADER_SIZE];
+    uint64 c, n_cells = (uint64)x->nx * x->ny;
+    int ok = 1;
+    VSIStatBufL st;
+    VSILFILE *fp;
+    /* The file as stored, a laz input's decoded copy has another size */
+    if( VSIStatL( las->path, &st ) != 0 )
+    {
+        CPLError( CE_Failure, CPLE_OpenFailed, "Failed to stat %s",
+                  las->path );
+        return CE_Failure;
+    }
+    fp = VSIFOpenL( path, "wb" );
+    if( fp == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OpenFailed, "Failed to create %s", path );
+        return CE_Failure;
+    }
+    memcpy( b, BCX_MAGIC, 4 );
+    put_u32( b + 4, 0 );
+    put_u64( b + 8, (uint64)st.st_size );
+    put_u64( b + 16, las->h.n_points );
+    put_f64( b + 24, x->min_x );
+    put_f64( b + 32, x->min_y );
+    put_f64( b + 40, x->size );
+    put_u32( b + 48, x->nx );
+    put_u32( b + 52, x->ny );
+    put_f64( b + 56, x->bounds.MinX );
+    put_f64( b + 64, x->bounds.MaxX );
+    put_f64( b + 72, x->bounds.MinY );
+    put_f64( b + 80, x->bounds.MaxY );
+    ok &= VSIFWriteL( b, BCX_HEADER_SIZE, 1, fp ) == 1;
+    put_u64( b, x->n_runs );
+    ok &= VSIFWriteL( b, 8, 1, fp ) == 1;
+    for( c = 0; c < n_cells && ok; c++ )
+    {
+        put_u64( b, x->cells[c].first );
+        put_u64( b + 8, x->cells[c].n_runs );
+        put_u64( b + 16, x->cells[c].count );
+        put_u32( b + 24, (uint32)x->cells[c].zmin );
+        put_u32( b + 28, (uint32)x->cells[c].zmax );
+        ok &= VSIFWriteL( b, BCX_CELL_SIZE, 1, fp ) == 1;
+    }
+    for( c = 0; c < x->n_runs && ok; c++ )
+    {
+        put_u64( b, x->runs[c].start );
+        put_u64( b + 8, x->runs[c].count );
+        ok &= VSIFWriteL( b, BCX_RUN_SIZE, 1, fp ) == 1;
+    }
+    ok &= VSIFCloseL( fp ) == 0;
+    if( !ok )
+    {
+        CPLError( CE_Failure, CPLE_FileIO, "Failed to write %s", path );
+        VSIUnlink( path );
+        return CE_Failure;
+    }
+    return CE_None;
+}
+
+/*
+** bcal_bcx_read reads the index of las from path.  The index is optional,
+** so one that can't be read, is damaged or is older than the file is
+** reported as a warning, and CE_Warning is returned.
+*/
+CPLErr bcal_bcx_read( const char *path, const bcal_las *las, bcal_bcx *x )
+{
+    VSIStatBufL st_bcx, st_las;
+    bcal_map map;
+    const uint8 *b;
+    uint64 c, n_cells, n_runs;
+    const char *problem = NULL;
+    memset( x, 0, sizeof( bcal_bcx ) );
+    if( VSIStatL( path, &st_bcx ) != 0 ||
+        bcal_map_open( path, FALSE, &map ) != CE_None )
+    {
+        CPLError( CE_Warning, CPLE_OpenFailed,
+                  "Failed to open index %s, reading %s without it", path,
+                  las->path );
+        return CE_Warning;
+    }
+    b = map.data;
+    n_cells = 0;
+    n_runs = 0;
+    if( map.size < BCX_HEADER_SIZE + 8 || memcmp( b, BCX_MAGIC, 4 ) != 0 )
+    {
+        problem = "is not a bcal index";
+    }
+    else if( VSIStatL( las->path, &st_las ) != 0 ||
+             get_u64( b + 8 ) != (uint64)st_las.st_size ||
+             get_u64( b + 16 ) != las->h.n_points ||
+             st_las.st_mtime > st_bcx.st_mtime )
+    {
+        problem = "is out of date";
+    }
+    else
+    {
+        x->min_x = get_f64( b + 24 );
+        x->min_y = get_f64( b + 32 );
+        x->size = get_f64( b + 40 );
+        x->nx = get_u32( b + 48 );
+        x->ny = get_u32( b + 52 );
+        x->bounds.MinX = get_f64( b + 56 );
+        x->bounds.MaxX = get_f64( b + 64 );
+        x->bounds.MinY = get_f64( b + 72 );
+        x->bounds.MaxY = get_f64( b + 80 );
+        n_cells = (uint64)x->nx * x->ny;
+        n_runs = get_u64( b + BCX_HEADER_SIZE );
+        if( !(x->size > 0) || n_cells == 0 ||
+            x->nx > BCAL_BCX_MAX_CELLS || x->ny > BCAL_BCX_MAX_CELLS ||
+            n_runs > las->h.n_points ||
+            map.size != BCX_HEADER_SIZE + 8 + n_cells * BCX_CELL_SIZE +
+                        n_runs * BCX_RUN_SIZE )
+        {
+            problem = "is damaged";
+        }
+    }
+    if( problem == NULL )
+    {
+        x->cells = malloc( sizeof( bcal_bcx_cell ) * n_cells );
+        x->runs = malloc( sizeof( bcal_bcx_run ) * (n_runs + 1) );
+        if( x->cells == NULL || x->runs == NULL )
+        {
+            problem = "does not fit in memory";
+        }
+    }
+    for( c = 0, b += BCX_HEADER_SIZE + 8; problem == NULL && c < n_cells;
+         c++, b += BCX_CELL_SIZE )
+    {
+        x->cells[c].first = get_u64( b );
+        x->cells[c].n_runs = get_u64( b + 8 );
+        x->cells[c].count = get_u64( b + 16 );
+        x->cells[c].zmin = (int32)get_u32( b + 24 );
+        x->cells[c].zmax = (int32)get_u32( b + 28 );
+        if( x->cells[c].first > n_runs ||
+            x->cells[c].n_runs > n_runs - x->cells[c].first )
+        {
+            problem = "is damaged";
+        }
+    }
+    for( c = 0; problem == NULL && c < n_runs; c++, b += BCX_RUN_SIZE )
+    {
+        x->runs[c].start = get_u64( b );
+        x->runs[c].count = get_u64( b + 8 );
+        if( x->runs[c].start > las->h.n_points ||
+            x->runs[c].count > las->h.n_points - x->runs[c].start )
+        {
+            problem = "is damaged";
+        }
+    }
+    x->n_runs = n_runs;
+    bcal_map_close( &map );
+    if( problem != NULL )
+    {
+        CPLError( CE_Warning, CPLE_AppDefined,
+                  "Index %s %s, reading %s without it", path, problem,
+                  las->path );
+        bcal_bcx_free( x );
+        return CE_Warning;
+    }
+    return CE_None;
+}
+
+static int compare_runs( const void *a, const void *b )
+{
+    const bcal_bcx_run *ra = a;
+    const bcal_bcx_run *rb = b;
+    return ra->start < rb->start ? -1 : ra->start > rb->start;
+}
+
+/*
+** bcal_bcx_query finds the runs of records that may hold points inside
+** env.  The runs are sorted, and overlapping or adjacent ones merged, so
+** no record is read twice.  Runs also hold records outside env, which the
+** caller must skip.  count is set to the number of points in the cells
+** env touches.  Free *runs with free.
+*/
+CPLErr bcal_bcx_query( const bcal_bcx *x, const OGREnvelope *env,
+                       bcal_bcx_run **runs, uint64 *n, uint64 *count )
+{
+    uint64 nw = cell_of( x, env->MinX, env->MaxY );
+    uint64 se = cell_of( x, env->MaxX, env->MinY );
+    uint32 c0 = (uint32)(nw % x->nx), r1 = (uint32)(nw / x->nx);
+    uint32 c1 = (uint32)(se % x->nx), r0 = (uint32)(se / x->nx);
+    uint32 row, col;
+    uint64 i, m = 0, total = 0;
+    const bcal_bcx_cell *cell;
+    bcal_bcx_run *r;
+    *runs = NULL;
+    *n = 0;
+    *count = 0;
+    /* Edge cells hold the points off the grid, so check the points' bounds */
+    if( !(env->MinX <= x->bounds.MaxX) || !(env->MaxX >= x->bounds.MinX) ||
+        !(env->MinY <= x->bounds.MaxY) || !(env->MaxY >= x->bounds.MinY) )
+    {
+        return CE_None;
+    }
+    for( row = r0; row <= r1; row++ )
+    {
+        for( col = c0; col <= c1; col++ )
+        {
+            total += x->cells[(uint64)row * x->nx + col].n_runs;
+        }
+    }
+    r = malloc( sizeof( bcal_bcx_run ) * (total + 1) );
+    if( r == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate %llu index runs",
+                  (unsigned long long)total );
+        return CE_Failure;
+    }
+    for( row = r0; row <= r1; row++ )
+    {
+        for( col = c0; col <= c1; col++ )
+        {
+            cell = x->cells + (uint64)row * x->nx + col;
+            memcpy( r + m, x->runs + cell->first,
+                    sizeof( bcal_bcx_run ) * cell->n_runs );
+            m += cell->n_runs;
+            *count += cell->count;
+        }
+    }
+    qsort( r, m, sizeof( bcal_bcx_run ), compare_runs );
+    for( i = 1, total = m > 0; i < m; i++ )
+    {
+        if( r[i].start <= r[total - 1].start + r[total - 1].count )
+        {
+            if( r[i].start + r[i].count >
+                r[total - 1].start + r[total - 1].count )
+            {
+                r[total - 1].count = r[i].start + r[i].count -
+                                     r[total - 1].start;
+            }
+        }
+        else
+        {
+            r[total++] = r[i];
+        }
+    }
+    *runs = r;
+    *n = total;
+    return CE_None;
+}
+
+void bcal_bcx_free( bcal_bcx *x )
+{
+    free( x->cells );
+    x->cells = NULL;
+    free( x->runs );
+    x->runs = NULL;
+    x->n_runs = 0;
+}
+
+/*
+** bcal_bcx_create indexes the las or laz file at path, with about
+** cell_points points per cell, and writes the index next to it.  x is left
+** holding the index, release it with bcal_bcx_free.
+*/
+CPLErr bcal_bcx_create( const char *path, uint32 cell_points, uint32 jobs,
+                        bcal_bcx *x )
+{
+    bcal_las las;
+    char *out;
+    CPLErr eErr;
+    VSIStatBufL st;
+    memset( x, 0, sizeof( bcal_bcx ) );
+    out = strdup( CPLResetExtension( path, BCAL_BCX_EXTENSION ) );
+    /* An old index would only be reported as out of date */
+    if( VSIStatL( out, &st ) == 0 )
+    {
+        VSIUnlink( out );
+    }
+    if( bcal_las_open( path, &las ) != CE_None )
+    {
+        free( out );
+        return CE_Failure;
+    }
+    eErr = bcal_las_decompress( &las, jobs, FALSE );
+    if( eErr == CE_None )
+    {
+        eErr = bcal_bcx_build( &las, cell_points, x );
+    }
+    if( eErr == CE_None )
+    {
+        eErr = bcal_bcx_write( x, &las, out );
+    }
+    if( eErr != CE_None )
+    {
+        bcal_bcx_free( x );
+    }
+    free( out );
+    bcal_las_close( &las );
+    return eErr;
+}
@@ -0,0 +1,467 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** las reads LAS 1.0 through 1.4 files directly from a mapped view of the
+** file.  The public header and variable length records are parsed on open,
+** and point records are decoded straight into the columns of a bcal_points
+** store.  All values in a LAS file are little endian.
+*/
+
+#include <math.h>
+
+#include "bcal_las.h"
+
+#include "cpl_conv.h"
+#include "cpl_port.h"
+#include "cpl_vsi.h"
+
+/* Records decoded at a time by bcal_las_read_env */
+#define BCAL_LAS_READ_BLOCK 65536
+
+static uint16 get_u16( const uint8 *b )
+{
+    uint16 v;
+    memcpy( &v, b, sizeof( v ) );
+    CPL_LSBPTR16( &v );
+    return v;
+}
+
+static uint32 get_u32( const uint8 *b )
+{
+    uint32 v;
+    memcpy( &v, b, sizeof( v ) );
+    CPL_LSBPTR32( &v );
+    return v;
+}
+
+static int32 get_i32( const uint8 *b )
+{
+    return (int32)get_u32( b );
+}
+
+static uint64 get_u64( const uint8 *b )
+{
+    uint64 v;
+    memcpy( &v, b, sizeof( v ) );
+    CPL_LSBPTR64( &v );
+    return v;
+}
+
+static double get_f64( const uint8 *b )
+{
+    uint64 v = get_u64( b );
+    double d;
+    memcpy( &d, &v, sizeof( d ) );
+    return d;
+}
+
+static void get_str( char *dst, const uint8 *src, int n )
+{
+    memcpy( dst, src, n );
+    dst[n] = '\0';
+}
+
+/*
+** Minimum record length for each point data format, 0 through 10.  Extra
+** bytes may follow, so the header's record length is used for striding.
+*/
+static const uint16 point_lengths[] = { 20, 28, 26, 34, 57, 63, 30, 36, 38,
+                                        59, 67 };
+
+static CPLErr parse_header( bcal_las *las )
+{
+    const uint8 *b = las->map.data;
+    bcal_las_header *h = &las->h;
+    int i;
+    if( las->map.size < BCAL_LAS_HEADER_SIZE_10 || memcmp( b, "LASF", 4 ) != 0 )
+    {
+        CPLError( CE_Failure, CPLE_AppDefined,
+                  "%s is not a LAS file", las->path );
+        return CE_Failure;
+    }
+    memset( h, 0, sizeof( bcal_las_header ) );
+    h->version_major = b[24];
+    h->version_minor = b[25];
+    h->header_size = get_u16( b + 94 );
+    h->point_offset = get_u32( b + 96 );
+    h->n_vlrs = get_u32( b + 100 );
+    h->compressed = (b[104] & 0x80) != 0;
+    h->point_format = b[104] & 0x3f;
+    h->point_length = get_u16( b + 105 );
+    h->n_points = get_u32( b + 107 );
+    for( i = 0; i < 3; i++ )
+    {
+        h->scale[i] = get_f64( b + 131 + i * 8 );
+        h->offset[i] = get_f64( b + 155 + i * 8 );
+        /* Stored as max x, min x, max y, min y, max z, min z */
+        h->max[i] = get_f64( b + 179 + i * 16 );
+        h->min[i] = get_f64( b + 187 + i * 16 );
+    }
+    if( h->version_major != 1 || h->version_minor > 4 )
+    {
+        CPLError( CE_Failure, CPLE_NotSupported,
+                  "Unsupported LAS version %d.%d in %s",
+                  h->version_major, h->version_minor, las->path );
+        return CE_Failure;
+    }
+    if( h->header_size < BCAL_LAS_HEADER_SIZE_10 ||
+        h->header_size > las->map.size )
+    {
+        CPLError( CE_Failure, CPLE_AppDefined,
+                  "Invalid header size %d in %s", h->header_size, las->path );
+        return CE_Failure;
+    }
+    if( h->point_format > 10 ||
+        h->point_length < point_lengths[h->point_format] )
+    {
+        CPLError( CE_Failure, CPLE_NotSupported,
+                  "Unsupported point format %d (record length %d) in %s",
+                  h->point_format, h->point_length, las->path );
+        return CE_Failure;
+    }
+    if( h->version_minor >= 4 && h->header_size >= BCAL_LAS_HEADER_SIZE_14 &&
+        las->map.size >= BCAL_LAS_HEADER_SIZE_14 )
+    {
+        h->evlr_offset = get_u64( b + 235 );
+        h->n_evlrs = get_u32( b + 243 );
+        /* The legacy count is zero for formats 6 and up. */
+        h->n_points = get_u64( b + 247 );
+    }
+    if( h->scale[0] == 0. || h->scale[1] == 0. || h->scale[2] == 0. )
+    {
+        CPLError( CE_Failure, CPLE_AppDefined,
+                  "Invalid scale factors in %s", las->path );
+        return CE_Failure;
+    }
+    if( !h->compressed &&
+        h->point_offset + h->n_points * h->point_length > las->map.size )
+    {
+        CPLError( CE_Failure, CPLE_AppDefined,
+                  "%s is truncated, expected %llu points",
+                  las->path, (unsigned long long)h->n_points );
+        return CE_Failure;
+    }
+    return CE_None;
+}
+
+static CPLErr parse_vlrs( bcal_las *las )
+{
+    const uint8 *b = las->map.data;
+    uint64 off = las->h.header_size;
+    /* Records end before the points, and the points of laz may not be */
+    const uint64 end = las->h.point_offset < las->map.size ?
+                       las->h.point_offset : las->map.size;
+    uint32 i;
+    las->vlrs = NULL;
+    if( las->h.n_vlrs == 0 )
+    {
+        return CE_None;
+    }
+    las->vlrs = calloc( las->h.n_vlrs, sizeof( bcal_las_vlr ) );
+    if( las->vlrs == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate variable length records" );
+        return CE_Failure;
+    }
+    for( i = 0; i < las->h.n_vlrs; i++ )
+    {
+        if( off + BCAL_LAS_VLR_HEADER_SIZE > end ||
+            off + BCAL_LAS_VLR_HEADER_SIZE + get_u16( b + off + 20 ) > end )
+        {
+            CPLError( CE_Failure, CPLE_AppDefined,
+                      "Variable length record %d overruns point data in %s",
+                      i, las->path );
+            return CE_Failure;
+        }
+        get_str( las->vlrs[i].user_id, b + off + 2, 16 );
+        las->vlrs[i].record_id = get_u16( b + off + 18 );
+        las->vlrs[i].length = get_u16( b + off + 20 );
+        get_str( las->vlrs[i].description, b + off + 22, 32 );
+        las->vlrs[i].data = b + off + BCAL_LAS_VLR_HEADER_SIZE;
+        off += BCAL_LAS_VLR_HEADER_SIZE + las->vlrs[i].length;
+    }
+    return CE_None;
+}
+
+/* Read the .bcx index next to the file, if there is a current one. */
+static void open_index( bcal_las *las )
+{
+    VSIStatBufL st;
+    char *path = strdup( CPLResetExtension( las->path, BCAL_BCX_EXTENSION ) );
+    if( path != NULL && VSIStatL( path, &st ) == 0 )
+    {
+        las->index = malloc( sizeof( bcal_bcx ) );
+        if( las->index != NULL &&
+            bcal_bcx_read( path, las, las->index ) != CE_None )
+        {
+            free( las->index );
+            las->index = NULL;
+        }
+    }
+    free( path );
+}
+
+/*
+** bcal_las_open maps a las file and reads its header and variable length
+** records, and its .bcx index if it has one.  Release with bcal_las_close.
+*/
+CPLErr bcal_las_open( const char *path, bcal_las *las )
+{
+    memset( las, 0, sizeof( bcal_las ) );
+    if( bcal_map_open( path, FALSE, &las->map ) != CE_None )
+    {
+        return CE_Failure;
+    }
+    las->path = strdup( path );
+    if( parse_header( las ) != CE_None || parse_vlrs( las ) != CE_None )
+    {
+        bcal_las_close( las );
+        return CE_Failure;
+    }
+    open_index( las );
+    CPLDebug( "BCAL", "opened %s: LAS %d.%d, format %d, %llu points",
+              path, las->h.version_major, las->h.version_minor,
+              las->h.point_format, (unsigned long long)las->h.n_points );
+    return CE_None;
+}
+
+void bcal_las_close( bcal_las *las )
+{
+    bcal_map_close( &las->map );
+    free( las->vlrs );
+    las->vlrs = NULL;
+    free( las->path );
+    las->path = NULL;
+    if( las->index != NULL )
+    {
+        bcal_bcx_free( las->index );
+        free( las->index );
+        las->index = NULL;
+    }
+    if( las->decoded != NULL )
+    {
+        VSIUnlink( las->decoded );
+        free( las->decoded );
+        las->decoded = NULL;
+    }
+}
+
+const bcal_las_vlr * bcal_las_find_vlr( const bcal_las *las,
+                                        const char *user_id,
+                                        uint16 record_id )
+{
+    uint32 i;
+    for( i = 0; i < las->h.n_vlrs; i++ )
+    {
+        if( las->vlrs[i].record_id == record_id &&
+            strcmp( las->vlrs[i].user_id, user_id ) == 0 )
+        {
+            return &las->vlrs[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+** Requantize coordinate d of *v from the scale and offset of h to those of
+** p.  FALSE if it does not fit an int32.
+*/
+static int requantize( int32 *v, const bcal_las_header *h,
+                       const bcal_points *p, int d )
+{
+    double q = floor( ((*v * h->scale[d] + h->offset[d]) - p->offset[d]) /
+                      p->scale[d] + 0.5 );
+    if( !(q >= INT32_MIN && q <= INT32_MAX) )
+    {
+        return FALSE;
+    }
+    *v = (int32)q;
+    return TRUE;
+}
+
+/*
+** bcal_las_read decodes count records starting at record start and appends
+** them to p.  The fid of each point is its record number, and h its point
+** source id, the height written by the filter.  Coordinates and heights are
+** kept as stored when p has the scale and offset of the file, otherwise they
+** are requantized to p's, failing if they do not fit.  The intensity,
+** number of returns and user data are read when p keeps them.  The points
+** of a laz input left compressed are decoded first.
+*/
+CPLErr bcal_las_read( const bcal_las *las, uint64 start, uint64 count,
+                      bcal_points *p )
+{
+    const bcal_las_header *h = &las->h;
+    const uint8 *base, *rec;
+    uint8 *decoded = NULL;
+    uint64 i;
+    uint32 j;
+    int d, same = TRUE;
+    if( h->compressed && las->chunk_points == 0 )
+    {
+        CPLError( CE_Failure, CPLE_NotSupported,
+                  "%s is compressed, decompress it with "
+                  "bcal_las_decompress first", las->path );
+        return CE_Failure;
+    }
+    if( start + count > h->n_points )
+    {
+        CPLError( CE_Failure, CPLE_IllegalArg,
+                  "Invalid point range %llu+%llu",
+                  (unsigned long long)start, (unsigned long long)count );
+        return CE_Failure;
+    }
+    if( (uint64)p->n + count > UINT32_MAX ||
+        bcal_points_reserve( p, p->n + (uint32)count ) != CE_None )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to make room for %llu points",
+                  (unsigned long long)count );
+        return CE_Failure;
+    }
+    for( d = 0; d < 3; d++ )
+    {
+        same = same && p->scale[d] == h->scale[d] &&
+                       p->offset[d] == h->offset[d];
+    }
+    if( !h->compressed )
+    {
+        base = las->map.data + h->point_offset + start * h->point_length;
+    }
+    else
+    {
+        decoded = malloc( count > 0 ? count * h->point_length : 1 );
+        if( decoded == NULL )
+        {
+            CPLError( CE_Failure, CPLE_OutOfMemory,
+                      "Failed to allocate %llu records",
+                      (unsigned long long)count );
+            return CE_Failure;
+        }
+        if( bcal_laz_decode( las, start, count, decoded ) != CE_None )
+        {
+            free( decoded );
+            return CE_Failure;
+        }
+        base = decoded;
+    }
+    rec = base;
+    /* Formats 6 and up store the full classification byte at 16. */
+    int class_off = h->point_format < 6 ? 15 : 16;
+    uint8 class_mask = h->point_format < 6 ? 0x1f : 0xff;
+    uint8 return_mask = h->point_format < 6 ? 0x07 : 0x0f;
+    int source_off = h->point_format < 6 ? 18 : 20;
+    for( i = 0, j = p->n; i < count; i++, j++ )
+    {
+        p->fid[j] = (int64)(start + i);
+        p->x[j] = get_i32( rec );
+        p->y[j] = get_i32( rec + 4 );
+        p->z[j] = get_i32( rec + 8 );
+        p->c[j] = rec[class_off] & class_mask;
+        p->r[j] = rec[14] & return_mask;
+        p->h[j] = get_u16( rec + source_off );
+        rec += h->point_length;
+    }
+    rec = base;
+    for( i = 0, j = p->n; i < count && p->intensity != NULL; i++, j++ )
+    {
+        p->intensity[j] = get_u16( rec + 12 );
+        p->n_returns[j] = h->point_format < 6 ? (rec[14] >> 3) & 0x07 :
+                                                rec[14] >> 4;
+        p->user[j] = rec[17];
+        rec += h->point_length;
+    }
+    if( !same )
+    {
+        for( j = p->n; j < p->n + count; j++ )
+        {
+            if( !requantize( p->x + j, h, p, 0 ) ||
+                !requantize( p->y + j, h, p, 1 ) ||
+                !requantize( p->z + j, h, p, 2 ) )
+            {
+                CPLError( CE_Failure, CPLE_AppDefined,
+                          "Record %llu of %s is out of range at the scale "
+                          "and offset it is read at",
+                          (unsigned long long)(start + j - p->n),
+                          las->path );
+                free( decoded );
+                return CE_Failure;
+            }
+            if( p->h[j] != BCAL_LAS_NO_HEIGHT )
+            {
+                p->h[j] = (uint16)fmin( floor( p->h[j] * h->scale[2] /
+                                               p->scale[2] + 0.5 ),
+                                        BCAL_LAS_NO_HEIGHT - 1 );
+            }
+        }
+    }
+    free( decoded );
+    p->n += (uint32)count;
+    return CE_None;
+}
+
+/*
+** Read count records from start into p, keeping only the points inside env.
+*/
+static CPLErr read_inside( const bcal_las *las, uint64 start, uint64 count,
+                           const OGREnvelope *env, bcal_points *p )
+{
+    uint64 n;
+    uint32 j, k;
+    double x, y;
+    for( ; count > 0; start += n, count -= n )
+    {
+        n = count < BCAL_LAS_READ_BLOCK ? count : BCAL_LAS_READ_BLOCK;
+        j = p->n;
+        if( bcal_las_read( las, start, n, p ) != CE_None )
+        {
+            return CE_Failure;
+        }
+        for( k = j; k < p->n; k++ )
+        {
+            x = bcal_points_x( p, k );
+            y = bcal_points_y( p, k );
+            if( x >= env->MinX && x <= env->MaxX &&
+                y >= env->MinY && y <= env->MaxY )
+            {
+                bcal_points_copy( p, j++, p, k );
+            }
+        }
+        p->n = j;
+    }
+    return CE_None;
+}
+
+/*
+** bcal_las_read_env appends the points inside env to p, as bcal_las_read
+** does.  With an index only the runs of the cells env touches are read,
+** otherwise every record is.
+*/
+CPLErr bcal_las_read_env( const bcal_las *las, const OGREnvelope *env,
+                          bcal_points *p )
+{
+    bcal_bcx_run *runs;
+    uint64 i, n, count;
+    CPLErr eErr = CE_None;
+    if( las->index == NULL )
+    {
+        return read_inside( las, 0, las->h.n_points, env, p );
+    }
+    if( bcal_bcx_query( las->index, env, &runs, &n, &count ) != CE_None )
+    {
+        return CE_Failure;
+    }
+    if( p->n + count <= UINT32_MAX )
+    {
+        eErr = bcal_points_reserve( p, p->n + (uint32)count );
+    }
+    for( i = 0; i < n && eErr == CE_None; i++ )
+    {
+        eErr = read_inside( las, runs[i].start, runs[i].count, env, p );
+    }
+    free( runs );
+    return eErr;
+}
@@ -0,0 +1,213 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef BCAL_LAS_H_
+#define BCAL_LAS_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bcal_point.h"
+#include "bcal_types.h"
+
+#include <gdal.h>
+
+/*
+** Sizes of the fixed parts of a LAS file, see http://www.asprs.org/ for the
+** 1.0-1.4 specifications.
+*/
+#define BCAL_LAS_HEADER_SIZE_10 227
+#define BCAL_LAS_HEADER_SIZE_13 235
+#define BCAL_LAS_HEADER_SIZE_14 375
+#define BCAL_LAS_VLR_HEADER_SIZE 54
+#define BCAL_LAS_EVLR_HEADER_SIZE 60
+
+/* The variable length record that marks a LASzip compressed file */
+#define BCAL_LASZIP_USER_ID "laszip encoded"
+#define BCAL_LASZIP_RECORD_ID 22204
+
+/* Default height value for points that have not been assigned one. */
+#define BCAL_LAS_NO_HEIGHT 65535
+
+/* Extension of the spatial index kept next to a las file, see bcal_bcx.c */
+#define BCAL_BCX_EXTENSION "bcx"
+/* Default points per index cell */
+#define BCAL_BCX_CELL_POINTS 4096
+/* Most index cells along each side of the grid */
+#define BCAL_BCX_MAX_CELLS 2048
+/* Records between two points of a cell that are still read as one run */
+#define BCAL_BCX_GAP 16
+
+/* Orders of output records, see bcal_las_sort */
+#define BCAL_ORDER_INPUT 0
+#define BCAL_ORDER_MORTON 1
+#define BCAL_ORDER_HILBERT 2
+
+/*
+** A read only or read/write view of a whole file.  The view is memory mapped
+** where the platform allows it.
+*/
+typedef struct bcal_map
+{
+    uint8 *data;
+    uint64 size;
+    int writable;
+    void *handle;
+} bcal_map;
+
+typedef struct bcal_las_header
+{
+    uint8 version_major;
+    uint8 version_minor;
+    uint16 header_size;
+    uint64 point_offset;
+    uint32 n_vlrs;
+    /* Point data format with the compression bits masked off */
+    uint8 point_format;
+    uint16 point_length;
+    uint64 n_points;
+    double scale[3];
+    double offset[3];
+    double min[3];
+    double max[3];
+    uint64 evlr_offset;
+    uint32 n_evlrs;
+    /* Set when the point format carries the LASzip compression bits */
+    int compressed;
+} bcal_las_header;
+
+typedef struct bcal_las_vlr
+{
+    char user_id[17];
+    uint16 record_id;
+    char description[33];
+    uint64 length;
+    /* Points into the mapped file, not owned */
+    const uint8 *data;
+} bcal_las_vlr;
+
+/* Records start to start + count - 1 */
+typedef struct bcal_bcx_run
+{
+    uint64 start;
+    uint64 count;
+} bcal_bcx_run;
+
+typedef struct bcal_bcx_cell
+{
+    /* The cell's runs are runs[first] to runs[first + n_runs - 1] */
+    uint64 first;
+    uint64 n_runs;
+    uint64 count;
+    /* Elevation range of the cell's points, as stored */
+    int32 zmin;
+    int32 zmax;
+} bcal_bcx_cell;
+
+/*
+** A grid of square cells over the points of a las file, from min_x, min_y
+** with row 0 to the south.  Points off the grid are in the edge cells.
+*/
+typedef struct bcal_bcx
+{
+    double min_x;
+    double min_y;
+    double size;
+    uint32 nx;
+    uint32 ny;
+    /* Bounds of the points themselves, whatever the header says */
+    OGREnvelope bounds;
+    bcal_bcx_cell *cells;
+    uint64 n_runs;
+    bcal_bcx_run *runs;
+} bcal_bcx;
+
+typedef struct bcal_las
+{
+    char *path;
+    bcal_las_header h;
+    bcal_las_vlr *vlrs;
+    bcal_map map;
+    /* Temporary uncompressed copy of a laz input, see bcal_las_decompress */
+    char *decoded;
+    /*
+    ** Points per chunk of a laz input decoded as it is read, see
+    ** bcal_las_decompress, 0 for files read from their records
+    */
+    uint32 chunk_points;
+    /* The .bcx index of the file, NULL if it has none or it is out of date */
+    bcal_bcx *index;
+} bcal_las;
+
+/*
+** A copy of an input file being patched with filter results.
+*/
+typedef struct bcal_las_writer
+{
+    char *path;
+    uint8 point_format;
+    uint16 point_length;
+    uint64 point_offset;
+    uint64 n_points;
+    double scale[3];
+    double offset[3];
+    bcal_map map;
+} bcal_las_writer;
+
+CPLErr bcal_map_open( const char *path, int writable, bcal_map *m );
+
+void bcal_map_close( bcal_map *m );
+
+CPLErr bcal_las_open( const char *path, bcal_las *las );
+
+void bcal_las_close( bcal_las *las );
+
+CPLErr bcal_las_decompress( bcal_las *las, uint32 jobs, int stream );
+
+CPLErr bcal_laz_decode( const bcal_las *las, uint64 start, uint64 count,
+                        uint8 *recs );
+
+const bcal_las_vlr * bcal_las_find_vlr( const bcal_las *las,
+                                        const char *user_id,
+                                        uint16 record_id );
+
+CPLErr bcal_las_read( const bcal_las *las, uint64 start, uint64 count,
+                      bcal_points *p );
+
+CPLErr bcal_las_read_env( const bcal_las *las, const OGREnvelope *env,
+                          bcal_points *p );
+
+CPLErr bcal_las_create_copy( const bcal_las *src, const char *path,
+                             bcal_las_writer *w );
+
+void bcal_las_patch( bcal_las_writer *w, uint64 fid, uint8 c, uint16 h );
+
+void bcal_las_writer_close( bcal_las_writer *w, int discard );
+
+uint64 bcal_morton( uint32 col, uint32 row );
+
+uint64 bcal_hilbert( uint32 col, uint32 row, int bits );
+
+CPLErr bcal_las_sort( bcal_las_writer *w, const OGREnvelope *env,
+                      double cell, int order );
+
+CPLErr bcal_bcx_build( const bcal_las *las, uint32 cell_points,
+                       bcal_bcx *x );
+
+CPLErr bcal_bcx_write( const bcal_bcx *x, const bcal_las *las,
+                       const char *path );
+
+CPLErr bcal_bcx_read( const char *path, const bcal_las *las, bcal_bcx *x );
+
+CPLErr bcal_bcx_query( const bcal_bcx *x, const OGREnvelope *env,
+                       bcal_bcx_run **runs, uint64 *n, uint64 *count );
+
+CPLErr bcal_bcx_create( const char *path, uint32 cell_points, uint32 jobs,
+                        bcal_bcx *x );
+
+void bcal_bcx_free( bcal_bcx *x );
+
+#endif /* BCAL_LAS_H_ */
+
@@ -0,0 +1,451 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** laz decompresses a LASzip compressed input to a temporary las file, which
+** then stands in for the input.  LASzip compresses points in chunks that
+** start a fresh coder and are listed in a chunk table, so a reader can seek
+** to any chunk and decode from there.  The chunks are split into runs that
+** are decoded on the worker pool, each with its own LASzip reader, straight
+** into their records of the mapped temporary file.  Readers that only take
+** blocks of points may instead leave a file of fixed size chunks compressed
+** and have each block decoded as it is read, which needs no disk.  Only
+** builds with BCAL_HAVE_LASZIP (cmake -DBCAL_WITH_LASZIP=ON) can read laz.
+*/
+
+#include "bcal_las.h"
+#include "bcal_pool.h"
+
+#include "cpl_conv.h"
+#include "cpl_port.h"
+#include "cpl_vsi.h"
+
+#ifdef BCAL_HAVE_LASZIP
+#include <laszip/laszip_api.h>
+#endif
+
+/* LASzip compressor ids, from the laszip vlr */
+#define BCAL_LASZIP_POINTWISE 1
+/* Chunk size of files compressed with variable chunks */
+#define BCAL_LASZIP_VARIABLE_CHUNK UINT32_MAX
+/* Runs of chunks per job, for load balancing */
+#define BCAL_LAZ_RUNS_PER_JOB 4
+
+#ifdef BCAL_HAVE_LASZIP
+
+static void put_u16( uint8 *b, uint16 v )
+{
+    CPL_LSBPTR16( &v );
+    memcpy( b, &v, sizeof( v ) );
+}
+
+static void put_u32( uint8 *b, uint32 v )
+{
+    CPL_LSBPTR32( &v );
+    memcpy( b, &v, sizeof( v ) );
+}
+
+static void put_u64( uint8 *b, uint64 v )
+{
+    CPL_LSBPTR64( &v );
+    memcpy( b, &v, sizeof( v ) );
+}
+
+static void put_f64( uint8 *b, double d )
+{
+    uint64 v;
+    memcpy( &v, &d, sizeof( v ) );
+    put_u64( b, v );
+}
+
+/*
+** Write the record of point pt in format, 0 through 10, to rec, which is
+** length bytes long.  Extra bytes follow the standard fields.
+*/
+static void encode( const laszip_point *pt, uint8 format, uint16 length,
+                    uint8 *rec )
+{
+    uint16 base;
+    int k;
+    memset( rec, 0, length );
+    put_u32( rec, (uint32)pt->X );
+    put_u32( rec + 4, (uint32)pt->Y );
+    put_u32( rec + 8, (uint32)pt->Z );
+    put_u16( rec + 12, pt->intensity );
+    if( format < 6 )
+    {
+        rec[14] = (uint8)(pt->return_number | (pt->number_of_returns << 3) |
+                          (pt->scan_direction_flag << 6) |
+                          (pt->edge_of_flight_line << 7));
+        rec[15] = (uint8)(pt->classification | (pt->synthetic_flag << 5) |
+                          (pt->keypoint_flag << 6) |
+                          (pt->withheld_flag << 7));
+        rec[16] = (uint8)pt->scan_angle_rank;
+        rec[17] = pt->user_data;
+        put_u16( rec + 18, pt->point_source_ID );
+        base = 20;
+        if( format == 1 || format >= 3 )
+        {
+            put_f64( rec + base, pt->gps_time );
+            base += 8;
+        }
+        if( format == 2 || format == 3 || format == 5 )
+        {
+            for( k = 0; k < 3; k++ )
+            {
+                put_u16( rec + base + 2 * k, pt->rgb[k] );
+            }
+            base += 6;
+        }
+        if( format == 4 || format == 5 )
+        {
+            memcpy( rec + base, pt->wave_packet, 29 );
+            base += 29;
+        }
+    }
+    else
+    {
+        rec[14] = (uint8)(pt->extended_return_number |
+                          (pt->extended_number_of_returns << 4));
+        rec[15] = (uint8)(pt->extended_classification_flags |
+                          (pt->extended_scanner_channel << 4) |
+                          (pt->scan_direction_flag << 6) |
+                          (pt->edge_of_flight_line << 7));
+        rec[16] = pt->extended_classification;
+        rec[17] = pt->user_data;
+        put_u16( rec + 18, (uint16)pt->extended_scan_angle );
+        put_u16( rec + 20, pt->point_source_ID );
+        put_f64( rec + 22, pt->gps_time );
+        base = 30;
+        if( format == 7 || format == 8 || format == 10 )
+        {
+            for( k = 0; k < (format == 7 ? 3 : 4); k++ )
+            {
+                put_u16( rec + base + 2 * k, pt->rgb[k] );
+            }
+            base += format == 7 ? 6 : 8;
+        }
+        if( format == 9 || format == 10 )
+        {
+            memcpy( rec + base, pt->wave_packet, 29 );
+            base += 29;
+        }
+    }
+    if( pt->num_extra_bytes > 0 && pt->extra_bytes != NULL && base < length )
+    {
+        memcpy( rec + base, pt->extra_bytes,
+                (size_t)pt->num_extra_bytes < (size_t)(length - base) ?
+                (size_t)pt->num_extra_bytes : (size_t)(length - base) );
+    }
+}
+
+typedef struct bcal_laz_job
+{
+    const bcal_las *las;
+    /* The mapped temporary file and where its points start */
+    bcal_map *out;
+    uint64 point_offset;
+    /* Points per run, a multiple of the chunk size */
+    uint64 run;
+} bcal_laz_job;
+
+static CPLErr laz_error( laszip_POINTER r, const char *path )
+{
+    laszip_CHAR *msg = NULL;
+    laszip_get_error( r, &msg );
+    CPLError( CE_Failure, CPLE_FileIO, "Failed to decompress %s: %s", path,
+              msg != NULL ? msg : "unknown LASzip error" );
+    return CE_Failure;
+}
+
+/* Decode points start to end - 1 of las into the records at rec. */
+static CPLErr decode( const bcal_las *las, uint64 start, uint64 end,
+                      uint8 *rec )
+{
+    const bcal_las_header *h = &las->h;
+    uint64 k;
+    laszip_POINTER r = NULL;
+    laszip_point *pt = NULL;
+    laszip_BOOL compressed = 0;
+    CPLErr eErr = CE_None;
+    if( laszip_create( &r ) != 0 )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to create a LASzip reader" );
+        return CE_Failure;
+    }
+    if( laszip_open_reader( r, las->path, &compressed ) != 0 ||
+        laszip_get_point_pointer( r, &pt ) != 0 ||
+        (start > 0 && laszip_seek_point( r, (laszip_I64)start ) != 0) )
+    {
+        eErr = laz_error( r, las->path );
+    }
+    for( k = start; k < end && eErr == CE_None; k++ )
+    {
+        if( laszip_read_point( r ) != 0 )
+        {
+            eErr = laz_error( r, las->path );
+            break;
+        }
+        encode( pt, h->point_format, h->point_length, rec );
+        rec += h->point_length;
+    }
+    laszip_close_reader( r );
+    laszip_destroy( r );
+    return eErr;
+}
+
+/* Decode run i of the points. */
+static CPLErr decode_run( void *arg, uint32 i )
+{
+    bcal_laz_job *job = arg;
+    const bcal_las_header *h = &job->las->h;
+    uint64 start = i * job->run;
+    uint64 end = start + job->run < h->n_points ? start + job->run :
+                                                  h->n_points;
+    return decode( job->las, start, end, job->out->data + job->point_offset +
+                                         start * h->point_length );
+}
+
+/*
+** Write the header and variable length records of the uncompressed copy of
+** las to path, leaving room for the points and copying any extended
+** records after them.  Sets point_offset to where the points go.
+*/
+static CPLErr write_layout( const bcal_las *las, const char *path,
+                            uint64 *point_offset )
+{
+    const bcal_las_header *h = &las->h;
+    const bcal_las_vlr *v;
+    uint8 *header;
+    uint64 off, points, evlr_size = 0;
+    uint32 i, n_vlrs = 0;
+    int ok;
+    VSILFILE *fp;
+
+    off = h->header_size;
+    for( i = 0; i < h->n_vlrs; i++ )
+    {
+        v = &las->vlrs[i];
+        if( v->record_id == BCAL_LASZIP_RECORD_ID &&
+            strcmp( v->user_id, BCAL_LASZIP_USER_ID ) == 0 )
+        {
+            continue;
+        }
+        off += BCAL_LAS_VLR_HEADER_SIZE + v->length;
+        n_vlrs++;
+    }
+    *point_offset = off;
+    points = h->n_points * h->point_length;
+    if( h->n_evlrs > 0 && h->evlr_offset > 0 &&
+        h->evlr_offset < las->map.size )
+    {
+        evlr_size = las->map.size - h->evlr_offset;
+    }
+
+    header = malloc( h->header_size );
+    fp = VSIFOpenL( path, "wb" );
+    if( header == NULL || fp == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OpenFailed, "Failed to create %s", path );
+        free( header );
+        if( fp != NULL )
+        {
+            VSIFCloseL( fp );
+        }
+        return CE_Failure;
+    }
+    /* The header, uncompressed, without the laszip vlr */
+    memcpy( header, las->map.data, h->header_size );
+    header[104] &= 0x3f;
+    put_u32( header + 96, (uint32)*point_offset );
+    put_u32( header + 100, n_vlrs );
+    if( h->header_size >= BCAL_LAS_HEADER_SIZE_14 && h->version_minor >= 4 )
+    {
+        put_u64( header + 235, evlr_size > 0 ? *point_offset + points : 0 );
+    }
+    ok = VSIFWriteL( header, 1, h->header_size, fp ) == h->header_size;
+    free( header );
+    for( i = 0; i < h->n_vlrs && ok; i++ )
+    {
+        v = &las->vlrs[i];
+        if( v->record_id == BCAL_LASZIP_RECORD_ID &&
+            strcmp( v->user_id, BCAL_LASZIP_USER_ID ) == 0 )
+        {
+            continue;
+        }
+        ok = VSIFWriteL( v->data - BCAL_LAS_VLR_HEADER_SIZE, 1,
+                         BCAL_LAS_VLR_HEADER_SIZE + v->length, fp ) ==
+             BCAL_LAS_VLR_HEADER_SIZE + v->length;
+    }
+    /* Size the file, the points are filled in through a map */
+    ok = ok && VSIFTruncateL( fp, *point_offset + points + evlr_size ) == 0;
+    if( ok && evlr_size > 0 )
+    {
+        ok = VSIFSeekL( fp, *point_offset + points, SEEK_SET ) == 0 &&
+             VSIFWriteL( las->map.data + h->evlr_offset, 1, evlr_size, fp ) ==
+             evlr_size;
+    }
+    if( VSIFCloseL( fp ) != 0 || !ok )
+    {
+        CPLError( CE_Failure, CPLE_FileIO, "Failed to write %s", path );
+        VSIUnlink( path );
+        return CE_Failure;
+    }
+    return CE_None;
+}
+
+#endif /* BCAL_HAVE_LASZIP */
+
+/*
+** bcal_las_decompress replaces a compressed las with an uncompressed copy
+** in a temporary file (see CPL_TMPDIR), decoded with jobs threads.  The
+** copy keeps the path of the input and is removed by bcal_las_close.  With
+** stream set, a file of fixed size chunks is left compressed instead, and
+** bcal_las_read decodes the points it is asked for.  Only readers of whole
+** blocks of points may ask for that, bcal_las_sort and the writers need
+** the records.  Uncompressed files are left alone.
+*/
+CPLErr bcal_las_decompress( bcal_las *las, uint32 jobs, int stream )
+{
+#ifdef BCAL_HAVE_LASZIP
+    const bcal_las_vlr *v;
+    bcal_laz_job job;
+    bcal_map out;
+    bcal_las tmp;
+    char *path;
+    uint32 chunk = BCAL_LASZIP_VARIABLE_CHUNK, runs;
+    uint16 compressor = 0;
+    CPLErr eErr;
+    if( !las->h.compressed )
+    {
+        return CE_None;
+    }
+    v = bcal_las_find_vlr( las, BCAL_LASZIP_USER_ID, BCAL_LASZIP_RECORD_ID );
+    if( v == NULL || v->length < 16 )
+    {
+        CPLError( CE_Failure, CPLE_AppDefined,
+                  "%s is compressed but has no laszip record", las->path );
+        return CE_Failure;
+    }
+    memcpy( &compressor, v->data, sizeof( compressor ) );
+    CPL_LSBPTR16( &compressor );
+    memcpy( &chunk, v->data + 12, sizeof( chunk ) );
+    CPL_LSBPTR32( &chunk );
+    /*
+    ** A block read from the start of a chunk decodes no more than it
+    ** keeps.  Pointwise compression and variable chunks give no such
+    ** start, a read would decode from the start of the file or chunk.
+    */
+    if( stream && compressor != BCAL_LASZIP_POINTWISE &&
+        chunk != BCAL_LASZIP_VARIABLE_CHUNK && chunk > 0 )
+    {
+        CPLDebug( "BCAL", "decoding %s as read, in chunks of %u points",
+                  las->path, chunk );
+        las->chunk_points = chunk;
+        return CE_None;
+    }
+
+    path = strdup( CPLGenerateTempFilename( "bcal_laz" ) );
+    if( path == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory, "Failed to allocate path" );
+        return CE_Failure;
+    }
+    memset( &job, 0, sizeof( job ) );
+    if( write_layout( las, path, &job.point_offset ) != CE_None )
+    {
+        free( path );
+        return CE_Failure;
+    }
+    if( bcal_map_open( path, TRUE, &out ) != CE_None )
+    {
+        VSIUnlink( path );
+        free( path );
+        return CE_Failure;
+    }
+
+    /*
+    ** Runs are whole chunks.  Pointwise compression has no chunks to seek
+    ** to, and variable chunks are of unknown size, so a seek may decode a
+    ** partial chunk; both are still correct.
+    */
+    job.las = las;
+    job.out = &out;
+    jobs = jobs > 0 ? jobs : 1;
+    if( compressor == BCAL_LASZIP_POINTWISE )
+    {
+        job.run = las->h.n_points;
+    }
+    else
+    {
+        job.run = (las->h.n_points + jobs * BCAL_LAZ_RUNS_PER_JOB - 1) /
+                  (jobs * BCAL_LAZ_RUNS_PER_JOB);
+        if( chunk != BCAL_LASZIP_VARIABLE_CHUNK && chunk > 0 )
+        {
+            job.run = (job.run + chunk - 1) / chunk * chunk;
+        }
+    }
+    job.run = job.run > 0 ? job.run : 1;
+    runs = (uint32)((las->h.n_points + job.run - 1) / job.run);
+    CPLDebug( "BCAL", "decompressing %s in %u runs of %llu points",
+              las->path, runs, (unsigned long long)job.run );
+    eErr = bcal_pool_run( jobs, runs, decode_run, &job );
+
+    /*
+    ** Nothing needs flushing, the copy is removed on close.  The dirty pages
+    ** stay in the page cache for the read only map below.
+    */
+    out.writable = FALSE;
+    bcal_map_close( &out );
+    if( eErr != CE_None || bcal_las_open( path, &tmp ) != CE_None )
+    {
+        VSIUnlink( path );
+        free( path );
+        return CE_Failure;
+    }
+    /* The copy stands in for the input, under the input's name */
+    free( tmp.path );
+    tmp.path = las->path;
+    tmp.decoded = path;
+    tmp.index = las->index;
+    las->path = NULL;
+    las->index = NULL;
+    bcal_las_close( las );
+    *las = tmp;
+    return CE_None;
+#else
+    (void)jobs;
+    (void)stream;
+    if( !las->h.compressed )
+    {
+        return CE_None;
+    }
+    CPLError( CE_Failure, CPLE_NotSupported,
+              "%s is compressed, and bcal was built without LASzip "
+              "(BCAL_WITH_LASZIP)", las->path );
+    return CE_Failure;
+#endif /* BCAL_HAVE_LASZIP */
+}
+
+/*
+** bcal_laz_decode decodes count points from start of a laz input left
+** compressed by bcal_las_decompress into recs, as the records of an
+** uncompressed copy would hold them.
+*/
+CPLErr bcal_laz_decode( const bcal_las *las, uint64 start, uint64 count,
+                        uint8 *recs )
+{
+#ifdef BCAL_HAVE_LASZIP
+    return decode( las, start, start + count, recs );
+#else
+    (void)start;
+    (void)count;
+    (void)recs;
+    CPLError( CE_Failure, CPLE_NotSupported,
+              "%s is compressed, and bcal was built without LASzip "
+              "(BCAL_WITH_LASZIP)", las->path );
+    return CE_Failure;
+#endif /* BCAL_HAVE_LASZIP */
+}
@@ -0,0 +1,136 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** map provides a whole file view for the las reader and writer.  On posix
+** systems and windows the file is memory mapped, so reading a point costs a
+** page fault at worst rather than a feature allocation.
+*/
+
+#include "bcal_las.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+CPLErr bcal_map_open( const char *path, int writable, bcal_map *m )
+{
+    HANDLE hFile, hMap;
+    LARGE_INTEGER size;
+    memset( m, 0, sizeof( bcal_map ) );
+    hFile = CreateFileA( path,
+                         writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+                         FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL, NULL );
+    if( hFile == INVALID_HANDLE_VALUE )
+    {
+        CPLError( CE_Failure, CPLE_OpenFailed, "Failed to open %s", path );
+        return CE_Failure;
+    }
+    if( !GetFileSizeEx( hFile, &size ) || size.QuadPart == 0 )
+    {
+        CPLError( CE_Failure, CPLE_FileIO, "Failed to size %s", path );
+        CloseHandle( hFile );
+        return CE_Failure;
+    }
+    hMap = CreateFileMappingA( hFile, NULL,
+                               writable ? PAGE_READWRITE : PAGE_READONLY,
+                               0, 0, NULL );
+    CloseHandle( hFile );
+    if( hMap == NULL )
+    {
+        CPLError( CE_Failure, CPLE_FileIO, "Failed to map %s", path );
+        return CE_Failure;
+    }
+    m->data = MapViewOfFile( hMap,
+                             writable ? FILE_MAP_WRITE : FILE_MAP_READ,
+                             0, 0, 0 );
+    if( m->data == NULL )
+    {
+        CPLError( CE_Failure, CPLE_FileIO, "Failed to map %s", path );
+        CloseHandle( hMap );
+        return CE_Failure;
+    }
+    m->size = (uint64)size.QuadPart;
+    m->writable = writable;
+    m->handle = hMap;
+    return CE_None;
+}
+
+void bcal_map_close( bcal_map *m )
+{
+    if( m->data != NULL )
+    {
+        if( m->writable )
+        {
+            FlushViewOfFile( m->data, 0 );
+        }
+        UnmapViewOfFile( m->data );
+        CloseHandle( (HANDLE)m->handle );
+    }
+    memset( m, 0, sizeof( bcal_map ) );
+}
+
+#else /* _WIN32 */
+
+CPLErr bcal_map_open( const char *path, int writable, bcal_map *m )
+{
+    struct stat st;
+    int fd;
+    memset( m, 0, sizeof( bcal_map ) );
+    fd = open( path, writable ? O_RDWR : O_RDONLY );
+    if( fd < 0 )
+    {
+        CPLError( CE_Failure, CPLE_OpenFailed, "Failed to open %s", path );
+        return CE_Failure;
+    }
+    if( fstat( fd, &st ) != 0 || st.st_size == 0 )
+    {
+        CPLError( CE_Failure, CPLE_FileIO, "Failed to size %s", path );
+        close( fd );
+        return CE_Failure;
+    }
+    m->data = mmap( NULL, (size_t)st.st_size,
+                    writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                    MAP_SHARED, fd, 0 );
+    /* The mapping holds its own reference to the file. */
+    close( fd );
+    if( m->data == MAP_FAILED )
+    {
+        CPLError( CE_Failure, CPLE_FileIO, "Failed to map %s", path );
+        m->data = NULL;
+        return CE_Failure;
+    }
+    /* Points are decoded front to back, but patched in any order. */
+    if( !writable )
+    {
+        madvise( m->data, (size_t)st.st_size, MADV_SEQUENTIAL );
+    }
+    m->size = (uint64)st.st_size;
+    m->writable = writable;
+    return CE_None;
+}
+
+void bcal_map_close( bcal_map *m )
+{
+    if( m->data != NULL )
+    {
+        if( m->writable )
+        {
+            msync( m->data, (size_t)m->size, MS_SYNC );
+        }
+        munmap( m->data, (size_t)m->size );
+    }
+    memset( m, 0, sizeof( bcal_map ) );
+}
+
+#endif /* _WIN32 */
+
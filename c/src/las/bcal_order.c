@@ -0,0 +1,197 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** order sorts the records of an output copy along a space filling curve
+** through the cells of a grid, so points close in space are close in the
+** file and a reader of an envelope touches few pages.  Morton (Z) order is
+** cheap to compute, Hilbert order never jumps between cells that are not
+** neighbours.  Records of a cell keep their order.
+**
+** Each record gets one 64 bit value, its curve key above its record
+** number, so a single sort of those values is stable and gives the
+** permutation.  Keys of fine grids lose their lowest bits to fit, which
+** only coarsens the curve.  The records are then moved in place through
+** the writable map, following the cycles of the permutation.
+*/
+
+#include <math.h>
+
+#include "bcal_las.h"
+
+#include "cpl_port.h"
+
+/* Spread the 32 bits of v over the even bits of the result. */
+static uint64 spread( uint32 v )
+{
+    uint64 x = v;
+    x = (x | (x << 16)) & UINT64_C(0x0000ffff0000ffff);
+    x = (x | (x << 8)) & UINT64_C(0x00ff00ff00ff00ff);
+    x = (x | (x << 4)) & UINT64_C(0x0f0f0f0f0f0f0f0f);
+    x = (x | (x << 2)) & UINT64_C(0x3333333333333333);
+    x = (x | (x << 1)) & UINT64_C(0x5555555555555555);
+    return x;
+}
+
+/* bcal_morton interleaves the bits of col and row, col in the low bit. */
+uint64 bcal_morton( uint32 col, uint32 row )
+{
+    return spread( col ) | (spread( row ) << 1);
+}
+
+/*
+** bcal_hilbert returns the distance of col, row along the Hilbert curve
+** through a 2^bits by 2^bits grid, bits at most 32, from 0, 0 to
+** 2^bits - 1, 0.
+*/
+uint64 bcal_hilbert( uint32 col, uint32 row, int bits )
+{
+    uint64 n = (uint64)1 << bits;
+    uint64 x = col, y = row, s, rx, ry, t, d = 0;
+    for( s = n / 2; s > 0; s /= 2 )
+    {
+        rx = (x & s) > 0;
+        ry = (y & s) > 0;
+        d += s * s * ((3 * rx) ^ ry);
+        /* Rotate the quadrant so the curve inside it starts at its origin */
+        if( ry == 0 )
+        {
+            if( rx == 1 )
+            {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            t = x;
+            x = y;
+            y = t;
+        }
+    }
+    return d;
+}
+
+static int compare_u64( const void *a, const void *b )
+{
+    uint64 ua = *(const uint64*)a;
+    uint64 ub = *(const uint64*)b;
+    return ua < ub ? -1 : ua > ub;
+}
+
+static int32 get_i32( const uint8 *b )
+{
+    int32 v;
+    memcpy( &v, b, sizeof( v ) );
+    CPL_LSBPTR32( &v );
+    return v;
+}
+
+/* Cell of a coordinate, clamped to the grid of last + 1 cells */
+static uint32 grid_cell( double v, double min, double cell, uint32 last )
+{
+    double c = (v - min) / cell;
+    return c > 0 ? (c < last ? (uint32)c : last) : 0;
+}
+
+/*
+** bcal_las_sort sorts the records of w by the order of their cell along
+** the curve, BCAL_ORDER_MORTON or BCAL_ORDER_HILBERT, in a grid of cells
+** of the given size over env, rows from the south.  Points off env are in
+** the edge cells.  Needs 8 bytes per point and a bit per point.
+*/
+CPLErr bcal_las_sort( bcal_las_writer *w, const OGREnvelope *env,
+                      double cell, int order )
+{
+    uint8 *base = w->map.data + w->point_offset;
+    uint8 *tmp, *visited;
+    uint64 *v, n = w->n_points, k, i, j, key;
+    uint32 nx, ny, col, row;
+    int bits = 0, rec_bits = 0, shift;
+    double x, y;
+    if( order == BCAL_ORDER_INPUT || n < 2 )
+    {
+        return CE_None;
+    }
+    if( !(cell > 0) || !(env->MaxX >= env->MinX) ||
+        !(env->MaxY >= env->MinY) )
+    {
+        CPLError( CE_Failure, CPLE_IllegalArg,
+                  "Invalid grid to sort %s", w->path );
+        return CE_Failure;
+    }
+    nx = (uint32)fmin( ceil( (env->MaxX - env->MinX) / cell ), UINT32_MAX );
+    ny = (uint32)fmin( ceil( (env->MaxY - env->MinY) / cell ), UINT32_MAX );
+    nx = nx > 0 ? nx : 1;
+    ny = ny > 0 ? ny : 1;
+    while( bits < 32 && ((uint64)1 << bits) < (nx > ny ? nx : ny) )
+    {
+        bits++;
+    }
+    while( rec_bits < 64 && (n - 1) >> rec_bits != 0 )
+    {
+        rec_bits++;
+    }
+    shift = 2 * bits + rec_bits > 64 ? 2 * bits + rec_bits - 64 : 0;
+
+    v = malloc( sizeof( uint64 ) * n );
+    tmp = malloc( w->point_length );
+    visited = calloc( n / 8 + 1, 1 );
+    if( v == NULL || tmp == NULL || visited == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate the sort of %llu points",
+                  (unsigned long long)n );
+        free( v );
+        free( tmp );
+        free( visited );
+        return CE_Failure;
+    }
+    for( k = 0; k < n; k++ )
+    {
+        x = get_i32( base + k * w->point_length ) * w->scale[0] +
+            w->offset[0];
+        y = get_i32( base + k * w->point_length + 4 ) * w->scale[1] +
+            w->offset[1];
+        col = grid_cell( x, env->MinX, cell, nx - 1 );
+        row = grid_cell( y, env->MinY, cell, ny - 1 );
+        key = order == BCAL_ORDER_HILBERT ? bcal_hilbert( col, row, bits ) :
+                                            bcal_morton( col, row );
+        v[k] = rec_bits < 64 ? (key >> shift) << rec_bits | k : k;
+    }
+    qsort( v, n, sizeof( uint64 ), compare_u64 );
+    for( k = 0; k < n && rec_bits < 64; k++ )
+    {
+        v[k] &= ((uint64)1 << rec_bits) - 1;
+    }
+
+    /*
+    ** Record k takes record v[k].  Each cycle is moved with one record
+    ** held aside.
+    */
+    for( k = 0; k < n; k++ )
+    {
+        if( visited[k / 8] & (1 << (k % 8)) )
+        {
+            continue;
+        }
+        memcpy( tmp, base + k * w->point_length, w->point_length );
+        for( i = k; ; i = j )
+        {
+            visited[i / 8] |= (uint8)(1 << (i % 8));
+            j = v[i];
+            if( j == k )
+            {
+                memcpy( base + i * w->point_length, tmp, w->point_length );
+                break;
+            }
+            memcpy( base + i * w->point_length, base + j * w->point_length,
+                    w->point_length );
+        }
+    }
+    free( v );
+    free( tmp );
+    free( visited );
+    CPLDebug( "BCAL", "sorted %s along a %s curve over %ux%u cells",
+              w->path, order == BCAL_ORDER_HILBERT ? "Hilbert" : "Morton",
+              nx, ny );
+    return CE_None;
+}
@@ -0,0 +1,201 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** write produces the filter output as a copy of the input with only the
+** classification and point source ID (height) of each record rewritten.
+** The copy is one sequential pass, copy_file_range on linux so the data
+** need not pass through user space, and the patches go through a writable
+** map of the copy.
+*/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "bcal_las.h"
+
+#include "cpl_port.h"
+#include "cpl_vsi.h"
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#if defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define BCAL_HAVE_COPY_FILE_RANGE
+#endif
+#endif
+
+/* Bytes written per call when copying through user space */
+#define BCAL_COPY_CHUNK (8 * 1024 * 1024)
+
+#ifdef BCAL_HAVE_COPY_FILE_RANGE
+/*
+** Copy with copy_file_range.  Returns CE_Warning if the file system does not
+** support it and nothing was copied, so the caller can fall back.
+*/
+static CPLErr copy_range( const bcal_las *src, const char *path )
+{
+    uint64 done = 0;
+    ssize_t n;
+    int in, out;
+    in = open( src->decoded != NULL ? src->decoded : src->path, O_RDONLY );
+    if( in < 0 )
+    {
+        return CE_Warning;
+    }
+    out = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0666 );
+    if( out < 0 )
+    {
+        close( in );
+        CPLError( CE_Failure, CPLE_OpenFailed, "Failed to create %s", path );
+        return CE_Failure;
+    }
+    while( done < src->map.size )
+    {
+        n = copy_file_range( in, NULL, out, NULL,
+                             (size_t)(src->map.size - done), 0 );
+        if( n <= 0 )
+        {
+            break;
+        }
+        done += (uint64)n;
+    }
+    close( in );
+    if( close( out ) != 0 || (done > 0 && done < src->map.size) )
+    {
+        CPLError( CE_Failure, CPLE_FileIO, "Failed to write %s", path );
+        return CE_Failure;
+    }
+    return done == src->map.size ? CE_None : CE_Warning;
+}
+#endif /* BCAL_HAVE_COPY_FILE_RANGE */
+
+/*
+** Copy by writing the mapped input, for platforms and file systems without
+** copy_file_range.
+*/
+static CPLErr copy_map( const bcal_las *src, const char *path )
+{
+    uint64 done = 0;
+    size_t n;
+    int ok = 1;
+    VSILFILE *fp = VSIFOpenL( path, "wb" );
+    if( fp == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OpenFailed, "Failed to create %s", path );
+        return CE_Failure;
+    }
+    while( ok && done < src->map.size )
+    {
+        n = src->map.size - done > BCAL_COPY_CHUNK ?
+            BCAL_COPY_CHUNK : (size_t)(src->map.size - done);
+        ok = VSIFWriteL( src->map.data + done, 1, n, fp ) == n;
+        done += n;
+    }
+    if( VSIFCloseL( fp ) != 0 || !ok )
+    {
+        CPLError( CE_Failure, CPLE_FileIO, "Failed to write %s", path );
+        return CE_Failure;
+    }
+    return CE_None;
+}
+
+/*
+** Whether path names the file of src, by another name, a link or the same
+** name.  Copying over it would truncate the mapped input.
+*/
+static int same_file( const bcal_las *src, const char *path )
+{
+    VSIStatBufL in, out;
+    if( strcmp( src->path, path ) == 0 )
+    {
+        return TRUE;
+    }
+    return VSIStatL( src->path, &in ) == 0 && VSIStatL( path, &out ) == 0 &&
+           in.st_dev == out.st_dev && in.st_ino == out.st_ino;
+}
+
+/*
+** bcal_las_create_copy copies src to path and maps the copy for
+** bcal_las_patch.  Release with bcal_las_writer_close.
+*/
+CPLErr bcal_las_create_copy( const bcal_las *src, const char *path,
+                             bcal_las_writer *w )
+{
+    CPLErr eErr = CE_Warning;
+    memset( w, 0, sizeof( bcal_las_writer ) );
+    if( same_file( src, path ) )
+    {
+        CPLError( CE_Failure, CPLE_IllegalArg,
+                  "The output must not be the input, %s", path );
+        return CE_Failure;
+    }
+#ifdef BCAL_HAVE_COPY_FILE_RANGE
+    eErr = copy_range( src, path );
+#endif
+    if( eErr == CE_Warning )
+    {
+        eErr = copy_map( src, path );
+    }
+    if( eErr != CE_None ||
+        bcal_map_open( path, TRUE, &w->map ) != CE_None )
+    {
+        return CE_Failure;
+    }
+    if( w->map.size != src->map.size )
+    {
+        CPLError( CE_Failure, CPLE_FileIO, "Failed to copy %s", path );
+        bcal_map_close( &w->map );
+        return CE_Failure;
+    }
+    w->path = strdup( path );
+    w->point_format = src->h.point_format;
+    w->point_length = src->h.point_length;
+    w->point_offset = src->h.point_offset;
+    w->n_points = src->h.n_points;
+    memcpy( w->scale, src->h.scale, sizeof( w->scale ) );
+    memcpy( w->offset, src->h.offset, sizeof( w->offset ) );
+    return CE_None;
+}
+
+/*
+** bcal_las_patch sets the classification and height of record fid.  Formats
+** 0-5 keep the synthetic, key point and withheld flags that share the
+** classification byte.  Records are disjoint, so different fids can be
+** patched from several threads.
+*/
+void bcal_las_patch( bcal_las_writer *w, uint64 fid, uint8 c, uint16 h )
+{
+    uint8 *rec = w->map.data + w->point_offset + fid * w->point_length;
+    CPL_LSBPTR16( &h );
+    if( w->point_format < 6 )
+    {
+        rec[15] = (uint8)((rec[15] & 0xe0) | (c & 0x1f));
+        memcpy( rec + 18, &h, sizeof( h ) );
+    }
+    else
+    {
+        rec[16] = c;
+        memcpy( rec + 20, &h, sizeof( h ) );
+    }
+}
+
+/*
+** bcal_las_writer_close flushes the patches and closes the copy.  If
+** discard is set, the copy is removed.
+*/
+void bcal_las_writer_close( bcal_las_writer *w, int discard )
+{
+    bcal_map_close( &w->map );
+    if( discard && w->path != NULL )
+    {
+        VSIUnlink( w->path );
+    }
+    free( w->path );
+    w->path = NULL;
+}
+
@@ -0,0 +1,431 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** kernel holds the loops that add the points of a chunk to the
+** accumulators of bcal metrics.  The kernels of a raster are picked once,
+** by bcal_metrics_kernels from its plan, so the loops test the points and
+** never the products:
+**
+**   - a pass bins every point to its pixel, or drops it
+**   - per set of points in the plan, a pass gathers the pixels and values
+**     of its points, then each kernel of the set runs over them
+**
+** The stats kernels are instances of one loop, for min/max or not and
+** for the sums of the first 0, 1, 2 or 4 powers, and the plan is rounded
+** up to these.  The others add heights to their counts by stratum, to the
+** sketch, the user data and last returns of all points, and the ground
+** points to the sums of the plane fits of their pixels.
+*/
+
+#include <math.h>
+
+#include "bcal_metrics.h"
+
+#if defined(__GNUC__)
+#define BCAL_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define BCAL_INLINE __forceinline
+#else
+#define BCAL_INLINE inline
+#endif
+
+/* The pixel of a point that is not gridded */
+#define NO_PIXEL UINT64_MAX
+
+/* Upper bounds of the strata of VegMetrics_BCAL.pro, the last is open */
+static const double strata[] = { 1., 2.5, 10., 20., 30. };
+
+/*
+** Add the n gathered values of a to the stats of set, with the min/max and
+** power sums the constant arguments ask for.
+*/
+static BCAL_INLINE void add_stats( bcal_metrics_acc *a, int set, uint32 n,
+                                   const int minmax, const int order )
+{
+    bcal_metrics_stats *st = a->set + set;
+    const uint64 *pix = a->pix;
+    const int32 *x = a->value;
+    double d, d2;
+    uint64 k;
+    uint32 i;
+    for( i = 0; i < n; i++ )
+    {
+        k = pix[i];
+        st->n[k]++;
+        if( minmax )
+        {
+            st->min[k] = x[i] < st->min[k] ? x[i] : st->min[k];
+            st->max[k] = x[i] > st->max[k] ? x[i] : st->max[k];
+        }
+        if( order >= 1 )
+        {
+            d = x[i];
+            st->s1[k] += d;
+        }
+        if( order >= 2 )
+        {
+            d2 = d * d;
+            st->s2[k] += d2;
+        }
+        if( order >= 4 )
+        {
+            st->s3[k] += d2 * d;
+            st->s4[k] += d2 * d2;
+        }
+    }
+}
+
+#define STATS_KERNEL( name, minmax, order )                           \
+    static CPLErr name( const bcal_metrics_file *v, bcal_metrics_acc *a, \
+                        int set, uint32 n )                           \
+    {                                                                 \
+        (void)v;                                                      \
+        add_stats( a, set, n, minmax, order );                        \
+        return CE_None;                                               \
+    }
+
+STATS_KERNEL( stats_n, FALSE, 0 )
+STATS_KERNEL( stats_m1, FALSE, 1 )
+STATS_KERNEL( stats_m2, FALSE, 2 )
+STATS_KERNEL( stats_m4, FALSE, 4 )
+STATS_KERNEL( stats_minmax, TRUE, 0 )
+STATS_KERNEL( stats_minmax_m1, TRUE, 1 )
+STATS_KERNEL( stats_minmax_m2, TRUE, 2 )
+STATS_KERNEL( stats_minmax_m4, TRUE, 4 )
+
+/* By min/max, then by the powers summed, 0, 1, 2 or 4 */
+static const bcal_metrics_kernel stats_kernels[2][4] =
+{
+    { stats_n, stats_m1, stats_m2, stats_m4 },
+    { stats_minmax, stats_minmax_m1, stats_minmax_m2, stats_minmax_m4 }
+};
+
+/* Count the gathered heights by range, and sum those under the crown */
+static BCAL_INLINE void add_counts( const bcal_metrics_file *v,
+                                    bcal_metrics_acc *a, uint32 n,
+                                    const int under )
+{
+    const double zs = v->r.m.h.scale[2];
+    const double ground = v->b.ground, crown = v->b.crown;
+    const uint64 *pix = a->pix;
+    const int32 *h = a->value;
+    double hm, x;
+    uint64 k;
+    uint32 i;
+    int s;
+    for( i = 0; i < n; i++ )
+    {
+        k = pix[i];
+        hm = h[i] * zs;
+        a->counts[BCAL_VEG_GROUND][k] += hm <= ground;
+        a->counts[BCAL_VEG_UNDER][k] += hm > ground && hm <= crown;
+        a->counts[BCAL_VEG_CROWN][k] += hm > crown;
+        if( under && hm > ground && hm <= crown )
+        {
+            x = h[i];
+            a->under_s1[k] += x;
+            a->under_s2[k] += x * x;
+        }
+        if( h[i] > 0 )
+        {
+            a->counts[BCAL_VEG_ABOVE0][k]++;
+            for( s = 0; s < 5 && hm > strata[s]; s++ )
+            {
+            }
+            a->counts[BCAL_VEG_STRATA + s][k]++;
+        }
+    }
+}
+
+static CPLErr counts( const bcal_metrics_file *v, bcal_metrics_acc *a,
+                      int set, uint32 n )
+{
+    (void)set;
+    add_counts( v, a, n, FALSE );
+    return CE_None;
+}
+
+static CPLErr counts_under( const bcal_metrics_file *v, bcal_metrics_acc *a,
+                            int set, uint32 n )
+{
+    (void)set;
+    add_counts( v, a, n, TRUE );
+    return CE_None;
+}
+
+static CPLErr sketch( const bcal_metrics_file *v, bcal_metrics_acc *a,
+                      int set, uint32 n )
+{
+    uint32 i;
+    (void)v;
+    (void)set;
+    for( i = 0; i < n; i++ )
+    {
+        if( bcal_sketch_add( &a->sketch, a->pix[i],
+                             (uint16)a->value[i] ) != CE_None )
+        {
+            return CE_Failure;
+        }
+    }
+    return CE_None;
+}
+
+static CPLErr user( const bcal_metrics_file *v, bcal_metrics_acc *a,
+                    int set, uint32 n )
+{
+    const uint8 *u = a->p.user;
+    uint32 i;
+    (void)v;
+    (void)set;
+    for( i = 0; i < n; i++ )
+    {
+        a->user[a->pix[i]] += u[a->member[i]];
+    }
+    return CE_None;
+}
+
+static CPLErr last( const bcal_metrics_file *v, bcal_metrics_acc *a,
+                    int set, uint32 n )
+{
+    const uint8 *r = a->p.r, *nr = a->p.n_returns;
+    uint32 i, j;
+    (void)v;
+    (void)set;
+    for( i = 0; i < n; i++ )
+    {
+        j = a->member[i];
+        a->last[a->pix[i]] += r[j] == nr[j];
+    }
+    return CE_None;
+}
+
+/*
+** Add the gathered ground points to the sums of the plane fits of their
+** pixels, from the centre of the pixel in x and y and from the lowest
+** point of the inputs in z.
+*/
+static CPLErr plane( const bcal_metrics_file *v, bcal_metrics_acc *a,
+                     int set, uint32 n )
+{
+    const bcal_points *p = &a->p;
+    const uint64 nx = v->r.nx;
+    const double cell = v->r.cell, z0 = v->r.m.h.min[2];
+    const double x0 = v->r.min_x + 0.5 * cell;
+    const double y0 = v->r.max_y - (a->lo + 0.5) * cell;
+    double *const *s = a->plane;
+    double x, y, z;
+    uint64 k;
+    uint32 i, j;
+    (void)set;
+    for( i = 0; i < n; i++ )
+    {
+        k = a->pix[i];
+        j = a->member[i];
+        x = bcal_points_x( p, j ) - x0 - (double)(k % nx) * cell;
+        y = bcal_points_y( p, j ) - y0 + (double)(k / nx) * cell;
+        z = bcal_points_z( p, j ) - z0;
+        s[BCAL_PLANE_SX][k] += x;
+        s[BCAL_PLANE_SY][k] += y;
+        s[BCAL_PLANE_SZ][k] += z;
+        s[BCAL_PLANE_SXX][k] += x * x;
+        s[BCAL_PLANE_SXY][k] += x * y;
+        s[BCAL_PLANE_SYY][k] += y * y;
+        s[BCAL_PLANE_SXZ][k] += x * z;
+        s[BCAL_PLANE_SYZ][k] += y * z;
+        s[BCAL_PLANE_SZZ][k] += z * z;
+    }
+    return CE_None;
+}
+
+/*
+** bcal_metrics_round rounds the stats of a plan of set up to those a kernel
+** keeps.
+*/
+uint32 bcal_metrics_round( uint32 plan )
+{
+    if( plan & (BCAL_STAT_MIN | BCAL_STAT_MAX) )
+    {
+        plan |= BCAL_STAT_MIN | BCAL_STAT_MAX;
+    }
+    if( plan & (BCAL_STAT_S3 | BCAL_STAT_S4) )
+    {
+        plan |= BCAL_STAT_S1 | BCAL_STAT_S2 | BCAL_STAT_S3 | BCAL_STAT_S4;
+    }
+    if( plan & BCAL_STAT_S2 )
+    {
+        plan |= BCAL_STAT_S1;
+    }
+    if( plan & BCAL_STAT_UNDER )
+    {
+        plan |= BCAL_STAT_COUNTS;
+    }
+    return plan;
+}
+
+/*
+** bcal_metrics_kernels sets kernels[s] to the kernels of set s of a
+** rounded plan, ending with NULL, and kernels[s][0] to NULL for the sets
+** not in use.
+*/
+void bcal_metrics_kernels( const uint32 *plan,
+                           bcal_metrics_kernel
+                           kernels[BCAL_SETS][BCAL_SET_KERNELS] )
+{
+    int s, j, order;
+    memset( kernels, 0, sizeof( bcal_metrics_kernel ) * BCAL_SETS *
+                        BCAL_SET_KERNELS );
+    for( s = 0; s < BCAL_SETS; s++ )
+    {
+        if( plan[s] == 0 )
+        {
+            continue;
+        }
+        order = plan[s] & BCAL_STAT_S4 ? 3 :
+                plan[s] & BCAL_STAT_S2 ? 2 :
+                plan[s] & BCAL_STAT_S1 ? 1 : 0;
+        j = 0;
+        kernels[s][j++] =
+            stats_kernels[(plan[s] & BCAL_STAT_MIN) != 0][order];
+        if( plan[s] & BCAL_STAT_COUNTS )
+        {
+            kernels[s][j++] = plan[s] & BCAL_STAT_UNDER ? counts_under :
+                                                          counts;
+        }
+        if( plan[s] & BCAL_STAT_SKETCH )
+        {
+            kernels[s][j++] = sketch;
+        }
+        if( plan[s] & BCAL_STAT_USER )
+        {
+            kernels[s][j++] = user;
+        }
+        if( plan[s] & BCAL_STAT_LAST )
+        {
+            kernels[s][j++] = last;
+        }
+        if( plan[s] & BCAL_STAT_PLANE )
+        {
+            kernels[s][j++] = plane;
+        }
+    }
+}
+
+/*
+** Bin the points of a to the pixels of rows lo to hi, returns how many are
+** in rows row to row + rows - 1.
+*/
+static uint32 bin_points( const bcal_metrics_file *v, bcal_metrics_acc *a,
+                          uint32 lo, uint32 hi, uint32 row, uint32 rows )
+{
+    const bcal_points *p = &a->p;
+    const int return_num = v->b.return_num;
+    uint32 i, col, r, n = 0;
+    for( i = 0; i < p->n; i++ )
+    {
+        if( (return_num > 0 && p->r[i] != return_num) ||
+            !bcal_raster_pixel( &v->r, p, i, &r, &col ) || r < lo ||
+            r >= hi )
+        {
+            a->bin[i] = NO_PIXEL;
+            continue;
+        }
+        a->bin[i] = (uint64)(r - lo) * v->r.nx + col;
+        n += r >= row && r < row + rows;
+    }
+    return n;
+}
+
+/*
+** Gather the pixels, values and indices in p of the binned points of set,
+** returns how many.  Called with a constant set, each is a loop of its own.
+*/
+static BCAL_INLINE uint32 gather_set( const bcal_metrics_file *v,
+                                      bcal_metrics_acc *a, const int set )
+{
+    const bcal_points *p = &a->p;
+    const uint64 *bin = a->bin;
+    const uint16 *h = p->h;
+    const double ground = v->b.ground, zs = v->r.m.h.scale[2];
+    uint32 i, m = 0;
+    int keep;
+    for( i = 0; i < p->n; i++ )
+    {
+        if( set == BCAL_SET_H )
+        {
+            keep = h[i] != BCAL_LAS_NO_HEIGHT;
+            a->value[m] = h[i];
+        }
+        else if( set == BCAL_SET_I || set == BCAL_SET_IV ||
+                 set == BCAL_SET_IB )
+        {
+            keep = set == BCAL_SET_I ||
+                   (h[i] != BCAL_LAS_NO_HEIGHT &&
+                    (h[i] * zs > ground) == (set == BCAL_SET_IV));
+            a->value[m] = p->intensity[i];
+        }
+        else
+        {
+            keep = set == BCAL_SET_Z || p->c[i] == BCAL_CLASS_GROUND;
+            a->value[m] = p->z[i];
+        }
+        /* Written either way, and kept by moving on */
+        a->pix[m] = bin[i];
+        a->member[m] = i;
+        m += keep && bin[i] != NO_PIXEL;
+    }
+    return m;
+}
+
+static uint32 gather( const bcal_metrics_file *v, bcal_metrics_acc *a,
+                      int set )
+{
+    switch( set )
+    {
+    case BCAL_SET_H:
+        return gather_set( v, a, BCAL_SET_H );
+    case BCAL_SET_I:
+        return gather_set( v, a, BCAL_SET_I );
+    case BCAL_SET_IV:
+        return gather_set( v, a, BCAL_SET_IV );
+    case BCAL_SET_IB:
+        return gather_set( v, a, BCAL_SET_IB );
+    case BCAL_SET_Z:
+        return gather_set( v, a, BCAL_SET_Z );
+    default:
+        return gather_set( v, a, BCAL_SET_ZB );
+    }
+}
+
+/*
+** bcal_metrics_kernels_run adds the points of a->p, at most
+** BCAL_RASTER_READ_BLOCK, to the accumulators of a, which start at row lo
+** and end before hi, with the kernels of v.  Only the points of rows row
+** to row + rows - 1 are counted.
+*/
+CPLErr bcal_metrics_kernels_run( const bcal_metrics_file *v,
+                                 bcal_metrics_acc *a, uint32 lo, uint32 hi,
+                                 uint32 row, uint32 rows )
+{
+    uint32 n;
+    int s, j;
+    a->lo = lo;
+    a->n_points += bin_points( v, a, lo, hi, row, rows );
+    for( s = 0; s < BCAL_SETS; s++ )
+    {
+        if( v->kernels[s][0] == NULL )
+        {
+            continue;
+        }
+        n = gather( v, a, s );
+        for( j = 0; j < BCAL_SET_KERNELS && v->kernels[s][j] != NULL; j++ )
+        {
+            if( v->kernels[s][j]( v, a, s, n ) != CE_None )
+            {
+                return CE_Failure;
+            }
+        }
+    }
+    return CE_None;
+}
@@ -0,0 +1,1254 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** metrics grids the points of las files filtered with bcal filter into the
+** products of VegMetrics_BCAL.pro, IntensityMetrics_BCAL.pro,
+** TopoRasterAll_BCAL.pro, TopoRasterBare_BCAL.pro and DEMLAS_BCAL.pro, a
+** band of the output per product.  Each of those reads the points again,
+** gathers those of each pixel and computes its products from them.  Here
+** the points are read once for any mix of the products.  Each pixel keeps
+** fixed size accumulators, only those the plan of the products needs, see
+** bcal_plan.c.  The points read are added to them by kernels picked once
+** from the plan, see bcal_kernel.c:
+**
+**   - per set of points, heights, intensities or elevations, their count,
+**     minimum and maximum, and sums of the first to fourth powers of their
+**     values, from which the mean, variance, skewness and kurtosis follow
+**   - counts of the heights in the ground, crown and strata ranges, and the
+**     sums of the heights between the ground and crown thresholds, for the
+**     cover, density, strata and texture products
+**   - a quantile sketch of the heights, see bcal_sketch.c, for the
+**     percentiles, MAD, AAD and FHD
+**   - the count of last returns and the sum of the user data
+**   - per pixel, the sums of the normal equations of the plane of its
+**     ground points, for the slope, aspect, TRASP and local roughness, see
+**     bcal_plane.c
+**
+** Accumulators of the same pixels merge by adding them, so -jobs threads
+** each read a share of the records of a band into accumulators of their
+** own, and these are merged before the band is written.  The raster is
+** written in bands of rows bounded by -max_mem.  Without it the whole
+** raster is one band and the inputs are read once.  Each further band
+** reads the inputs again, but an input indexed with bcal index only has
+** the records near the band read.
+**
+** The sketch keeps -sketch bins a pixel.  Products from it are exact in
+** pixels with at most that many points, and close in the others.  With
+** -exact every height of a band is kept instead, and the percentiles are
+** those of VegMetrics_BCAL.pro.
+**
+** With -fill, empty pixels of bareelev take the mean of the ground points
+** of the pixels around them, in windows growing a pixel at a time up to
+** -fill pixels as GetIndex_BCAL.pro grows its search, and failed plane
+** fits are solved again the same way.  The accumulators then also hold
+** -fill rows either side of the band.
+**
+** bcal vegmetrics, bcal dem and bcal topo are bcal metrics writing the
+** vegetation metrics, the bare earth elevation, and the elevation with the
+** plane products of TopoRasterBare_BCAL.pro by default.
+*/
+
+#include <math.h>
+
+#include "bcal_pool.h"
+#include "bcal_metrics.h"
+
+#include "cpl_conv.h"
+#include "cpl_string.h"
+#include "cpl_vsi.h"
+
+static void Usage()
+{
+    const char *family = "";
+    int i;
+    printf(
+"bcal metrics [-jobs n] [-cell f] [-nodata f] [-return n]\n"
+"             [-products p,p,...] [-ground f] [-crown f] [-fhd_bin f]\n"
+"             [-fill n] [-sketch n] [-exact] [-max_mem n]\n"
+"             [-te xmin ymin xmax ymax] [-a_srs srs] [-co NAME=VALUE]\n"
+"             [-list file] input [input ...] output\n"
+"bcal vegmetrics|dem|topo [options as bcal metrics] input [input ...]\n"
+"             output\n"
+"\n"
+"   -jobs           how many threads read the points of each band\n"
+"   -cell           pixel size, default 1.0\n"
+"   -nodata         value of pixels without the points for a product,\n"
+"                   default -9999\n"
+"   -return         only grid this return number, default all\n"
+"   -products       the products or families of them to write, in this\n"
+"                   order, default all.  bcal vegmetrics writes the veg\n"
+"                   family by default, bcal dem bareelev, and bcal topo\n"
+"                   bareslope, bareaspect, baretrasp, barelrough and\n"
+"                   bareelev.\n"
+"   -ground         heights at most this are ground, default 0.15\n"
+"   -crown          heights above this are crown, default 1.37\n"
+"   -fhd_bin        bin height of FHD, default 1.0\n"
+"   -fill           fill empty pixels of bareelev with the mean of the\n"
+"                   ground points up to this many pixels away, and fit\n"
+"                   the planes of pixels with fewer than %d ground points,\n"
+"                   or with them in a line, to those up to this many\n"
+"                   pixels away, default 0 (no fill)\n"
+"   -sketch         bins kept per pixel for percentiles, MAD, AAD and\n"
+"                   FHD, default %d.  These products are exact in pixels\n"
+"                   with at most this many points.\n"
+"   -exact          keep every height of a band instead of a sketch\n"
+"   -max_mem        approximate memory budget in megabytes, for the\n"
+"                   accumulators and output of a band and a block of\n"
+"                   points per job.  The raster is written in bands of\n"
+"                   rows that fit, and each band reads the inputs again.\n"
+"                   Inputs indexed with bcal index only have the records\n"
+"                   near each band read.\n"
+"   -te             extent of the raster, default the bounds of the\n"
+"                   inputs.  Pixels line up with xmin, ymin.\n"
+"   -a_srs          spatial reference of the output, default the WKT of\n"
+"                   the first input\n"
+"   -co             a GeoTIFF creation option, may be repeated\n"
+"   -list           a text file of inputs, one per line\n"
+"   input           a *.las or *.laz file filtered with bcal filter, or a\n"
+"                   directory of them.  The points of all the inputs are\n"
+"                   gridded into one raster.  laz is decoded as each band\n"
+"                   reads it, except laz compressed pointwise or in\n"
+"                   chunks of variable size.  That is decompressed to a\n"
+"                   temporary file (see CPL_TMPDIR) that takes the disk\n"
+"                   of the uncompressed las, for every input at once.\n"
+"   output          the output GeoTIFF, a band per product\n",
+            BCAL_PLANE_MIN_POINTS, BCAL_SKETCH_K );
+    for( i = 0; i < BCAL_METRICS; i++ )
+    {
+        if( strcmp( family, bcal_metrics_family_name( i ) ) != 0 )
+        {
+            family = bcal_metrics_family_name( i );
+            printf( "\n   %s products:\n", family );
+        }
+        printf( "   %-15s %s\n", bcal_metrics_name( i ),
+                bcal_metrics_title( i ) );
+    }
+    exit( 1 );
+}
+
+/* Allocate the arrays of the stats of plan, NULL for the others */
+static int stats_init( bcal_metrics_stats *st, uint32 plan, uint64 pixels )
+{
+    int j;
+    double **s[4];
+    if( plan == 0 )
+    {
+        return TRUE;
+    }
+    st->n = malloc( sizeof( uint32 ) * pixels );
+    if( plan & BCAL_STAT_MIN )
+    {
+        st->min = malloc( sizeof( int32 ) * pixels );
+    }
+    if( plan & BCAL_STAT_MAX )
+    {
+        st->max = malloc( sizeof( int32 ) * pixels );
+    }
+    s[0] = &st->s1;
+    s[1] = &st->s2;
+    s[2] = &st->s3;
+    s[3] = &st->s4;
+    for( j = 0; j < 4; j++ )
+    {
+        if( plan & (BCAL_STAT_S1 << j) )
+        {
+            *s[j] = malloc( sizeof( double ) * pixels );
+            if( *s[j] == NULL )
+            {
+                return FALSE;
+            }
+        }
+    }
+    return st->n != NULL && (st->min != NULL || !(plan & BCAL_STAT_MIN)) &&
+           (st->max != NULL || !(plan & BCAL_STAT_MAX));
+}
+
+static CPLErr acc_init( bcal_metrics_acc *a, const uint32 *plan, uint32 k,
+                        uint64 pixels, const bcal_raster *r )
+{
+    const uint32 h = plan[BCAL_SET_H];
+    int s, j = BCAL_VEG_COUNTS, ok = TRUE;
+    for( s = 0; s < BCAL_SETS; s++ )
+    {
+        ok = ok && stats_init( a->set + s, plan[s], pixels );
+    }
+    if( h & BCAL_STAT_COUNTS )
+    {
+        for( j = 0; j < BCAL_VEG_COUNTS; j++ )
+        {
+            a->counts[j] = malloc( sizeof( uint32 ) * pixels );
+            if( a->counts[j] == NULL )
+            {
+                break;
+            }
+        }
+    }
+    if( h & BCAL_STAT_UNDER )
+    {
+        a->under_s1 = malloc( sizeof( double ) * pixels );
+        a->under_s2 = malloc( sizeof( double ) * pixels );
+        ok = ok && a->under_s1 != NULL && a->under_s2 != NULL;
+    }
+    if( plan[BCAL_SET_Z] & BCAL_STAT_LAST )
+    {
+        a->last = malloc( sizeof( uint32 ) * pixels );
+        ok = ok && a->last != NULL;
+    }
+    if( plan[BCAL_SET_I] & BCAL_STAT_USER )
+    {
+        a->user = malloc( sizeof( double ) * pixels );
+        ok = ok && a->user != NULL;
+    }
+    if( plan[BCAL_SET_ZB] & BCAL_STAT_PLANE )
+    {
+        a->plane[0] = malloc( sizeof( double ) * BCAL_PLANE_SUMS * pixels );
+        for( s = 1; s < BCAL_PLANE_SUMS && a->plane[0] != NULL; s++ )
+        {
+            a->plane[s] = a->plane[0] + s * pixels;
+        }
+        ok = ok && a->plane[0] != NULL;
+    }
+    a->pixels = pixels;
+    a->bin = malloc( sizeof( uint64 ) * BCAL_RASTER_READ_BLOCK );
+    a->pix = malloc( sizeof( uint64 ) * BCAL_RASTER_READ_BLOCK );
+    a->value = malloc( sizeof( int32 ) * BCAL_RASTER_READ_BLOCK );
+    a->member = malloc( sizeof( uint32 ) * BCAL_RASTER_READ_BLOCK );
+    ok = ok && a->bin != NULL && a->pix != NULL && a->value != NULL &&
+         a->member != NULL;
+    bcal_points_init( &a->p, r->m.h.scale, r->m.h.offset );
+    /* Intensities, last returns and user data are only read for these */
+    a->p.attrs = bcal_metrics_attrs( plan );
+    if( !ok || j < BCAL_VEG_COUNTS )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate %llu pixels of accumulators",
+                  (unsigned long long)pixels );
+        return CE_Failure;
+    }
+    if( h & BCAL_STAT_SKETCH )
+    {
+        return bcal_sketch_init( &a->sketch, k, pixels );
+    }
+    return CE_None;
+}
+
+/* Zero the arrays of st that are in use */
+static void stats_reset( bcal_metrics_stats *st, uint64 pixels )
+{
+    uint64 k;
+    double *s[4];
+    int j;
+    if( st->n == NULL )
+    {
+        return;
+    }
+    memset( st->n, 0, sizeof( uint32 ) * pixels );
+    for( k = 0; k < pixels && st->min != NULL; k++ )
+    {
+        st->min[k] = INT32_MAX;
+    }
+    for( k = 0; k < pixels && st->max != NULL; k++ )
+    {
+        st->max[k] = INT32_MIN;
+    }
+    s[0] = st->s1;
+    s[1] = st->s2;
+    s[2] = st->s3;
+    s[3] = st->s4;
+    for( j = 0; j < 4; j++ )
+    {
+        if( s[j] != NULL )
+        {
+            memset( s[j], 0, sizeof( double ) * pixels );
+        }
+    }
+}
+
+static void acc_reset( bcal_metrics_acc *a, uint64 pixels )
+{
+    int j;
+    for( j = 0; j < BCAL_SETS; j++ )
+    {
+        stats_reset( a->set + j, pixels );
+    }
+    for( j = 0; j < BCAL_VEG_COUNTS && a->counts[j] != NULL; j++ )
+    {
+        memset( a->counts[j], 0, sizeof( uint32 ) * pixels );
+    }
+    if( a->under_s1 != NULL )
+    {
+        memset( a->under_s1, 0, sizeof( double ) * pixels );
+        memset( a->under_s2, 0, sizeof( double ) * pixels );
+    }
+    if( a->last != NULL )
+    {
+        memset( a->last, 0, sizeof( uint32 ) * pixels );
+    }
+    if( a->user != NULL )
+    {
+        memset( a->user, 0, sizeof( double ) * pixels );
+    }
+    for( j = 0; j < BCAL_PLANE_SUMS && a->plane[0] != NULL; j++ )
+    {
+        memset( a->plane[j], 0, sizeof( double ) * pixels );
+    }
+    if( a->set[BCAL_SET_H].n != NULL )
+    {
+        bcal_sketch_reset( &a->sketch, pixels );
+    }
+    a->n_points = 0;
+}
+
+static void acc_free( bcal_metrics_acc *a )
+{
+    bcal_metrics_stats *st;
+    int j;
+    for( j = 0; j < BCAL_SETS; j++ )
+    {
+        st = a->set + j;
+        free( st->n );
+        free( st->min );
+        free( st->max );
+        free( st->s1 );
+        free( st->s2 );
+        free( st->s3 );
+        free( st->s4 );
+    }
+    for( j = 0; j < BCAL_VEG_COUNTS; j++ )
+    {
+        free( a->counts[j] );
+    }
+    free( a->under_s1 );
+    free( a->under_s2 );
+    free( a->last );
+    free( a->user );
+    free( a->plane[0] );
+    free( a->bin );
+    free( a->pix );
+    free( a->value );
+    free( a->member );
+    bcal_sketch_free( &a->sketch );
+    bcal_points_free( &a->p );
+    memset( a, 0, sizeof( bcal_metrics_acc ) );
+}
+
+/*
+** bcal_metrics_open opens the inputs of b, plans the accumulators of its
+** products and sizes the raster and the accumulators of each job.  v keeps
+** a shallow copy of b.  Release with bcal_metrics_close, whatever the
+** result.
+*/
+CPLErr bcal_metrics_open( bcal_metrics_file *v, const bcal_metrics_data *b )
+{
+    uint64 pixels, bytes, fixed, budget;
+    int i;
+    memset( v, 0, sizeof( bcal_metrics_file ) );
+    v->b = *b;
+    bcal_metrics_plan( b->products, v->plan );
+    bcal_metrics_kernels( v->plan, v->kernels );
+    for( i = 0; i < BCAL_METRICS && !b->products[i]; i++ )
+    {
+    }
+    if( b->jobs < 1 || !(b->fhd_bin > 0) || b->fill < 0 ||
+        i == BCAL_METRICS )
+    {
+        CPLError( CE_Failure, CPLE_IllegalArg,
+                  "Invalid jobs, FHD bin height, fill or products" );
+        return CE_Failure;
+    }
+    /* Only bareelev and the plane fits look past their pixel */
+    if( b->products[BCAL_DEM_ELEV] || (v->plan[BCAL_SET_ZB] & BCAL_STAT_PLANE) )
+    {
+        v->halo = (uint32)b->fill;
+    }
+    if( bcal_raster_open( &v->r, b->inputs, (uint32)b->jobs,
+                          b->have_env ? &b->env : NULL, b->cell ) != CE_None )
+    {
+        return CE_Failure;
+    }
+    /*
+    ** The read blocks of the jobs come out of the budget first, the rest
+    ** holds the accumulators and the output of a band.
+    */
+    budget = b->max_mem;
+    fixed = bcal_metrics_fixed_bytes( b, v->plan );
+    if( budget > 0 )
+    {
+        budget = budget > fixed ? budget - fixed : 1;
+    }
+    bytes = bcal_metrics_band_bytes( b, v->plan );
+    v->band_rows = bcal_raster_band_rows( &v->r, budget, bytes, v->halo );
+    pixels = (v->band_rows + 2 * (uint64)v->halo) * v->r.nx;
+    v->acc = calloc( (size_t)b->jobs, sizeof( bcal_metrics_acc ) );
+    if( v->acc == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate accumulators" );
+        return CE_Failure;
+    }
+    for( i = 0; i < b->jobs; i++ )
+    {
+        if( acc_init( v->acc + i, v->plan, b->sketch_k, pixels,
+                      &v->r ) != CE_None )
+        {
+            return CE_Failure;
+        }
+    }
+    return CE_None;
+}
+
+/* What the tasks of a band share */
+typedef struct band_task
+{
+    bcal_metrics_file *v;
+    const bcal_raster_chunk *chunks;
+    uint32 n_chunks;
+    uint32 row;
+    uint32 rows;
+    /* The rows of the accumulators, those of the band and the halo */
+    uint32 lo;
+    uint32 hi;
+    float **out;
+} band_task;
+
+/* Add the points of chunk c to a, for the rows of band t */
+static CPLErr accumulate( const band_task *t, bcal_metrics_acc *a,
+                          const bcal_raster_chunk *c )
+{
+    const bcal_metrics_file *v = t->v;
+    a->p.n = 0;
+    if( bcal_las_read( v->r.m.las + c->file, c->start, c->count,
+                       &a->p ) != CE_None )
+    {
+        return CE_Failure;
+    }
+    return bcal_metrics_kernels_run( v, a, t->lo, t->hi, t->row, t->rows );
+}
+
+/* Job i reads chunks i, i + jobs, ... into its accumulators */
+static CPLErr accumulate_task( void *arg, uint32 i )
+{
+    band_task *t = (band_task*)arg;
+    uint32 c;
+    for( c = i; c < t->n_chunks; c += (uint32)t->v->b.jobs )
+    {
+        if( accumulate( t, t->v->acc + i, t->chunks + c ) != CE_None )
+        {
+            return CE_Failure;
+        }
+    }
+    return CE_None;
+}
+
+/* The share of job i of rows of the band */
+static void task_pixels( const band_task *t, uint32 i, uint32 rows,
+                         uint64 *first, uint64 *last )
+{
+    uint64 pixels = (uint64)rows * t->v->r.nx;
+    uint32 jobs = (uint32)t->v->b.jobs;
+    *first = pixels * i / jobs;
+    *last = pixels * (i + 1) / jobs;
+}
+
+/* Merge pixel k of src into dst */
+static void merge_stats( bcal_metrics_stats *dst,
+                         const bcal_metrics_stats *src, uint64 k )
+{
+    dst->n[k] += src->n[k];
+    if( dst->min != NULL && src->min[k] < dst->min[k] )
+    {
+        dst->min[k] = src->min[k];
+    }
+    if( dst->max != NULL && src->max[k] > dst->max[k] )
+    {
+        dst->max[k] = src->max[k];
+    }
+    if( dst->s1 != NULL )
+    {
+        dst->s1[k] += src->s1[k];
+    }
+    if( dst->s2 != NULL )
+    {
+        dst->s2[k] += src->s2[k];
+    }
+    if( dst->s3 != NULL )
+    {
+        dst->s3[k] += src->s3[k];
+    }
+    if( dst->s4 != NULL )
+    {
+        dst->s4[k] += src->s4[k];
+    }
+}
+
+/* Job i merges its share of the pixels of the other jobs into the first */
+static CPLErr merge_task( void *arg, uint32 i )
+{
+    band_task *t = (band_task*)arg;
+    bcal_metrics_acc *dst = t->v->acc, *src;
+    const int sketch = (t->v->plan[BCAL_SET_H] & BCAL_STAT_SKETCH) &&
+                       dst->sketch.k > 0;
+    uint64 k, first, last;
+    int j, s, c;
+    task_pixels( t, i, t->hi - t->lo, &first, &last );
+    for( j = 1; j < t->v->b.jobs; j++ )
+    {
+        src = t->v->acc + j;
+        for( s = 0; s < BCAL_SETS; s++ )
+        {
+            for( k = first; k < last && dst->set[s].n != NULL; k++ )
+            {
+                if( src->set[s].n[k] > 0 )
+                {
+                    merge_stats( dst->set + s, src->set + s, k );
+                }
+            }
+        }
+        for( k = first; k < last; k++ )
+        {
+            for( c = 0; c < BCAL_VEG_COUNTS && dst->counts[c] != NULL; c++ )
+            {
+                dst->counts[c][k] += src->counts[c][k];
+            }
+            if( dst->under_s1 != NULL )
+            {
+                dst->under_s1[k] += src->under_s1[k];
+                dst->under_s2[k] += src->under_s2[k];
+            }
+            if( dst->last != NULL )
+            {
+                dst->last[k] += src->last[k];
+            }
+            if( dst->user != NULL )
+            {
+                dst->user[k] += src->user[k];
+            }
+            for( c = 0; c < BCAL_PLANE_SUMS && dst->plane[0] != NULL; c++ )
+            {
+                dst->plane[c][k] += src->plane[c][k];
+            }
+            if( sketch && src->set[BCAL_SET_H].n[k] > 0 )
+            {
+                bcal_sketch_merge( &dst->sketch, &src->sketch, k );
+            }
+        }
+    }
+    return CE_None;
+}
+
+/* c / d as a percentage, nodata without d */
+static double percent( uint32 c, uint32 d, double nodata )
+{
+    return d > 0 ? (double)c / d * 100. : nodata;
+}
+
+/* The p-th percentile of q, of rank p * n / 100 as in VegMetrics_BCAL.pro */
+static double percentile( const bcal_sketch_sorted *q, int p )
+{
+    return bcal_sketch_rank( q, (uint64)p * q->total / 100 );
+}
+
+/*
+** The median of the absolute deviations of the heights of q from their
+** median, merged in order from both sides of it.
+*/
+static double deviation_median( const bcal_sketch_sorted *q )
+{
+    const uint64 r = q->total / 2;
+    const float med = bcal_sketch_rank( q, r );
+    uint64 seen = 0;
+    uint32 lo, hi;
+    double d = 0;
+    for( lo = 0; q->v[lo] != med; lo++ )
+    {
+    }
+    for( hi = lo; seen <= r; )
+    {
+        if( hi < q->m && (lo == 0 || q->v[hi] - med <= med - q->v[lo - 1]) )
+        {
+            d = q->v[hi] - med;
+            seen += q->w[hi++];
+        }
+        else
+        {
+            d = med - q->v[--lo];
+            seen += q->w[lo];
+        }
+    }
+    return d;
+}
+
+/*
+** Entropy of the bins of fhd_bin of the heights of q from the j-th, in z
+** units.
+*/
+static double fhd( const bcal_sketch_sorted *q, uint32 j, double zs,
+                   double fhd_bin )
+{
+    double e = 0, p, bin, last = -1;
+    uint64 total = 0, c = 0;
+    uint32 i;
+    for( i = j; i < q->m; i++ )
+    {
+        total += q->w[i];
+    }
+    for( ; j <= q->m; j++ )
+    {
+        bin = j < q->m ? floor( q->v[j] * zs / fhd_bin ) : -1;
+        if( bin != last && c > 0 )
+        {
+            p = (double)c / total;
+            e -= p * log( p );
+            c = 0;
+        }
+        last = bin;
+        c += j < q->m ? q->w[j] : 0;
+    }
+    return e;
+}
+
+/* The value of vegetation metric product of pixel k, with n > 0 heights */
+static double veg_value( const bcal_metrics_file *v, int product, uint64 k,
+                         const bcal_sketch_sorted *q )
+{
+    const bcal_metrics_acc *a = v->acc;
+    const bcal_metrics_stats *st = a->set + BCAL_SET_H;
+    const double zs = v->r.m.h.scale[2], nodata = v->b.nodata;
+    const uint32 n = st->n[k];
+    double mean = st->s1 != NULL ? st->s1[k] / n : 0, c2, var, sd, u;
+    double aad = 0;
+    uint32 j, ground;
+    switch( product )
+    {
+    case BCAL_VEG_HMIN:
+        return st->min[k] * zs;
+    case BCAL_VEG_HMAX:
+        return st->max[k] * zs;
+    case BCAL_VEG_HRANGE:
+        return (st->max[k] - st->min[k]) * zs;
+    case BCAL_VEG_HMEAN:
+        return mean * zs;
+    case BCAL_VEG_HMAD:
+        return n > 1 ? 1.4826 * deviation_median( q ) * zs : nodata;
+    case BCAL_VEG_HAAD:
+        for( j = 0; j < q->m; j++ )
+        {
+            aad += fabs( q->v[j] - mean ) * q->w[j];
+        }
+        return aad / q->total * zs;
+    case BCAL_VEG_HIQR:
+        return (percentile( q, 75 ) - percentile( q, 25 )) * zs;
+    case BCAL_VEG_HP5TH:
+        return percentile( q, 5 ) * zs;
+    case BCAL_VEG_HP10TH:
+        return percentile( q, 10 ) * zs;
+    case BCAL_VEG_HP25TH:
+        return percentile( q, 25 ) * zs;
+    case BCAL_VEG_HMEDIAN:
+        return n > 1 ? percentile( q, 50 ) * zs : nodata;
+    case BCAL_VEG_HP75TH:
+        return percentile( q, 75 ) * zs;
+    case BCAL_VEG_HP90TH:
+        return percentile( q, 90 ) * zs;
+    case BCAL_VEG_HP95TH:
+        return percentile( q, 95 ) * zs;
+    case BCAL_VEG_FHD:
+        return fhd( q, 0, zs, v->b.fhd_bin );
+    case BCAL_VEG_FHD2:
+        for( j = 0; j < q->m && q->v[j] * zs <= v->b.ground; j++ )
+        {
+        }
+        return fhd( q, j, zs, v->b.fhd_bin );
+    case BCAL_VEG_CRR:
+        return st->max[k] > st->min[k] ?
+               (mean - st->min[k]) / (st->max[k] - st->min[k]) : nodata;
+    case BCAL_VEG_NELEV:
+        return n;
+    default:
+        break;
+    }
+
+    if( product >= BCAL_VEG_VEGNELEV )
+    {
+        ground = a->counts[BCAL_VEG_GROUND][k];
+        switch( product )
+        {
+        case BCAL_VEG_VEGNELEV:
+            return a->counts[BCAL_VEG_CROWN][k];
+        case BCAL_VEG_GNDNELEV:
+            return ground;
+        case BCAL_VEG_VDENSITY:
+            return percent( a->counts[BCAL_VEG_CROWN][k], ground, nodata );
+        case BCAL_VEG_VCOVER:
+            return percent( a->counts[BCAL_VEG_CROWN][k], n, nodata );
+        case BCAL_VEG_STRATUM0:
+            return percent( ground, n, nodata );
+        case BCAL_VEG_TEX:
+            j = a->counts[BCAL_VEG_UNDER][k];
+            if( j < 2 )
+            {
+                return nodata;
+            }
+            u = a->under_s1[k] / j;
+            var = (a->under_s2[k] - j * u * u) / (j - 1);
+            return sqrt( var > 0 ? var : 0 ) * zs;
+        default:
+            return percent( a->counts[BCAL_VEG_STRATA + product -
+                                      BCAL_VEG_STRATUM1][k],
+                            a->counts[BCAL_VEG_ABOVE0][k], nodata );
+        }
+    }
+
+    /* The moments of IDL moment(), about the mean with sd of n - 1 */
+    if( n < 2 )
+    {
+        return nodata;
+    }
+    c2 = st->s2[k] - n * mean * mean;
+    var = (c2 > 0 ? c2 : 0) / (n - 1);
+    sd = sqrt( var );
+    switch( product )
+    {
+    case BCAL_VEG_HVAR:
+        return var * zs * zs;
+    case BCAL_VEG_HSTDV:
+        return sd * zs;
+    case BCAL_VEG_HCV:
+        return mean > 0 ? sd / mean * 100. : nodata;
+    case BCAL_VEG_HSKEW:
+        if( !(var > 0) )
+        {
+            return nodata;
+        }
+        return (st->s3[k] - 3 * mean * st->s2[k] +
+                2 * n * mean * mean * mean) / n / (var * sd);
+    case BCAL_VEG_HKURT:
+        if( !(var > 0) )
+        {
+            return nodata;
+        }
+        return (st->s4[k] - 4 * mean * st->s3[k] +
+                6 * mean * mean * st->s2[k] -
+                3 * n * mean * mean * mean * mean) / n / (var * var) - 3;
+    default:
+        return nodata;
+    }
+}
+
+/* The value of product of pixel k, nodata without the points it needs */
+static double product_value( const bcal_metrics_file *v, int product,
+                             uint64 k, const bcal_sketch_sorted *q )
+{
+    const bcal_metrics_acc *a = v->acc;
+    const int set = bcal_metrics_product_set( product );
+    const bcal_metrics_stats *st = a->set + set;
+    const uint32 n = st->n[k];
+    double scale = v->r.m.h.scale[2], offset = 0, mean, c2;
+    if( n == 0 )
+    {
+        return v->b.nodata;
+    }
+    if( set == BCAL_SET_H )
+    {
+        return veg_value( v, product, k, q );
+    }
+    if( set == BCAL_SET_I || set == BCAL_SET_IV || set == BCAL_SET_IB )
+    {
+        scale = 1.;
+    }
+    else
+    {
+        offset = v->r.m.h.offset[2];
+    }
+    switch( product )
+    {
+    case BCAL_INT_IMIN:
+    case BCAL_INT_IVMIN:
+    case BCAL_INT_IBMIN:
+    case BCAL_ALL_MIN:
+    case BCAL_BARE_MIN:
+        return st->min[k] * scale + offset;
+    case BCAL_INT_IMAX:
+    case BCAL_INT_IVMAX:
+    case BCAL_INT_IBMAX:
+    case BCAL_ALL_MAX:
+    case BCAL_BARE_MAX:
+        return st->max[k] * scale + offset;
+    case BCAL_INT_IMEAN:
+    case BCAL_INT_IVMEAN:
+    case BCAL_INT_IBMEAN:
+    case BCAL_ALL_MEAN:
+    case BCAL_BARE_MEAN:
+    case BCAL_DEM_ELEV:
+        return st->s1[k] / n * scale + offset;
+    case BCAL_INT_ISTD:
+    case BCAL_INT_IVSTD:
+    case BCAL_INT_IBSTD:
+    case BCAL_ALL_ROUGH:
+    case BCAL_BARE_ROUGH:
+        /* stddev() of IDL, with n - 1 */
+        if( n < 2 )
+        {
+            return v->b.nodata;
+        }
+        mean = st->s1[k] / n;
+        c2 = st->s2[k] - n * mean * mean;
+        return sqrt( (c2 > 0 ? c2 : 0) / (n - 1) ) * scale;
+    case BCAL_INT_AGCMEAN:
+        return a->user[k] / n;
+    case BCAL_ALL_DEN:
+    case BCAL_BARE_DEN:
+        return n / (v->b.cell * v->b.cell);
+    case BCAL_ALL_LASTRET:
+        return percent( a->last[k], n, v->b.nodata );
+    default:
+        return v->b.nodata;
+    }
+}
+
+/*
+** The bare earth elevation of pixel k of band t, or with none the mean of
+** the ground points of the smallest window up to fill pixels around it
+** that has some.
+*/
+static double elev_value( const band_task *t, uint64 k )
+{
+    const bcal_metrics_file *v = t->v;
+    const bcal_metrics_stats *st = v->acc->set + BCAL_SET_ZB;
+    const uint32 nx = v->r.nx, r = t->lo + (uint32)(k / nx);
+    const uint32 c = (uint32)(k % nx);
+    uint32 f, rr, cc, r0, r1, c0, c1;
+    uint64 n, j;
+    double sum;
+    if( st->n[k] > 0 )
+    {
+        return product_value( v, BCAL_DEM_ELEV, k, NULL );
+    }
+    for( f = 1; f <= v->halo; f++ )
+    {
+        r0 = r > t->lo + f ? r - f : t->lo;
+        r1 = r + f < t->hi ? r + f : t->hi - 1;
+        c0 = c > f ? c - f : 0;
+        c1 = c + f < nx ? c + f : nx - 1;
+        sum = 0;
+        n = 0;
+        for( rr = r0; rr <= r1; rr++ )
+        {
+            for( cc = c0; cc <= c1; cc++ )
+            {
+                j = (uint64)(rr - t->lo) * nx + cc;
+                sum += st->s1[j];
+                n += st->n[j];
+            }
+        }
+        if( n > 0 )
+        {
+            return sum / n * v->r.m.h.scale[2] + v->r.m.h.offset[2];
+        }
+    }
+    return v->b.nodata;
+}
+
+/* Job i computes the products of its share of the pixels of the band */
+static CPLErr finalize_task( void *arg, uint32 i )
+{
+    band_task *t = (band_task*)arg;
+    const bcal_metrics_file *v = t->v;
+    const bcal_metrics_stats *st = v->acc->set + BCAL_SET_H;
+    const int sketch = (v->plan[BCAL_SET_H] & BCAL_STAT_SKETCH) != 0;
+    const int plane = (v->plan[BCAL_SET_ZB] & BCAL_STAT_PLANE) != 0;
+    /* The pixels of the accumulators start with the halo */
+    const uint64 halo = (uint64)(t->row - t->lo) * v->r.nx;
+    double gx[BCAL_PLANE_BLOCK], gy[BCAL_PLANE_BLOCK], var[BCAL_PLANE_BLOCK];
+    double value;
+    bcal_sketch_sorted q;
+    uint64 k, o, first, last;
+    uint32 j, m;
+    int product;
+    CPLErr eErr = CE_None;
+    memset( &q, 0, sizeof( q ) );
+    task_pixels( t, i, t->rows, &first, &last );
+    for( o = first; o < last && eErr == CE_None; o += m )
+    {
+        m = last - o < BCAL_PLANE_BLOCK ? (uint32)(last - o) :
+                                          BCAL_PLANE_BLOCK;
+        if( plane )
+        {
+            bcal_plane_fits( v, t->lo, t->hi, o + halo, m, gx, gy, var );
+        }
+        for( j = 0; j < m; j++ )
+        {
+            k = o + j + halo;
+            if( sketch && st->n[k] > 0 &&
+                (eErr = bcal_sketch_get( &v->acc->sketch, k,
+                                         &q )) != CE_None )
+            {
+                break;
+            }
+            for( product = 0; product < BCAL_METRICS; product++ )
+            {
+                if( t->out[product] == NULL )
+                {
+                    continue;
+                }
+                if( product >= BCAL_BARE_SLOPE &&
+                    product <= BCAL_BARE_LROUGH )
+                {
+                    value = bcal_plane_value( product, gx[j], gy[j],
+                                              var[j], v->b.nodata );
+                }
+                else if( product == BCAL_DEM_ELEV )
+                {
+                    value = elev_value( t, k );
+                }
+                else
+                {
+                    value = product_value( v, product, k, &q );
+                }
+                t->out[product][o + j] = (float)value;
+            }
+        }
+    }
+    bcal_sketch_sorted_free( &q );
+    return eErr;
+}
+
+/*
+** bcal_metrics_rows grids rows row to row + rows - 1 of the raster, at most
+** band_rows of them, from the north.  out holds a band of rows for each
+** product to compute, and NULL for the others, which must be products of b.
+*/
+CPLErr bcal_metrics_rows( bcal_metrics_file *v, uint32 row, uint32 rows,
+                          float **out )
+{
+    bcal_raster_chunk *chunks;
+    band_task t;
+    uint64 pixels;
+    uint32 jobs = (uint32)v->b.jobs, i, n;
+    const int sketch = (v->plan[BCAL_SET_H] & BCAL_STAT_SKETCH) != 0;
+    CPLErr eErr;
+    if( rows > v->band_rows || row + rows > v->r.ny || rows == 0 )
+    {
+        CPLError( CE_Failure, CPLE_IllegalArg,
+                  "Invalid rows %u+%u", row, rows );
+        return CE_Failure;
+    }
+    for( i = 0; i < BCAL_METRICS; i++ )
+    {
+        if( out[i] != NULL && !v->b.products[i] )
+        {
+            CPLError( CE_Failure, CPLE_IllegalArg,
+                      "%s is not planned", bcal_metrics_name( i ) );
+            return CE_Failure;
+        }
+    }
+    t.v = v;
+    t.row = row;
+    t.rows = rows;
+    t.lo = row > v->halo ? row - v->halo : 0;
+    t.hi = row + rows + v->halo < v->r.ny ? row + rows + v->halo : v->r.ny;
+    t.out = out;
+    pixels = (uint64)(t.hi - t.lo) * v->r.nx;
+    for( i = 0; i < jobs; i++ )
+    {
+        acc_reset( v->acc + i, pixels );
+    }
+    if( bcal_raster_chunks( &v->r, t.lo, t.hi, &chunks, &n ) != CE_None )
+    {
+        return CE_Failure;
+    }
+    t.chunks = chunks;
+    t.n_chunks = n;
+    eErr = bcal_pool_run( jobs, jobs, accumulate_task, &t );
+    free( chunks );
+    t.chunks = NULL;
+    /* Exact sketches are pooled whole, the rest pixel by pixel */
+    for( i = 1; i < jobs && eErr == CE_None && sketch &&
+                v->b.sketch_k == 0; i++ )
+    {
+        eErr = bcal_sketch_merge_exact( &v->acc->sketch,
+                                        &v->acc[i].sketch );
+    }
+    if( eErr == CE_None && jobs > 1 )
+    {
+        eErr = bcal_pool_run( jobs, jobs, merge_task, &t );
+    }
+    if( eErr == CE_None && sketch )
+    {
+        eErr = bcal_sketch_sort( &v->acc->sketch );
+    }
+    if( eErr == CE_None )
+    {
+        eErr = bcal_pool_run( jobs, jobs, finalize_task, &t );
+    }
+    for( i = 0; i < jobs && eErr == CE_None; i++ )
+    {
+        v->n_points += v->acc[i].n_points;
+    }
+    return eErr;
+}
+
+void bcal_metrics_close( bcal_metrics_file *v )
+{
+    int i;
+    for( i = 0; v->acc != NULL && i < v->b.jobs; i++ )
+    {
+        acc_free( v->acc + i );
+    }
+    free( v->acc );
+    v->acc = NULL;
+    bcal_raster_close( &v->r );
+}
+
+/*
+** bcal_metrics writes the products of b->inputs to b->output, band by band.
+** The output is removed if it fails.
+*/
+CPLErr bcal_metrics( const bcal_metrics_data *b )
+{
+    bcal_metrics_file v;
+    GDALDatasetH hDS = NULL;
+    GDALRasterBandH hBand;
+    float *out[BCAL_METRICS];
+    uint32 row, rows, bands = 0;
+    int i, n_products = 0;
+    CPLErr eErr;
+
+    memset( out, 0, sizeof( out ) );
+    eErr = bcal_metrics_open( &v, b );
+    for( i = 0; i < BCAL_METRICS && eErr == CE_None; i++ )
+    {
+        if( !b->products[i] )
+        {
+            continue;
+        }
+        n_products++;
+        out[i] = malloc( sizeof( float ) * (uint64)v.band_rows * v.r.nx );
+        if( out[i] == NULL )
+        {
+            CPLError( CE_Failure, CPLE_OutOfMemory,
+                      "Failed to allocate a band of %u rows", v.band_rows );
+            eErr = CE_Failure;
+        }
+    }
+    if( eErr == CE_None )
+    {
+        hDS = bcal_raster_create( &v.r, b->output, n_products, b->nodata,
+                                  b->srs, b->options );
+        eErr = hDS == NULL ? CE_Failure : CE_None;
+    }
+    for( i = 0, n_products = 0; i < BCAL_METRICS && hDS != NULL; i++ )
+    {
+        if( out[i] != NULL )
+        {
+            hBand = GDALGetRasterBand( hDS, ++n_products );
+            GDALSetDescription( hBand, bcal_metrics_title( i ) );
+        }
+    }
+    for( row = 0; row < v.r.ny && eErr == CE_None; row += rows )
+    {
+        rows = v.r.ny - row < v.band_rows ? v.r.ny - row : v.band_rows;
+        eErr = bcal_metrics_rows( &v, row, rows, out );
+        for( i = 0, n_products = 0; i < BCAL_METRICS &&
+                                    eErr == CE_None; i++ )
+        {
+            if( out[i] == NULL )
+            {
+                continue;
+            }
+            eErr = GDALRasterIO( GDALGetRasterBand( hDS, ++n_products ),
+                                 GF_Write, 0, (int)row, (int)v.r.nx,
+                                 (int)rows, out[i], (int)v.r.nx, (int)rows,
+                                 GDT_Float32, 0, 0 );
+        }
+        bands++;
+    }
+    if( hDS != NULL )
+    {
+        GDALClose( hDS );
+        if( eErr != CE_None )
+        {
+            VSIUnlink( b->output );
+        }
+    }
+    if( eErr == CE_None )
+    {
+        printf( "%s: %ux%u pixels of %g, %d products, %llu points, "
+                "%u bands\n", b->output, v.r.nx, v.r.ny, b->cell,
+                n_products, (unsigned long long)v.n_points, bands );
+    }
+    for( i = 0; i < BCAL_METRICS; i++ )
+    {
+        free( out[i] );
+    }
+    bcal_metrics_close( &v );
+    return eErr;
+}
+
+/* bcal_metrics_app runs bcal metrics, vegmetrics, dem or topo */
+int bcal_metrics_app( int argc, char *argv[] )
+{
+    int i;
+    int n;
+    int exact = FALSE;
+    int k = BCAL_SKETCH_K;
+    bcal_metrics_data b;
+    char **names = NULL;
+    char **inputs = NULL;
+    double max_mem = 0;
+    CPLErr eErr;
+    /* Absolute minimum is 4 arguments. bcal metrics in out */
+    if( argc < 4 )
+    {
+        Usage();
+    }
+
+    memset( &b, 0, sizeof( b ) );
+    b.jobs = 1;
+    b.cell = 1.0;
+    b.nodata = -9999.;
+    b.ground = 0.15;
+    b.crown = 1.37;
+    b.fhd_bin = 1.0;
+    if( strncmp( argv[1], "vegmetrics", strlen( "vegmetrics" ) ) == 0 )
+    {
+        bcal_metrics_products( "veg", b.products );
+    }
+    else if( strncmp( argv[1], "dem", strlen( "dem" ) ) == 0 )
+    {
+        bcal_metrics_products( "dem", b.products );
+    }
+    else if( strncmp( argv[1], "topo", strlen( "topo" ) ) == 0 )
+    {
+        bcal_metrics_products( "bareslope,bareaspect,baretrasp,barelrough,"
+                               "bareelev", b.products );
+    }
+    else
+    {
+        bcal_metrics_products( "all", b.products );
+    }
+    i = 2;
+    while( i < argc )
+    {
+        if( strncmp( argv[i], "-help", strlen( "-help" ) ) == 0 )
+        {
+            Usage();
+        }
+        else if( strncmp( argv[i], "-jobs", strlen( "-jobs" ) ) == 0 && i + 1 < argc )
+        {
+            b.jobs = atoi( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-cell", strlen( "-cell" ) ) == 0 && i + 1 < argc )
+        {
+            b.cell = atof( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-nodata", strlen( "-nodata" ) ) == 0 && i + 1 < argc )
+        {
+            b.nodata = atof( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-return", strlen( "-return" ) ) == 0 && i + 1 < argc )
+        {
+            b.return_num = atoi( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-products", strlen( "-products" ) ) == 0 && i + 1 < argc )
+        {
+            if( bcal_metrics_products( argv[++i], b.products ) != CE_None )
+            {
+                exit( 1 );
+            }
+        }
+        else if( strncmp( argv[i], "-ground", strlen( "-ground" ) ) == 0 && i + 1 < argc )
+        {
+            b.ground = atof( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-crown", strlen( "-crown" ) ) == 0 && i + 1 < argc )
+        {
+            b.crown = atof( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-fhd_bin", strlen( "-fhd_bin" ) ) == 0 && i + 1 < argc )
+        {
+            b.fhd_bin = atof( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-fill", strlen( "-fill" ) ) == 0 && i + 1 < argc )
+        {
+            b.fill = atoi( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-sketch", strlen( "-sketch" ) ) == 0 && i + 1 < argc )
+        {
+            k = atoi( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-exact", strlen( "-exact" ) ) == 0 )
+        {
+            exact = TRUE;
+        }
+        else if( strncmp( argv[i], "-max_mem", strlen( "-max_mem" ) ) == 0 && i + 1 < argc )
+        {
+            max_mem = atof( argv[++i] );
+        }
+        else if( strncmp( argv[i], "-te", strlen( "-te" ) ) == 0 && i + 4 < argc )
+        {
+            b.env.MinX = atof( argv[++i] );
+            b.env.MinY = atof( argv[++i] );
+            b.env.MaxX = atof( argv[++i] );
+            b.env.MaxY = atof( argv[++i] );
+            b.have_env = TRUE;
+        }
+        else if( strncmp( argv[i], "-a_srs", strlen( "-a_srs" ) ) == 0 && i + 1 < argc )
+        {
+            b.srs = argv[++i];
+        }
+        else if( strncmp( argv[i], "-co", strlen( "-co" ) ) == 0 && i + 1 < argc )
+        {
+            b.options = CSLAddString( b.options, argv[++i] );
+        }
+        else if( strncmp( argv[i], "-list", strlen( "-list" ) ) == 0 && i + 1 < argc )
+        {
+            inputs = bcal_batch_add_list( inputs, argv[++i] );
+            if( inputs == NULL )
+            {
+                exit( 1 );
+            }
+        }
+        else
+        {
+            names = CSLAddString( names, argv[i] );
+        }
+        i++;
+    }
+    /* The last name is the output, the others are inputs */
+    n = CSLCount( names );
+    for( i = 0; i < n - 1; i++ )
+    {
+        inputs = bcal_batch_add( inputs, names[i] );
+    }
+    if( CSLCount( inputs ) == 0 )
+    {
+        fprintf( stderr, "No input specified\n" );
+        exit( 1 );
+    }
+    if( n < 1 )
+    {
+        fprintf( stderr, "No output specified\n" );
+        exit( 1 );
+    }
+    if( b.jobs < 1 || !(b.cell > 0) || b.return_num < 0 ||
+        !(b.fhd_bin > 0) || b.fill < 0 || k < 2 || k > BCAL_SKETCH_MAX_K ||
+        max_mem < 0 )
+    {
+        fprintf( stderr, "Invalid -jobs, -cell, -return, -fhd_bin, -fill, "
+                         "-sketch or -max_mem\n" );
+        exit( 1 );
+    }
+    b.inputs = inputs;
+    b.output = names[n - 1];
+    b.sketch_k = exact ? 0 : (uint32)k;
+    b.max_mem = (uint64)(max_mem * 1024 * 1024);
+
+    eErr = bcal_metrics( &b );
+    CSLDestroy( inputs );
+    CSLDestroy( names );
+    CSLDestroy( b.options );
+    return (int)eErr;
+}
@@ -0,0 +1,350 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef BCAL_METRICS_H_
+#define BCAL_METRICS_H_
+
+#include "bcal_filter.h"
+#include "bcal_las.h"
+#include "bcal_raster.h"
+#include "bcal_sketch.h"
+#include "bcal_types.h"
+
+/*
+** The products of VegMetrics_BCAL.pro, IntensityMetrics_BCAL.pro,
+** TopoRasterAll_BCAL.pro, TopoRasterBare_BCAL.pro and DEMLAS_BCAL.pro, each
+** in its order.
+*/
+typedef enum bcal_metric
+{
+    BCAL_VEG_HMIN,
+    BCAL_VEG_HMAX,
+    BCAL_VEG_HRANGE,
+    BCAL_VEG_HMEAN,
+    BCAL_VEG_HMAD,
+    BCAL_VEG_HAAD,
+    BCAL_VEG_HVAR,
+    BCAL_VEG_HSTDV,
+    BCAL_VEG_HSKEW,
+    BCAL_VEG_HKURT,
+    BCAL_VEG_HIQR,
+    BCAL_VEG_HCV,
+    BCAL_VEG_HP5TH,
+    BCAL_VEG_HP10TH,
+    BCAL_VEG_HP25TH,
+    BCAL_VEG_HMEDIAN,
+    BCAL_VEG_HP75TH,
+    BCAL_VEG_HP90TH,
+    BCAL_VEG_HP95TH,
+    BCAL_VEG_NELEV,
+    BCAL_VEG_VEGNELEV,
+    BCAL_VEG_GNDNELEV,
+    BCAL_VEG_VDENSITY,
+    BCAL_VEG_VCOVER,
+    BCAL_VEG_STRATUM0,
+    BCAL_VEG_STRATUM1,
+    BCAL_VEG_STRATUM2,
+    BCAL_VEG_STRATUM3,
+    BCAL_VEG_STRATUM4,
+    BCAL_VEG_STRATUM5,
+    BCAL_VEG_STRATUM6,
+    BCAL_VEG_CRR,
+    BCAL_VEG_TEX,
+    BCAL_VEG_FHD,
+    BCAL_VEG_FHD2,
+    BCAL_INT_IMIN,
+    BCAL_INT_IMAX,
+    BCAL_INT_IMEAN,
+    BCAL_INT_ISTD,
+    BCAL_INT_IVMIN,
+    BCAL_INT_IVMAX,
+    BCAL_INT_IVMEAN,
+    BCAL_INT_IVSTD,
+    BCAL_INT_IBMIN,
+    BCAL_INT_IBMAX,
+    BCAL_INT_IBMEAN,
+    BCAL_INT_IBSTD,
+    BCAL_INT_AGCMEAN,
+    BCAL_ALL_MIN,
+    BCAL_ALL_MEAN,
+    BCAL_ALL_MAX,
+    BCAL_ALL_ROUGH,
+    BCAL_ALL_DEN,
+    BCAL_ALL_LASTRET,
+    BCAL_BARE_MIN,
+    BCAL_BARE_MEAN,
+    BCAL_BARE_MAX,
+    BCAL_BARE_ROUGH,
+    BCAL_BARE_DEN,
+    BCAL_BARE_SLOPE,
+    BCAL_BARE_ASPECT,
+    BCAL_BARE_TRASP,
+    BCAL_BARE_LROUGH,
+    BCAL_DEM_ELEV,
+    BCAL_METRICS
+} bcal_metric;
+
+/* The IDL tools, each a family of products */
+typedef enum bcal_metrics_family
+{
+    BCAL_FAMILY_VEG,
+    BCAL_FAMILY_INTENSITY,
+    BCAL_FAMILY_TOPO_ALL,
+    BCAL_FAMILY_TOPO_BARE,
+    BCAL_FAMILY_DEM,
+    BCAL_FAMILIES
+} bcal_metrics_family;
+
+/* The points of a pixel a product is computed from, and their value */
+typedef enum bcal_metrics_set
+{
+    /* Heights of the points with one */
+    BCAL_SET_H,
+    /* Intensities of all points */
+    BCAL_SET_I,
+    /* Intensities of the points above, and at most, the ground threshold */
+    BCAL_SET_IV,
+    BCAL_SET_IB,
+    /* Elevations of all points, and of the ground points */
+    BCAL_SET_Z,
+    BCAL_SET_ZB,
+    BCAL_SETS
+} bcal_metrics_set;
+
+/*
+** What a set keeps per pixel.  The plan of a raster is a mask of these per
+** set, the union of those of its products.
+*/
+#define BCAL_STAT_MIN    0x001
+#define BCAL_STAT_MAX    0x002
+/* Sums of the first to fourth powers of the values */
+#define BCAL_STAT_S1     0x004
+#define BCAL_STAT_S2     0x008
+#define BCAL_STAT_S3     0x010
+#define BCAL_STAT_S4     0x020
+/* A quantile sketch of the values, of BCAL_SET_H */
+#define BCAL_STAT_SKETCH 0x040
+/* Counts of the heights in the ranges of bcal_veg_count, of BCAL_SET_H */
+#define BCAL_STAT_COUNTS 0x080
+/* Sums of the heights counted in BCAL_VEG_UNDER and their squares */
+#define BCAL_STAT_UNDER  0x100
+/* The count of last returns, of BCAL_SET_Z */
+#define BCAL_STAT_LAST   0x200
+/* The sum of the user data, of BCAL_SET_I */
+#define BCAL_STAT_USER   0x400
+/* The count of the points, kept by every set in use */
+#define BCAL_STAT_N      0x800
+/* The sums of the plane fits of bcal_plane_sum, of BCAL_SET_ZB */
+#define BCAL_STAT_PLANE  0x1000
+
+/* Most kernels of a set, see bcal_kernel.c */
+#define BCAL_SET_KERNELS 6
+
+/* The counts kept per pixel, of heights in each range */
+typedef enum bcal_veg_count
+{
+    /* At most the ground threshold */
+    BCAL_VEG_GROUND,
+    /* Above the crown threshold */
+    BCAL_VEG_CROWN,
+    /* Above the ground and at most the crown threshold, the texture */
+    BCAL_VEG_UNDER,
+    /* Above 0 */
+    BCAL_VEG_ABOVE0,
+    /* The strata of VegMetrics_BCAL.pro, 0 to 1, 2.5, 10, 20, 30 and up */
+    BCAL_VEG_STRATA,
+    BCAL_VEG_COUNTS = BCAL_VEG_STRATA + 6
+} bcal_veg_count;
+
+/*
+** The sums of the plane fits, of the points of a pixel from its centre in
+** x and y and from the lowest point of the inputs in z, in the units of the
+** inputs, see bcal_plane.c.
+*/
+typedef enum bcal_plane_sum
+{
+    BCAL_PLANE_SX,
+    BCAL_PLANE_SY,
+    BCAL_PLANE_SZ,
+    BCAL_PLANE_SXX,
+    BCAL_PLANE_SXY,
+    BCAL_PLANE_SYY,
+    BCAL_PLANE_SXZ,
+    BCAL_PLANE_SYZ,
+    BCAL_PLANE_SZZ,
+    BCAL_PLANE_SUMS
+} bcal_plane_sum;
+
+/* Fewest points of a plane fit, as in TopoRasterBare_BCAL.pro */
+#define BCAL_PLANE_MIN_POINTS 6
+
+/* Pixels whose planes are fitted at a time */
+#define BCAL_PLANE_BLOCK 256
+
+typedef struct bcal_metrics_data
+{
+    /* The las or laz files gridded as one raster */
+    char **inputs;
+    char *output;
+    int jobs;
+    /* Pixel size, in the units of the inputs */
+    double cell;
+    double nodata;
+    /* Return number to grid, 0 for all returns */
+    int return_num;
+    /* Height thresholds of ground and crown, and the FHD bin height */
+    double ground;
+    double crown;
+    double fhd_bin;
+    /*
+    ** Empty pixels of bareelev take the mean of the ground points up to
+    ** fill pixels away, and plane fits that fail are solved again with
+    ** them.
+    */
+    int fill;
+    /* Non zero for each bcal_metric to write */
+    uint8 products[BCAL_METRICS];
+    /* Bins kept per pixel for percentiles, 0 for all heights */
+    uint32 sketch_k;
+    /* Approximate memory budget of the accumulators in bytes, 0 for none */
+    uint64 max_mem;
+    /* Extent of the raster, the bounds of the inputs if not have_env */
+    OGREnvelope env;
+    int have_env;
+    /* Spatial reference of the output, NULL to take it from the inputs */
+    char *srs;
+    /* GDAL creation options of the output */
+    char **options;
+} bcal_metrics_data;
+
+/*
+** The accumulators of a set of points of the pixels of a band.  Arrays the
+** plan has no use for are NULL.  Values are heights and elevations in z
+** units, and intensities.
+*/
+typedef struct bcal_metrics_stats
+{
+    uint32 *n;
+    int32 *min;
+    int32 *max;
+    double *s1;
+    double *s2;
+    double *s3;
+    double *s4;
+} bcal_metrics_stats;
+
+/*
+** The accumulators of the pixels of a band of rows.  Each holds what the
+** products need of the points of a pixel, and those of two sets of the
+** same pixels merge by adding them.
+*/
+typedef struct bcal_metrics_acc
+{
+    bcal_metrics_stats set[BCAL_SETS];
+    uint32 *counts[BCAL_VEG_COUNTS];
+    double *under_s1;
+    double *under_s2;
+    uint32 *last;
+    double *user;
+    /* The sums of the plane fits, one block of BCAL_PLANE_SUMS arrays */
+    double *plane[BCAL_PLANE_SUMS];
+    bcal_sketch sketch;
+    bcal_points p;
+    /*
+    ** Per point of p, its pixel.  Per point of the set the kernels run
+    ** over, its pixel, value and index in p.
+    */
+    uint64 *bin;
+    uint64 *pix;
+    int32 *value;
+    uint32 *member;
+    /* Pixels of each array, and the row of the raster of the first */
+    uint64 pixels;
+    uint32 lo;
+    /* Points added to the accumulators */
+    uint64 n_points;
+} bcal_metrics_acc;
+
+typedef struct bcal_metrics_file bcal_metrics_file;
+
+/*
+** A kernel adds the n points of set gathered in a to its accumulators,
+** see bcal_kernel.c.
+*/
+typedef CPLErr (*bcal_metrics_kernel)( const bcal_metrics_file *v,
+                                       bcal_metrics_acc *a, int set,
+                                       uint32 n );
+
+/*
+** The raster of bcal_metrics_data.  The points of a band of rows are read
+** once, by jobs threads into accumulators of their own, which are merged
+** into the first.
+*/
+struct bcal_metrics_file
+{
+    bcal_metrics_data b;
+    bcal_raster r;
+    /* The stats each set keeps, the union of those of the products */
+    uint32 plan[BCAL_SETS];
+    /* The kernels of each set for plan, ending with NULL */
+    bcal_metrics_kernel kernels[BCAL_SETS][BCAL_SET_KERNELS];
+    /* Rows written at a time, and those either side the accumulators hold */
+    uint32 band_rows;
+    uint32 halo;
+    bcal_metrics_acc *acc;
+    /* Points gridded so far */
+    uint64 n_points;
+};
+
+const char * bcal_metrics_name( int product );
+
+const char * bcal_metrics_title( int product );
+
+const char * bcal_metrics_family_name( int product );
+
+int bcal_metrics_product_set( int product );
+
+CPLErr bcal_metrics_products( const char *names, uint8 *products );
+
+void bcal_metrics_plan( const uint8 *products, uint32 *plan );
+
+uint64 bcal_metrics_pixel_bytes( const uint32 *plan, uint32 k );
+
+int bcal_metrics_attrs( const uint32 *plan );
+
+uint64 bcal_metrics_band_bytes( const bcal_metrics_data *b,
+                                const uint32 *plan );
+
+uint64 bcal_metrics_fixed_bytes( const bcal_metrics_data *b,
+                                 const uint32 *plan );
+
+uint32 bcal_metrics_round( uint32 plan );
+
+void bcal_metrics_kernels( const uint32 *plan,
+                           bcal_metrics_kernel
+                           kernels[BCAL_SETS][BCAL_SET_KERNELS] );
+
+CPLErr bcal_metrics_kernels_run( const bcal_metrics_file *v,
+                                 bcal_metrics_acc *a, uint32 lo, uint32 hi,
+                                 uint32 row, uint32 rows );
+
+void bcal_plane_fits( const bcal_metrics_file *v, uint32 lo, uint32 hi,
+                      uint64 first, uint32 n, double *gx, double *gy,
+                      double *var );
+
+double bcal_plane_value( int product, double gx, double gy, double var,
+                         double nodata );
+
+int bcal_metrics_app( int argc, char *argv[] );
+
+CPLErr bcal_metrics_open( bcal_metrics_file *v, const bcal_metrics_data *b );
+
+CPLErr bcal_metrics_rows( bcal_metrics_file *v, uint32 row, uint32 rows,
+                          float **out );
+
+void bcal_metrics_close( bcal_metrics_file *v );
+
+CPLErr bcal_metrics( const bcal_metrics_data *b );
+
+#endif /* BCAL_METRICS_H_ */
@@ -0,0 +1,357 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** plan is the catalogue of the products of bcal metrics.  Each names the
+** set of points of a pixel it is computed from and the stats it needs of
+** them.  The plan of a raster is the union of the stats of its products,
+** so the accumulators only hold those, however many products share them.
+*/
+
+#include "bcal_metrics.h"
+
+#include "cpl_conv.h"
+#include "cpl_string.h"
+
+#define MOMENT2 (BCAL_STAT_S1 | BCAL_STAT_S2)
+
+static const struct
+{
+    const char *name;
+    const char *title;
+    int family;
+    int set;
+    uint32 stats;
+} catalogue[BCAL_METRICS] =
+{
+    { "hmin", "Height: Minimum",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_MIN },
+    { "hmax", "Height: Maximum",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_MAX },
+    { "hrange", "Height: Range",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_MIN | BCAL_STAT_MAX },
+    { "hmean", "Height: Mean",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_S1 },
+    { "hmad", "Height: MAD - Median Absolute Deviation from Median",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_SKETCH },
+    { "haad", "Height: AAD - Mean Absolute Deviation from Mean",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_SKETCH | BCAL_STAT_S1 },
+    { "hvar", "Height: Variance",
+      BCAL_FAMILY_VEG, BCAL_SET_H, MOMENT2 },
+    { "hstdv", "Height: Standard Deviation",
+      BCAL_FAMILY_VEG, BCAL_SET_H, MOMENT2 },
+    { "hskew", "Height: Skewness",
+      BCAL_FAMILY_VEG, BCAL_SET_H, MOMENT2 | BCAL_STAT_S3 },
+    { "hkurt", "Height: Kurtosis",
+      BCAL_FAMILY_VEG, BCAL_SET_H, MOMENT2 | BCAL_STAT_S3 | BCAL_STAT_S4 },
+    { "hiqr", "Height: Interquartile Range",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_SKETCH },
+    { "hcv", "Height: Coefficient of Variation",
+      BCAL_FAMILY_VEG, BCAL_SET_H, MOMENT2 },
+    { "hp5th", "Height: 5th Percentile",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_SKETCH },
+    { "hp10th", "Height: 10th Percentile",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_SKETCH },
+    { "hp25th", "Height: 25th Percentile",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_SKETCH },
+    { "hmedian", "Height: 50th Percentile (Median)",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_SKETCH },
+    { "hp75th", "Height: 75th Percentile",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_SKETCH },
+    { "hp90th", "Height: 90th Percentile",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_SKETCH },
+    { "hp95th", "Height: 95th Percentile",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_SKETCH },
+    { "nelev", "Number of LiDAR returns",
+      BCAL_FAMILY_VEG, BCAL_SET_H, 0 },
+    { "vegnelev", "Number of LiDAR vegetation returns",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_COUNTS },
+    { "gndnelev", "Number of LiDAR ground returns",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_COUNTS },
+    { "vdensity", "Total vegetation density",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_COUNTS },
+    { "vcover", "Vegetation cover",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_COUNTS },
+    { "stratum0", "Percentage of ground returns",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_COUNTS },
+    { "stratum1",
+      "Percent of vegetation in height range > 0 and <= 1 meters",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_COUNTS },
+    { "stratum2", "Percent of vegetation in height range > 1 <= 2.5 meters",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_COUNTS },
+    { "stratum3", "Percent of vegetation in height range > 2.5 <= 10 meters",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_COUNTS },
+    { "stratum4", "Percent of vegetation in height range > 10 <= 20 meters",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_COUNTS },
+    { "stratum5", "Percent of vegetation in height range > 20 <= 30 meters",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_COUNTS },
+    { "stratum6", "Percent of vegetation in height range > 30 meters",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_COUNTS },
+    { "crr", "Canopy Relief Ratio",
+      BCAL_FAMILY_VEG, BCAL_SET_H,
+      BCAL_STAT_MIN | BCAL_STAT_MAX | BCAL_STAT_S1 },
+    { "tex", "Texture of heights",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_COUNTS | BCAL_STAT_UNDER },
+    { "fhd", "Foliage Height Diversity (FHD) - All points",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_SKETCH },
+    { "fhd2",
+      "Foliage Height Diversity (FHD) - Points above ground threshold",
+      BCAL_FAMILY_VEG, BCAL_SET_H, BCAL_STAT_SKETCH },
+    { "imin", "Intensity: Minimum",
+      BCAL_FAMILY_INTENSITY, BCAL_SET_I, BCAL_STAT_MIN },
+    { "imax", "Intensity: Maximum",
+      BCAL_FAMILY_INTENSITY, BCAL_SET_I, BCAL_STAT_MAX },
+    { "imean", "Intensity: Mean",
+      BCAL_FAMILY_INTENSITY, BCAL_SET_I, BCAL_STAT_S1 },
+    { "istd", "Intensity: St. Deviation",
+      BCAL_FAMILY_INTENSITY, BCAL_SET_I, MOMENT2 },
+    { "ivmin", "Vegetation Intensity: Minimum",
+      BCAL_FAMILY_INTENSITY, BCAL_SET_IV, BCAL_STAT_MIN },
+    { "ivmax", "Vegetation Intensity: Maximum",
+      BCAL_FAMILY_INTENSITY, BCAL_SET_IV, BCAL_STAT_MAX },
+    { "ivmean", "Vegetation Intensity: Mean",
+      BCAL_FAMILY_INTENSITY, BCAL_SET_IV, BCAL_STAT_S1 },
+    { "ivstd", "Vegetation Intensity: St. Deviation",
+      BCAL_FAMILY_INTENSITY, BCAL_SET_IV, MOMENT2 },
+    { "ibmin", "Bare-earth Intensity: Minimum",
+      BCAL_FAMILY_INTENSITY, BCAL_SET_IB, BCAL_STAT_MIN },
+    { "ibmax", "Bare-earth Intensity: Maximum",
+      BCAL_FAMILY_INTENSITY, BCAL_SET_IB, BCAL_STAT_MAX },
+    { "ibmean", "Bare-earth Intensity: Mean",
+      BCAL_FAMILY_INTENSITY, BCAL_SET_IB, BCAL_STAT_S1 },
+    { "ibstd", "Bare-earth Intensity: St. Deviation",
+      BCAL_FAMILY_INTENSITY, BCAL_SET_IB, MOMENT2 },
+    { "agcmean", "Mean AGC",
+      BCAL_FAMILY_INTENSITY, BCAL_SET_I, BCAL_STAT_USER },
+    { "allmin", "Elevation - Minimum",
+      BCAL_FAMILY_TOPO_ALL, BCAL_SET_Z, BCAL_STAT_MIN },
+    { "allmean", "Elevation - Mean",
+      BCAL_FAMILY_TOPO_ALL, BCAL_SET_Z, BCAL_STAT_S1 },
+    { "allmax", "Elevation - Maximum",
+      BCAL_FAMILY_TOPO_ALL, BCAL_SET_Z, BCAL_STAT_MAX },
+    { "allrough", "Absolute Roughness",
+      BCAL_FAMILY_TOPO_ALL, BCAL_SET_Z, MOMENT2 },
+    { "allden", "Point Density",
+      BCAL_FAMILY_TOPO_ALL, BCAL_SET_Z, 0 },
+    { "alllastret", "Percent Last Return",
+      BCAL_FAMILY_TOPO_ALL, BCAL_SET_Z, BCAL_STAT_LAST },
+    { "baremin", "Bare Earth Elevation - Minimum",
+      BCAL_FAMILY_TOPO_BARE, BCAL_SET_ZB, BCAL_STAT_MIN },
+    { "baremean", "Bare Earth Elevation - Mean",
+      BCAL_FAMILY_TOPO_BARE, BCAL_SET_ZB, BCAL_STAT_S1 },
+    { "baremax", "Bare Earth Elevation - Maximum",
+      BCAL_FAMILY_TOPO_BARE, BCAL_SET_ZB, BCAL_STAT_MAX },
+    { "barerough", "Bare Earth Absolute Roughness",
+      BCAL_FAMILY_TOPO_BARE, BCAL_SET_ZB, MOMENT2 },
+    { "bareden", "Ground Point Density",
+      BCAL_FAMILY_TOPO_BARE, BCAL_SET_ZB, 0 },
+    { "bareslope", "Bare Earth Slope (degrees)",
+      BCAL_FAMILY_TOPO_BARE, BCAL_SET_ZB, BCAL_STAT_PLANE },
+    { "bareaspect", "Bare Earth Aspect (degrees from N)",
+      BCAL_FAMILY_TOPO_BARE, BCAL_SET_ZB, BCAL_STAT_PLANE },
+    { "baretrasp", "Bare Topographic Solar-Radiation Index (TRASP)",
+      BCAL_FAMILY_TOPO_BARE, BCAL_SET_ZB, BCAL_STAT_PLANE },
+    { "barelrough", "Bare Earth Local Roughness",
+      BCAL_FAMILY_TOPO_BARE, BCAL_SET_ZB, BCAL_STAT_PLANE },
+    { "bareelev", "Bare Earth Elevation",
+      BCAL_FAMILY_DEM, BCAL_SET_ZB, BCAL_STAT_S1 }
+};
+
+/* Names of the families, as -products takes them */
+static const char *families[BCAL_FAMILIES] =
+{
+    "veg", "intensity", "topoall", "topobare", "dem"
+};
+
+const char * bcal_metrics_name( int product )
+{
+    return catalogue[product].name;
+}
+
+const char * bcal_metrics_title( int product )
+{
+    return catalogue[product].title;
+}
+
+const char * bcal_metrics_family_name( int product )
+{
+    return families[catalogue[product].family];
+}
+
+int bcal_metrics_product_set( int product )
+{
+    return catalogue[product].set;
+}
+
+static int name_is( const char *s, size_t len, const char *name )
+{
+    return len == strlen( name ) && EQUALN( s, name, len );
+}
+
+/*
+** bcal_metrics_products sets products[i] for each product named in the
+** comma separated names, each product of a family named, or all of them
+** for "all".  products is cleared first.
+*/
+CPLErr bcal_metrics_products( const char *names, uint8 *products )
+{
+    const char *s = names, *e;
+    size_t len;
+    int i, found, any = FALSE;
+    memset( products, 0, BCAL_METRICS );
+    while( *s != '\0' )
+    {
+        e = strchr( s, ',' );
+        len = e != NULL ? (size_t)(e - s) : strlen( s );
+        for( i = 0, found = FALSE; i < BCAL_METRICS; i++ )
+        {
+            if( name_is( s, len, "all" ) ||
+                name_is( s, len, families[catalogue[i].family] ) ||
+                name_is( s, len, catalogue[i].name ) )
+            {
+                products[i] = TRUE;
+                found = any = TRUE;
+            }
+        }
+        if( !found )
+        {
+            CPLError( CE_Failure, CPLE_IllegalArg,
+                      "Unknown product %.*s", (int)len, s );
+            return CE_Failure;
+        }
+        s += e != NULL ? len + 1 : len;
+    }
+    if( !any )
+    {
+        CPLError( CE_Failure, CPLE_IllegalArg, "No products in %s", names );
+        return CE_Failure;
+    }
+    return CE_None;
+}
+
+/*
+** bcal_metrics_plan sets plan[s] to the stats set s keeps for products,
+** 0 for the sets none of them use.  These are rounded up to those of the
+** kernels, see bcal_kernel.c.
+*/
+void bcal_metrics_plan( const uint8 *products, uint32 *plan )
+{
+    int i;
+    memset( plan, 0, sizeof( uint32 ) * BCAL_SETS );
+    for( i = 0; i < BCAL_METRICS; i++ )
+    {
+        if( products[i] )
+        {
+            plan[catalogue[i].set] |= catalogue[i].stats | BCAL_STAT_N;
+        }
+    }
+    for( i = 0; i < BCAL_SETS; i++ )
+    {
+        plan[i] = bcal_metrics_round( plan[i] );
+    }
+}
+
+/*
+** bcal_metrics_pixel_bytes returns the bytes of the accumulators of plan
+** per pixel of a job keeping k bins a pixel, without the heights of exact
+** sketches.
+*/
+uint64 bcal_metrics_pixel_bytes( const uint32 *plan, uint32 k )
+{
+    uint64 bytes = 0;
+    int s;
+    for( s = 0; s < BCAL_SETS; s++ )
+    {
+        if( plan[s] & BCAL_STAT_N )
+        {
+            bytes += sizeof( uint32 );
+        }
+        if( plan[s] & BCAL_STAT_MIN )
+        {
+            bytes += sizeof( int32 );
+        }
+        if( plan[s] & BCAL_STAT_MAX )
+        {
+            bytes += sizeof( int32 );
+        }
+        bytes += sizeof( double ) * (((plan[s] & BCAL_STAT_S1) != 0) +
+                                     ((plan[s] & BCAL_STAT_S2) != 0) +
+                                     ((plan[s] & BCAL_STAT_S3) != 0) +
+                                     ((plan[s] & BCAL_STAT_S4) != 0));
+    }
+    if( plan[BCAL_SET_H] & BCAL_STAT_SKETCH )
+    {
+        /* Pixels of exact sketches are sized by their points */
+        bytes += k == 0 ? sizeof( uint64 ) :
+                 sizeof( uint16 ) + sizeof( bcal_sketch_bin ) * (uint64)k;
+    }
+    if( plan[BCAL_SET_H] & BCAL_STAT_COUNTS )
+    {
+        bytes += sizeof( uint32 ) * BCAL_VEG_COUNTS;
+    }
+    if( plan[BCAL_SET_H] & BCAL_STAT_UNDER )
+    {
+        bytes += sizeof( double ) * 2;
+    }
+    if( plan[BCAL_SET_Z] & BCAL_STAT_LAST )
+    {
+        bytes += sizeof( uint32 );
+    }
+    if( plan[BCAL_SET_I] & BCAL_STAT_USER )
+    {
+        bytes += sizeof( double );
+    }
+    if( plan[BCAL_SET_ZB] & BCAL_STAT_PLANE )
+    {
+        bytes += sizeof( double ) * BCAL_PLANE_SUMS;
+    }
+    return bytes;
+}
+
+/*
+** bcal_metrics_attrs returns whether plan needs the intensities, number of
+** returns and user data of the points.
+*/
+int bcal_metrics_attrs( const uint32 *plan )
+{
+    return plan[BCAL_SET_I] != 0 || plan[BCAL_SET_IV] != 0 ||
+           plan[BCAL_SET_IB] != 0 || (plan[BCAL_SET_Z] & BCAL_STAT_LAST);
+}
+
+/*
+** bcal_metrics_band_bytes returns the bytes per pixel of a band of b: the
+** accumulators of every job and a float of each product.
+*/
+uint64 bcal_metrics_band_bytes( const bcal_metrics_data *b,
+                                const uint32 *plan )
+{
+    uint64 bytes = bcal_metrics_pixel_bytes( plan, b->sketch_k ) *
+                   (uint64)b->jobs;
+    int i;
+    for( i = 0; i < BCAL_METRICS; i++ )
+    {
+        bytes += b->products[i] ? sizeof( float ) : 0;
+    }
+    return bytes;
+}
+
+/*
+** bcal_metrics_fixed_bytes returns the bytes of b that do not grow with
+** the band: the binning scratch and the points of a read block of every
+** job.
+*/
+uint64 bcal_metrics_fixed_bytes( const bcal_metrics_data *b,
+                                 const uint32 *plan )
+{
+    /* bin, pix, value and member */
+    uint64 bytes = 2 * sizeof( uint64 ) + sizeof( int32 ) + sizeof( uint32 );
+    /* fid, x, y, z, c, r and h */
+    bytes += sizeof( int64 ) + 3 * sizeof( int32 ) + 2 * sizeof( uint8 ) +
+             sizeof( uint16 );
+    if( bcal_metrics_attrs( plan ) )
+    {
+        bytes += sizeof( uint16 ) + 2 * sizeof( uint8 );
+    }
+    return bytes * BCAL_RASTER_READ_BLOCK * (uint64)b->jobs;
+}
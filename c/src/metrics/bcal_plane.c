@@ -0,0 +1,234 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** plane solves the slope, aspect, TRASP and local roughness of the bare
+** earth, as TopoRasterBare_BCAL.pro does from the least squares plane
+** z = a + b x + c y of the points of each pixel.  That gathers the points
+** of a pixel and regresses them, and where the fit fails gathers those of
+** a growing window and regresses again.
+**
+** Here the pass of bcal metrics adds each ground point to the sums of the
+** normal equations of its pixel, see bcal_kernel.c, and no point is kept.
+** The planes are solved a block of pixels at a time, in a loop over the
+** sums alone.  Pixels with fewer than BCAL_PLANE_MIN_POINTS points, or with
+** them in a line, are solved again with the sums of the pixels around them
+** merged in, a ring at a time up to -fill pixels away.  The sums are of the
+** points from the centre of their pixel, which keeps them small and makes
+** merging a shift of the origin.
+**
+** The aspect is that of TopoRasterBare_BCAL.pro, the direction of the
+** gradient in degrees clockwise from north, and TRASP is
+** (1 - cos(aspect - 30)) / 2.
+*/
+
+#include <math.h>
+
+#include "bcal_metrics.h"
+
+#include "cpl_conv.h"
+
+/* The sweep keeps the restrict of its arguments only when not inlined */
+#if defined(__GNUC__)
+#define BCAL_NOINLINE __attribute__((noinline))
+#define BCAL_RESTRICT __restrict__
+#elif defined(_MSC_VER)
+#define BCAL_NOINLINE __declspec(noinline)
+#define BCAL_RESTRICT __restrict
+#else
+#define BCAL_NOINLINE
+#define BCAL_RESTRICT
+#endif
+
+/* Determinants below this share of the product of the variances fail */
+#define FIT_EPSILON 1e-10
+
+/*
+** Solve the plane of n points with sums s for its gradient in x and y and
+** the variance of the points about it.  Returns FALSE, and NaNs, for too
+** few points or points in a line, which may divide by 0 on the way.
+** Branch free, so a block of them vectorizes.
+*/
+static inline int fit( double n, const double *s, double *gx, double *gy,
+                       double *var )
+{
+    const double inv = 1. / n;
+    const double mx = s[BCAL_PLANE_SX] * inv, my = s[BCAL_PLANE_SY] * inv;
+    const double mz = s[BCAL_PLANE_SZ] * inv;
+    /* The normal equations about the means, a 2 by 2 system */
+    const double cxx = s[BCAL_PLANE_SXX] - s[BCAL_PLANE_SX] * mx;
+    const double cxy = s[BCAL_PLANE_SXY] - s[BCAL_PLANE_SX] * my;
+    const double cyy = s[BCAL_PLANE_SYY] - s[BCAL_PLANE_SY] * my;
+    const double cxz = s[BCAL_PLANE_SXZ] - s[BCAL_PLANE_SX] * mz;
+    const double cyz = s[BCAL_PLANE_SYZ] - s[BCAL_PLANE_SY] * mz;
+    const double czz = s[BCAL_PLANE_SZZ] - s[BCAL_PLANE_SZ] * mz;
+    const double det = cxx * cyy - cxy * cxy;
+    const int ok = (n >= BCAL_PLANE_MIN_POINTS) &
+                   (det > FIT_EPSILON * cxx * cyy);
+    const double idet = 1. / det;
+    const double b = (cxz * cyy - cyz * cxy) * idet;
+    const double c = (cyz * cxx - cxz * cxy) * idet;
+    const double rss = czz - b * cxz - c * cyz;
+    const double v = (rss > 0 ? rss : 0.) / (n - 1);
+    /*
+    ** Fail by adding NaN rather than selecting it, or the compiler moves
+    ** the divisions under a branch, as they may trap.
+    */
+    const double fail = ok ? 0. : NAN;
+    *gx = b + fail;
+    *gy = c + fail;
+    *var = v + fail;
+    return ok;
+}
+
+/*
+** Fit the n pixels of counts c and sums s, sum j of each stride after sum
+** j - 1, on their own.  The sweep of a block.
+*/
+static BCAL_NOINLINE void fit_block( uint32 n, const uint32 *BCAL_RESTRICT c,
+                                     const double *BCAL_RESTRICT s,
+                                     uint64 stride,
+                                     double *BCAL_RESTRICT gx,
+                                     double *BCAL_RESTRICT gy,
+                                     double *BCAL_RESTRICT var )
+{
+    double p[BCAL_PLANE_SUMS];
+    uint32 i;
+    int j;
+    for( i = 0; i < n; i++ )
+    {
+        for( j = 0; j < BCAL_PLANE_SUMS; j++ )
+        {
+            p[j] = s[j * stride + i];
+        }
+        fit( c[i], p, gx + i, gy + i, var + i );
+    }
+}
+
+/*
+** Add the sums of pixel k of a to n and s, with its points dx and dy from
+** the origin of s.
+*/
+static void merge( const bcal_metrics_acc *a, uint64 k, double dx,
+                   double dy, double *n, double *s )
+{
+    const double m = a->set[BCAL_SET_ZB].n[k];
+    const double sx = a->plane[BCAL_PLANE_SX][k];
+    const double sy = a->plane[BCAL_PLANE_SY][k];
+    const double sz = a->plane[BCAL_PLANE_SZ][k];
+    *n += m;
+    s[BCAL_PLANE_SX] += sx + m * dx;
+    s[BCAL_PLANE_SY] += sy + m * dy;
+    s[BCAL_PLANE_SZ] += sz;
+    s[BCAL_PLANE_SXX] += a->plane[BCAL_PLANE_SXX][k] + 2 * dx * sx +
+                         m * dx * dx;
+    s[BCAL_PLANE_SXY] += a->plane[BCAL_PLANE_SXY][k] + dx * sy + dy * sx +
+                         m * dx * dy;
+    s[BCAL_PLANE_SYY] += a->plane[BCAL_PLANE_SYY][k] + 2 * dy * sy +
+                         m * dy * dy;
+    s[BCAL_PLANE_SXZ] += a->plane[BCAL_PLANE_SXZ][k] + dx * sz;
+    s[BCAL_PLANE_SYZ] += a->plane[BCAL_PLANE_SYZ][k] + dy * sz;
+    s[BCAL_PLANE_SZZ] += a->plane[BCAL_PLANE_SZZ][k];
+}
+
+/*
+** Fit the pixel at row r, column c of the accumulators, which start at row
+** lo and end before hi, to its own points and then those up to fill pixels
+** away, until a fit succeeds.
+*/
+static int fit_window( const bcal_metrics_file *v, uint32 lo, uint32 hi,
+                       uint32 r, uint32 c, double *gx, double *gy,
+                       double *var )
+{
+    const bcal_metrics_acc *a = v->acc;
+    const int64 nx = v->r.nx, f_max = v->b.fill;
+    const double cell = v->r.cell;
+    double n = 0, s[BCAL_PLANE_SUMS];
+    int64 f, rr, cc, step;
+    memset( s, 0, sizeof( s ) );
+    merge( a, (uint64)(r - lo) * nx + c, 0., 0., &n, s );
+    for( f = 1; f <= f_max; f++ )
+    {
+        /* The ring f pixels away */
+        for( rr = (int64)r - f; rr <= (int64)r + f; rr++ )
+        {
+            if( rr < lo || rr >= hi )
+            {
+                continue;
+            }
+            step = rr == (int64)r - f || rr == (int64)r + f ? 1 : 2 * f;
+            for( cc = (int64)c - f; cc <= (int64)c + f; cc += step )
+            {
+                if( cc >= 0 && cc < nx )
+                {
+                    merge( a, (uint64)(rr - lo) * nx + cc,
+                           (double)(cc - c) * cell, (double)(r - rr) * cell,
+                           &n, s );
+                }
+            }
+        }
+        if( fit( n, s, gx, gy, var ) )
+        {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/*
+** bcal_plane_fits solves the planes of the n pixels from first of the
+** merged accumulators of v, which start at row lo and end before hi, for
+** their gradients gx and gy and the variances var of their points about
+** them.  Pixels that fail alone and within -fill pixels are NaN.
+*/
+void bcal_plane_fits( const bcal_metrics_file *v, uint32 lo, uint32 hi,
+                      uint64 first, uint32 n, double *gx, double *gy,
+                      double *var )
+{
+    const bcal_metrics_acc *a = v->acc;
+    const uint64 nx = v->r.nx;
+    uint64 k;
+    uint32 i;
+    fit_block( n, a->set[BCAL_SET_ZB].n + first, a->plane[0] + first,
+               a->pixels, gx, gy, var );
+    for( i = 0; i < n && v->b.fill > 0; i++ )
+    {
+        k = first + i;
+        if( isnan( gx[i] ) )
+        {
+            fit_window( v, lo, hi, lo + (uint32)(k / nx), (uint32)(k % nx),
+                        gx + i, gy + i, var + i );
+        }
+    }
+}
+
+/*
+** bcal_plane_value returns the value of plane product of a pixel with
+** gradient gx and gy and variance var about its plane, nodata if its fit
+** failed.
+*/
+double bcal_plane_value( int product, double gx, double gy, double var,
+                         double nodata )
+{
+    const double deg = 180. / M_PI;
+    double aspect;
+    if( isnan( gx ) )
+    {
+        return nodata;
+    }
+    aspect = atan2( gx, gy ) * deg + (gx < 0 ? 360. : 0.);
+    switch( product )
+    {
+    case BCAL_BARE_SLOPE:
+        return atan( sqrt( gx * gx + gy * gy ) ) * deg;
+    case BCAL_BARE_ASPECT:
+        return aspect;
+    case BCAL_BARE_TRASP:
+        return (1. - cos( (aspect - 30.) / deg )) / 2.;
+    case BCAL_BARE_LROUGH:
+        return sqrt( var );
+    default:
+        return nodata;
+    }
+}
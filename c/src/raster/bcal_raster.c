@@ -0,0 +1,277 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** raster holds what the raster tools share: the pixel grid over a mosaic
+** of inputs, the bands of rows they are written in, the records each band
+** reads and the GeoTIFF they are written to.  The IDL tools histogram
+** every point of a file and hold the whole raster.  Here a tool keeps
+** fixed size state for a band of rows, streams the records near the band
+** into it and writes the band before moving to the next, so memory is
+** bounded by the band.  An input indexed with bcal index only has the
+** records near each band read.
+*/
+
+#include <limits.h>
+#include <math.h>
+
+#include "bcal_raster.h"
+
+#include "cpl_conv.h"
+#include "cpl_string.h"
+#include "ogr_srs_api.h"
+
+static int overlaps( const OGREnvelope *a, const OGREnvelope *b )
+{
+    return a->MinX <= b->MaxX && a->MaxX >= b->MinX &&
+           a->MinY <= b->MaxY && a->MaxY >= b->MinY;
+}
+
+/*
+** bcal_raster_open opens inputs, decoding laz as it is read where it can
+** and otherwise decompressing it with jobs threads, and lays a grid of cell
+** size over env, or the bounds of the inputs if env is NULL.  Release with
+** bcal_raster_close, whatever the result.
+*/
+CPLErr bcal_raster_open( bcal_raster *r, char **inputs, uint32 jobs,
+                         const OGREnvelope *env, double cell )
+{
+    OGREnvelope e;
+    memset( r, 0, sizeof( bcal_raster ) );
+    if( !(cell > 0) )
+    {
+        CPLError( CE_Failure, CPLE_IllegalArg, "Invalid cell size %g",
+                  cell );
+        return CE_Failure;
+    }
+    if( bcal_mosaic_open( &r->m, inputs, (uint32)CSLCount( inputs ),
+                          jobs, TRUE ) != CE_None )
+    {
+        return CE_Failure;
+    }
+    if( env != NULL )
+    {
+        e = *env;
+    }
+    else
+    {
+        bcal_mosaic_env( &r->m, &e );
+    }
+    if( !(e.MaxX >= e.MinX) || !(e.MaxY >= e.MinY) ||
+        ceil( (e.MaxX - e.MinX) / cell ) >= INT_MAX ||
+        ceil( (e.MaxY - e.MinY) / cell ) >= INT_MAX )
+    {
+        CPLError( CE_Failure, CPLE_IllegalArg,
+                  "Invalid raster extent for a cell size of %g", cell );
+        return CE_Failure;
+    }
+    r->cell = cell;
+    r->nx = (uint32)ceil( (e.MaxX - e.MinX) / cell );
+    r->ny = (uint32)ceil( (e.MaxY - e.MinY) / cell );
+    r->nx = r->nx > 0 ? r->nx : 1;
+    r->ny = r->ny > 0 ? r->ny : 1;
+    r->min_x = e.MinX;
+    r->max_y = e.MinY + r->ny * cell;
+    return CE_None;
+}
+
+void bcal_raster_close( bcal_raster *r )
+{
+    bcal_mosaic_close( &r->m );
+}
+
+/*
+** bcal_raster_band_rows returns how many rows of pixel_bytes each fit in
+** max_mem, less halo rows either side, at least 1 and at most the raster.
+** All of them without a budget.
+*/
+uint32 bcal_raster_band_rows( const bcal_raster *r, uint64 max_mem,
+                              uint64 pixel_bytes, uint32 halo )
+{
+    uint64 rows = r->ny;
+    if( max_mem > 0 )
+    {
+        rows = max_mem / (r->nx * pixel_bytes);
+        rows = rows > 2 * (uint64)halo ? rows - 2 * (uint64)halo : 1;
+        rows = rows < r->ny ? rows : r->ny;
+    }
+    return (uint32)rows;
+}
+
+/*
+** bcal_raster_chunks lists the records that may hold points of rows lo to
+** hi - 1, in spans of at most BCAL_RASTER_READ_BLOCK records.  Those are
+** the runs of the cells of indexed files, and every record of the others,
+** skipping files that do not reach the rows.  Spans of laz decoded as it
+** is read are whole chunks where they fit.  Free *chunks.
+*/
+CPLErr bcal_raster_chunks( const bcal_raster *r, uint32 lo, uint32 hi,
+                           bcal_raster_chunk **chunks, uint32 *n )
+{
+    const bcal_las *las;
+    bcal_raster_chunk *c = NULL, *grown;
+    bcal_bcx_run *runs, all;
+    OGREnvelope env;
+    uint64 n_runs, count, span, j, k;
+    uint32 i, alloced = 0;
+    *chunks = NULL;
+    *n = 0;
+    env.MinX = r->min_x;
+    env.MaxX = r->min_x + r->nx * r->cell;
+    env.MinY = r->max_y - hi * r->cell;
+    env.MaxY = r->max_y - lo * r->cell;
+    for( i = 0; i < r->m.n; i++ )
+    {
+        las = r->m.las + i;
+        if( !overlaps( r->m.envs + i, &env ) )
+        {
+            continue;
+        }
+        span = BCAL_RASTER_READ_BLOCK;
+        if( las->chunk_points > 0 && las->chunk_points < span )
+        {
+            span = span / las->chunk_points * las->chunk_points;
+        }
+        all.start = 0;
+        all.count = las->h.n_points;
+        runs = &all;
+        n_runs = 1;
+        if( las->index != NULL &&
+            bcal_bcx_query( las->index, &env, &runs, &n_runs,
+                            &count ) != CE_None )
+        {
+            free( c );
+            return CE_Failure;
+        }
+        for( j = 0; j < n_runs; j++ )
+        {
+            for( k = 0; k < runs[j].count; k += span )
+            {
+                if( *n == alloced )
+                {
+                    alloced = alloced > 0 ? alloced * 2 : 64;
+                    grown = realloc( c, sizeof( bcal_raster_chunk ) *
+                                        alloced );
+                    if( grown == NULL )
+                    {
+                        CPLError( CE_Failure, CPLE_OutOfMemory,
+                                  "Failed to list the records of a band" );
+                        free( c );
+                        if( runs != &all )
+                        {
+                            free( runs );
+                        }
+                        return CE_Failure;
+                    }
+                    c = grown;
+                }
+                c[*n].file = i;
+                c[*n].start = runs[j].start + k;
+                c[*n].count = runs[j].count - k < span ?
+                              runs[j].count - k : span;
+                (*n)++;
+            }
+        }
+        if( runs != &all )
+        {
+            free( runs );
+        }
+    }
+    *chunks = c;
+    return CE_None;
+}
+
+/*
+** The WKT of the output, from srs or the WKT record of the first input.
+** NULL if neither has one, or srs does not parse.
+*/
+static char * output_wkt( const bcal_raster *r, const char *srs )
+{
+    const bcal_las_vlr *vlr;
+    OGRSpatialReferenceH hSRS;
+    char *wkt = NULL, *copy = NULL;
+    if( srs != NULL )
+    {
+        hSRS = OSRNewSpatialReference( NULL );
+        if( OSRSetFromUserInput( hSRS, srs ) == OGRERR_NONE &&
+            OSRExportToWkt( hSRS, &wkt ) == OGRERR_NONE )
+        {
+            copy = strdup( wkt );
+        }
+        else
+        {
+            CPLError( CE_Failure, CPLE_IllegalArg,
+                      "Failed to read spatial reference %s", srs );
+        }
+        CPLFree( wkt );
+        OSRDestroySpatialReference( hSRS );
+        return copy;
+    }
+    vlr = bcal_las_find_vlr( r->m.las, "LASF_Projection", 2112 );
+    if( vlr != NULL )
+    {
+        copy = calloc( vlr->length + 1, 1 );
+        if( copy != NULL )
+        {
+            memcpy( copy, vlr->data, vlr->length );
+        }
+        return copy;
+    }
+    if( bcal_las_find_vlr( r->m.las, "LASF_Projection", 34735 ) != NULL )
+    {
+        CPLError( CE_Warning, CPLE_NotSupported,
+                  "%s has GeoTIFF keys but no WKT, set the spatial "
+                  "reference of the output with -a_srs", r->m.las->path );
+    }
+    return NULL;
+}
+
+/*
+** bcal_raster_create creates the float GeoTIFF of r at path with the given
+** bands, all with nodata.  The spatial reference is srs, or the WKT of the
+** first input if srs is NULL.  options are GDAL creation options.
+*/
+GDALDatasetH bcal_raster_create( const bcal_raster *r, const char *path,
+                                 int bands, double nodata, const char *srs,
+                                 char **options )
+{
+    GDALDriverH hDriver;
+    GDALDatasetH hDS;
+    double gt[6];
+    char *wkt;
+    int i;
+    wkt = output_wkt( r, srs );
+    if( wkt == NULL && srs != NULL )
+    {
+        return NULL;
+    }
+    GDALAllRegister();
+    hDriver = GDALGetDriverByName( "GTiff" );
+    hDS = hDriver == NULL ? NULL :
+          GDALCreate( hDriver, path, (int)r->nx, (int)r->ny, bands,
+                      GDT_Float32, options );
+    if( hDS == NULL )
+    {
+        CPLError( CE_Failure, CPLE_AppDefined, "Failed to create %s", path );
+        free( wkt );
+        return NULL;
+    }
+    gt[0] = r->min_x;
+    gt[1] = r->cell;
+    gt[2] = 0.;
+    gt[3] = r->max_y;
+    gt[4] = 0.;
+    gt[5] = -r->cell;
+    GDALSetGeoTransform( hDS, gt );
+    if( wkt != NULL )
+    {
+        GDALSetProjection( hDS, wkt );
+    }
+    for( i = 1; i <= bands; i++ )
+    {
+        GDALSetRasterNoDataValue( GDALGetRasterBand( hDS, i ), nodata );
+    }
+    free( wkt );
+    return hDS;
+}
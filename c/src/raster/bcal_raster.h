@@ -0,0 +1,78 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef BCAL_RASTER_H_
+#define BCAL_RASTER_H_
+
+#include "bcal_filter.h"
+#include "bcal_las.h"
+#include "bcal_types.h"
+
+/* Records read at a time while a band of a raster is accumulated */
+#define BCAL_RASTER_READ_BLOCK 65536
+
+/*
+** A raster of nx by ny pixels of cell size over a mosaic of las files,
+** from min_x, max_y with row 0 to the north.  The pixels line up with the
+** south west corner of the extent, as in the IDL raster tools.
+*/
+typedef struct bcal_raster
+{
+    bcal_mosaic m;
+    double cell;
+    double min_x;
+    double max_y;
+    uint32 nx;
+    uint32 ny;
+} bcal_raster;
+
+/*
+** A span of records of one file of the mosaic, read as a unit while a band
+** is accumulated.
+*/
+typedef struct bcal_raster_chunk
+{
+    uint32 file;
+    uint64 start;
+    uint64 count;
+} bcal_raster_chunk;
+
+CPLErr bcal_raster_open( bcal_raster *r, char **inputs, uint32 jobs,
+                         const OGREnvelope *env, double cell );
+
+void bcal_raster_close( bcal_raster *r );
+
+uint32 bcal_raster_band_rows( const bcal_raster *r, uint64 max_mem,
+                              uint64 pixel_bytes, uint32 halo );
+
+CPLErr bcal_raster_chunks( const bcal_raster *r, uint32 lo, uint32 hi,
+                           bcal_raster_chunk **chunks, uint32 *n );
+
+/*
+** bcal_raster_pixel finds the row and column of point i of p, read at the
+** scale of the mosaic.  Points on the east and south edges are in the last
+** pixel.  Returns FALSE for points off the raster.
+*/
+static inline int bcal_raster_pixel( const bcal_raster *r,
+                                     const bcal_points *p, uint32 i,
+                                     uint32 *row, uint32 *col )
+{
+    double x = bcal_points_x( p, i ) - r->min_x;
+    double y = r->max_y - bcal_points_y( p, i );
+    if( !(x >= 0 && x <= r->nx * r->cell && y >= 0 && y <= r->ny * r->cell) )
+    {
+        return FALSE;
+    }
+    *col = (uint32)(x / r->cell);
+    *col = *col < r->nx ? *col : r->nx - 1;
+    *row = (uint32)(y / r->cell);
+    *row = *row < r->ny ? *row : r->ny - 1;
+    return TRUE;
+}
+
+GDALDatasetH bcal_raster_create( const bcal_raster *r, const char *path,
+                                 int bands, double nodata, const char *srs,
+                                 char **options );
+
+#endif /* BCAL_RASTER_H_ */
@@ -0,0 +1,396 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** sketch keeps a fixed size summary of the values of each pixel, from which
+** percentiles are read without holding the values.  VegMetrics_BCAL.pro
+** gathers every height of a pixel and sorts them.  A sketch keeps up to k
+** bins of a pixel, each the mean and count of some of its values, as the
+** streaming histogram of Ben-Haim and Tom-Tov does.  A value added takes a
+** bin of its own, so the sketch is exact until the pixel has more than k
+** distinct values.  When the k bins are full, the closest bins are merged
+** until a quarter of them are free again.  Equal values merge first and
+** lose nothing, and bins merge where the values are dense, so the error of
+** a percentile is small in height however the heights are spread, about a
+** percent of their range for a k of 64.
+**
+** Sketches of the same pixels merge by pooling their bins and merging the
+** closest until they fit.  Partial sketches of a band filled by several
+** threads are merged this way.
+**
+** Exact sketches, k of 0, keep every value of the band as a (pixel, value)
+** pair, and sort them all once the band is read.
+*/
+
+#include "bcal_sketch.h"
+
+#include <string.h>
+
+/* Bins sorted at a time with insertion sort */
+#define INSERTION_SORT 256
+
+static int compare_bins( const void *a, const void *b )
+{
+    float ma = ((const bcal_sketch_bin*)a)->mean;
+    float mb = ((const bcal_sketch_bin*)b)->mean;
+    return ma < mb ? -1 : ma > mb;
+}
+
+static int compare_floats( const void *a, const void *b )
+{
+    float fa = *(const float*)a;
+    float fb = *(const float*)b;
+    return fa < fb ? -1 : fa > fb;
+}
+
+static int compare_u64( const void *a, const void *b )
+{
+    uint64 ua = *(const uint64*)a;
+    uint64 ub = *(const uint64*)b;
+    return ua < ub ? -1 : ua > ub;
+}
+
+/* Sorts bins by mean, usually sorted but for a few appended */
+static void sort_bins( bcal_sketch_bin *b, uint32 n )
+{
+    bcal_sketch_bin t;
+    uint32 i, j;
+    if( n > INSERTION_SORT )
+    {
+        qsort( b, n, sizeof( bcal_sketch_bin ), compare_bins );
+        return;
+    }
+    for( i = 1; i < n; i++ )
+    {
+        t = b[i];
+        for( j = i; j > 0 && b[j - 1].mean > t.mean; j-- )
+        {
+            b[j] = b[j - 1];
+        }
+        b[j] = t;
+    }
+}
+
+/*
+** Merge the closest of the n bins b until at most target are left, and
+** return how many are.  Each pass merges the pairs of neighbours at most
+** the gap of the pair that has to be merged last.
+*/
+static uint32 shrink( bcal_sketch_bin *b, uint32 n, uint32 target )
+{
+    float gaps[2 * BCAL_SKETCH_MAX_K], gap;
+    uint32 j, m, need, merged, count;
+    double mean;
+    sort_bins( b, n );
+    while( n > target )
+    {
+        need = n - target;
+        for( j = 0; j + 1 < n; j++ )
+        {
+            gaps[j] = b[j + 1].mean - b[j].mean;
+        }
+        qsort( gaps, n - 1, sizeof( float ), compare_floats );
+        gap = gaps[need - 1];
+        for( j = 0, m = 0, merged = 0; j < n; m++ )
+        {
+            if( merged < need && j + 1 < n &&
+                b[j + 1].mean - b[j].mean <= gap )
+            {
+                count = b[j].count + b[j + 1].count;
+                mean = ((double)b[j].mean * b[j].count +
+                        (double)b[j + 1].mean * b[j + 1].count) / count;
+                b[m].count = count;
+                b[m].mean = (float)mean;
+                merged++;
+                j += 2;
+            }
+            else
+            {
+                b[m] = b[j++];
+            }
+        }
+        n = m;
+    }
+    return n;
+}
+
+/*
+** bcal_sketch_init allocates sketches of n pixels that keep k bins each,
+** 2 to BCAL_SKETCH_MAX_K, or 0 for exact sketches.  Release with
+** bcal_sketch_free, whatever the result.
+*/
+CPLErr bcal_sketch_init( bcal_sketch *s, uint32 k, uint64 n )
+{
+    memset( s, 0, sizeof( bcal_sketch ) );
+    if( k == 1 || k > BCAL_SKETCH_MAX_K )
+    {
+        CPLError( CE_Failure, CPLE_IllegalArg,
+                  "A sketch keeps 2 to %d bins, or 0 for all values",
+                  BCAL_SKETCH_MAX_K );
+        return CE_Failure;
+    }
+    s->k = k;
+    s->n = n;
+    if( k == 0 )
+    {
+        s->first = calloc( n + 1, sizeof( uint64 ) );
+        if( s->first == NULL )
+        {
+            CPLError( CE_Failure, CPLE_OutOfMemory,
+                      "Failed to allocate exact sketches of %llu pixels",
+                      (unsigned long long)n );
+            return CE_Failure;
+        }
+        return CE_None;
+    }
+    s->held = calloc( n, sizeof( uint16 ) );
+    s->bins = malloc( sizeof( bcal_sketch_bin ) * k * n );
+    if( s->held == NULL || s->bins == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate sketches of %llu pixels",
+                  (unsigned long long)n );
+        return CE_Failure;
+    }
+    return CE_None;
+}
+
+/* bcal_sketch_reset empties the sketches of the first n pixels. */
+void bcal_sketch_reset( bcal_sketch *s, uint64 n )
+{
+    s->n_pairs = 0;
+    if( s->k != 0 )
+    {
+        memset( s->held, 0, sizeof( uint16 ) * n );
+    }
+}
+
+CPLErr bcal_sketch_add_exact( bcal_sketch *s, uint64 i, uint16 v )
+{
+    uint64 *grown;
+    if( s->n_pairs == s->alloced )
+    {
+        s->alloced = s->alloced > 0 ? s->alloced * 2 : 65536;
+        grown = realloc( s->pairs, sizeof( uint64 ) * s->alloced );
+        if( grown == NULL )
+        {
+            CPLError( CE_Failure, CPLE_OutOfMemory,
+                      "Failed to grow exact sketches to %llu values",
+                      (unsigned long long)s->alloced );
+            return CE_Failure;
+        }
+        s->pairs = grown;
+    }
+    s->pairs[s->n_pairs++] = i << 16 | v;
+    return CE_None;
+}
+
+/* bcal_sketch_compact frees a quarter of the full bins of pixel i. */
+void bcal_sketch_compact( bcal_sketch *s, uint64 i )
+{
+    s->held[i] = (uint16)shrink( s->bins + i * s->k, s->held[i],
+                                 s->k - (s->k + 3) / 4 );
+}
+
+/*
+** bcal_sketch_merge adds the sketch of pixel i of src to that of dst.  Both
+** keep the same k.
+*/
+void bcal_sketch_merge( bcal_sketch *dst, const bcal_sketch *src,
+                        uint64 i )
+{
+    bcal_sketch_bin pool[2 * BCAL_SKETCH_MAX_K];
+    uint32 n = dst->held[i];
+    if( src->held[i] == 0 )
+    {
+        return;
+    }
+    memcpy( pool, dst->bins + i * dst->k, sizeof( bcal_sketch_bin ) * n );
+    memcpy( pool + n, src->bins + i * src->k,
+            sizeof( bcal_sketch_bin ) * src->held[i] );
+    n = shrink( pool, n + src->held[i], dst->k );
+    memcpy( dst->bins + i * dst->k, pool, sizeof( bcal_sketch_bin ) * n );
+    dst->held[i] = (uint16)n;
+}
+
+/* bcal_sketch_merge_exact adds every value of src to dst. */
+CPLErr bcal_sketch_merge_exact( bcal_sketch *dst, const bcal_sketch *src )
+{
+    uint64 *grown;
+    if( dst->n_pairs + src->n_pairs > dst->alloced )
+    {
+        grown = realloc( dst->pairs, sizeof( uint64 ) *
+                                     (dst->n_pairs + src->n_pairs) );
+        if( grown == NULL )
+        {
+            CPLError( CE_Failure, CPLE_OutOfMemory,
+                      "Failed to merge exact sketches" );
+            return CE_Failure;
+        }
+        dst->pairs = grown;
+        dst->alloced = dst->n_pairs + src->n_pairs;
+    }
+    if( src->n_pairs > 0 )
+    {
+        memcpy( dst->pairs + dst->n_pairs, src->pairs,
+                sizeof( uint64 ) * src->n_pairs );
+    }
+    dst->n_pairs += src->n_pairs;
+    return CE_None;
+}
+
+/*
+** bcal_sketch_sort sorts the values of exact sketches by pixel, once they
+** are all added.  Sketches of k bins are sorted by bcal_sketch_get.
+*/
+CPLErr bcal_sketch_sort( bcal_sketch *s )
+{
+    uint64 j, i = 0;
+    if( s->k != 0 )
+    {
+        return CE_None;
+    }
+    free( s->values );
+    s->values = malloc( sizeof( uint16 ) * (s->n_pairs + 1) );
+    if( s->values == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to sort %llu values",
+                  (unsigned long long)s->n_pairs );
+        return CE_Failure;
+    }
+    qsort( s->pairs, s->n_pairs, sizeof( uint64 ), compare_u64 );
+    for( j = 0; j < s->n_pairs; j++ )
+    {
+        while( i <= (s->pairs[j] >> 16) )
+        {
+            s->first[i++] = j;
+        }
+        s->values[j] = (uint16)(s->pairs[j] & 0xffff);
+    }
+    while( i <= s->n )
+    {
+        s->first[i++] = s->n_pairs;
+    }
+    return CE_None;
+}
+
+/* Make room for m values in q */
+static CPLErr reserve( bcal_sketch_sorted *q, uint64 m )
+{
+    float *v;
+    uint32 *w;
+    if( m <= q->alloced )
+    {
+        return CE_None;
+    }
+    v = m > UINT32_MAX ? NULL : realloc( q->v, sizeof( float ) * m );
+    if( v != NULL )
+    {
+        q->v = v;
+    }
+    w = m > UINT32_MAX ? NULL : realloc( q->w, sizeof( uint32 ) * m );
+    if( w != NULL )
+    {
+        q->w = w;
+    }
+    if( v == NULL || w == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory,
+                  "Failed to allocate %llu values of a pixel",
+                  (unsigned long long)m );
+        return CE_Failure;
+    }
+    q->alloced = (uint32)m;
+    return CE_None;
+}
+
+/* Append w of value v to q, adding to its last value if the same */
+static void append( bcal_sketch_sorted *q, float v, uint32 w )
+{
+    if( q->m > 0 && q->v[q->m - 1] == v )
+    {
+        q->w[q->m - 1] += w;
+    }
+    else
+    {
+        q->v[q->m] = v;
+        q->w[q->m++] = w;
+    }
+    q->total += w;
+}
+
+/*
+** bcal_sketch_get sorts the values of pixel i into q, which is reused from
+** pixel to pixel.  Free it with bcal_sketch_sorted_free.
+*/
+CPLErr bcal_sketch_get( const bcal_sketch *s, uint64 i,
+                        bcal_sketch_sorted *q )
+{
+    bcal_sketch_bin b[BCAL_SKETCH_MAX_K];
+    uint64 j, first, last;
+    q->m = 0;
+    q->total = 0;
+    if( s->k == 0 )
+    {
+        first = s->first[i];
+        last = s->first[i + 1];
+        if( reserve( q, last - first ) != CE_None )
+        {
+            return CE_Failure;
+        }
+        for( j = first; j < last; j++ )
+        {
+            append( q, s->values[j], 1 );
+        }
+        return CE_None;
+    }
+    if( reserve( q, s->k ) != CE_None )
+    {
+        return CE_Failure;
+    }
+    memcpy( b, s->bins + i * s->k, sizeof( bcal_sketch_bin ) * s->held[i] );
+    sort_bins( b, s->held[i] );
+    for( j = 0; j < s->held[i]; j++ )
+    {
+        append( q, b[j].mean, b[j].count );
+    }
+    return CE_None;
+}
+
+/*
+** bcal_sketch_rank returns the value of rank r of q, from 0, as would be
+** v[r] of all the values sorted.
+*/
+float bcal_sketch_rank( const bcal_sketch_sorted *q, uint64 r )
+{
+    uint64 seen = 0;
+    uint32 j;
+    for( j = 0; j + 1 < q->m; j++ )
+    {
+        seen += q->w[j];
+        if( seen > r )
+        {
+            break;
+        }
+    }
+    return q->v[j];
+}
+
+void bcal_sketch_sorted_free( bcal_sketch_sorted *q )
+{
+    free( q->v );
+    free( q->w );
+    memset( q, 0, sizeof( bcal_sketch_sorted ) );
+}
+
+void bcal_sketch_free( bcal_sketch *s )
+{
+    free( s->held );
+    free( s->bins );
+    free( s->pairs );
+    free( s->values );
+    free( s->first );
+    memset( s, 0, sizeof( bcal_sketch ) );
+}
@@ -0,0 +1,105 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef BCAL_SKETCH_H_
+#define BCAL_SKETCH_H_
+
+#include <stdlib.h>
+
+#include "bcal_types.h"
+
+#include <gdal.h>
+
+/* Default bins a sketch keeps per pixel */
+#define BCAL_SKETCH_K 64
+/* Most bins a sketch keeps per pixel */
+#define BCAL_SKETCH_MAX_K 4096
+
+/* A bin of a sketch, count values of this mean */
+typedef struct bcal_sketch_bin
+{
+    float mean;
+    uint32 count;
+} bcal_sketch_bin;
+
+/*
+** Quantile sketches of the uint16 values of n pixels, see bcal_sketch.c.
+** With k of 0 every value is kept, and the sketches are exact.
+*/
+typedef struct bcal_sketch
+{
+    uint32 k;
+    uint64 n;
+    /* Bins used by each pixel */
+    uint16 *held;
+    /* k bins per pixel */
+    bcal_sketch_bin *bins;
+    /*
+    ** Exact sketches keep (pixel << 16 | value) of every value, sorted and
+    ** split into values and the first value of each pixel by
+    ** bcal_sketch_sort.
+    */
+    uint64 *pairs;
+    uint64 n_pairs;
+    uint64 alloced;
+    uint16 *values;
+    uint64 *first;
+} bcal_sketch;
+
+/*
+** The values of a pixel in order, each standing for w of the values added,
+** w summing to total.
+*/
+typedef struct bcal_sketch_sorted
+{
+    float *v;
+    uint32 *w;
+    uint32 m;
+    uint32 alloced;
+    uint64 total;
+} bcal_sketch_sorted;
+
+CPLErr bcal_sketch_init( bcal_sketch *s, uint32 k, uint64 n );
+
+void bcal_sketch_reset( bcal_sketch *s, uint64 n );
+
+CPLErr bcal_sketch_add_exact( bcal_sketch *s, uint64 i, uint16 v );
+
+void bcal_sketch_compact( bcal_sketch *s, uint64 i );
+
+/* bcal_sketch_add adds v to pixel i. */
+static inline CPLErr bcal_sketch_add( bcal_sketch *s, uint64 i, uint16 v )
+{
+    bcal_sketch_bin *b;
+    if( s->k == 0 )
+    {
+        return bcal_sketch_add_exact( s, i, v );
+    }
+    if( s->held[i] == s->k )
+    {
+        bcal_sketch_compact( s, i );
+    }
+    b = s->bins + i * s->k + s->held[i]++;
+    b->mean = v;
+    b->count = 1;
+    return CE_None;
+}
+
+void bcal_sketch_merge( bcal_sketch *dst, const bcal_sketch *src,
+                        uint64 i );
+
+CPLErr bcal_sketch_merge_exact( bcal_sketch *dst, const bcal_sketch *src );
+
+CPLErr bcal_sketch_sort( bcal_sketch *s );
+
+CPLErr bcal_sketch_get( const bcal_sketch *s, uint64 i,
+                        bcal_sketch_sorted *q );
+
+float bcal_sketch_rank( const bcal_sketch_sorted *q, uint64 r );
+
+void bcal_sketch_sorted_free( bcal_sketch_sorted *q );
+
+void bcal_sketch_free( bcal_sketch *s );
+
+#endif /* BCAL_SKETCH_H_ */
@@ -0,0 +1,226 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** pool runs a set of independent tasks over a fixed number of threads with
+** work stealing.  Tasks are dealt out heaviest first into a queue per
+** thread.  A thread takes work from the front of its own queue, and once it
+** runs dry it steals from the back of the fullest queue, so threads that
+** drew sparse tiles help with the dense ones.  The calling thread works as
+** well.
+*/
+
+#include "bcal_pool.h"
+
+#include "cpl_atomic_ops.h"
+#include "cpl_multiproc.h"
+
+typedef struct bcal_queue
+{
+    CPLMutex *lock;
+    uint32 *tasks;
+    volatile uint32 head;
+    volatile uint32 tail;
+} bcal_queue;
+
+typedef struct bcal_pool
+{
+    bcal_task f;
+    void *arg;
+    uint32 jobs;
+    bcal_queue *q;
+    volatile int failed;
+    volatile int steals;
+} bcal_pool;
+
+typedef struct bcal_worker
+{
+    bcal_pool *pool;
+    uint32 id;
+} bcal_worker;
+
+static int take( bcal_queue *q, int back, uint32 *task )
+{
+    int found = FALSE;
+    CPLAcquireMutex( q->lock, 1000.0 );
+    if( q->head < q->tail )
+    {
+        *task = back ? q->tasks[--q->tail] : q->tasks[q->head++];
+        found = TRUE;
+    }
+    CPLReleaseMutex( q->lock );
+    return found;
+}
+
+/* Steal from the queue with the most work left. */
+static int steal( bcal_pool *pool, uint32 self, uint32 *task )
+{
+    uint32 i, victim, left, most;
+    for( ;; )
+    {
+        most = 0;
+        victim = self;
+        for( i = 0; i < pool->jobs; i++ )
+        {
+            left = pool->q[i].tail - pool->q[i].head;
+            if( i != self && left > most )
+            {
+                most = left;
+                victim = i;
+            }
+        }
+        if( most == 0 )
+        {
+            return FALSE;
+        }
+        if( take( &pool->q[victim], TRUE, task ) )
+        {
+            CPLAtomicAdd( &pool->steals, 1 );
+            return TRUE;
+        }
+    }
+}
+
+static void worker( void *p )
+{
+    bcal_worker *w = (bcal_worker*)p;
+    bcal_pool *pool = w->pool;
+    uint32 task;
+    while( !pool->failed )
+    {
+        if( !take( &pool->q[w->id], FALSE, &task ) &&
+            !steal( pool, w->id, &task ) )
+        {
+            break;
+        }
+        if( pool->f( pool->arg, task ) != CE_None )
+        {
+            CPLAtomicAdd( &pool->failed, 1 );
+        }
+    }
+}
+
+typedef struct bcal_weighted
+{
+    uint64 cost;
+    uint32 i;
+} bcal_weighted;
+
+static int compare_cost( const void *a, const void *b )
+{
+    const bcal_weighted *wa = (const bcal_weighted*)a;
+    const bcal_weighted *wb = (const bcal_weighted*)b;
+    if( wa->cost != wb->cost )
+    {
+        return wa->cost > wb->cost ? -1 : 1;
+    }
+    return wa->i < wb->i ? -1 : 1;
+}
+
+/*
+** bcal_pool_run_weighted calls f( arg, i ) for every i in [0, n) using up to
+** jobs threads and returns once all are done.  cost, when not NULL, gives
+** the relative cost of each task.  Tasks not yet started are skipped after
+** the first failure.
+*/
+CPLErr bcal_pool_run_weighted( uint32 jobs, uint32 n, const uint64 *cost,
+                               bcal_task f, void *arg )
+{
+    bcal_pool pool;
+    bcal_worker *workers;
+    CPLJoinableThread **threads;
+    bcal_weighted *order;
+    uint32 *slots;
+    uint32 i, per_queue;
+    if( n == 0 )
+    {
+        return CE_None;
+    }
+    if( jobs > n )
+    {
+        jobs = n;
+    }
+    if( jobs < 1 )
+    {
+        jobs = 1;
+    }
+    pool.f = f;
+    pool.arg = arg;
+    pool.jobs = jobs;
+    pool.failed = 0;
+    pool.steals = 0;
+    pool.q = calloc( jobs, sizeof( bcal_queue ) );
+    workers = malloc( sizeof( bcal_worker ) * jobs );
+    threads = calloc( jobs, sizeof( CPLJoinableThread* ) );
+    order = malloc( sizeof( bcal_weighted ) * n );
+    per_queue = n / jobs + 1;
+    slots = malloc( sizeof( uint32 ) * per_queue * jobs );
+    if( pool.q == NULL || workers == NULL || threads == NULL ||
+        order == NULL || slots == NULL )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory, "Failed to start threads" );
+        free( pool.q );
+        free( workers );
+        free( threads );
+        free( order );
+        free( slots );
+        return CE_Failure;
+    }
+    for( i = 0; i < n; i++ )
+    {
+        order[i].cost = cost != NULL ? cost[i] : 0;
+        order[i].i = i;
+    }
+    qsort( order, n, sizeof( bcal_weighted ), compare_cost );
+    /* Deal the tasks out round robin, heaviest first */
+    for( i = 0; i < jobs; i++ )
+    {
+        pool.q[i].tasks = slots + i * per_queue;
+        pool.q[i].lock = CPLCreateMutex();
+        /* Mutexes are created held */
+        CPLReleaseMutex( pool.q[i].lock );
+        workers[i].pool = &pool;
+        workers[i].id = i;
+    }
+    for( i = 0; i < n; i++ )
+    {
+        bcal_queue *q = &pool.q[i % jobs];
+        q->tasks[q->tail++] = order[i].i;
+    }
+    free( order );
+    for( i = 1; i < jobs; i++ )
+    {
+        threads[i] = CPLCreateJoinableThread( worker, &workers[i] );
+    }
+    worker( &workers[0] );
+    for( i = 1; i < jobs; i++ )
+    {
+        if( threads[i] != NULL )
+        {
+            CPLJoinThread( threads[i] );
+        }
+    }
+    /* Pick up the queue of any thread that failed to start */
+    if( !pool.failed )
+    {
+        worker( &workers[0] );
+    }
+    CPLDebug( "BCAL", "ran %u tasks on %u threads, %d stolen",
+              n, jobs, pool.steals );
+    for( i = 0; i < jobs; i++ )
+    {
+        CPLDestroyMutex( pool.q[i].lock );
+    }
+    free( slots );
+    free( pool.q );
+    free( workers );
+    free( threads );
+    return pool.failed ? CE_Failure : CE_None;
+}
+
+CPLErr bcal_pool_run( uint32 jobs, uint32 n, bcal_task f, void *arg )
+{
+    return bcal_pool_run_weighted( jobs, n, NULL, f, arg );
+}
+
@@ -0,0 +1,23 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef BCAL_POOL_H_
+#define BCAL_POOL_H_
+
+#include <stdlib.h>
+
+#include "bcal_types.h"
+
+#include <gdal.h>
+
+/* A unit of work, i is the task index in [0, n). */
+typedef CPLErr (*bcal_task)( void *arg, uint32 i );
+
+CPLErr bcal_pool_run( uint32 jobs, uint32 n, bcal_task f, void *arg );
+
+CPLErr bcal_pool_run_weighted( uint32 jobs, uint32 n, const uint64 *cost,
+                               bcal_task f, void *arg );
+
+#endif /* BCAL_POOL_H_ */
+
@@ -0,0 +1,61 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** time reads a monotonic clock for phase timings and the peak resident set
+** size of the process.
+*/
+
+#include "bcal_time.h"
+
+#ifdef _WIN32
+/* Use the kernel32 entry points, so psapi need not be linked */
+#define PSAPI_VERSION 2
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+/* bcal_time_now returns seconds since an arbitrary start. */
+double bcal_time_now( void )
+{
+#ifdef _WIN32
+    LARGE_INTEGER f, c;
+    QueryPerformanceFrequency( &f );
+    QueryPerformanceCounter( &c );
+    return (double)c.QuadPart / (double)f.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+/* bcal_peak_rss returns the peak resident set size in bytes, 0 if unknown. */
+uint64 bcal_peak_rss( void )
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if( !GetProcessMemoryInfo( GetCurrentProcess(), &pmc, sizeof( pmc ) ) )
+    {
+        return 0;
+    }
+    return (uint64)pmc.PeakWorkingSetSize;
+#else
+    struct rusage ru;
+    if( getrusage( RUSAGE_SELF, &ru ) != 0 )
+    {
+        return 0;
+    }
+#ifdef __APPLE__
+    return (uint64)ru.ru_maxrss;
+#else
+    /* Linux and the BSDs report kilobytes */
+    return (uint64)ru.ru_maxrss * 1024;
+#endif
+#endif
+}
+
@@ -0,0 +1,15 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef BCAL_TIME_H_
+#define BCAL_TIME_H_
+
+#include "bcal_types.h"
+
+double bcal_time_now( void );
+
+uint64 bcal_peak_rss( void );
+
+#endif /* BCAL_TIME_H_ */
+
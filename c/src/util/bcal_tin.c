@@ -0,0 +1,431 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** tin is an incremental Delaunay triangulation for linear interpolation of
+** a surface that grows a few points at a time, such as the ground of a
+** filtered working set.  A point is located by walking from the last hit,
+** the containing triangle (or edge) is split and the new edges are made
+** locally Delaunay by flipping (Lawson).
+**
+** Coordinates are integers within BCAL_TIN_MAX_EXTENT of the center, so the
+** orientation test is exact in 64 bit integers.  The in-circle test is done
+** in doubles, and a flip only happens when the quadrilateral is strictly
+** convex by the exact test.  Rounding can leave a triangle that is not quite
+** Delaunay, but never an invalid mesh.
+*/
+
+#include <math.h>
+#include <string.h>
+
+#include "bcal_tin.h"
+
+/* Distance of the super triangle vertices from the center */
+#define BCAL_TIN_SUPER (1 << 28)
+/* Flips allowed per insertion before the mesh is left as it is */
+#define BCAL_TIN_MAX_FLIPS 100000
+
+static int64 orient( const bcal_tin *t, uint32 a, uint32 b, int64 px,
+                     int64 py )
+{
+    int64 ax = t->x[a], ay = t->y[a];
+    return ((int64)t->x[b] - ax) * (py - ay) -
+           ((int64)t->y[b] - ay) * (px - ax);
+}
+
+static int64 orient_v( const bcal_tin *t, uint32 a, uint32 b, uint32 c )
+{
+    return orient( t, a, b, t->x[c], t->y[c] );
+}
+
+/* Positive if d is inside the circle through counter clockwise a, b, c */
+static double incircle( const bcal_tin *t, uint32 a, uint32 b, uint32 c,
+                        uint32 d )
+{
+    double adx = (double)t->x[a] - t->x[d], ady = (double)t->y[a] - t->y[d];
+    double bdx = (double)t->x[b] - t->x[d], bdy = (double)t->y[b] - t->y[d];
+    double cdx = (double)t->x[c] - t->x[d], cdy = (double)t->y[c] - t->y[d];
+    return (adx * adx + ady * ady) * (bdx * cdy - cdx * bdy) +
+           (bdx * bdx + bdy * bdy) * (cdx * ady - adx * cdy) +
+           (cdx * cdx + cdy * cdy) * (adx * bdy - bdx * ady);
+}
+
+static CPLErr reserve( bcal_tin *t, uint32 nv, uint32 nt )
+{
+    void *a;
+    uint32 n;
+    if( nv > t->av )
+    {
+        n = t->av * 2 + 64;
+        if( (a = realloc( t->x, sizeof( int32 ) * n )) == NULL )
+        {
+            return CE_Failure;
+        }
+        t->x = a;
+        if( (a = realloc( t->y, sizeof( int32 ) * n )) == NULL )
+        {
+            return CE_Failure;
+        }
+        t->y = a;
+        if( (a = realloc( t->z, sizeof( double ) * n )) == NULL )
+        {
+            return CE_Failure;
+        }
+        t->z = a;
+        t->av = n;
+    }
+    if( nt > t->at )
+    {
+        n = t->at * 2 + 128;
+        if( (a = realloc( t->t, sizeof( bcal_tin_tri ) * n )) == NULL )
+        {
+            return CE_Failure;
+        }
+        t->t = a;
+        /* Every flip pushes two triangles, one is popped per test */
+        if( (a = realloc( t->stack, sizeof( uint32 ) * n * 2 )) == NULL )
+        {
+            return CE_Failure;
+        }
+        t->stack = a;
+        t->at = n;
+    }
+    return CE_None;
+}
+
+/*
+** bcal_tin_init sets up an empty triangulation for points in the box x0, y0
+** to x1, y1.  The box must fit within BCAL_TIN_MAX_EXTENT of its center.
+*/
+CPLErr bcal_tin_init( bcal_tin *t, int64 x0, int64 y0, int64 x1, int64 y1 )
+{
+    bcal_tin_tri *s;
+    memset( t, 0, sizeof( bcal_tin ) );
+    t->cx = x0 + (x1 - x0) / 2;
+    t->cy = y0 + (y1 - y0) / 2;
+    if( x1 < x0 || y1 < y0 || (x1 - x0) / 2 + 1 > BCAL_TIN_MAX_EXTENT ||
+        (y1 - y0) / 2 + 1 > BCAL_TIN_MAX_EXTENT )
+    {
+        CPLError( CE_Failure, CPLE_IllegalArg,
+                  "Invalid or too large tin extent" );
+        return CE_Failure;
+    }
+    if( reserve( t, 3, 1 ) != CE_None )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory, "Failed to allocate tin" );
+        return CE_Failure;
+    }
+    t->x[0] = -BCAL_TIN_SUPER;
+    t->y[0] = -BCAL_TIN_SUPER;
+    t->x[1] = BCAL_TIN_SUPER;
+    t->y[1] = -BCAL_TIN_SUPER;
+    t->x[2] = 0;
+    t->y[2] = BCAL_TIN_SUPER;
+    t->z[0] = t->z[1] = t->z[2] = 0;
+    t->nv = 3;
+    s = &t->t[0];
+    s->v[0] = 0;
+    s->v[1] = 1;
+    s->v[2] = 2;
+    s->n[0] = s->n[1] = s->n[2] = BCAL_TIN_NONE;
+    t->nt = 1;
+    return CE_None;
+}
+
+/*
+** Walk to the triangle holding px, py, starting from the hint.  The first
+** edge tested rotates from step to step so the walk does not cycle, and a
+** walk that runs longer than there are triangles restarts as a scan.  *on
+** is set to the edge the point lies on, or -1, and *at to the vertex it
+** coincides with, or BCAL_TIN_NONE.
+*/
+static uint32 locate( bcal_tin *t, int64 px, int64 py, int *on, uint32 *at )
+{
+    uint32 cur = t->hint < t->nt ? t->hint : 0;
+    uint32 steps = 0;
+    const bcal_tin_tri *tr;
+    int k, i, zeros, moved;
+    int64 o;
+    for( ;; steps++ )
+    {
+        tr = &t->t[cur];
+        moved = 0;
+        zeros = 0;
+        *on = -1;
+        for( k = 0; k < 3; k++ )
+        {
+            i = (k + (int)(steps % 3)) % 3;
+            o = orient( t, tr->v[(i + 1) % 3], tr->v[(i + 2) % 3], px, py );
+            if( o < 0 && tr->n[i] != BCAL_TIN_NONE )
+            {
+                cur = tr->n[i];
+                moved = 1;
+                break;
+            }
+            if( o == 0 )
+            {
+                *on = i;
+                zeros++;
+            }
+        }
+        if( !moved )
+        {
+            break;
+        }
+        if( steps > t->nt )
+        {
+            /* Walk from every triangle in turn, one step each */
+            cur = (uint32)(steps - t->nt) % t->nt;
+        }
+    }
+    *at = BCAL_TIN_NONE;
+    if( zeros == 2 )
+    {
+        /* On two edges: the vertex they share, the one not opposite either */
+        for( k = 0; k < 3; k++ )
+        {
+            if( t->x[tr->v[k]] == px && t->y[tr->v[k]] == py )
+            {
+                *at = tr->v[k];
+            }
+        }
+    }
+    t->hint = cur;
+    return cur;
+}
+
+static void relink( bcal_tin *t, uint32 tri, uint32 from, uint32 to )
+{
+    int k;
+    if( tri == BCAL_TIN_NONE )
+    {
+        return;
+    }
+    for( k = 0; k < 3; k++ )
+    {
+        if( t->t[tri].n[k] == from )
+        {
+            t->t[tri].n[k] = to;
+        }
+    }
+}
+
+static void set_tri( bcal_tin *t, uint32 tri, uint32 v0, uint32 v1, uint32 v2,
+                     uint32 n0, uint32 n1, uint32 n2 )
+{
+    bcal_tin_tri *r = &t->t[tri];
+    r->v[0] = v0;
+    r->v[1] = v1;
+    r->v[2] = v2;
+    r->n[0] = n0;
+    r->n[1] = n1;
+    r->n[2] = n2;
+}
+
+/*
+** Restore the Delaunay property around the new vertex.  Every triangle on
+** the stack has the new vertex at v[0] and the edge to test opposite it.
+*/
+static void legalize( bcal_tin *t, uint32 ns )
+{
+    uint32 tri, u, p, a, b, d, n_ad, n_db, n_bp, n_pa, flips = 0;
+    int j;
+    while( ns > 0 && ns + 2 <= 2 * t->at && flips < BCAL_TIN_MAX_FLIPS )
+    {
+        tri = t->stack[--ns];
+        u = t->t[tri].n[0];
+        if( u == BCAL_TIN_NONE )
+        {
+            continue;
+        }
+        for( j = 0; j < 3 && t->t[u].n[j] != tri; j++ )
+        {
+        }
+        if( j == 3 )
+        {
+            continue;
+        }
+        p = t->t[tri].v[0];
+        a = t->t[tri].v[1];
+        b = t->t[tri].v[2];
+        d = t->t[u].v[j];
+        if( incircle( t, p, a, b, d ) <= 0 || orient_v( t, p, a, d ) <= 0 ||
+            orient_v( t, p, d, b ) <= 0 )
+        {
+            continue;
+        }
+        /* u is (d, b, a) from j */
+        n_ad = t->t[u].n[(j + 1) % 3];
+        n_db = t->t[u].n[(j + 2) % 3];
+        n_bp = t->t[tri].n[1];
+        n_pa = t->t[tri].n[2];
+        set_tri( t, tri, p, a, d, n_ad, u, n_pa );
+        set_tri( t, u, p, d, b, n_db, n_bp, tri );
+        relink( t, n_ad, u, tri );
+        relink( t, n_bp, tri, u );
+        t->stack[ns++] = tri;
+        t->stack[ns++] = u;
+        flips++;
+    }
+}
+
+/*
+** bcal_tin_insert adds a vertex at x, y with value z.  Returns CE_Warning
+** and leaves the tin unchanged if the point is outside the extent or a
+** vertex is already there.
+*/
+CPLErr bcal_tin_insert( bcal_tin *t, int64 x, int64 y, double z )
+{
+    int64 px = x - t->cx, py = y - t->cy;
+    uint32 cur, v, at, t1, t2, t3, a, b, c, u, d, na, nb, nc, nbd, ndc;
+    int on, i, j;
+    if( px < -BCAL_TIN_MAX_EXTENT || px > BCAL_TIN_MAX_EXTENT ||
+        py < -BCAL_TIN_MAX_EXTENT || py > BCAL_TIN_MAX_EXTENT )
+    {
+        return CE_Warning;
+    }
+    if( reserve( t, t->nv + 1, t->nt + 2 ) != CE_None )
+    {
+        CPLError( CE_Failure, CPLE_OutOfMemory, "Failed to grow tin" );
+        return CE_Failure;
+    }
+    cur = locate( t, px, py, &on, &at );
+    if( at != BCAL_TIN_NONE )
+    {
+        return CE_Warning;
+    }
+    v = t->nv++;
+    t->x[v] = (int32)px;
+    t->y[v] = (int32)py;
+    t->z[v] = z;
+    t1 = t->nt;
+    t2 = t->nt + 1;
+    t->nt += 2;
+    if( on < 0 )
+    {
+        /* Split (a, b, c) into three around v */
+        a = t->t[cur].v[0];
+        b = t->t[cur].v[1];
+        c = t->t[cur].v[2];
+        na = t->t[cur].n[0];
+        nb = t->t[cur].n[1];
+        nc = t->t[cur].n[2];
+        set_tri( t, cur, v, b, c, na, t1, t2 );
+        set_tri( t, t1, v, c, a, nb, t2, cur );
+        set_tri( t, t2, v, a, b, nc, cur, t1 );
+        relink( t, nb, cur, t1 );
+        relink( t, nc, cur, t2 );
+        t->stack[0] = cur;
+        t->stack[1] = t1;
+        t->stack[2] = t2;
+        legalize( t, 3 );
+        return CE_None;
+    }
+    /*
+    ** Split the edge (b, c) opposite a, shared with u = (d, c, b), into four
+    ** triangles around v.  The super triangle holds every point, so u
+    ** exists.
+    */
+    i = on;
+    a = t->t[cur].v[i];
+    b = t->t[cur].v[(i + 1) % 3];
+    c = t->t[cur].v[(i + 2) % 3];
+    u = t->t[cur].n[i];
+    nb = t->t[cur].n[(i + 1) % 3];
+    nc = t->t[cur].n[(i + 2) % 3];
+    for( j = 0; j < 3 && t->t[u].n[j] != cur; j++ )
+    {
+    }
+    d = t->t[u].v[j];
+    nbd = t->t[u].n[(j + 1) % 3];
+    ndc = t->t[u].n[(j + 2) % 3];
+    t3 = t2;
+    set_tri( t, cur, v, c, a, nb, t1, t3 );
+    set_tri( t, t1, v, a, b, nc, u, cur );
+    set_tri( t, u, v, b, d, nbd, t3, t1 );
+    set_tri( t, t3, v, d, c, ndc, cur, u );
+    relink( t, nc, cur, t1 );
+    relink( t, ndc, u, t3 );
+    t->stack[0] = cur;
+    t->stack[1] = t1;
+    t->stack[2] = u;
+    t->stack[3] = t3;
+    legalize( t, 4 );
+    return CE_None;
+}
+
+/* Evaluate the plane through the vertices of tri at px, py. */
+static double plane( const bcal_tin *t, const bcal_tin_tri *tr, int64 px,
+                     int64 py )
+{
+    double w0 = (double)orient( t, tr->v[1], tr->v[2], px, py );
+    double w1 = (double)orient( t, tr->v[2], tr->v[0], px, py );
+    double w2 = (double)orient( t, tr->v[0], tr->v[1], px, py );
+    return (w0 * t->z[tr->v[0]] + w1 * t->z[tr->v[1]] +
+            w2 * t->z[tr->v[2]]) / (w0 + w1 + w2);
+}
+
+/*
+** bcal_tin_interpolate returns the linear interpolation at x, y.  Just
+** outside the convex hull, where the point falls in a triangle with one
+** super vertex, the plane of the hull triangle across the edge is
+** extended.  Elsewhere outside the hull the result is NaN.
+*/
+double bcal_tin_interpolate( bcal_tin *t, int64 x, int64 y )
+{
+    int64 px = x - t->cx, py = y - t->cy;
+    const bcal_tin_tri *tr;
+    uint32 at, u = BCAL_TIN_NONE;
+    int on, k, super = 0;
+    if( t->nv < 6 || px < -BCAL_TIN_MAX_EXTENT || px > BCAL_TIN_MAX_EXTENT ||
+        py < -BCAL_TIN_MAX_EXTENT || py > BCAL_TIN_MAX_EXTENT )
+    {
+        return NAN;
+    }
+    tr = &t->t[locate( t, px, py, &on, &at )];
+    for( k = 0; k < 3; k++ )
+    {
+        if( tr->v[k] < 3 )
+        {
+            super++;
+            u = tr->n[k];
+        }
+    }
+    if( super == 0 )
+    {
+        return plane( t, tr, px, py );
+    }
+    if( super > 1 || u == BCAL_TIN_NONE || t->t[u].v[0] < 3 ||
+        t->t[u].v[1] < 3 || t->t[u].v[2] < 3 )
+    {
+        return NAN;
+    }
+    return plane( t, &t->t[u], px, py );
+}
+
+/*
+** bcal_tin_interpolate_n interpolates at the points x[index[i]],
+** y[index[i]] into z[i].  Each walk starts where the last one ended, so
+** nearby queries are cheap.
+*/
+void bcal_tin_interpolate_n( bcal_tin *t, const int32 *x, const int32 *y,
+                             const uint32 *index, uint32 n, double *z )
+{
+    uint32 i;
+    for( i = 0; i < n; i++ )
+    {
+        z[i] = bcal_tin_interpolate( t, x[index[i]], y[index[i]] );
+    }
+}
+
+void bcal_tin_free( bcal_tin *t )
+{
+    free( t->x );
+    free( t->y );
+    free( t->z );
+    free( t->t );
+    free( t->stack );
+    memset( t, 0, sizeof( bcal_tin ) );
+}
+
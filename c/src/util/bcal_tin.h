@@ -0,0 +1,63 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef BCAL_TIN_H_
+#define BCAL_TIN_H_
+
+#include <stdlib.h>
+
+#include "bcal_types.h"
+
+#include <gdal.h>
+
+/* Largest distance from the center, in coordinate units, the tin accepts */
+#define BCAL_TIN_MAX_EXTENT (1 << 26)
+/* Marks a missing neighbour */
+#define BCAL_TIN_NONE UINT32_MAX
+
+typedef struct bcal_tin_tri
+{
+    /* Vertices in counter clockwise order */
+    uint32 v[3];
+    /* Neighbour across the edge opposite v[i] */
+    uint32 n[3];
+} bcal_tin_tri;
+
+/*
+** An incremental Delaunay triangulation of integer coordinates.  Vertices 0
+** to 2 make up a super triangle around the extent, and triangles that use
+** them lie outside the convex hull of the inserted points.
+*/
+typedef struct bcal_tin
+{
+    int64 cx;
+    int64 cy;
+    /* Vertex coordinates relative to cx, cy */
+    int32 *x;
+    int32 *y;
+    double *z;
+    uint32 nv;
+    uint32 av;
+    bcal_tin_tri *t;
+    uint32 nt;
+    uint32 at;
+    /* Triangle of the last hit, where the next walk starts */
+    uint32 hint;
+    uint32 *stack;
+    uint32 astack;
+} bcal_tin;
+
+CPLErr bcal_tin_init( bcal_tin *t, int64 x0, int64 y0, int64 x1, int64 y1 );
+
+CPLErr bcal_tin_insert( bcal_tin *t, int64 x, int64 y, double z );
+
+double bcal_tin_interpolate( bcal_tin *t, int64 x, int64 y );
+
+void bcal_tin_interpolate_n( bcal_tin *t, const int32 *x, const int32 *y,
+                             const uint32 *index, uint32 n, double *z );
+
+void bcal_tin_free( bcal_tin *t );
+
+#endif /* BCAL_TIN_H_ */
+
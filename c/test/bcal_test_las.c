@@ -0,0 +1,174 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+/*
+** test_las writes the small las files of the tests: a LAS 1.x public
+** header, at most one variable length record and the records the test
+** builds.  The point count and the bounds are patched in on close.
+*/
+
+#include <math.h>
+
+#include "bcal_test_las.h"
+
+#include "cpl_port.h"
+
+/* Offsets of the fields of the public header */
+#define VERSION_MAJOR 24
+#define VERSION_MINOR 25
+#define HEADER_SIZE 94
+#define POINT_OFFSET 96
+#define N_VLRS 100
+#define POINT_FORMAT 104
+#define POINT_LENGTH 105
+#define N_POINTS 107
+#define SCALE 131
+#define OFFSET 155
+#define BOUNDS 179
+
+static void put_u32( uint8 *b, uint32 v )
+{
+    CPL_LSBPTR32( &v );
+    memcpy( b, &v, 4 );
+}
+
+static void put_f64( uint8 *b, double v )
+{
+    CPL_LSBPTR64( &v );
+    memcpy( b, &v, 8 );
+}
+
+/*
+** bcal_test_las_init sets t to a LAS 1.2 file of point_format, records of
+** point_length bytes, and coordinates at scale with no offset.
+*/
+void bcal_test_las_init( bcal_test_las *t, uint8 point_format,
+                         uint16 point_length, double scale )
+{
+    int i;
+    memset( t, 0, sizeof( bcal_test_las ) );
+    t->version_minor = 2;
+    t->point_format = point_format;
+    t->point_length = point_length;
+    for( i = 0; i < 3; i++ )
+    {
+        t->scale[i] = scale;
+    }
+}
+
+/* bcal_test_las_bounds fixes the bounds of x and y in the header. */
+void bcal_test_las_bounds( bcal_test_las *t, double min_x, double min_y,
+                           double max_x, double max_y )
+{
+    t->fixed_bounds = TRUE;
+    t->min[0] = min_x;
+    t->min[1] = min_y;
+    t->max[0] = max_x;
+    t->max[1] = max_y;
+}
+
+/* Write the public header, with the count and bounds so far. */
+static int write_header( bcal_test_las *t )
+{
+    uint8 h[BCAL_LAS_HEADER_SIZE_10];
+    uint32 vlr = t->vlr_user_id != NULL ?
+                 BCAL_LAS_VLR_HEADER_SIZE + t->vlr_length : 0;
+    int i;
+    memset( h, 0, sizeof( h ) );
+    memcpy( h, "LASF", 4 );
+    h[VERSION_MAJOR] = 1;
+    h[VERSION_MINOR] = t->version_minor;
+    bcal_test_las_u16( h + HEADER_SIZE, BCAL_LAS_HEADER_SIZE_10 );
+    put_u32( h + POINT_OFFSET, BCAL_LAS_HEADER_SIZE_10 + vlr );
+    put_u32( h + N_VLRS, vlr > 0 ? 1 : 0 );
+    h[POINT_FORMAT] = t->point_format;
+    bcal_test_las_u16( h + POINT_LENGTH, t->point_length );
+    put_u32( h + N_POINTS, t->n_points );
+    for( i = 0; i < 3; i++ )
+    {
+        put_f64( h + SCALE + i * 8, t->scale[i] );
+        put_f64( h + OFFSET + i * 8, t->offset[i] );
+        /* Stored as max x, min x, max y, min y, max z, min z */
+        put_f64( h + BOUNDS + i * 16, t->max[i] );
+        put_f64( h + BOUNDS + i * 16 + 8, t->min[i] );
+    }
+    return fseek( t->fp, 0, SEEK_SET ) != 0 ||
+           fwrite( h, sizeof( h ), 1, t->fp ) != 1;
+}
+
+/*
+** bcal_test_las_create creates path and writes the header and record of t.
+** Returns 0 on success.
+*/
+int bcal_test_las_create( bcal_test_las *t, const char *path )
+{
+    uint8 vlr[BCAL_LAS_VLR_HEADER_SIZE];
+    t->n_points = 0;
+    t->fp = fopen( path, "wb" );
+    if( t->fp == NULL || write_header( t ) != 0 )
+    {
+        return 1;
+    }
+    if( t->vlr_user_id == NULL )
+    {
+        return 0;
+    }
+    memset( vlr, 0, sizeof( vlr ) );
+    strncpy( (char *)vlr + 2, t->vlr_user_id, 16 );
+    bcal_test_las_u16( vlr + 18, t->vlr_record_id );
+    bcal_test_las_u16( vlr + 20, t->vlr_length );
+    return fwrite( vlr, sizeof( vlr ), 1, t->fp ) != 1 ||
+           fwrite( t->vlr_data, 1, t->vlr_length, t->fp ) != t->vlr_length;
+}
+
+/* bcal_test_las_xyz sets the raw coordinates of a record. */
+void bcal_test_las_xyz( uint8 *rec, int32 x, int32 y, int32 z )
+{
+    put_u32( rec, (uint32)x );
+    put_u32( rec + 4, (uint32)y );
+    put_u32( rec + 8, (uint32)z );
+}
+
+/* bcal_test_las_u16 stores v at b, little endian. */
+void bcal_test_las_u16( uint8 *b, uint16 v )
+{
+    CPL_LSBPTR16( &v );
+    memcpy( b, &v, 2 );
+}
+
+/*
+** bcal_test_las_put writes a record of point_length bytes, and adds its
+** coordinates to the bounds.
+*/
+void bcal_test_las_put( bcal_test_las *t, const uint8 *rec )
+{
+    double v;
+    int32 raw;
+    int i;
+    for( i = 0; i < 3; i++ )
+    {
+        memcpy( &raw, rec + i * 4, 4 );
+        CPL_LSBPTR32( &raw );
+        v = raw * t->scale[i] + t->offset[i];
+        if( i == 2 || !t->fixed_bounds )
+        {
+            t->min[i] = t->n_points == 0 || v < t->min[i] ? v : t->min[i];
+            t->max[i] = t->n_points == 0 || v > t->max[i] ? v : t->max[i];
+        }
+    }
+    fwrite( rec, t->point_length, 1, t->fp );
+    t->n_points++;
+}
+
+/*
+** bcal_test_las_close writes the point count and bounds into the header
+** and closes the file.  Returns 0 on success.
+*/
+int bcal_test_las_close( bcal_test_las *t )
+{
+    int rc = write_header( t );
+    rc |= fclose( t->fp ) != 0;
+    t->fp = NULL;
+    return rc;
+}
@@ -0,0 +1,55 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#ifndef BCAL_TEST_LAS_H_
+#define BCAL_TEST_LAS_H_
+
+#include "bcal_las.h"
+
+/*
+** A las file written by a test, record by record.  The tests set the
+** fields after bcal_test_las_init and before bcal_test_las_create.
+*/
+typedef struct bcal_test_las
+{
+    uint8 version_minor;
+    /* Point data format, with the compressed bit if asked for */
+    uint8 point_format;
+    uint16 point_length;
+    double scale[3];
+    double offset[3];
+    /*
+    ** Bounds of x and y, or if not fixed the bounds of the points written.
+    ** z is always that of the points.
+    */
+    int fixed_bounds;
+    double min[3];
+    double max[3];
+    /* A variable length record, written if vlr_user_id is not NULL */
+    const char *vlr_user_id;
+    uint16 vlr_record_id;
+    const void *vlr_data;
+    uint16 vlr_length;
+    /* Set by the writer */
+    FILE *fp;
+    uint32 n_points;
+} bcal_test_las;
+
+void bcal_test_las_init( bcal_test_las *t, uint8 point_format,
+                         uint16 point_length, double scale );
+
+void bcal_test_las_bounds( bcal_test_las *t, double min_x, double min_y,
+                           double max_x, double max_y );
+
+int bcal_test_las_create( bcal_test_las *t, const char *path );
+
+void bcal_test_las_xyz( uint8 *rec, int32 x, int32 y, int32 z );
+
+void bcal_test_las_u16( uint8 *b, uint16 v );
+
+void bcal_test_las_put( bcal_test_las *t, const uint8 *rec );
+
+int bcal_test_las_close( bcal_test_las *t );
+
+#endif /* BCAL_TEST_LAS_H_ */
@@ -0,0 +1,173 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <math.h>
+
+#include "bcal_test_las.h"
+
+#include "cpl_conv.h"
+#include "cpl_port.h"
+
+#define SIDE 40
+
+/*
+** Write a LAS 1.2, point format 0 file with a point on every integer
+** coordinate from 0 to SIDE - 1, in rows from the south, every other row
+** written backwards.  z is x + y.
+*/
+static int write_grid( const char *path )
+{
+    bcal_test_las t;
+    uint8 rec[20];
+    uint32 x, y, k;
+    bcal_test_las_init( &t, 0, sizeof( rec ), 0.01 );
+    if( bcal_test_las_create( &t, path ) != 0 )
+    {
+        return 1;
+    }
+    for( y = 0; y < SIDE; y++ )
+    {
+        for( k = 0; k < SIDE; k++ )
+        {
+            x = y % 2 ? SIDE - 1 - k : k;
+            memset( rec, 0, sizeof( rec ) );
+            bcal_test_las_xyz( rec, x * 100, y * 100, (x + y) * 100 );
+            bcal_test_las_put( &t, rec );
+        }
+    }
+    return bcal_test_las_close( &t );
+}
+
+static int same_index( const bcal_bcx *a, const bcal_bcx *b )
+{
+    return a->nx == b->nx && a->ny == b->ny && a->size == b->size &&
+           a->min_x == b->min_x && a->n_runs == b->n_runs &&
+           a->bounds.MaxX == b->bounds.MaxX &&
+           memcmp( a->cells, b->cells,
+                   sizeof( bcal_bcx_cell ) * a->nx * a->ny ) == 0 &&
+           memcmp( a->runs, b->runs,
+                   sizeof( bcal_bcx_run ) * a->n_runs ) == 0;
+}
+
+int main()
+{
+    char *path = strdup( CPLGenerateTempFilename( "test_bcx1" ) );
+    char *bcx;
+    bcal_las las;
+    bcal_bcx x, y;
+    bcal_bcx_run *runs = NULL;
+    bcal_points p;
+    OGREnvelope env;
+    uint64 n, count, total = 0, read = 0, c;
+    uint32 k;
+    int rc = 1;
+
+    bcx = strdup( CPLResetExtension( path, BCAL_BCX_EXTENSION ) );
+    memset( &las, 0, sizeof( las ) );
+    memset( &x, 0, sizeof( x ) );
+    memset( &y, 0, sizeof( y ) );
+    memset( &p, 0, sizeof( p ) );
+    if( write_grid( path ) != 0 || bcal_las_open( path, &las ) != CE_None ||
+        las.index != NULL )
+    {
+        goto done;
+    }
+
+    /* 100 points per cell is a 4x4 grid of 10 by 10 points */
+    if( bcal_bcx_build( &las, 100, &x ) != CE_None || x.nx != 4 ||
+        x.ny != 4 || x.size != 9.75 || x.bounds.MaxY != SIDE - 1 )
+    {
+        goto done;
+    }
+    for( c = 0; c < 16; c++ )
+    {
+        total += x.cells[c].count;
+        /* A row of a cell is a run, or two when the rows meet at its edge */
+        if( x.cells[c].count != 100 || x.cells[c].n_runs < 5 ||
+            x.cells[c].n_runs > 10 )
+        {
+            goto done;
+        }
+    }
+    if( total != SIDE * SIDE || x.cells[5].zmin != 2000 ||
+        x.cells[5].zmax != 3800 )
+    {
+        goto done;
+    }
+
+    /* A query touching one cell reads only its rows */
+    env.MinX = 12.;
+    env.MaxX = 14.;
+    env.MinY = 12.;
+    env.MaxY = 14.;
+    if( bcal_bcx_query( &x, &env, &runs, &n, &count ) != CE_None ||
+        count != 100 )
+    {
+        goto done;
+    }
+    for( c = 0; c < n; c++ )
+    {
+        read += runs[c].count;
+        if( c > 0 && runs[c].start <= runs[c - 1].start + runs[c - 1].count )
+        {
+            goto done;
+        }
+    }
+    if( read >= SIDE * SIDE / 2 )
+    {
+        goto done;
+    }
+
+    /* The index round trips, and is picked up by the next open */
+    if( bcal_bcx_write( &x, &las, bcx ) != CE_None ||
+        bcal_bcx_read( bcx, &las, &y ) != CE_None || !same_index( &x, &y ) )
+    {
+        goto done;
+    }
+    bcal_las_close( &las );
+    if( bcal_las_open( path, &las ) != CE_None || las.index == NULL ||
+        !same_index( &x, las.index ) )
+    {
+        goto done;
+    }
+
+    /* Envelope reads find the points inside, with and without the index */
+    env.MinX = 8.5;
+    env.MaxX = 21.;
+    env.MinY = -5.;
+    env.MaxY = 3.;
+    bcal_points_init( &p, las.h.scale, las.h.offset );
+    if( bcal_las_read_env( &las, &env, &p ) != CE_None || p.n != 13 * 4 )
+    {
+        goto done;
+    }
+    for( k = 0; k < p.n; k++ )
+    {
+        if( bcal_points_x( &p, k ) < 8.5 || bcal_points_x( &p, k ) > 21. ||
+            bcal_points_y( &p, k ) > 3. )
+        {
+            goto done;
+        }
+    }
+    bcal_bcx_free( las.index );
+    free( las.index );
+    las.index = NULL;
+    p.n = 0;
+    if( bcal_las_read_env( &las, &env, &p ) != CE_None || p.n != 13 * 4 )
+    {
+        goto done;
+    }
+    rc = 0;
+done:
+    free( runs );
+    bcal_points_free( &p );
+    bcal_bcx_free( &x );
+    bcal_bcx_free( &y );
+    bcal_las_close( &las );
+    VSIUnlink( path );
+    VSIUnlink( bcx );
+    free( path );
+    free( bcx );
+    return rc;
+}
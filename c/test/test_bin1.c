@@ -0,0 +1,92 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "bcal_filter.h"
+
+int main()
+{
+    bcal_working_set s;
+    const double scale[3] = { 0.1, 0.1, 0.1 };
+    const double offset[3] = { 0., 0., 0. };
+    uint32 i, k;
+    memset( &s, 0, sizeof( s ) );
+    s.env.MinX = 0.;
+    s.env.MaxX = 3.;
+    s.env.MinY = 0.;
+    s.env.MaxY = 2.;
+    s.spacing = 1.;
+    bcal_points_init( &s.p, scale, offset );
+    /* Scatter the raster attributes too, the widest after h */
+    s.p.attrs = TRUE;
+    if( bcal_points_reserve( &s.p, 100 ) != CE_None )
+    {
+        return 1;
+    }
+    s.p.n = 100;
+    for( i = 0; i < s.p.n; i++ )
+    {
+        s.p.fid[i] = i;
+        s.p.x[i] = i * 7 % 40;
+        s.p.y[i] = i * 3 % 25;
+        s.p.z[i] = i;
+        s.p.c[i] = i % 10 == 0 ? BCAL_CLASS_UNCLASSIFIED : BCAL_CLASS_CREATED;
+        s.p.r[i] = 1;
+        s.p.h[i] = 0;
+        s.p.intensity[i] = (uint16)(i * 600);
+        s.p.n_returns[i] = (uint8)(i % 5);
+        s.p.user[i] = (uint8)i;
+    }
+    if( bcal_bin( &s ) != CE_None )
+    {
+        return 1;
+    }
+    /* 4 x 3 cells, plus one for unclassified points */
+    if( s.nx != 4 || s.ny != 3 || s.cells[0] != 0 ||
+        s.cells[s.nx * s.ny + 1] != s.p.n ||
+        s.cells[s.nx * s.ny + 1] - s.cells[s.nx * s.ny] != 10 )
+    {
+        return 1;
+    }
+    /* Unclassified points are last */
+    for( i = s.cells[s.nx * s.ny]; i < s.p.n; i++ )
+    {
+        if( s.p.c[i] != BCAL_CLASS_UNCLASSIFIED )
+        {
+            return 1;
+        }
+    }
+    for( k = 0; k < s.nx * s.ny; k++ )
+    {
+        for( i = s.cells[k]; i < s.cells[k + 1]; i++ )
+        {
+            /* Columns move together */
+            if( s.p.z[i] != s.p.fid[i] ||
+                s.p.x[i] != s.p.fid[i] * 7 % 40 ||
+                s.p.intensity[i] != s.p.fid[i] * 600 ||
+                s.p.n_returns[i] != s.p.fid[i] % 5 ||
+                s.p.user[i] != s.p.fid[i] )
+            {
+                return 1;
+            }
+            /* Input order is kept within a cell */
+            if( i > s.cells[k] && s.p.fid[i] < s.p.fid[i - 1] )
+            {
+                return 1;
+            }
+            /* North west corner is bin 0, the south east corner the last */
+            if( s.p.x[i] < 10 && s.p.y[i] > 10 && k != 0 )
+            {
+                return 1;
+            }
+            if( s.p.x[i] >= 30 && s.p.y[i] == 0 && k != 11 )
+            {
+                return 1;
+            }
+        }
+    }
+    bcal_points_free( &s.p );
+    free( s.cells );
+    return 0;
+}
+
@@ -0,0 +1,163 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <math.h>
+
+#include "bcal_metrics.h"
+#include "bcal_test_las.h"
+
+#include "cpl_conv.h"
+#include "cpl_port.h"
+#include "cpl_string.h"
+
+#define SIDE 8
+#define REC 20
+/* The pixel, from the north, left without ground points */
+#define EMPTY_ROW 3
+#define EMPTY_COL 4
+#define NODATA -9999.
+
+static void put_point( bcal_test_las *t, double x, double y, double z,
+                       uint8 c )
+{
+    uint8 rec[REC];
+    memset( rec, 0, sizeof( rec ) );
+    bcal_test_las_xyz( rec, (int32)floor( x * 100 + 0.5 ),
+                       (int32)floor( y * 100 + 0.5 ),
+                       (int32)floor( z * 100 + 0.5 ) );
+    rec[14] = 1;
+    rec[15] = c;
+    bcal_test_las_put( t, rec );
+}
+
+/*
+** Write a LAS 1.2, point format 0 file over 0 to SIDE, with two ground
+** points in every unit pixel but one, half a metre either side of 10 times
+** its row from the north plus its column, and a vegetation point above.
+*/
+static int write_ground( const char *path )
+{
+    bcal_test_las t;
+    uint32 row, col;
+    double x, y, z;
+    bcal_test_las_init( &t, 0, REC, 0.01 );
+    bcal_test_las_bounds( &t, 0., 0., SIDE, SIDE );
+    if( bcal_test_las_create( &t, path ) != 0 )
+    {
+        return 1;
+    }
+    for( row = 0; row < SIDE; row++ )
+    {
+        for( col = 0; col < SIDE; col++ )
+        {
+            x = col + 0.5;
+            y = SIDE - row - 0.5;
+            z = 10. * row + col;
+            if( row != EMPTY_ROW || col != EMPTY_COL )
+            {
+                put_point( &t, x - 0.25, y, z - 0.5, BCAL_CLASS_GROUND );
+                put_point( &t, x + 0.25, y, z + 0.5, BCAL_CLASS_GROUND );
+            }
+            put_point( &t, x, y, z + 20., BCAL_CLASS_VEGETATION );
+        }
+    }
+    return bcal_test_las_close( &t );
+}
+
+/* Grid the raster of bareelev in bands of rows, and check every pixel. */
+static int check( bcal_metrics_data *b, uint32 band_rows )
+{
+    bcal_metrics_file v;
+    float out[SIDE * SIDE], *bands[BCAL_METRICS];
+    float expect;
+    uint32 plan[BCAL_SETS], row, col, rows;
+    int rc = 1;
+    bcal_metrics_plan( b->products, plan );
+    b->max_mem = (uint64)(band_rows + 2 * b->fill) * SIDE *
+                 bcal_metrics_band_bytes( b, plan ) +
+                 bcal_metrics_fixed_bytes( b, plan );
+    memset( bands, 0, sizeof( bands ) );
+    if( bcal_metrics_open( &v, b ) != CE_None || v.r.nx != SIDE ||
+        v.r.ny != SIDE || v.band_rows != band_rows || v.r.max_y != SIDE )
+    {
+        goto done;
+    }
+    for( row = 0; row < SIDE; row += rows )
+    {
+        rows = SIDE - row < band_rows ? SIDE - row : band_rows;
+        bands[BCAL_DEM_ELEV] = out + row * SIDE;
+        if( bcal_metrics_rows( &v, row, rows, bands ) != CE_None )
+        {
+            goto done;
+        }
+    }
+    /* Each point once, whatever the rows of the halo */
+    if( v.n_points != 3 * SIDE * SIDE - 2 )
+    {
+        goto done;
+    }
+    for( row = 0; row < SIDE; row++ )
+    {
+        for( col = 0; col < SIDE; col++ )
+        {
+            expect = (float)(10. * row + col);
+            /* The neighbours of the empty pixel average to its value */
+            if( row == EMPTY_ROW && col == EMPTY_COL && b->fill == 0 )
+            {
+                expect = (float)NODATA;
+            }
+            if( fabs( out[row * SIDE + col] - expect ) > 1e-4 )
+            {
+                goto done;
+            }
+        }
+    }
+    rc = 0;
+done:
+    bcal_metrics_close( &v );
+    return rc;
+}
+
+int main()
+{
+    char *path = strdup( CPLGenerateTempFilename( "test_dem1" ) );
+    bcal_metrics_data b;
+    int rc = 1;
+
+    memset( &b, 0, sizeof( b ) );
+    b.inputs = CSLAddString( NULL, path );
+    b.jobs = 1;
+    b.cell = 1.;
+    b.nodata = NODATA;
+    b.fhd_bin = 1.;
+    b.products[BCAL_DEM_ELEV] = TRUE;
+    if( write_ground( path ) != 0 )
+    {
+        goto done;
+    }
+    /* One band, and bands that split the rows unevenly */
+    if( check( &b, SIDE ) != 0 || check( &b, 3 ) != 0 ||
+        check( &b, 1 ) != 0 )
+    {
+        goto done;
+    }
+    /* The fill window reaches into the rows of the next band */
+    b.fill = 1;
+    if( check( &b, SIDE ) != 0 || check( &b, 3 ) != 0 )
+    {
+        goto done;
+    }
+    /* And the halos of jobs merge */
+    b.jobs = 2;
+    if( check( &b, 3 ) != 0 )
+    {
+        goto done;
+    }
+    rc = 0;
+done:
+    CSLDestroy( b.inputs );
+    VSIUnlink( path );
+    free( path );
+    return rc;
+}
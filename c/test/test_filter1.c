@@ -0,0 +1,145 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <math.h>
+
+#include "bcal_filter.h"
+#include "bcal_test_las.h"
+
+#include "cpl_conv.h"
+
+#define SIDE 40
+#define REC 20
+
+/*
+** Filter a file through bcal_filter as bcal filter does for one input: a
+** sloped plane sampled every 0.5 m with 1 to 2 m tall vegetation over every
+** third 2 m block, as in test_ground1.  b is zeroed and only the options
+** of the command line are set, so read_jobs falls back to jobs.  The output
+** must hold ground as ground with no height and vegetation as vegetation
+** with its height.
+*/
+static double ground( double x, double y )
+{
+    return 100. + 0.1 * x + 0.05 * y;
+}
+
+static int32 q( double v )
+{
+    return (int32)floor( v / 0.01 + 0.5 );
+}
+
+static int write_plane( const char *path, uint32 *n )
+{
+    bcal_test_las t;
+    uint8 rec[REC];
+    uint32 i, j;
+    double x, y;
+    bcal_test_las_init( &t, 0, REC, 0.01 );
+    if( bcal_test_las_create( &t, path ) != 0 )
+    {
+        return 1;
+    }
+    for( i = 0; i < SIDE; i++ )
+    {
+        for( j = 0; j < SIDE; j++ )
+        {
+            x = i * 0.5 + 0.25;
+            y = j * 0.5 + 0.25;
+            memset( rec, 0, sizeof( rec ) );
+            /* Return 1 of 1 */
+            rec[14] = 0x09;
+            bcal_test_las_xyz( rec, q( x ), q( y ), q( ground( x, y ) ) );
+            bcal_test_las_put( &t, rec );
+            if( ((int)(x / 2) + (int)(y / 2)) % 3 == 0 && (i + j) % 2 == 0 )
+            {
+                bcal_test_las_xyz( rec, q( x + 0.1 ), q( y ),
+                                   q( ground( x + 0.1, y ) + 1. +
+                                      ((i * 7 + j) % 10) / 10. ) );
+                bcal_test_las_put( &t, rec );
+            }
+        }
+    }
+    *n = t.n_points;
+    return bcal_test_las_close( &t );
+}
+
+static int check( const char *path, uint32 n )
+{
+    bcal_las las;
+    bcal_points p;
+    uint32 i, bad = 0;
+    double expect;
+    int rc = 1;
+    memset( &las, 0, sizeof( las ) );
+    memset( &p, 0, sizeof( p ) );
+    if( bcal_las_open( path, &las ) != CE_None )
+    {
+        return 1;
+    }
+    bcal_points_init( &p, las.h.scale, las.h.offset );
+    if( las.h.n_points != n || bcal_las_read( &las, 0, n, &p ) != CE_None ||
+        p.n != n )
+    {
+        goto done;
+    }
+    for( i = 0; i < p.n; i++ )
+    {
+        expect = bcal_points_z( &p, i ) -
+                 ground( bcal_points_x( &p, i ), bcal_points_y( &p, i ) );
+        if( expect < 0.5 )
+        {
+            bad += p.c[i] != BCAL_CLASS_GROUND || p.h[i] != 0;
+        }
+        else
+        {
+            bad += p.c[i] != BCAL_CLASS_VEGETATION ||
+                   fabs( p.h[i] * p.scale[2] - expect ) > 0.25;
+        }
+    }
+    /* Allow a few misfits at the grid edges */
+    rc = bad * 50 > n ? 1 : 0;
+done:
+    bcal_points_free( &p );
+    bcal_las_close( &las );
+    return rc;
+}
+
+int main()
+{
+    char *path = strdup( CPLGenerateTempFilename( "test_filter1" ) );
+    char *out = strdup( CPLGenerateTempFilename( "test_filter1_out" ) );
+    bcal_filter_data b;
+    uint32 n = 0;
+    int rc = 1;
+
+    if( write_plane( path, &n ) != 0 )
+    {
+        goto done;
+    }
+    memset( &b, 0, sizeof( b ) );
+    b.input = path;
+    b.output = out;
+    b.jobs = 2;
+    /* Several tiles, so the jobs share the halo */
+    b.tile_points = n / 8;
+    b.spacing = 2.;
+    b.merge_buf = BCAL_HALO_CELLS * b.spacing;
+    b.threshold = 0.3;
+    b.max_height = 50.;
+    b.max_iter = 15;
+    b.interp = BCAL_INTERP_IDW;
+    b.low_z = -HUGE_VAL;
+    if( bcal_filter( &b ) != CE_None || check( out, n ) != 0 )
+    {
+        goto done;
+    }
+    rc = 0;
+done:
+    VSIUnlink( path );
+    VSIUnlink( out );
+    free( path );
+    free( out );
+    return rc;
+}
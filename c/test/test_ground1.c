@@ -0,0 +1,120 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <math.h>
+
+#include "bcal_filter.h"
+
+/*
+** A sloped plane sampled every 0.5 m, with 1 to 2 m tall vegetation over
+** every third 2 m block.  Ground must come out as ground with no height,
+** vegetation as vegetation with its height.  Linear interpolation on the
+** tin follows the plane, inverse distance weighting needs a threshold for
+** the slope.
+*/
+static double ground( double x, double y )
+{
+    return 100. + 0.1 * x + 0.05 * y;
+}
+
+static int32 q( double v )
+{
+    return (int32)floor( v / 0.01 + 0.5 );
+}
+
+static int run( int interp, double threshold, double tolerance )
+{
+    bcal_working_set s;
+    bcal_filter_data b;
+    const double scale[3] = { 0.01, 0.01, 0.01 };
+    const double offset[3] = { 0., 0., 0. };
+    uint32 i, j, n = 0;
+    double x, y;
+    memset( &s, 0, sizeof( s ) );
+    memset( &b, 0, sizeof( b ) );
+    s.env.MinX = 0.;
+    s.env.MaxX = 20.;
+    s.env.MinY = 0.;
+    s.env.MaxY = 20.;
+    s.spacing = 2.;
+    bcal_points_init( &s.p, scale, offset );
+    if( bcal_points_reserve( &s.p, 2 * 40 * 40 ) != CE_None )
+    {
+        return 1;
+    }
+    for( i = 0; i < 40; i++ )
+    {
+        for( j = 0; j < 40; j++ )
+        {
+            x = i * 0.5 + 0.25;
+            y = j * 0.5 + 0.25;
+            s.p.fid[n] = n;
+            s.p.x[n] = q( x );
+            s.p.y[n] = q( y );
+            s.p.z[n] = q( ground( x, y ) );
+            s.p.c[n] = BCAL_CLASS_CREATED;
+            s.p.r[n] = 1;
+            s.p.h[n] = BCAL_LAS_NO_HEIGHT;
+            n++;
+            if( ((int)(x / 2) + (int)(y / 2)) % 3 == 0 && (i + j) % 2 == 0 )
+            {
+                s.p.n = n;
+                bcal_points_copy( &s.p, n, &s.p, n - 1 );
+                s.p.fid[n] = n;
+                s.p.x[n] += 10;
+                s.p.z[n] = q( ground( x + 0.1, y ) + 1. +
+                              ((i * 7 + j) % 10) / 10. );
+                n++;
+            }
+        }
+    }
+    s.p.n = n;
+    b.threshold = threshold;
+    b.interp = interp;
+    b.max_height = 50.;
+    b.max_iter = 15;
+    if( bcal_bin( &s ) != CE_None || bcal_ground( &s, &b ) != CE_None )
+    {
+        return 1;
+    }
+    /* Every occupied cell finished at some iteration */
+    uint32 bad = 0, cells = s.stats.n_cells_unfinished;
+    double expect;
+    for( i = 0; i < BCAL_STATS_ITER_BINS; i++ )
+    {
+        cells += s.stats.iter[i];
+    }
+    if( s.stats.n_cells == 0 || cells != s.stats.n_cells )
+    {
+        return 1;
+    }
+    for( i = 0; i < s.p.n; i++ )
+    {
+        expect = bcal_points_z( &s.p, i ) -
+                 ground( bcal_points_x( &s.p, i ), bcal_points_y( &s.p, i ) );
+        if( expect < 0.5 )
+        {
+            bad += s.p.c[i] != BCAL_CLASS_GROUND || s.p.h[i] != 0;
+        }
+        else
+        {
+            bad += s.p.c[i] != BCAL_CLASS_VEGETATION ||
+                   fabs( s.p.h[i] * s.p.scale[2] - expect ) > tolerance;
+        }
+    }
+    bcal_points_free( &s.p );
+    free( s.cells );
+    /* Allow a few misfits at the grid edges */
+    return bad * 50 > n ? 1 : 0;
+}
+
+int main()
+{
+    if( run( BCAL_INTERP_IDW, 0.3, 0.25 ) != 0 )
+    {
+        return 1;
+    }
+    return run( BCAL_INTERP_LINEAR, 0.05, 0.1 );
+}
+
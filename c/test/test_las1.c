@@ -0,0 +1,154 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "bcal_test_las.h"
+
+#include "cpl_conv.h"
+
+/*
+** Write a minimal LAS 1.2, point format 1 file with one VLR and n points
+** on a diagonal line.
+*/
+static int write_las( const char *path, uint32 n )
+{
+    bcal_test_las t;
+    uint8 rec[28];
+    uint32 i;
+    bcal_test_las_init( &t, 1, sizeof( rec ), 0.01 );
+    t.offset[0] = 1000.;
+    t.offset[1] = 1000.;
+    t.vlr_user_id = "bcal_test";
+    t.vlr_record_id = 42;
+    t.vlr_data = "abcd";
+    t.vlr_length = 4;
+    if( bcal_test_las_create( &t, path ) != 0 )
+    {
+        return 1;
+    }
+    for( i = 0; i < n; i++ )
+    {
+        memset( rec, 0, sizeof( rec ) );
+        bcal_test_las_xyz( rec, i * 100, i * 100, i * 10 );
+        /* Classification with the withheld flag set */
+        rec[15] = 0x80 | (i % 3);
+        bcal_test_las_put( &t, rec );
+    }
+    return bcal_test_las_close( &t );
+}
+
+/* Write the 16 bit value v at offset off of the file */
+static void patch_u16( const char *path, long off, uint16 v )
+{
+    FILE *fp = fopen( path, "r+b" );
+    if( fp != NULL )
+    {
+        fseek( fp, off, SEEK_SET );
+        fwrite( &v, 2, 1, fp );
+        fclose( fp );
+    }
+}
+
+/*
+** Opening must fail for a header size short of the public header and for
+** a record that overruns the points, or the file.
+*/
+static int malformed( const char *path )
+{
+    bcal_las las;
+    int rc = 0;
+    write_las( path, 10 );
+    patch_u16( path, 94, 100 );
+    rc |= bcal_las_open( path, &las ) == CE_None;
+    write_las( path, 10 );
+    patch_u16( path, BCAL_LAS_HEADER_SIZE_10 + 20, 5000 );
+    rc |= bcal_las_open( path, &las ) == CE_None;
+    write_las( path, 0 );
+    patch_u16( path, BCAL_LAS_HEADER_SIZE_10 + 20, 5 );
+    rc |= bcal_las_open( path, &las ) == CE_None;
+    return rc;
+}
+
+int main()
+{
+    const char *path = CPLGenerateTempFilename( "test_las1" );
+    char *name = strdup( path );
+    bcal_las las;
+    bcal_points p;
+    int rc = 1;
+    if( write_las( name, 10 ) != 0 )
+    {
+        free( name );
+        return 1;
+    }
+    if( bcal_las_open( name, &las ) != CE_None )
+    {
+        VSIUnlink( name );
+        free( name );
+        return 1;
+    }
+    bcal_points_init( &p, las.h.scale, las.h.offset );
+    if( las.h.n_points != 10 || las.h.point_format != 1 ||
+        las.h.point_length != 28 || las.h.compressed )
+    {
+        goto done;
+    }
+    if( !CPLIsEqual( las.h.min[0], 1000. ) ||
+        !CPLIsEqual( las.h.max[1], 1009. ) )
+    {
+        goto done;
+    }
+    const bcal_las_vlr *vlr = bcal_las_find_vlr( &las, "bcal_test", 42 );
+    if( vlr == NULL || vlr->length != 4 || memcmp( vlr->data, "abcd", 4 ) != 0 )
+    {
+        goto done;
+    }
+    if( bcal_las_read( &las, 0, 10, &p ) != CE_None || p.n != 10 )
+    {
+        goto done;
+    }
+    if( p.fid[3] != 3 || p.x[3] != 300 || p.z[3] != 30 ||
+        !CPLIsEqual( bcal_points_x( &p, 3 ), 1003. ) ||
+        !CPLIsEqual( bcal_points_y( &p, 3 ), 1003. ) ||
+        !CPLIsEqual( bcal_points_z( &p, 3 ), 0.3 ) ||
+        p.c[3] != 0 || p.c[5] != 2 )
+    {
+        goto done;
+    }
+    /* Reading past the end must fail */
+    if( bcal_las_read( &las, 5, 10, &p ) == CE_None )
+    {
+        goto done;
+    }
+    /* Appending with another quantization requantizes */
+    double scale[3] = { 0.001, 0.001, 0.001 };
+    double offset[3] = { 1000., 1000., 0. };
+    bcal_points_free( &p );
+    bcal_points_init( &p, scale, offset );
+    if( bcal_las_read( &las, 2, 2, &p ) != CE_None || p.n != 2 ||
+        p.fid[1] != 3 || p.x[1] != 3000 || p.z[1] != 300 )
+    {
+        goto done;
+    }
+    /* but fails where the points do not fit an int32 there */
+    scale[0] = 1e-7;
+    offset[0] = 0.;
+    bcal_points_free( &p );
+    bcal_points_init( &p, scale, offset );
+    if( bcal_las_read( &las, 2, 2, &p ) == CE_None || p.n != 0 )
+    {
+        goto done;
+    }
+    rc = 0;
+done:
+    bcal_points_free( &p );
+    bcal_las_close( &las );
+    if( rc == 0 && malformed( name ) != 0 )
+    {
+        rc = 1;
+    }
+    VSIUnlink( name );
+    free( name );
+    return rc;
+}
+
@@ -0,0 +1,236 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "bcal_test_las.h"
+
+#include "cpl_conv.h"
+#include "cpl_vsi.h"
+
+#ifdef BCAL_HAVE_LASZIP
+#include <laszip/laszip_api.h>
+#endif
+
+/* Points in the test file, a few chunks and a partial one */
+#define N_POINTS 5321
+#define CHUNK 1000
+
+#ifdef BCAL_HAVE_LASZIP
+
+static int32 coord( uint32 i, int d )
+{
+    return (int32)((i * 7919u + d * 104729u) % 100000u);
+}
+
+/* Write a LAS 1.2, point format 1 laz file with small chunks. */
+static int write_laz( const char *path )
+{
+    laszip_POINTER w = NULL;
+    laszip_header *h = NULL;
+    laszip_point *pt = NULL;
+    uint32 i;
+    int rc = 1;
+    if( laszip_create( &w ) != 0 )
+    {
+        return 1;
+    }
+    if( laszip_get_header_pointer( w, &h ) != 0 ||
+        laszip_get_point_pointer( w, &pt ) != 0 )
+    {
+        goto done;
+    }
+    h->version_major = 1;
+    h->version_minor = 2;
+    h->point_data_format = 1;
+    h->point_data_record_length = 28;
+    h->number_of_point_records = N_POINTS;
+    h->x_scale_factor = 0.01;
+    h->y_scale_factor = 0.01;
+    h->z_scale_factor = 0.01;
+    h->max_x = h->max_y = h->max_z = 1000.;
+    if( laszip_set_chunk_size( w, CHUNK ) != 0 ||
+        laszip_open_writer( w, path, 1 ) != 0 )
+    {
+        goto done;
+    }
+    for( i = 0; i < N_POINTS; i++ )
+    {
+        pt->X = coord( i, 0 );
+        pt->Y = coord( i, 1 );
+        pt->Z = coord( i, 2 );
+        pt->classification = i % 7;
+        pt->withheld_flag = i % 2;
+        pt->return_number = 1 + i % 3;
+        pt->number_of_returns = 3;
+        pt->point_source_ID = (uint16)i;
+        pt->gps_time = i * 0.5;
+        if( laszip_write_point( w ) != 0 )
+        {
+            goto done;
+        }
+    }
+    rc = laszip_close_writer( w ) != 0;
+done:
+    laszip_destroy( w );
+    return rc;
+}
+
+/* Decompress with several jobs and check every record. */
+static int check_laz( const char *path )
+{
+    bcal_las las;
+    bcal_points p;
+    const uint8 *rec;
+    uint32 i;
+    uint16 psid;
+    double t;
+    int rc = 1;
+    if( bcal_las_open( path, &las ) != CE_None )
+    {
+        return 1;
+    }
+    bcal_points_init( &p, las.h.scale, las.h.offset );
+    if( !las.h.compressed || bcal_las_decompress( &las, 3, FALSE ) != CE_None ||
+        las.h.compressed || las.decoded == NULL ||
+        strcmp( las.path, path ) != 0 || las.h.n_points != N_POINTS ||
+        bcal_las_find_vlr( &las, BCAL_LASZIP_USER_ID,
+                           BCAL_LASZIP_RECORD_ID ) != NULL ||
+        bcal_las_read( &las, 0, N_POINTS, &p ) != CE_None )
+    {
+        goto done;
+    }
+    for( i = 0; i < N_POINTS; i++ )
+    {
+        rec = las.map.data + las.h.point_offset + i * las.h.point_length;
+        memcpy( &psid, rec + 18, 2 );
+        CPL_LSBPTR16( &psid );
+        memcpy( &t, rec + 20, 8 );
+        CPL_LSBPTR64( &t );
+        if( p.x[i] != coord( i, 0 ) || p.y[i] != coord( i, 1 ) ||
+            p.z[i] != coord( i, 2 ) || p.c[i] != i % 7 ||
+            p.r[i] != 1 + i % 3 || (rec[15] >> 7) != i % 2 ||
+            psid != (uint16)i || t != i * 0.5 )
+        {
+            goto done;
+        }
+    }
+    rc = 0;
+done:
+    bcal_points_free( &p );
+    bcal_las_close( &las );
+    return rc;
+}
+
+/*
+** Leave the file compressed and read it in blocks, across chunks and from
+** the middle of one, which must give the points of the records.
+*/
+static int check_stream( const char *path )
+{
+    bcal_las las;
+    bcal_points p;
+    const uint64 starts[3] = { 0, CHUNK, 2500 };
+    const uint64 counts[3] = { N_POINTS, 2 * CHUNK, N_POINTS - 2500 };
+    uint32 i, k;
+    int b, rc = 1;
+    if( bcal_las_open( path, &las ) != CE_None )
+    {
+        return 1;
+    }
+    bcal_points_init( &p, las.h.scale, las.h.offset );
+    if( bcal_las_decompress( &las, 3, TRUE ) != CE_None ||
+        !las.h.compressed || las.decoded != NULL ||
+        las.chunk_points != CHUNK )
+    {
+        goto done;
+    }
+    for( b = 0; b < 3; b++ )
+    {
+        p.n = 0;
+        if( bcal_las_read( &las, starts[b], counts[b], &p ) != CE_None ||
+            p.n != counts[b] )
+        {
+            goto done;
+        }
+        for( i = 0; i < p.n; i++ )
+        {
+            k = (uint32)starts[b] + i;
+            if( p.fid[i] != k || p.x[i] != coord( k, 0 ) ||
+                p.y[i] != coord( k, 1 ) || p.z[i] != coord( k, 2 ) ||
+                p.c[i] != k % 7 || p.h[i] != (uint16)k )
+            {
+                goto done;
+            }
+        }
+    }
+    rc = 0;
+done:
+    bcal_points_free( &p );
+    bcal_las_close( &las );
+    return rc;
+}
+
+#endif /* BCAL_HAVE_LASZIP */
+
+/*
+** A header marked compressed, with no points, which only a build with
+** LASzip may try to read.
+*/
+static int write_marked( const char *path, uint8 format )
+{
+    bcal_test_las t;
+    bcal_test_las_init( &t, format, 28, 0.01 );
+    if( bcal_test_las_create( &t, path ) != 0 )
+    {
+        return 1;
+    }
+    return bcal_test_las_close( &t );
+}
+
+int main()
+{
+    bcal_las las;
+    char *name = strdup( CPLGenerateTempFilename( "test_laz1" ) );
+    int rc = 1;
+
+    /* Uncompressed files are left alone */
+    if( write_marked( name, 1 ) != 0 || bcal_las_open( name, &las ) != CE_None )
+    {
+        goto done;
+    }
+    if( bcal_las_decompress( &las, 2, TRUE ) != CE_None ||
+        las.decoded != NULL || las.chunk_points != 0 )
+    {
+        bcal_las_close( &las );
+        goto done;
+    }
+    bcal_las_close( &las );
+
+    /* A compressed file must be decompressed before it is read */
+    if( write_marked( name, 0x81 ) != 0 ||
+        bcal_las_open( name, &las ) != CE_None )
+    {
+        goto done;
+    }
+    if( !las.h.compressed || las.h.point_format != 1 ||
+        bcal_las_decompress( &las, 2, FALSE ) == CE_None ||
+        bcal_las_decompress( &las, 2, TRUE ) == CE_None )
+    {
+        bcal_las_close( &las );
+        goto done;
+    }
+    bcal_las_close( &las );
+
+#ifdef BCAL_HAVE_LASZIP
+    if( write_laz( name ) != 0 || check_laz( name ) != 0 ||
+        check_stream( name ) != 0 )
+    {
+        goto done;
+    }
+#endif
+    rc = 0;
+done:
+    VSIUnlink( name );
+    free( name );
+    return rc;
+}
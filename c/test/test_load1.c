@@ -0,0 +1,178 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "bcal_filter.h"
+#include "bcal_test_las.h"
+
+#include "cpl_conv.h"
+#include "cpl_port.h"
+
+/*
+** Write a LAS 1.2, point format 0 file with a withheld point on every
+** integer coordinate of a 21 x 21 grid.
+*/
+static int write_las( const char *path )
+{
+    bcal_test_las t;
+    uint8 rec[20];
+    uint32 x, y;
+    bcal_test_las_init( &t, 0, sizeof( rec ), 0.01 );
+    if( bcal_test_las_create( &t, path ) != 0 )
+    {
+        return 1;
+    }
+    for( y = 0; y < 21; y++ )
+    {
+        for( x = 0; x < 21; x++ )
+        {
+            memset( rec, 0, sizeof( rec ) );
+            bcal_test_las_xyz( rec, x * 100, y * 100, 0 );
+            /* Withheld, which the writer must keep */
+            rec[15] = 0x80;
+            bcal_test_las_put( &t, rec );
+        }
+    }
+    return bcal_test_las_close( &t );
+}
+
+int main()
+{
+    const char *path = CPLGenerateTempFilename( "test_load1" );
+    char *name = strdup( path );
+    char *out_name = strdup( CPLGenerateTempFilename( "test_load1_out" ) );
+    /* The input by another path, through its directory's "." */
+    char *dir = strdup( CPLFormFilename( CPLGetPath( name ), ".", NULL ) );
+    char *alias = strdup( CPLFormFilename( dir, CPLGetFilename( name ),
+                                           NULL ) );
+    bcal_mosaic m;
+    bcal_las *las;
+    bcal_las out;
+    bcal_las_writer w;
+    const uint8 *rec;
+    uint16 h;
+    bcal_domain d;
+    bcal_working_set sets[4];
+    bcal_working_set spilled[4];
+    bcal_spill spill;
+    bcal_points p;
+    uint32 counts[4] = { 0, 0, 0, 0 };
+    uint32 i, k, owned = 0;
+    int rc = 1;
+    memset( sets, 0, sizeof( sets ) );
+    memset( spilled, 0, sizeof( spilled ) );
+    memset( &spill, 0, sizeof( spill ) );
+    memset( &p, 0, sizeof( p ) );
+    memset( &w, 0, sizeof( w ) );
+    memset( &out, 0, sizeof( out ) );
+    if( write_las( name ) != 0 || bcal_mosaic_open( &m, &name, 1, 1, FALSE ) != CE_None )
+    {
+        bcal_mosaic_close( &m );
+        VSIUnlink( name );
+        free( name );
+        free( out_name );
+        free( dir );
+        free( alias );
+        return 1;
+    }
+    las = m.las;
+    bcal_mosaic_env( &m, &d.env );
+    if( bcal_partition( &d, 2 ) != CE_None || d.n != 4 ||
+        bcal_las_create_copy( las, name, &w ) == CE_None ||
+        bcal_las_create_copy( las, alias, &w ) == CE_None ||
+        bcal_las_create_copy( las, out_name, &w ) != CE_None )
+    {
+        goto done;
+    }
+    /*
+    ** Tiles split at 10, so with a 1.5 halo every set reads 12 columns and
+    ** 12 rows.
+    */
+    if( bcal_load_count( &m, &d, 1.5, 1, counts, NULL ) != CE_None ||
+        bcal_load( &m, &d, 1., 1.5, counts, NULL, sets ) != CE_None )
+    {
+        goto done;
+    }
+    /* Spilled sets read back the same points */
+    if( bcal_spill_create( &spill, 4, counts, 0 ) != CE_None ||
+        bcal_load( &m, &d, 1., 1.5, counts, &spill, spilled ) != CE_None )
+    {
+        goto done;
+    }
+    for( i = 0; i < d.n; i++ )
+    {
+        bcal_points_init( &p, las->h.scale, las->h.offset );
+        if( spilled[i].p.n != 0 ||
+            bcal_spill_read( &spill, i, &p ) != CE_None ||
+            p.n != sets[i].p.n ||
+            memcmp( p.fid, sets[i].p.fid, sizeof( int64 ) * p.n ) != 0 ||
+            memcmp( p.x, sets[i].p.x, sizeof( int32 ) * p.n ) != 0 ||
+            memcmp( p.y, sets[i].p.y, sizeof( int32 ) * p.n ) != 0 ||
+            memcmp( p.z, sets[i].p.z, sizeof( int32 ) * p.n ) != 0 )
+        {
+            goto done;
+        }
+        bcal_points_free( &p );
+    }
+    for( i = 0; i < d.n; i++ )
+    {
+        if( sets[i].p.n != 144 ||
+            !CPLIsEqual( sets[i].env.MinX, sets[i].own.MinX - 1.5 ) )
+        {
+            goto done;
+        }
+        for( k = 0; k < sets[i].p.n; k++ )
+        {
+            owned += bcal_partition_find( &d, bcal_points_x( &sets[i].p, k ),
+                                          bcal_points_y( &sets[i].p, k ) ) == i;
+            sets[i].p.c[k] = (uint8)(i + 1);
+            sets[i].p.h[k] = (uint16)i;
+        }
+        bcal_merge( &d, i, &sets[i], &w );
+    }
+    bcal_las_writer_close( &w, FALSE );
+    /* Merged points are counted by class, class 4 is not a filter class */
+    if( sets[0].stats.n_unclassified + sets[1].stats.n_ground +
+        sets[2].stats.n_vegetation + sets[3].stats.n_unfinished != owned ||
+        sets[0].stats.n_owned + sets[1].stats.n_owned +
+        sets[2].stats.n_owned + sets[3].stats.n_owned != owned )
+    {
+        goto done;
+    }
+    if( owned != las->h.n_points || bcal_las_open( out_name, &out ) != CE_None ||
+        out.map.size != las->map.size )
+    {
+        goto done;
+    }
+    /* Every point is merged once, from the set that owns it */
+    for( k = 0; k < 21 * 21; k++ )
+    {
+        i = bcal_partition_find( &d, k % 21, k / 21 );
+        rec = out.map.data + out.h.point_offset + k * out.h.point_length;
+        memcpy( &h, rec + 18, 2 );
+        CPL_LSBPTR16( &h );
+        if( rec[15] != (0x80 | (i + 1)) || h != i ||
+            memcmp( rec, las->map.data + las->h.point_offset +
+                         k * las->h.point_length, 15 ) != 0 )
+        {
+            goto done;
+        }
+    }
+    rc = 0;
+done:
+    bcal_points_free( &p );
+    bcal_spill_close( &spill );
+    bcal_free_sets( spilled, 4 );
+    bcal_free_sets( sets, 4 );
+    bcal_free_decomp( &d );
+    bcal_las_writer_close( &w, FALSE );
+    bcal_las_close( &out );
+    bcal_mosaic_close( &m );
+    VSIUnlink( out_name );
+    VSIUnlink( name );
+    free( out_name );
+    free( name );
+    free( dir );
+    free( alias );
+    return rc;
+}
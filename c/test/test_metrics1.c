@@ -0,0 +1,255 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <math.h>
+
+#include "bcal_metrics.h"
+#include "bcal_test_las.h"
+
+#include "cpl_conv.h"
+#include "cpl_port.h"
+#include "cpl_string.h"
+
+#define SIDE 4
+#define PIXELS (SIDE * SIDE)
+#define REC 20
+/* Points of pixel i, from the north, so pixel 0 is empty and 1 has one */
+#define POINTS( i ) ((i) * (i))
+#define MOST POINTS( PIXELS - 1 )
+#define TOTAL ((PIXELS - 1) * PIXELS * (2 * PIXELS - 1) / 6)
+/* Bins of the sketch, fewer than the points of the last pixels */
+#define K 64
+#define NODATA -9999.
+/* The vegetation metrics, the first products */
+#define VEG (BCAL_VEG_FHD2 + 1)
+
+/* The height of point j of pixel i, in cm */
+static uint16 height( uint32 i, uint32 j )
+{
+    return (uint16)((i * 131 + j * 7919) % 3000);
+}
+
+static void put_point( bcal_test_las *t, double x, double y, uint16 h )
+{
+    uint8 rec[REC];
+    memset( rec, 0, sizeof( rec ) );
+    bcal_test_las_xyz( rec, (int32)floor( x * 100 + 0.5 ),
+                       (int32)floor( y * 100 + 0.5 ), 100000 + h );
+    rec[14] = 1;
+    rec[15] = BCAL_CLASS_VEGETATION;
+    /* The height of bcal filter, in the point source id */
+    bcal_test_las_u16( rec + 18, h );
+    bcal_test_las_put( t, rec );
+}
+
+/*
+** Write a LAS 1.2, point format 0 file over 0 to SIDE with the points of
+** each unit pixel whose index is part modulo 2.
+*/
+static int write_heights( const char *path, uint32 part )
+{
+    bcal_test_las t;
+    uint32 i, j;
+    bcal_test_las_init( &t, 0, REC, 0.01 );
+    bcal_test_las_bounds( &t, 0., 0., SIDE, SIDE );
+    if( bcal_test_las_create( &t, path ) != 0 )
+    {
+        return 1;
+    }
+    for( i = 0; i < PIXELS; i++ )
+    {
+        for( j = part; j < POINTS( i ); j += 2 )
+        {
+            put_point( &t, i % SIDE + 0.5, SIDE - i / SIDE - 0.5,
+                       height( i, j ) );
+        }
+    }
+    return bcal_test_las_close( &t );
+}
+
+static int compare_heights( const void *a, const void *b )
+{
+    return (int)*(const uint16*)a - (int)*(const uint16*)b;
+}
+
+/* Check products of pixel i, with n points, against its sorted heights */
+static int check_pixel( float **out, uint32 i, uint16 *h )
+{
+    const uint32 n = POINTS( i );
+    double sum = 0, expect[5];
+    uint32 j, c;
+    if( n == 0 )
+    {
+        return out[BCAL_VEG_HMIN][i] != NODATA ||
+               out[BCAL_VEG_HMEDIAN][i] != NODATA;
+    }
+    for( j = 0; j < n; j++ )
+    {
+        h[j] = height( i, j );
+        sum += h[j];
+    }
+    qsort( h, n, sizeof( uint16 ), compare_heights );
+    for( j = 0, c = 0; j < n; j++ )
+    {
+        c += h[j] * 0.01 > 1.37;
+    }
+    expect[0] = h[0] * 0.01;
+    expect[1] = sum / n * 0.01;
+    expect[2] = h[25 * n / 100] * 0.01;
+    expect[3] = n > 1 ? h[n / 2] * 0.01 : NODATA;
+    expect[4] = (double)c / n * 100.;
+    return out[BCAL_VEG_NELEV][i] != n ||
+           fabs( out[BCAL_VEG_HMIN][i] - expect[0] ) > 1e-4 ||
+           fabs( out[BCAL_VEG_HMEAN][i] - expect[1] ) > 1e-4 ||
+           fabs( out[BCAL_VEG_HP25TH][i] - expect[2] ) > 1e-4 ||
+           fabs( out[BCAL_VEG_HMEDIAN][i] - expect[3] ) > 1e-4 ||
+           fabs( out[BCAL_VEG_VCOVER][i] - expect[4] ) > 1e-3;
+}
+
+/* Whether product p comes from the sketch */
+static int sketched( int p )
+{
+    return p == BCAL_VEG_HMAD || p == BCAL_VEG_HAAD ||
+           p == BCAL_VEG_HIQR || p == BCAL_VEG_FHD || p == BCAL_VEG_FHD2 ||
+           (p >= BCAL_VEG_HP5TH && p <= BCAL_VEG_HP95TH);
+}
+
+/* Grid every product in bands of band_rows rows */
+static int grid( bcal_metrics_data *b, uint32 band_rows, float **out )
+{
+    bcal_metrics_file v;
+    float *band[BCAL_METRICS];
+    uint32 plan[BCAL_SETS], row, rows;
+    int p, rc = 1;
+    memset( band, 0, sizeof( band ) );
+    bcal_metrics_plan( b->products, plan );
+    b->max_mem = (uint64)band_rows * SIDE *
+                 bcal_metrics_band_bytes( b, plan ) +
+                 bcal_metrics_fixed_bytes( b, plan );
+    if( bcal_metrics_open( &v, b ) != CE_None || v.r.nx != SIDE ||
+        v.r.ny != SIDE || v.band_rows != band_rows )
+    {
+        goto done;
+    }
+    for( row = 0; row < SIDE; row += rows )
+    {
+        rows = SIDE - row < band_rows ? SIDE - row : band_rows;
+        for( p = 0; p < VEG; p++ )
+        {
+            band[p] = out[p] + row * SIDE;
+        }
+        if( bcal_metrics_rows( &v, row, rows, band ) != CE_None )
+        {
+            goto done;
+        }
+    }
+    rc = v.n_points != TOTAL;
+done:
+    bcal_metrics_close( &v );
+    return rc;
+}
+
+int main()
+{
+    char *paths[2];
+    float *exact[VEG], *out[VEG];
+    uint16 h[MOST];
+    bcal_metrics_data b;
+    uint32 i;
+    int p, rc = 1;
+
+    paths[0] = strdup( CPLGenerateTempFilename( "test_vegmetrics1a" ) );
+    paths[1] = strdup( CPLGenerateTempFilename( "test_vegmetrics1b" ) );
+    memset( &b, 0, sizeof( b ) );
+    memset( exact, 0, sizeof( exact ) );
+    memset( out, 0, sizeof( out ) );
+    b.inputs = CSLAddString( NULL, paths[0] );
+    b.inputs = CSLAddString( b.inputs, paths[1] );
+    b.jobs = 1;
+    b.cell = 1.;
+    b.nodata = NODATA;
+    b.ground = 0.15;
+    b.crown = 1.37;
+    b.fhd_bin = 1.;
+    if( bcal_metrics_products( "veg", b.products ) != CE_None )
+    {
+        goto done;
+    }
+    for( p = 0; p < VEG; p++ )
+    {
+        exact[p] = malloc( sizeof( float ) * PIXELS );
+        out[p] = malloc( sizeof( float ) * PIXELS );
+        if( exact[p] == NULL || out[p] == NULL )
+        {
+            goto done;
+        }
+    }
+    if( write_heights( paths[0], 0 ) != 0 ||
+        write_heights( paths[1], 1 ) != 0 )
+    {
+        goto done;
+    }
+
+    /* Exact sketches, in one band of one job */
+    if( grid( &b, SIDE, exact ) != 0 )
+    {
+        goto done;
+    }
+    for( i = 0; i < PIXELS; i++ )
+    {
+        if( check_pixel( exact, i, h ) != 0 )
+        {
+            goto done;
+        }
+    }
+
+    /* Two jobs in uneven bands give the same */
+    b.jobs = 2;
+    if( grid( &b, 3, out ) != 0 )
+    {
+        goto done;
+    }
+    for( p = 0; p < VEG; p++ )
+    {
+        if( memcmp( out[p], exact[p], sizeof( float ) * PIXELS ) != 0 )
+        {
+            goto done;
+        }
+    }
+
+    /*
+    ** Sketches agree in pixels of at most K points, and in the products of
+    ** the other pixels that do not come from them.
+    */
+    b.sketch_k = K;
+    if( grid( &b, 1, out ) != 0 )
+    {
+        goto done;
+    }
+    for( i = 0; i < PIXELS; i++ )
+    {
+        for( p = 0; p < VEG; p++ )
+        {
+            if( (POINTS( i ) <= K || !sketched( p )) &&
+                fabs( out[p][i] - exact[p][i] ) > 1e-3 )
+            {
+                goto done;
+            }
+        }
+    }
+    rc = 0;
+done:
+    for( p = 0; p < VEG; p++ )
+    {
+        free( exact[p] );
+        free( out[p] );
+    }
+    CSLDestroy( b.inputs );
+    for( i = 0; i < 2; i++ )
+    {
+        VSIUnlink( paths[i] );
+        free( paths[i] );
+    }
+    return rc;
+}
@@ -0,0 +1,289 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <math.h>
+
+#include "bcal_metrics.h"
+#include "bcal_test_las.h"
+
+#include "cpl_conv.h"
+#include "cpl_port.h"
+#include "cpl_string.h"
+
+#define SIDE 3
+#define PIXELS (SIDE * SIDE)
+#define REC 20
+/* Points of pixel i, from the north, so pixel 0 is empty */
+#define POINTS( i ) (3 * (i))
+/* The pixel without ground points */
+#define NO_GROUND 4
+#define NODATA -9999.
+
+/* Point j of pixel i, heights in cm */
+static uint16 height( uint32 i, uint32 j )
+{
+    return i == NO_GROUND || j % 3 != 0 ? (uint16)(100 + 37 * j) : 5;
+}
+
+static uint16 intensity( uint32 i, uint32 j )
+{
+    return (uint16)(i * 10 + j * 7 % 11);
+}
+
+static int32 elevation( uint32 i, uint32 j )
+{
+    return 100000 + (int32)(i * 50) + height( i, j );
+}
+
+static void put_point( bcal_test_las *t, uint32 i, uint32 j )
+{
+    uint8 rec[REC];
+    memset( rec, 0, sizeof( rec ) );
+    bcal_test_las_xyz( rec, (int32)(i % SIDE) * 100 + 50,
+                       (int32)(SIDE - i / SIDE) * 100 - 50,
+                       elevation( i, j ) );
+    bcal_test_las_u16( rec + 12, intensity( i, j ) );
+    /* Return j % 3 + 1 of 3 */
+    rec[14] = (uint8)((j % 3 + 1) | 3 << 3);
+    rec[15] = height( i, j ) <= 15 ? BCAL_CLASS_GROUND :
+                                     BCAL_CLASS_VEGETATION;
+    rec[17] = (uint8)(j + 1);
+    bcal_test_las_u16( rec + 18, height( i, j ) );
+    bcal_test_las_put( t, rec );
+}
+
+/* Write a LAS 1.2, point format 0 file over 0 to SIDE */
+static int write_points( const char *path )
+{
+    bcal_test_las t;
+    uint32 i, j;
+    bcal_test_las_init( &t, 0, REC, 0.01 );
+    bcal_test_las_bounds( &t, 0., 0., SIDE, SIDE );
+    if( bcal_test_las_create( &t, path ) != 0 )
+    {
+        return 1;
+    }
+    for( i = 0; i < PIXELS; i++ )
+    {
+        for( j = 0; j < POINTS( i ); j++ )
+        {
+            put_point( &t, i, j );
+        }
+    }
+    return bcal_test_las_close( &t );
+}
+
+/* Grid the products of names with jobs threads in one band */
+static int grid( bcal_metrics_data *b, const char *names, int jobs,
+                 float **out )
+{
+    bcal_metrics_file v;
+    float *band[BCAL_METRICS];
+    int p, rc = 1;
+    b->jobs = jobs;
+    if( bcal_metrics_products( names, b->products ) != CE_None ||
+        bcal_metrics_open( &v, b ) != CE_None || v.r.nx != SIDE ||
+        v.r.ny != SIDE || v.band_rows != SIDE )
+    {
+        goto done;
+    }
+    for( p = 0; p < BCAL_METRICS; p++ )
+    {
+        band[p] = b->products[p] ? out[p] : NULL;
+    }
+    if( bcal_metrics_rows( &v, 0, SIDE, band ) != CE_None )
+    {
+        goto done;
+    }
+    rc = 0;
+done:
+    bcal_metrics_close( &v );
+    return rc;
+}
+
+/* Mean and standard deviation with n - 1 of n values */
+static void moments( const double *x, uint32 n, double *mean, double *sd )
+{
+    double s = 0, s2 = 0;
+    uint32 j;
+    for( j = 0; j < n; j++ )
+    {
+        s += x[j];
+    }
+    *mean = n > 0 ? s / n : NODATA;
+    for( j = 0; j < n; j++ )
+    {
+        s2 += (x[j] - *mean) * (x[j] - *mean);
+    }
+    *sd = n > 1 ? sqrt( s2 / (n - 1) ) : NODATA;
+}
+
+/* Check products of pixel i against its points */
+static int check_pixel( float **out, uint32 i )
+{
+    double all[3 * PIXELS], veg[3 * PIXELS], bare[3 * PIXELS];
+    double mean, sd, expect[8], agc = 0;
+    uint32 j, n_veg = 0, n_bare = 0, last = 0;
+    for( j = 0; j < POINTS( i ); j++ )
+    {
+        if( height( i, j ) > 15 )
+        {
+            veg[n_veg++] = intensity( i, j );
+        }
+        else
+        {
+            bare[n_bare++] = elevation( i, j ) * 0.01;
+        }
+        all[j] = elevation( i, j ) * 0.01;
+        agc += j + 1;
+        last += j % 3 == 2;
+    }
+    moments( all, POINTS( i ), &mean, &sd );
+    expect[0] = mean;
+    expect[1] = sd;
+    expect[2] = POINTS( i ) > 0 ? 100. * last / POINTS( i ) : NODATA;
+    expect[3] = POINTS( i ) > 0 ? agc / POINTS( i ) : NODATA;
+    moments( veg, n_veg, &mean, &sd );
+    expect[4] = mean;
+    expect[5] = sd;
+    moments( bare, n_bare, &mean, &sd );
+    expect[6] = mean;
+    expect[7] = n_bare > 0 ? n_bare : NODATA;
+    return fabs( out[BCAL_ALL_MEAN][i] - expect[0] ) > 1e-2 ||
+           fabs( out[BCAL_ALL_ROUGH][i] - expect[1] ) > 1e-4 ||
+           fabs( out[BCAL_ALL_LASTRET][i] - expect[2] ) > 1e-4 ||
+           fabs( out[BCAL_INT_AGCMEAN][i] - expect[3] ) > 1e-4 ||
+           fabs( out[BCAL_INT_IVMEAN][i] - expect[4] ) > 1e-4 ||
+           fabs( out[BCAL_INT_IVSTD][i] - expect[5] ) > 1e-4 ||
+           fabs( out[BCAL_DEM_ELEV][i] - expect[6] ) > 1e-2 ||
+           fabs( out[BCAL_BARE_DEN][i] - expect[7] ) > 1e-4;
+}
+
+int main()
+{
+    char *path = strdup( CPLGenerateTempFilename( "test_metrics2" ) );
+    float *one[BCAL_METRICS], *each[BCAL_METRICS];
+    uint32 plan[BCAL_SETS], i;
+    uint8 products[BCAL_METRICS];
+    bcal_metrics_data b;
+    uint64 bytes;
+    int p, rc = 1;
+
+    memset( &b, 0, sizeof( b ) );
+    memset( one, 0, sizeof( one ) );
+    memset( each, 0, sizeof( each ) );
+    b.inputs = CSLAddString( NULL, path );
+    b.cell = 1.;
+    b.nodata = NODATA;
+    b.ground = 0.15;
+    b.crown = 1.37;
+    b.fhd_bin = 1.;
+    b.sketch_k = BCAL_SKETCH_K;
+
+    /* The plan only keeps what the products need */
+    if( bcal_metrics_products( "imin,imax", products ) != CE_None )
+    {
+        goto done;
+    }
+    bcal_metrics_plan( products, plan );
+    bytes = bcal_metrics_pixel_bytes( plan, b.sketch_k );
+    if( plan[BCAL_SET_I] != (BCAL_STAT_N | BCAL_STAT_MIN | BCAL_STAT_MAX) ||
+        plan[BCAL_SET_H] != 0 || plan[BCAL_SET_Z] != 0 ||
+        bytes != sizeof( uint32 ) + 2 * sizeof( int32 ) )
+    {
+        goto done;
+    }
+    if( bcal_metrics_products( "baremean,bareelev,topobare", products ) !=
+        CE_None )
+    {
+        goto done;
+    }
+    bcal_metrics_plan( products, plan );
+    if( plan[BCAL_SET_ZB] != (BCAL_STAT_N | BCAL_STAT_MIN | BCAL_STAT_MAX |
+                              BCAL_STAT_S1 | BCAL_STAT_S2 |
+                              BCAL_STAT_PLANE) ||
+        products[BCAL_BARE_DEN] == 0 || products[BCAL_ALL_MIN] != 0 ||
+        bcal_metrics_products( "hmin,nosuch", products ) == CE_None )
+    {
+        goto done;
+    }
+    /* It is rounded up to what the kernels keep */
+    if( bcal_metrics_products( "hskew,ivstd", products ) != CE_None )
+    {
+        goto done;
+    }
+    bcal_metrics_plan( products, plan );
+    if( plan[BCAL_SET_H] != (BCAL_STAT_N | BCAL_STAT_S1 | BCAL_STAT_S2 |
+                             BCAL_STAT_S3 | BCAL_STAT_S4) ||
+        plan[BCAL_SET_IV] != (BCAL_STAT_N | BCAL_STAT_S1 | BCAL_STAT_S2) )
+    {
+        goto done;
+    }
+
+    for( p = 0; p < BCAL_METRICS; p++ )
+    {
+        one[p] = malloc( sizeof( float ) * PIXELS );
+        each[p] = malloc( sizeof( float ) * PIXELS );
+        if( one[p] == NULL || each[p] == NULL )
+        {
+            goto done;
+        }
+    }
+    if( write_points( path ) != 0 )
+    {
+        goto done;
+    }
+
+    /* Every family in one pass of two jobs, and each on its own */
+    if( grid( &b, "all", 2, one ) != 0 ||
+        grid( &b, "veg", 1, each ) != 0 ||
+        grid( &b, "intensity", 1, each ) != 0 ||
+        grid( &b, "topoall", 1, each ) != 0 ||
+        grid( &b, "topobare,dem", 1, each ) != 0 )
+    {
+        goto done;
+    }
+    for( p = 0; p < BCAL_METRICS; p++ )
+    {
+        if( memcmp( one[p], each[p], sizeof( float ) * PIXELS ) != 0 )
+        {
+            goto done;
+        }
+    }
+    /* Each product on its own, with the kernels of its plan alone */
+    for( p = 0; p < BCAL_METRICS; p++ )
+    {
+        if( grid( &b, bcal_metrics_name( p ), 1, each ) != 0 ||
+            memcmp( one[p], each[p], sizeof( float ) * PIXELS ) != 0 )
+        {
+            goto done;
+        }
+    }
+    for( i = 0; i < PIXELS; i++ )
+    {
+        if( check_pixel( one, i ) != 0 )
+        {
+            goto done;
+        }
+    }
+    /* Pixels without the points of a set have no value for its products */
+    if( one[BCAL_INT_IMIN][0] != NODATA || one[BCAL_BARE_MIN][0] != NODATA ||
+        one[BCAL_BARE_MIN][NO_GROUND] != NODATA ||
+        one[BCAL_ALL_MIN][NO_GROUND] == NODATA ||
+        one[BCAL_ALL_DEN][1] != 3 )
+    {
+        goto done;
+    }
+    rc = 0;
+done:
+    for( p = 0; p < BCAL_METRICS; p++ )
+    {
+        free( one[p] );
+        free( each[p] );
+    }
+    CSLDestroy( b.inputs );
+    VSIUnlink( path );
+    free( path );
+    return rc;
+}
@@ -0,0 +1,198 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <math.h>
+
+#include "bcal_filter.h"
+#include "bcal_test_las.h"
+
+#include "cpl_conv.h"
+#include "cpl_port.h"
+
+/*
+** Write a LAS 1.2, point format 0 file with a point on every integer
+** coordinate from x0 to x1 and 0 to 20, stored at the given x scale and
+** offset, and z scale.
+*/
+static int write_tile( const char *path, uint32 x0, uint32 x1,
+                       double scale, double offset, double zscale )
+{
+    bcal_test_las t;
+    uint8 rec[20];
+    uint32 x, y;
+    bcal_test_las_init( &t, 0, sizeof( rec ), 0.01 );
+    t.scale[0] = scale;
+    t.offset[0] = offset;
+    t.scale[2] = zscale;
+    if( bcal_test_las_create( &t, path ) != 0 )
+    {
+        return 1;
+    }
+    for( y = 0; y < 21; y++ )
+    {
+        for( x = x0; x <= x1; x++ )
+        {
+            memset( rec, 0, sizeof( rec ) );
+            bcal_test_las_xyz( rec, (int32)floor( (x - offset) / scale + 0.5 ),
+                               y * 100, 0 );
+            bcal_test_las_put( &t, rec );
+        }
+    }
+    return bcal_test_las_close( &t );
+}
+
+/*
+** The height merged for a point at y by set i, in the units of the mosaic,
+** the z scale of the west file.  The top row has none, and the one under
+** it one that overflows the heights of the east file.
+*/
+static uint16 merged_height( uint32 i, uint32 y )
+{
+    return y == 20 ? BCAL_LAS_NO_HEIGHT : y == 19 ? 7000 : (uint16)i;
+}
+
+/* The file and record a point at x, y came from */
+static int64 expected_fid( uint32 x, uint32 y )
+{
+    return x < 10 ? BCAL_FID( 0, y * 10 + x ) :
+                    BCAL_FID( 1, y * 11 + x - 10 );
+}
+
+int main()
+{
+    char *names[3];
+    char *outs[2];
+    bcal_mosaic m;
+    bcal_las out;
+    bcal_las_writer w[2];
+    bcal_domain d;
+    bcal_working_set sets[4];
+    const bcal_points *p;
+    const uint8 *rec;
+    uint32 counts[4] = { 0, 0, 0, 0 };
+    uint32 i, j, k, x, y, expect, seam = 0;
+    uint16 h;
+    int rc = 1;
+
+    names[0] = strdup( CPLGenerateTempFilename( "test_mosaic1_w" ) );
+    names[1] = strdup( CPLGenerateTempFilename( "test_mosaic1_e" ) );
+    names[2] = NULL;
+    outs[0] = strdup( CPLGenerateTempFilename( "test_mosaic1_wout" ) );
+    outs[1] = strdup( CPLGenerateTempFilename( "test_mosaic1_eout" ) );
+    memset( sets, 0, sizeof( sets ) );
+    memset( w, 0, sizeof( w ) );
+    memset( &d, 0, sizeof( d ) );
+    memset( &out, 0, sizeof( out ) );
+
+    /* Two tiles meeting at x = 10, the east one at other scales */
+    if( write_tile( names[0], 0, 9, 0.01, 0., 0.01 ) != 0 ||
+        write_tile( names[1], 10, 20, 0.001, 10., 0.001 ) != 0 ||
+        bcal_mosaic_open( &m, names, 2, 1, FALSE ) != CE_None )
+    {
+        goto done;
+    }
+    if( m.n != 2 || m.h.n_points != 21 * 21 || m.h.min[0] != 0. ||
+        m.h.max[0] != 20. || m.h.scale[0] != 0.01 || m.envs[1].MinX != 10. )
+    {
+        goto done;
+    }
+    bcal_mosaic_env( &m, &d.env );
+    if( bcal_partition( &d, 2 ) != CE_None || d.n != 4 ||
+        bcal_las_create_copy( m.las, outs[0], w ) != CE_None ||
+        bcal_las_create_copy( m.las + 1, outs[1], w + 1 ) != CE_None )
+    {
+        goto done;
+    }
+
+    /*
+    ** With a 1.5 halo every set reads 12 columns and 12 rows, across the
+    ** seam between the files.
+    */
+    if( bcal_load_count( &m, &d, 1.5, 3, counts, NULL ) != CE_None ||
+        bcal_load( &m, &d, 1., 1.5, counts, NULL, sets ) != CE_None )
+    {
+        goto done;
+    }
+    for( i = 0; i < d.n; i++ )
+    {
+        p = &sets[i].p;
+        if( p->n != 144 )
+        {
+            goto done;
+        }
+        for( k = 0; k < p->n; k++ )
+        {
+            x = (uint32)floor( bcal_points_x( p, k ) + 0.5 );
+            y = (uint32)floor( bcal_points_y( p, k ) + 0.5 );
+            if( p->x[k] != (int32)x * 100 ||
+                p->fid[k] != expected_fid( x, y ) )
+            {
+                goto done;
+            }
+            seam += (x < 10) != (sets[i].own.MinX < 5);
+            sets[i].p.c[k] = (uint8)(i + 1);
+            sets[i].p.h[k] = merged_height( i, y );
+        }
+        bcal_merge( &d, i, &sets[i], w );
+    }
+    bcal_las_writer_close( w, FALSE );
+    bcal_las_writer_close( w + 1, FALSE );
+    /*
+    ** West sets read columns 10 and 11 of the east file, east sets column 9
+    ** of the west file.
+    */
+    if( seam != 2 * 2 * 12 + 2 * 12 )
+    {
+        goto done;
+    }
+
+    /*
+    ** Every point is patched once, into the copy of its own file, with its
+    ** height in the z scale of the file
+    */
+    for( j = 0; j < 2; j++ )
+    {
+        if( bcal_las_open( outs[j], &out ) != CE_None )
+        {
+            goto done;
+        }
+        for( k = 0; k < out.h.n_points; k++ )
+        {
+            x = j == 0 ? k % 10 : 10 + k % 11;
+            y = j == 0 ? k / 10 : k / 11;
+            i = bcal_partition_find( &d, x, y );
+            rec = out.map.data + out.h.point_offset + k * out.h.point_length;
+            memcpy( &h, rec + 18, 2 );
+            CPL_LSBPTR16( &h );
+            expect = merged_height( i, y );
+            /* The east file has heights in mm, and 7000 cm overflows */
+            if( j == 1 && expect != BCAL_LAS_NO_HEIGHT )
+            {
+                expect = expect * 10 < BCAL_LAS_NO_HEIGHT ?
+                         expect * 10 : BCAL_LAS_NO_HEIGHT - 1;
+            }
+            if( rec[15] != i + 1 || h != expect )
+            {
+                bcal_las_close( &out );
+                goto done;
+            }
+        }
+        bcal_las_close( &out );
+    }
+    rc = 0;
+done:
+    bcal_free_sets( sets, 4 );
+    bcal_free_decomp( &d );
+    bcal_las_writer_close( w, FALSE );
+    bcal_las_writer_close( w + 1, FALSE );
+    bcal_mosaic_close( &m );
+    for( j = 0; j < 2; j++ )
+    {
+        VSIUnlink( names[j] );
+        VSIUnlink( outs[j] );
+        free( names[j] );
+        free( outs[j] );
+    }
+    return rc;
+}
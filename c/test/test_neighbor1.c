@@ -0,0 +1,130 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "bcal_filter.h"
+
+static int compare_u32( const void *a, const void *b )
+{
+    uint32 ua = *(const uint32*)a;
+    uint32 ub = *(const uint32*)b;
+    return ua < ub ? -1 : (ua > ub ? 1 : 0);
+}
+
+/*
+** The square search of GetIndex_BCAL, rescanning every point of the square
+** at each step.
+*/
+static uint32 brute( const bcal_working_set *s, uint32 i, uint32 j,
+                     uint32 min, uint32 *out )
+{
+    uint32 f, n, ii, jj, k, q, i0, i1, j0, j1;
+    for( f = 1;; f++ )
+    {
+        i0 = i >= f ? i - f : 0;
+        j0 = j >= f ? j - f : 0;
+        i1 = i + f < s->nx ? i + f : s->nx - 1;
+        j1 = j + f < s->ny ? j + f : s->ny - 1;
+        n = 0;
+        for( jj = j0; jj <= j1; jj++ )
+        {
+            for( ii = i0; ii <= i1; ii++ )
+            {
+                k = jj * s->nx + ii;
+                for( q = s->cells[k]; q < s->cells[k + 1]; q++ )
+                {
+                    if( s->p.c[q] == BCAL_CLASS_GROUND )
+                    {
+                        out[n++] = q;
+                    }
+                }
+            }
+        }
+        if( n >= min ||
+            (i0 == 0 && j0 == 0 && i1 == s->nx - 1 && j1 == s->ny - 1) )
+        {
+            return n;
+        }
+    }
+}
+
+int main()
+{
+    bcal_working_set s;
+    bcal_ground_index gi;
+    bcal_neighbors nb;
+    const double scale[3] = { 0.01, 0.01, 0.01 };
+    const double offset[3] = { 0., 0., 0. };
+    uint32 seed = 7, i, j, k, q, n, *expect;
+    int rc = 1;
+    memset( &s, 0, sizeof( s ) );
+    memset( &nb, 0, sizeof( nb ) );
+    s.env.MinX = 0.;
+    s.env.MaxX = 30.;
+    s.env.MinY = 0.;
+    s.env.MaxY = 20.;
+    s.spacing = 1.;
+    bcal_points_init( &s.p, scale, offset );
+    if( bcal_points_reserve( &s.p, 600 ) != CE_None )
+    {
+        return 1;
+    }
+    /* Ground is dense in the west half and sparse in the east */
+    for( i = 0; i < 600; i++ )
+    {
+        seed = seed * 1103515245 + 12345;
+        s.p.fid[i] = i;
+        s.p.x[i] = (int32)((seed >> 8) % 3000);
+        seed = seed * 1103515245 + 12345;
+        s.p.y[i] = (int32)((seed >> 8) % 2000);
+        s.p.z[i] = 0;
+        s.p.r[i] = 1;
+        s.p.c[i] = BCAL_CLASS_CREATED;
+    }
+    s.p.n = 600;
+    if( bcal_bin( &s ) != CE_None ||
+        bcal_ground_index_init( &gi, &s ) != CE_None )
+    {
+        bcal_points_free( &s.p );
+        return 1;
+    }
+    expect = malloc( sizeof( uint32 ) * s.p.n );
+    for( k = 0; k < s.nx * s.ny; k++ )
+    {
+        for( q = s.cells[k]; q < s.cells[k + 1]; q++ )
+        {
+            if( s.p.x[q] < 1500 ? q % 2 == 0 : q % 23 == 0 )
+            {
+                s.p.c[q] = BCAL_CLASS_GROUND;
+                bcal_ground_index_add( &gi, k, q );
+            }
+        }
+    }
+    for( j = 0; j < s.ny; j++ )
+    {
+        for( i = 0; i < s.nx; i++ )
+        {
+            n = brute( &s, i, j, 10, expect );
+            if( bcal_ground_index_query( &gi, i, j, 10, &nb ) != CE_None ||
+                nb.n != n )
+            {
+                goto done;
+            }
+            qsort( expect, n, sizeof( uint32 ), compare_u32 );
+            qsort( nb.idx, n, sizeof( uint32 ), compare_u32 );
+            if( memcmp( expect, nb.idx, sizeof( uint32 ) * n ) != 0 )
+            {
+                goto done;
+            }
+        }
+    }
+    rc = 0;
+done:
+    free( expect );
+    bcal_neighbors_free( &nb );
+    bcal_ground_index_free( &gi );
+    bcal_points_free( &s.p );
+    free( s.cells );
+    return rc;
+}
+
@@ -0,0 +1,149 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "bcal_test_las.h"
+
+#include "cpl_conv.h"
+#include "cpl_port.h"
+
+#define SIDE 16
+#define REC 20
+
+/*
+** Write a LAS 1.2, point format 0 file with two points in every unit cell
+** from 0 to SIDE, in rows from the south.  The first pass puts z 0 at the
+** quarter of each cell, the second z 1 at three quarters.
+*/
+static int write_pairs( const char *path )
+{
+    bcal_test_las t;
+    uint8 rec[REC];
+    uint32 x, y, k;
+    bcal_test_las_init( &t, 0, REC, 0.01 );
+    bcal_test_las_bounds( &t, 0., 0., SIDE, SIDE );
+    if( bcal_test_las_create( &t, path ) != 0 )
+    {
+        return 1;
+    }
+    for( k = 0; k < 2; k++ )
+    {
+        for( y = 0; y < SIDE; y++ )
+        {
+            for( x = 0; x < SIDE; x++ )
+            {
+                memset( rec, 0, sizeof( rec ) );
+                bcal_test_las_xyz( rec, x * 100 + 25 + k * 50,
+                                   y * 100 + 25 + k * 50, k );
+                bcal_test_las_put( &t, rec );
+            }
+        }
+    }
+    return bcal_test_las_close( &t );
+}
+
+static int32 field( const bcal_las_writer *w, uint64 k, int offset )
+{
+    int32 v;
+    memcpy( &v, w->map.data + w->point_offset + k * w->point_length + offset,
+            sizeof( v ) );
+    CPL_LSBPTR32( &v );
+    return v;
+}
+
+/*
+** Sort a copy along the curve and check every point is still there, the
+** keys of their cells never decrease and the points of a cell keep their
+** order.
+*/
+static int check_order( const bcal_las *las, const char *path, int order )
+{
+    bcal_las_writer w;
+    OGREnvelope env;
+    uint8 seen[SIDE * SIDE * 2];
+    uint64 k, key, last = 0;
+    uint32 col, row;
+    int32 z, last_z = 0;
+    int rc = 1;
+    env.MinX = 0.;
+    env.MaxX = SIDE;
+    env.MinY = 0.;
+    env.MaxY = SIDE;
+    memset( seen, 0, sizeof( seen ) );
+    memset( &w, 0, sizeof( w ) );
+    if( bcal_las_create_copy( las, path, &w ) != CE_None ||
+        bcal_las_sort( &w, &env, 1., order ) != CE_None )
+    {
+        goto done;
+    }
+    for( k = 0; k < w.n_points; k++ )
+    {
+        col = field( &w, k, 0 ) / 100;
+        row = field( &w, k, 4 ) / 100;
+        z = field( &w, k, 8 );
+        if( col >= SIDE || row >= SIDE || z < 0 || z > 1 ||
+            seen[(row * SIDE + col) * 2 + z]++ )
+        {
+            goto done;
+        }
+        key = order == BCAL_ORDER_HILBERT ? bcal_hilbert( col, row, 4 ) :
+                                            bcal_morton( col, row );
+        if( k > 0 && (key < last || (key == last && z <= last_z)) )
+        {
+            goto done;
+        }
+        /* Hilbert order only steps between neighbouring cells */
+        if( order == BCAL_ORDER_HILBERT && k > 0 && key > last &&
+            key != last + 1 )
+        {
+            goto done;
+        }
+        last = key;
+        last_z = z;
+    }
+    rc = 0;
+done:
+    bcal_las_writer_close( &w, TRUE );
+    return rc;
+}
+
+int main()
+{
+    char *path = strdup( CPLGenerateTempFilename( "test_order1" ) );
+    char *copy = strdup( CPLGenerateTempFilename( "test_order1_copy" ) );
+    bcal_las las;
+    int rc = 1;
+
+    memset( &las, 0, sizeof( las ) );
+    /* The curves of a 2x2 grid */
+    if( bcal_morton( 0, 0 ) != 0 || bcal_morton( 1, 0 ) != 1 ||
+        bcal_morton( 0, 1 ) != 2 || bcal_morton( 1, 1 ) != 3 ||
+        bcal_morton( 2, 0 ) != 4 || bcal_morton( 0, 2 ) != 8 )
+    {
+        goto done;
+    }
+    if( bcal_hilbert( 0, 0, 1 ) != 0 || bcal_hilbert( 0, 1, 1 ) != 1 ||
+        bcal_hilbert( 1, 1, 1 ) != 2 || bcal_hilbert( 1, 0, 1 ) != 3 ||
+        bcal_hilbert( 15, 0, 4 ) != 255 )
+    {
+        goto done;
+    }
+
+    if( write_pairs( path ) != 0 || bcal_las_open( path, &las ) != CE_None )
+    {
+        goto done;
+    }
+    if( check_order( &las, copy, BCAL_ORDER_MORTON ) != 0 ||
+        check_order( &las, copy, BCAL_ORDER_HILBERT ) != 0 )
+    {
+        goto done;
+    }
+    rc = 0;
+done:
+    bcal_las_close( &las );
+    VSIUnlink( path );
+    VSIUnlink( copy );
+    free( path );
+    free( copy );
+    return rc;
+}
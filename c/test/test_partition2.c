@@ -0,0 +1,62 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "bcal_filter.h"
+
+int main()
+{
+    bcal_domain d;
+    d.env.MinX = 0.;
+    d.env.MaxX = 10.;
+    d.env.MinY = 0.;
+    d.env.MaxY = 10.;
+    CPLErr e = bcal_partition( &d, 4 );
+    if( e != CE_None || d.n != 4 || d.nx != 2 || d.ny != 2 )
+    {
+        return 1;
+    }
+    /* South east envelope */
+    if( !CPLIsEqual( d.sub_envs[3].MinX, 5. ) ||
+        !CPLIsEqual( d.sub_envs[3].MaxX, 10. ) ||
+        !CPLIsEqual( d.sub_envs[3].MinY, 0. ) ||
+        !CPLIsEqual( d.sub_envs[3].MaxY, 5. ) )
+    {
+        return 1;
+    }
+    if( bcal_partition_find( &d, 1., 9. ) != 0 ||
+        bcal_partition_find( &d, 9., 9. ) != 1 ||
+        bcal_partition_find( &d, 1., 1. ) != 2 ||
+        bcal_partition_find( &d, 9., 1. ) != 3 )
+    {
+        return 1;
+    }
+    /* Shared edges go east/south, the domain edges are clamped */
+    if( bcal_partition_find( &d, 5., 5. ) != 3 ||
+        bcal_partition_find( &d, 10., 10. ) != 1 ||
+        bcal_partition_find( &d, 0., 0. ) != 2 )
+    {
+        return 1;
+    }
+    bcal_free_decomp( &d );
+
+    /* 10 tiles by point count, raised to 4 per job, on a 2:1 domain */
+    d.env.MaxX = 2000.;
+    d.env.MaxY = 1000.;
+    e = bcal_partition_tiles( &d, 4, 10000000, 1000000, 1. );
+    if( e != CE_None || d.n < 16 || d.nx != 2 * d.ny )
+    {
+        return 1;
+    }
+    bcal_free_decomp( &d );
+    /* Tiles are never narrower than BCAL_TILE_MIN_CELLS cells */
+    e = bcal_partition_tiles( &d, 4, 10000000, 1000, 10. );
+    if( e != CE_None || d.nx * BCAL_TILE_MIN_CELLS * 10. > 2000. ||
+        d.ny * BCAL_TILE_MIN_CELLS * 10. > 1000. )
+    {
+        return 1;
+    }
+    bcal_free_decomp( &d );
+    return 0;
+}
+
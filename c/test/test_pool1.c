@@ -0,0 +1,63 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "bcal_pool.h"
+
+#include "cpl_atomic_ops.h"
+
+#define N_TASKS 1000
+
+static volatile int runs[N_TASKS];
+
+static CPLErr task( void *arg, uint32 i )
+{
+    volatile int *sum = (volatile int*)arg;
+    uint32 k, spin = (i % 7) * 1000;
+    for( k = 0; k < spin; k++ )
+    {
+        CPLAtomicAdd( sum, 0 );
+    }
+    CPLAtomicAdd( &runs[i], 1 );
+    return CE_None;
+}
+
+static CPLErr fail( void *arg, uint32 i )
+{
+    (void)arg;
+    return i == 3 ? CE_Failure : CE_None;
+}
+
+int main()
+{
+    uint64 cost[N_TASKS];
+    volatile int sum = 0;
+    uint32 i;
+    for( i = 0; i < N_TASKS; i++ )
+    {
+        cost[i] = (i * 37) % 101;
+    }
+    if( bcal_pool_run_weighted( 4, N_TASKS, cost, task, (void*)&sum ) != CE_None )
+    {
+        return 1;
+    }
+    /* Every task runs exactly once */
+    for( i = 0; i < N_TASKS; i++ )
+    {
+        if( runs[i] != 1 )
+        {
+            return 1;
+        }
+    }
+    if( bcal_pool_run( 3, N_TASKS, task, (void*)&sum ) != CE_None ||
+        runs[N_TASKS - 1] != 2 )
+    {
+        return 1;
+    }
+    if( bcal_pool_run( 4, 10, fail, NULL ) != CE_Failure )
+    {
+        return 1;
+    }
+    return 0;
+}
+
@@ -0,0 +1,110 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <math.h>
+
+#include "bcal_filter.h"
+
+/* Points in the test set, not a multiple of any vector width */
+#define N_POINTS 1003
+
+static uint32 next( uint64 *state )
+{
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (uint32)(*state >> 33);
+}
+
+/*
+** Every instruction set gives the bins and heights of the scalar kernels,
+** for points inside, on the edge of and outside the envelope, and for
+** surfaces that are NaN or infinite.
+*/
+int main()
+{
+    double scale[3] = { 0.01, 0.01, 0.001 };
+    double offset[3] = { 500000., 4000000., 10. };
+    bcal_working_set s;
+    uint32 bin[BCAL_SIMD_AVX2 + 1][N_POINTS];
+    uint32 n_low[BCAL_SIMD_AVX2 + 1][8];
+    double h[BCAL_SIMD_AVX2 + 1][N_POINTS];
+    double surface[N_POINTS];
+    uint32 index[N_POINTS];
+    uint64 state = 42;
+    uint32 i, n;
+    int level, best, rc = 1;
+
+    memset( &s, 0, sizeof( s ) );
+    bcal_points_init( &s.p, scale, offset );
+    if( bcal_points_reserve( &s.p, N_POINTS ) != CE_None )
+    {
+        return 1;
+    }
+    s.env.MinX = 500010.;
+    s.env.MaxX = 500073.3;
+    s.env.MinY = 4000020.;
+    s.env.MaxY = 4000051.7;
+    s.spacing = 0.7;
+    s.nx = (uint32)((s.env.MaxX - s.env.MinX) / s.spacing) + 1;
+    s.ny = (uint32)((s.env.MaxY - s.env.MinY) / s.spacing) + 1;
+    for( i = 0; i < N_POINTS; i++ )
+    {
+        /* A margin of 5 m around the envelope, and points on its edges */
+        s.p.x[i] = 500 + (int32)(next( &state ) % 7340);
+        s.p.y[i] = 1500 + (int32)(next( &state ) % 4180);
+        if( i % 50 == 0 )
+        {
+            s.p.x[i] = 1000;
+            s.p.y[i] = 5170;
+        }
+        s.p.z[i] = (int32)(next( &state ) % 100000) - 50000;
+        index[i] = (i * 389) % N_POINTS;
+        surface[i] = (next( &state ) % 100000) * 0.001 - 40.;
+        if( i % 97 == 0 )
+        {
+            surface[i] = i % 2 ? NAN : -HUGE_VAL;
+        }
+    }
+    s.p.n = N_POINTS;
+
+    best = bcal_simd_set_level( BCAL_SIMD_AVX2 );
+    for( level = BCAL_SIMD_SCALAR; level <= best; level++ )
+    {
+        if( bcal_simd_set_level( level ) != level )
+        {
+            goto done;
+        }
+        bcal_bin_cells( &s, bin[level] );
+        /* Every tail length of the 2 and 4 wide loops */
+        for( n = 0; n < 8; n++ )
+        {
+            memcpy( h[level], surface, sizeof( surface ) );
+            n_low[level][n] = bcal_heights( &s.p, index, N_POINTS - n,
+                                            h[level], 0.25 * n );
+        }
+    }
+    for( i = 0; i < N_POINTS; i++ )
+    {
+        if( bin[0][i] >= s.nx * s.ny )
+        {
+            goto done;
+        }
+    }
+    if( n_low[0][0] == 0 || n_low[0][0] == N_POINTS )
+    {
+        goto done;
+    }
+    for( level = BCAL_SIMD_SCALAR + 1; level <= best; level++ )
+    {
+        if( memcmp( bin[level], bin[0], sizeof( bin[0] ) ) != 0 ||
+            memcmp( n_low[level], n_low[0], sizeof( n_low[0] ) ) != 0 ||
+            memcmp( h[level], h[0], sizeof( h[0] ) ) != 0 )
+        {
+            goto done;
+        }
+    }
+    rc = 0;
+done:
+    bcal_points_free( &s.p );
+    return rc;
+}
@@ -0,0 +1,137 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include "bcal_sketch.h"
+
+#include "cpl_port.h"
+
+#define N 20000
+#define K 64
+/* Most a percentile may be off, in ranks of N */
+#define RANK_ERROR (N / 40)
+
+/* A permutation of 0 to N - 1, so the rank of v is v */
+static uint16 value( uint32 i )
+{
+    return (uint16)((i * 7919) % N);
+}
+
+/* Check the percentiles of pixel i, holding a permutation of 0 to n - 1 */
+static int check_ranks( bcal_sketch *s, uint64 i, uint32 n,
+                        bcal_sketch_sorted *q )
+{
+    uint32 j, p;
+    int64 err;
+    if( bcal_sketch_get( s, i, q ) != CE_None || q->m == 0 || q->m > K ||
+        q->total != n )
+    {
+        return 1;
+    }
+    for( j = 1; j < q->m; j++ )
+    {
+        if( q->v[j] <= q->v[j - 1] )
+        {
+            return 1;
+        }
+    }
+    for( p = 5; p <= 95; p += 5 )
+    {
+        err = (int64)bcal_sketch_rank( q, (uint64)p * n / 100 ) -
+              (int64)p * n / 100;
+        if( err > RANK_ERROR || err < -RANK_ERROR )
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main()
+{
+    bcal_sketch a, b, e;
+    bcal_sketch_sorted q;
+    uint32 i;
+    int rc = 1;
+
+    memset( &a, 0, sizeof( a ) );
+    memset( &b, 0, sizeof( b ) );
+    memset( &e, 0, sizeof( e ) );
+    memset( &q, 0, sizeof( q ) );
+    /* A bin is too few to merge into */
+    if( bcal_sketch_init( &a, 1, 3 ) == CE_None )
+    {
+        goto done;
+    }
+    if( bcal_sketch_init( &a, K, 3 ) != CE_None ||
+        bcal_sketch_init( &b, K, 3 ) != CE_None ||
+        bcal_sketch_init( &e, 0, 3 ) != CE_None )
+    {
+        goto done;
+    }
+
+    /* Pixel 0 has all values, pixel 1 k, and its sketch is exact */
+    for( i = 0; i < N; i++ )
+    {
+        bcal_sketch_add( &a, 0, value( i ) );
+    }
+    for( i = 0; i < K; i++ )
+    {
+        bcal_sketch_add( &a, 1, (uint16)(K - i) );
+    }
+    if( check_ranks( &a, 0, N, &q ) != 0 )
+    {
+        goto done;
+    }
+    if( bcal_sketch_get( &a, 1, &q ) != CE_None || q.m != K ||
+        q.total != K || q.v[0] != 1 || q.v[K - 1] != K || q.w[0] != 1 ||
+        bcal_sketch_rank( &q, K / 2 ) != K / 2 + 1 )
+    {
+        goto done;
+    }
+    if( bcal_sketch_get( &a, 2, &q ) != CE_None || q.m != 0 )
+    {
+        goto done;
+    }
+
+    /* Halves of the values in two sketches merge into one of them all */
+    bcal_sketch_reset( &a, 3 );
+    for( i = 0; i < N; i++ )
+    {
+        bcal_sketch_add( i < N / 3 ? &a : &b, 0, value( i ) );
+    }
+    bcal_sketch_merge( &a, &b, 0 );
+    bcal_sketch_merge( &a, &b, 1 );
+    if( check_ranks( &a, 0, N, &q ) != 0 || a.held[1] != 0 )
+    {
+        goto done;
+    }
+
+    /* Exact sketches keep and sort every value, by pixel */
+    for( i = 0; i < 1000; i++ )
+    {
+        bcal_sketch_add( &e, 2 - i % 2, (uint16)(1000 - i) );
+    }
+    if( bcal_sketch_sort( &e ) != CE_None ||
+        bcal_sketch_get( &e, 0, &q ) != CE_None || q.m != 0 )
+    {
+        goto done;
+    }
+    if( bcal_sketch_get( &e, 2, &q ) != CE_None || q.m != 500 ||
+        q.total != 500 || q.v[0] != 2 || q.v[499] != 1000 )
+    {
+        goto done;
+    }
+    if( bcal_sketch_get( &e, 1, &q ) != CE_None || q.m != 500 ||
+        q.v[0] != 1 || q.v[499] != 999 )
+    {
+        goto done;
+    }
+    rc = 0;
+done:
+    bcal_sketch_free( &a );
+    bcal_sketch_free( &b );
+    bcal_sketch_free( &e );
+    bcal_sketch_sorted_free( &q );
+    return rc;
+}
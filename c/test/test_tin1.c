@@ -0,0 +1,147 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <math.h>
+
+#include "bcal_tin.h"
+
+static uint32 seed = 12345;
+
+static uint32 next( uint32 n )
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+}
+
+static double plane( int64 x, int64 y )
+{
+    return 10. + 0.25 * x - 0.125 * y;
+}
+
+/*
+** Every triangle is counter clockwise and its neighbours point back to it.
+** If delaunay is set, no vertex is inside a circumcircle.
+*/
+static int check( const bcal_tin *t, int delaunay )
+{
+    uint32 i, j, k, a, b, c, u;
+    double adx, ady, bdx, bdy, cdx, cdy, det;
+    for( i = 0; i < t->nt; i++ )
+    {
+        a = t->t[i].v[0];
+        b = t->t[i].v[1];
+        c = t->t[i].v[2];
+        if( ((int64)t->x[b] - t->x[a]) * ((int64)t->y[c] - t->y[a]) -
+            ((int64)t->y[b] - t->y[a]) * ((int64)t->x[c] - t->x[a]) <= 0 )
+        {
+            return 1;
+        }
+        for( k = 0; k < 3; k++ )
+        {
+            u = t->t[i].n[k];
+            if( u != BCAL_TIN_NONE && t->t[u].n[0] != i &&
+                t->t[u].n[1] != i && t->t[u].n[2] != i )
+            {
+                return 1;
+            }
+        }
+        if( !delaunay || a < 3 || b < 3 || c < 3 )
+        {
+            continue;
+        }
+        for( j = 3; j < t->nv; j++ )
+        {
+            adx = (double)t->x[a] - t->x[j];
+            ady = (double)t->y[a] - t->y[j];
+            bdx = (double)t->x[b] - t->x[j];
+            bdy = (double)t->y[b] - t->y[j];
+            cdx = (double)t->x[c] - t->x[j];
+            cdy = (double)t->y[c] - t->y[j];
+            det = (adx * adx + ady * ady) * (bdx * cdy - cdx * bdy) +
+                  (bdx * bdx + bdy * bdy) * (cdx * ady - adx * cdy) +
+                  (cdx * cdx + cdy * cdy) * (adx * bdy - bdx * ady);
+            if( det > 1e-6 )
+            {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int main()
+{
+    bcal_tin t;
+    uint32 i, inserted = 0;
+    int64 x, y;
+    double z;
+
+    /* Random points, some repeated */
+    if( bcal_tin_init( &t, 0, 0, 10000, 10000 ) != CE_None ||
+        !isnan( bcal_tin_interpolate( &t, 5000, 5000 ) ) )
+    {
+        return 1;
+    }
+    for( i = 0; i < 500; i++ )
+    {
+        x = next( 10001 );
+        y = next( 10001 );
+        if( bcal_tin_insert( &t, x, y, plane( x, y ) ) == CE_None )
+        {
+            inserted++;
+            if( bcal_tin_insert( &t, x, y, 0. ) != CE_Warning )
+            {
+                return 1;
+            }
+        }
+    }
+    if( t.nv != inserted + 3 || t.nt != 2 * inserted + 1 || check( &t, 1 ) )
+    {
+        return 1;
+    }
+    /* A plane is reproduced inside the hull and just outside it */
+    for( i = 0; i < 100; i++ )
+    {
+        x = 2000 + next( 6001 );
+        y = 2000 + next( 6001 );
+        z = bcal_tin_interpolate( &t, x, y );
+        if( fabs( z - plane( x, y ) ) > 1e-6 )
+        {
+            return 1;
+        }
+    }
+    z = bcal_tin_interpolate( &t, -10, 5000 );
+    if( (!isnan( z ) && fabs( z - plane( -10, 5000 ) ) > 1e-6) ||
+        bcal_tin_insert( &t, 0, (int64)BCAL_TIN_MAX_EXTENT * 4, 0. ) !=
+        CE_Warning )
+    {
+        return 1;
+    }
+    bcal_tin_free( &t );
+
+    /* A regular grid, every point on an edge or cocircular with others */
+    if( bcal_tin_init( &t, 0, 0, 100, 100 ) != CE_None )
+    {
+        return 1;
+    }
+    for( i = 0; i < 121; i++ )
+    {
+        x = (i * 37 % 121) % 11 * 10;
+        y = (i * 37 % 121) / 11 * 10;
+        if( bcal_tin_insert( &t, x, y, plane( x, y ) ) != CE_None )
+        {
+            return 1;
+        }
+    }
+    if( t.nv != 124 || check( &t, 1 ) ||
+        fabs( bcal_tin_interpolate( &t, 55, 43 ) - plane( 55, 43 ) ) > 1e-9 ||
+        fabs( bcal_tin_interpolate( &t, 100, 50 ) - plane( 100, 50 ) ) >
+        1e-9 )
+    {
+        return 1;
+    }
+    bcal_tin_free( &t );
+    return 0;
+}
+
@@ -0,0 +1,247 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <math.h>
+
+#include "bcal_metrics.h"
+#include "bcal_test_las.h"
+
+#include "cpl_conv.h"
+#include "cpl_port.h"
+#include "cpl_string.h"
+
+#define SIDE 6
+#define REC 20
+#define NODATA -9999.
+/* Pixels, from the north, with 3 points, with 8 in a line, and empty */
+#define SPARSE_ROW 2
+#define SPARSE_COL 3
+#define LINE_ROW 4
+#define LINE_COL 1
+#define EMPTY_ROW 0
+#define EMPTY_COL 5
+/* The gradient of the ground, exact in cm at the offsets of the points */
+#define GX 0.4
+#define GY -0.2
+/* Points of a full pixel from its centre, in cm, and their bump in cm */
+#define FULL 8
+static const int off[FULL][3] =
+{
+    { -25, -25, 0 }, { 25, -25, 0 }, { -25, 25, 0 }, { 25, 25, 0 },
+    { 0, -30, -18 }, { 0, 30, -18 }, { -30, 0, 18 }, { 30, 0, 18 }
+};
+
+/* Write a point in cm, on the plane plus bump */
+static void put_point( bcal_test_las *t, int32 x, int32 y, int32 bump )
+{
+    uint8 rec[REC];
+    memset( rec, 0, sizeof( rec ) );
+    bcal_test_las_xyz( rec, x, y,
+                       10000 + (int32)floor( GX * x + GY * y + 0.5 ) + bump );
+    rec[14] = 1;
+    rec[15] = BCAL_CLASS_GROUND;
+    bcal_test_las_put( t, rec );
+}
+
+/*
+** Write a LAS 1.2, point format 0 file over 0 to SIDE of ground points on
+** a plane.  The bumps of a full pixel are not in the span of its plane, so
+** its fit is the plane.
+*/
+static int write_ground( const char *path )
+{
+    bcal_test_las t;
+    uint32 row, col, j;
+    int32 x, y;
+    bcal_test_las_init( &t, 0, REC, 0.01 );
+    bcal_test_las_bounds( &t, 0., 0., SIDE, SIDE );
+    if( bcal_test_las_create( &t, path ) != 0 )
+    {
+        return 1;
+    }
+    for( row = 0; row < SIDE; row++ )
+    {
+        for( col = 0; col < SIDE; col++ )
+        {
+            x = (int32)col * 100 + 50;
+            y = (int32)(SIDE - row) * 100 - 50;
+            for( j = 0; j < FULL; j++ )
+            {
+                if( (row == EMPTY_ROW && col == EMPTY_COL) ||
+                    (row == SPARSE_ROW && col == SPARSE_COL && j >= 3) )
+                {
+                    continue;
+                }
+                if( row == SPARSE_ROW && col == SPARSE_COL )
+                {
+                    put_point( &t, x + off[j][0], y + off[j][1], 0 );
+                }
+                else if( row == LINE_ROW && col == LINE_COL )
+                {
+                    put_point( &t, x + (int32)j * 10 - 35, y, 0 );
+                }
+                else
+                {
+                    put_point( &t, x + off[j][0], y + off[j][1],
+                               off[j][2] );
+                }
+            }
+        }
+    }
+    return bcal_test_las_close( &t );
+}
+
+/* The products of bcal topo */
+static const int topo[] =
+{
+    BCAL_DEM_ELEV, BCAL_BARE_SLOPE, BCAL_BARE_ASPECT, BCAL_BARE_TRASP,
+    BCAL_BARE_LROUGH
+};
+#define TOPO_BANDS (int)(sizeof( topo ) / sizeof( topo[0] ))
+
+/* Grid the raster in bands of rows, and check every pixel */
+static int check( bcal_metrics_data *b, uint32 band_rows, const float *elev )
+{
+    bcal_metrics_file v;
+    float bands[BCAL_METRICS][SIDE * SIDE], *out[BCAL_METRICS];
+    const double slope = atan( sqrt( GX * GX + GY * GY ) ) * 180. / M_PI;
+    const double aspect = atan2( GX, GY ) * 180. / M_PI;
+    const double trasp = (1. - cos( (aspect - 30.) * M_PI / 180. )) / 2.;
+    /* Of the bumps, 4 of 0.18 m in 8 points */
+    const double rough = sqrt( 4 * 0.18 * 0.18 / 7 );
+    uint32 plan[BCAL_SETS], row, col, rows;
+    uint64 k;
+    int j, own, rc = 1;
+    memset( b->products, 0, sizeof( b->products ) );
+    for( j = 0; j < TOPO_BANDS; j++ )
+    {
+        b->products[topo[j]] = TRUE;
+    }
+    bcal_metrics_plan( b->products, plan );
+    b->max_mem = (uint64)(band_rows + 2 * b->fill) * SIDE *
+                 bcal_metrics_band_bytes( b, plan ) +
+                 bcal_metrics_fixed_bytes( b, plan );
+    memset( out, 0, sizeof( out ) );
+    if( bcal_metrics_open( &v, b ) != CE_None || v.band_rows != band_rows )
+    {
+        goto done;
+    }
+    for( row = 0; row < SIDE; row += rows )
+    {
+        rows = SIDE - row < band_rows ? SIDE - row : band_rows;
+        for( j = 0; j < TOPO_BANDS; j++ )
+        {
+            out[topo[j]] = bands[topo[j]] + row * SIDE;
+        }
+        if( bcal_metrics_rows( &v, row, rows, out ) != CE_None )
+        {
+            goto done;
+        }
+    }
+    /* The elevations are those of bareelev alone */
+    if( memcmp( bands[BCAL_DEM_ELEV], elev, sizeof( float ) * SIDE * SIDE )
+        != 0 )
+    {
+        goto done;
+    }
+    for( row = 0; row < SIDE; row++ )
+    {
+        for( col = 0; col < SIDE; col++ )
+        {
+            k = row * SIDE + col;
+            own = !(row == SPARSE_ROW && col == SPARSE_COL) &&
+                  !(row == LINE_ROW && col == LINE_COL) &&
+                  !(row == EMPTY_ROW && col == EMPTY_COL);
+            /* Only windows fit the others, and the plane still */
+            if( !own && b->fill == 0 )
+            {
+                if( bands[BCAL_BARE_SLOPE][k] != NODATA ||
+                    bands[BCAL_BARE_ASPECT][k] != NODATA ||
+                    bands[BCAL_BARE_TRASP][k] != NODATA ||
+                    bands[BCAL_BARE_LROUGH][k] != NODATA )
+                {
+                    goto done;
+                }
+                continue;
+            }
+            if( fabs( bands[BCAL_BARE_SLOPE][k] - slope ) > 1e-3 ||
+                fabs( bands[BCAL_BARE_ASPECT][k] - aspect ) > 1e-3 ||
+                fabs( bands[BCAL_BARE_TRASP][k] - trasp ) > 1e-5 ||
+                (own && fabs( bands[BCAL_BARE_LROUGH][k] - rough ) > 1e-5) )
+            {
+                goto done;
+            }
+        }
+    }
+    rc = 0;
+done:
+    bcal_metrics_close( &v );
+    return rc;
+}
+
+/* The elevations of bareelev alone, in one band */
+static int dem( bcal_metrics_data *b, float *elev )
+{
+    bcal_metrics_file v;
+    float *out[BCAL_METRICS];
+    int rc = 1;
+    memset( b->products, 0, sizeof( b->products ) );
+    memset( out, 0, sizeof( out ) );
+    b->products[BCAL_DEM_ELEV] = TRUE;
+    b->max_mem = 0;
+    out[BCAL_DEM_ELEV] = elev;
+    if( bcal_metrics_open( &v, b ) == CE_None &&
+        v.acc->plane[0] == NULL &&
+        bcal_metrics_rows( &v, 0, SIDE, out ) == CE_None &&
+        (elev[EMPTY_ROW * SIDE + EMPTY_COL] == NODATA) == (b->fill == 0) )
+    {
+        rc = 0;
+    }
+    bcal_metrics_close( &v );
+    return rc;
+}
+
+int main()
+{
+    char *path = strdup( CPLGenerateTempFilename( "test_topo1" ) );
+    float elev[SIDE * SIDE];
+    bcal_metrics_data b;
+    int rc = 1;
+
+    memset( &b, 0, sizeof( b ) );
+    b.inputs = CSLAddString( NULL, path );
+    b.jobs = 1;
+    b.cell = 1.;
+    b.nodata = NODATA;
+    b.fhd_bin = 1.;
+    if( write_ground( path ) != 0 )
+    {
+        goto done;
+    }
+    /* Pixels fit alone, in one band and in bands */
+    if( dem( &b, elev ) != 0 || check( &b, SIDE, elev ) != 0 ||
+        check( &b, 4, elev ) != 0 )
+    {
+        goto done;
+    }
+    /* The windows of the others reach into the rows of the next band */
+    b.fill = 1;
+    if( dem( &b, elev ) != 0 || check( &b, SIDE, elev ) != 0 ||
+        check( &b, 2, elev ) != 0 )
+    {
+        goto done;
+    }
+    /* And the sums of jobs merge, halos too */
+    b.jobs = 2;
+    if( check( &b, SIDE, elev ) != 0 || check( &b, 2, elev ) != 0 )
+    {
+        goto done;
+    }
+    rc = 0;
+done:
+    CSLDestroy( b.inputs );
+    VSIUnlink( path );
+    free( path );
+    return rc;
+}
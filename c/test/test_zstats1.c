@@ -0,0 +1,108 @@
+// Copyright 2016 Boise State University.  All rights reserved.
+// Use of this source code is governed by a BSD-style
+// license that can be found in the LICENSE file.
+
+#include <math.h>
+
+#include "bcal_filter.h"
+
+int main()
+{
+    bcal_las_header h;
+    bcal_zstats zs, part;
+    bcal_points p;
+    uint32 i, below;
+    double low;
+    memset( &h, 0, sizeof( h ) );
+    h.scale[0] = h.scale[1] = h.scale[2] = 0.01;
+    h.min[2] = 100.;
+    h.max[2] = 110.;
+    bcal_points_init( &p, h.scale, h.offset );
+    if( bcal_points_reserve( &p, 4 ) != CE_None ||
+        bcal_zstats_init( &zs, &h ) != CE_None || zs.width != 1 )
+    {
+        return 1;
+    }
+    /* 100, 101, 102, 103: the upper middle value is 102 */
+    for( i = 0; i < 4; i++ )
+    {
+        p.z[i] = 10000 + i * 100;
+    }
+    p.n = 4;
+    bcal_zstats_add( &zs, &p );
+    low = bcal_zstats_low( &zs, 1 );
+    if( fabs( low - (102. - sqrt( 5. / 3. )) ) > 1e-9 )
+    {
+        return 1;
+    }
+    /* Selection over the points alone agrees */
+    if( fabs( bcal_zstats_local_low( &p, 1 ) - low ) > 1e-9 )
+    {
+        return 1;
+    }
+    bcal_zstats_free( &zs );
+
+    /* Halves counted apart and merged give the same threshold */
+    if( bcal_zstats_init( &zs, &h ) != CE_None ||
+        bcal_zstats_init( &part, &h ) != CE_None )
+    {
+        return 1;
+    }
+    p.n = 2;
+    bcal_zstats_add( &zs, &p );
+    p.z[0] = p.z[2];
+    p.z[1] = p.z[3];
+    bcal_zstats_add( &part, &p );
+    bcal_zstats_merge( &zs, &part );
+    if( fabs( bcal_zstats_low( &zs, 1 ) - low ) > 1e-9 )
+    {
+        return 1;
+    }
+    bcal_zstats_free( &part );
+    bcal_zstats_free( &zs );
+    bcal_points_free( &p );
+
+    /* The median of a shuffled run with repeats, exactly half below it */
+    bcal_points_init( &p, h.scale, h.offset );
+    if( bcal_points_reserve( &p, 1001 ) != CE_None )
+    {
+        return 1;
+    }
+    for( i = 0; i < 1001; i++ )
+    {
+        p.z[i] = 10000 + (int32)((i * 389u) % 1001u) / 2;
+    }
+    p.n = 1001;
+    low = bcal_zstats_local_low( &p, 0 );
+    for( i = 0, below = 0; i < p.n; i++ )
+    {
+        below += bcal_points_z( &p, i ) < low;
+    }
+    if( fabs( low - 102.5 ) > 1e-9 || below != 500 )
+    {
+        return 1;
+    }
+    for( i = 0; i < 4; i++ )
+    {
+        p.z[i] = 10000 + i * 100;
+    }
+    p.n = 4;
+
+    /* A wide range is binned, the median is off by at most a bin */
+    h.min[2] = -1000000.;
+    h.max[2] = 1000000.;
+    if( bcal_zstats_init( &zs, &h ) != CE_None || zs.width < 2 ||
+        zs.nbins > BCAL_ZSTATS_BINS )
+    {
+        return 1;
+    }
+    bcal_zstats_add( &zs, &p );
+    low = bcal_zstats_low( &zs, 0 );
+    if( fabs( low - 102. ) > zs.width * h.scale[2] )
+    {
+        return 1;
+    }
+    bcal_zstats_free( &zs );
+    bcal_points_free( &p );
+    return 0;
+}